@@ -5,6 +5,14 @@ sudo -u enerccio cp ../build/init initramfs/sys
 sudo -u enerccio cp ../build/ddm initramfs/sys/daemons
 sudo -u enerccio cp ../build/framebuffer initramfs/sys/daemons
 sudo -u enerccio cp ../build/sata initramfs/sys/drivers
+# BENCH=1 ./update_image.sh makes init start benchmark service after boot
+if [ -n "$BENCH" ]; then
+    sudo -u enerccio cp ../build/bench initramfs/sys
+    grep -qx sys/bench initramfs/conf/init/rlyeh_load_order || \
+        printf "\nsys/bench\n" | sudo -u enerccio tee -a initramfs/conf/init/rlyeh_load_order > /dev/null
+else
+    sudo -u enerccio sed -i '/^sys\/bench$/d' initramfs/conf/init/rlyeh_load_order
+fi
 sudo -u enerccio ./mkfs.py initramfs rlyeh
 cp ../build/azathoth.img mnt/boot/azathoth.img
 cp rlyeh mnt/boot/rlyeh
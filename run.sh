@@ -8,4 +8,4 @@ pushd disk
 ./update_image.sh
 popd
 
-sudo -u enerccio qemu-system-x86_64 -hdc disk.img -m 128 -s -smp cores=2,threads=2,sockets=3 -cpu Haswell,+pdpe1gb
+sudo -u enerccio qemu-system-x86_64 -hdc disk.img -m ${MEM:-128} -s -smp cores=2,threads=2,sockets=3 -cpu Haswell,+pdpe1gb
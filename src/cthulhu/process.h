@@ -39,6 +39,7 @@ typedef struct create_process_stage1 {
 	bool parent;
 	bool privilege; // whether this process has privilege to access some operations (ddm, drivers etc)
 	int8_t priority; // -1 parent process priority
+	size_t stack_size; // stack reservation of threads, 0 for default size
 } cp_stage1;
 
 #ifdef __cplusplus
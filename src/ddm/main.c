@@ -46,6 +46,7 @@ void load_disk_drive(char* driver_path) {
 	cp1->parent = true;
 	cp1->priority = -1;
 	cp1->privilege = true;
+	cp1->stack_size = 0;
 
 	send_message(message);
 	receive_message(reply);
@@ -45,8 +45,10 @@ extern void load_gdt(gdt_ptr_t* gdt, uint16_t tssid);
 extern gdt_ptr_t gdt;
 extern void kp_halt();
 extern uintptr_t get_active_page();
-extern uint64_t tlb_shootdown_processor;
-extern uint64_t tlb_shootdown_counter;
+extern void set_active_page(uintptr_t address);
+extern void invalidate_address(uintptr_t address);
+extern ruint_t is_pcid_supported();
+extern void enable_pcid();
 extern void proc_spinlock_lock(void* a);
 extern void proc_spinlock_unlock(void* a);
 
@@ -61,6 +63,19 @@ uint32_t cpuid_to_cputord[256];
 /** Contains LAPIC address from ACPI */
 uint32_t apicaddr;
 uint64_t __tlb_lock;
+/** Whether cr3 is tagged with pcid on all cpus */
+bool pcid_enabled;
+/** Shootdowns of more pages than this reload cr3 instead of invlpg */
+size_t tlb_flush_threshold = TLB_FLUSH_THRESHOLD;
+
+/** Shootdown in progress, written only with __tlb_lock held */
+volatile uintptr_t tlb_shootdown_cr3;
+volatile uintptr_t tlb_shootdown_from;
+volatile size_t    tlb_shootdown_amount;
+/** Number of cpus that acknowledged current shootdown */
+volatile uint64_t  tlb_shootdown_counter;
+/** Incremented when shootdown ends, releases waiting cpus */
+volatile uint64_t  tlb_shootdown_generation;
 
 bool multiprocessing_ready = false;
 
@@ -148,9 +163,12 @@ void ap_main(ruint_t proc_id) {
 
     load_gdt(&gdt, (uint16_t)(cpuid_to_cputord[proc_id]*24)+(48));
     idt_flush(&idt_ptr);
+    if (pcid_enabled)
+        enable_pcid();
 
     ENABLE_INTERRUPTS();
     initialize_lapic();
+    initialize_local_timer();
 
     wait_until_activated(WAIT_SCHEDULER_INIT_WAIT);
     schedule(NULL);
@@ -253,10 +271,6 @@ void initialize_mp(unsigned int localcpu) {
 #define KERNEL_SYSCALL_STACK_SIZE      (0x10000)
 #define PAGE_ALIGN(x) ((x) & (~(0xFFF)))
 
-static struct chained_element* __thread_queue_get(void* data) {
-    return &((thread_t*)data)->schedule_list;
-}
-
 /**
  * Creates cpu_t structure from APIC MADT information.
  */
@@ -291,12 +305,16 @@ cpu_t* make_cpu(MADT_LOCAL_APIC* apic, size_t insertid) {
     cpu->df_stack = (void*) PAGE_ALIGN((uintptr_t)malloc(KERNEL_DF_STACK_SIZE)+KERNEL_DF_STACK_SIZE);
     cpu->ipi_stack = (void*) PAGE_ALIGN((uintptr_t)malloc(KERNEL_IPI_STACK_SIZE)+KERNEL_IPI_STACK_SIZE);
     cpu->pf_handler.handler = NULL;
+    cpu->pf_handler.nofault = false;
+    cpu->frame_cache.count = 0;
+    cpu->tlb_shootdown_pending = 0;
+    cpu->pcid_next = 0;
+    for (size_t i=0; i<PCID_SLOTS; i++) {
+        cpu->pcids[i].address_space = 0;
+        cpu->pcids[i].stale = false;
+    }
     cpu->ct = NULL;
-    cpu->priority_0 = create_queue_static(__thread_queue_get);
-    cpu->priority_1 = create_queue_static(__thread_queue_get);
-    cpu->priority_2 = create_queue_static(__thread_queue_get);
-    cpu->priority_3 = create_queue_static(__thread_queue_get);
-    cpu->priority_4 = create_queue_static(__thread_queue_get);
+    run_queue_init(&cpu->runq);
     return cpu;
 }
 
@@ -307,18 +325,161 @@ cpu_t* make_cpu_default() {
     return make_cpu(NULL, 0);
 }
 
+/**
+ * Marks pcid slots of cpu that might hold entries of cr3 as stale.
+ */
+static void tlb_mark_stale(cpu_t* cpu, uintptr_t cr3, bool all) {
+    for (size_t i=0; i<PCID_SLOTS; i++) {
+        if (all || cpu->pcids[i].address_space == cr3)
+            __atomic_store_n(&cpu->pcids[i].stale, true, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Invalidates range in this cpu's TLB.
+ *
+ * Only current pcid is invalidated by invlpg, so for kernel addresses all other
+ * pcids are marked stale. If cpu already moved away from cr3, its pcid of cr3
+ * is marked stale instead.
+ */
+static void tlb_invalidate_local(cpu_t* cpu, uintptr_t cr3, uintptr_t from, size_t amount) {
+    bool kernel = from >= KERNEL_SPACE_START;
+    if (kernel || get_active_page() == cr3) {
+        if (amount / 0x1000 > tlb_flush_threshold) {
+            if (cpu != NULL)
+                tlb_flush_local(cpu);
+            else
+                set_active_page(get_active_page());
+        } else {
+            for (uintptr_t i=from; i<from+amount; i+=0x1000)
+                invalidate_address(i);
+        }
+    }
+    if (cpu != NULL && pcid_enabled) {
+        if (kernel)
+            tlb_mark_stale(cpu, 0, true);
+        else if (get_active_page() != cr3)
+            tlb_mark_stale(cpu, cr3, false);
+    }
+}
+
+void tlb_shootdown_poll(cpu_t* cpu) {
+    if (__atomic_exchange_n(&cpu->tlb_shootdown_pending, 0, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    uint64_t generation = __atomic_load_n(&tlb_shootdown_generation, __ATOMIC_SEQ_CST);
+    tlb_invalidate_local(cpu, tlb_shootdown_cr3, tlb_shootdown_from, tlb_shootdown_amount);
+    __atomic_fetch_add(&tlb_shootdown_counter, 1, __ATOMIC_SEQ_CST);
+
+    // page structures are being modified, wait until initiator is done
+    while (__atomic_load_n(&tlb_shootdown_generation, __ATOMIC_SEQ_CST) == generation) {
+        __asm__ ("pause");
+    }
+}
+
 void tlb_shootdown(uintptr_t cr3, uintptr_t from, size_t amount) {
-	proc_spinlock_lock(&__tlb_lock);
-	tlb_shootdown_processor = get_local_apic_id();
-	send_ipi_message(get_local_apic_id(), IPI_INVALIDATE_PAGE, from, amount, cr3, NULL);
-	while (__atomic_load_n(&tlb_shootdown_counter, __ATOMIC_SEQ_CST) != array_get_size(cpus)) {
-		__asm__ ("pause");
-	}
+    cr3 = ALIGN(cr3);
+    cpu_t* cpu = multiprocessing_ready ? get_current_cput() : NULL;
+
+    // cpus spinning here have interrupts disabled, so they must serve
+    // shootdowns of others while waiting
+    while (__atomic_exchange_n(&__tlb_lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        if (cpu != NULL)
+            tlb_shootdown_poll(cpu);
+        __asm__ ("pause");
+    }
+
+    tlb_shootdown_from = from;
+    tlb_shootdown_amount = amount;
+    __atomic_store_n(&tlb_shootdown_counter, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&tlb_shootdown_cr3, cr3, __ATOMIC_SEQ_CST);
+
+    uint64_t targets = 0;
+    if (cpu != NULL) {
+        bool kernel = from >= KERNEL_SPACE_START;
+        for (unsigned int i=0; i<array_get_size(cpus); i++) {
+            cpu_t* target = array_get_at(cpus, i);
+            if (target == cpu || !target->started)
+                continue;
+
+            // mark stale first, cpu switching to cr3 concurrently will either
+            // see stale mark or will be seen in current_address_space
+            if (pcid_enabled)
+                tlb_mark_stale(target, cr3, kernel);
+            if (kernel || __atomic_load_n(&target->current_address_space, __ATOMIC_SEQ_CST) == cr3) {
+                __atomic_store_n(&target->tlb_shootdown_pending, 1, __ATOMIC_SEQ_CST);
+                send_ipi_to(target->apic_id, EXC_TLB_IPI, 0, false);
+                ++targets;
+            }
+        }
+    }
+
+    tlb_invalidate_local(cpu, cr3, from, amount);
+
+    while (__atomic_load_n(&tlb_shootdown_counter, __ATOMIC_SEQ_CST) != targets) {
+        __asm__ ("pause");
+    }
 }
 
 void tlb_shootdown_end() {
-	__atomic_store_n(&tlb_shootdown_counter, 0, __ATOMIC_SEQ_CST);
-	proc_spinlock_unlock(&__tlb_lock);
+    __atomic_store_n(&tlb_shootdown_cr3, 0, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&tlb_shootdown_generation, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&__tlb_lock, 0, __ATOMIC_RELEASE);
+}
+
+void tlb_forget_address_space(uintptr_t cr3) {
+    if (!pcid_enabled || cpus == NULL)
+        return;
+    for (unsigned int i=0; i<array_get_size(cpus); i++)
+        tlb_mark_stale(array_get_at(cpus, i), ALIGN(cr3), false);
+}
+
+void tlb_flush_local(cpu_t* cpu) {
+    uintptr_t cr3 = get_active_page();
+    if (pcid_enabled) {
+        for (size_t i=0; i<PCID_SLOTS; i++) {
+            if (cpu->pcids[i].address_space == cr3) {
+                set_active_page(cr3 | (i+1));
+                return;
+            }
+        }
+    }
+    set_active_page(cr3);
+}
+
+void switch_address_space(cpu_t* cpu, uintptr_t cr3) {
+    __atomic_store_n(&cpu->current_address_space, cr3, __ATOMIC_SEQ_CST);
+
+    // do not enter address space which page structures are being changed
+    while (__atomic_load_n(&tlb_shootdown_cr3, __ATOMIC_SEQ_CST) == cr3) {
+        tlb_shootdown_poll(cpu);
+        __asm__ ("pause");
+    }
+
+    if (get_active_page() == cr3)
+        return;
+
+    if (!pcid_enabled) {
+        set_active_page(cr3);
+        return;
+    }
+
+    bool flush = true;
+    size_t slot;
+    for (slot=0; slot<PCID_SLOTS; slot++) {
+        if (cpu->pcids[slot].address_space == cr3)
+            break;
+    }
+    if (slot == PCID_SLOTS) {
+        slot = cpu->pcid_next;
+        cpu->pcid_next = (slot + 1) % PCID_SLOTS;
+        cpu->pcids[slot].address_space = cr3;
+        __atomic_store_n(&cpu->pcids[slot].stale, false, __ATOMIC_SEQ_CST);
+    } else {
+        flush = __atomic_exchange_n(&cpu->pcids[slot].stale, false, __ATOMIC_SEQ_CST);
+    }
+
+    set_active_page(cr3 | (slot+1) | (flush ? 0 : CR3_PCID_NOFLUSH));
 }
 
 /**
@@ -333,6 +494,13 @@ void initialize_cpus() {
 
     apicaddr = 0xFEE00000;
     __tlb_lock = 0;
+    tlb_shootdown_cr3 = 0;
+    tlb_shootdown_counter = 0;
+    tlb_shootdown_generation = 0;
+
+    pcid_enabled = is_pcid_supported() != 0;
+    if (pcid_enabled)
+        enable_pcid();
 
     cpus = create_array_spec(256);
     unsigned int cnt = 0;
@@ -40,11 +40,21 @@
 #include <ds/queue.h>
 
 #include "../processes/process.h"
+#include "../processes/runqueue.h"
 
 extern void write_gs(ruint_t addr);
 
 typedef void (*jmp_handler_t)(jmp_buf b, void* fa, ruint_t errno);
 
+/** Number of address spaces kept tagged in TLB per cpu, pcid 0 is left for kernel */
+#define PCID_SLOTS (6)
+/** Do not flush pcid entries when loading cr3 */
+#define CR3_PCID_NOFLUSH (1UL<<63)
+/** Default number of pages above which whole TLB is flushed instead of invlpg */
+#define TLB_FLUSH_THRESHOLD (33)
+/** Addresses from here on are shared by all address spaces */
+#define KERNEL_SPACE_START (0xFFFF800000000000UL)
+
 typedef struct cpu {
     struct cpu*   self;
     void*         syscall_stack;
@@ -72,20 +82,28 @@ typedef struct cpu {
 
     /* scheduler info */
     volatile ruint_t __cpu_sched_lock;
-    thread_t* ct; // head thread is being executed
+    thread_t* ct; // head thread is being executed, NULL if cpu is idle
 
-    queue_t* priority_0;
-    queue_t* priority_1;
-    queue_t* priority_2;
-    queue_t* priority_3;
-    queue_t* priority_4;
+    run_queue_t runq;
 
     volatile bool started;
 
     struct {
         jmp_handler_t handler;
         jmp_buf       jmp;
+        bool          nofault; // fault aborts copy instead of being resolved
     } pf_handler;
+
+    /* memory info */
+    frame_cache_t frame_cache;
+
+    /* tlb info */
+    volatile uint8_t tlb_shootdown_pending;
+    size_t           pcid_next;
+    struct {
+        uintptr_t     address_space;
+        volatile bool stale; // entries of this pcid must be flushed on next load
+    } pcids[PCID_SLOTS];
 } cpu_t;
 
 #define WAIT_NO_WAIT              (0)
@@ -96,6 +114,8 @@ typedef struct cpu {
 
 extern array_t* cpus;
 extern uint32_t apicaddr;
+/** Tunable, shootdowns of more pages than this flush whole TLB */
+extern size_t tlb_flush_threshold;
 
 /**
  * Initializes cpu information. Initializes SMP if available.
@@ -142,8 +162,31 @@ void enable_ipi_interrupts();
  */
 void disable_ipi_interrupts();
 
+/**
+ * Starts TLB shootdown of range in address space cr3.
+ *
+ * Only cpus that have cr3 loaded are interrupted (all cpus for kernel addresses),
+ * other cpus flush their pcid of cr3 lazily on next switch. Interrupted cpus wait
+ * until tlb_shootdown_end is called.
+ */
 void tlb_shootdown(uintptr_t cr3, uintptr_t from, size_t amount);
 void tlb_shootdown_end();
+/**
+ * Handles pending shootdown request for this cpu, if there is any.
+ */
+void tlb_shootdown_poll(cpu_t* cpu);
+/**
+ * Marks address space as stale on all cpus, used when cr3 is reused.
+ */
+void tlb_forget_address_space(uintptr_t cr3);
+/**
+ * Flushes TLB entries of currently loaded address space.
+ */
+void tlb_flush_local(cpu_t* cpu);
+/**
+ * Loads address space cr3 on this cpu, keeping its TLB entries if possible.
+ */
+void switch_address_space(cpu_t* cpu, uintptr_t cr3);
 
 /**
  * Initializes lapic
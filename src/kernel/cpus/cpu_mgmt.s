@@ -34,3 +34,38 @@ lock    xchg    [rdi], rax
 proc_spinlock_unlock:
         mov qword [rdi], 0
         ret
+
+[GLOBAL read_tsc]
+; Returns time stamp counter
+;
+; extern uint64_t read_tsc()
+read_tsc:
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        ret
+
+[GLOBAL is_tsc_deadline_supported]
+; Returns non-zero if local apic timer supports TSC-deadline mode
+;
+; extern uint64_t is_tsc_deadline_supported()
+is_tsc_deadline_supported:
+        push    rbx
+        mov     rax, 1
+        cpuid
+        mov     eax, ecx
+        and     eax, 1<<24
+        pop     rbx
+        ret
+
+[GLOBAL write_msr]
+; Writes value to model specific register
+;
+; extern void write_msr(uint32_t msr, uint64_t value)
+write_msr:
+        mov     ecx, edi
+        mov     rax, rsi
+        mov     rdx, rsi
+        shr     rdx, 32
+        wrmsr
+        ret
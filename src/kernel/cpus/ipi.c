@@ -35,12 +35,7 @@
 extern void proc_spinlock_lock(volatile void* memaddr);
 extern void proc_spinlock_unlock(volatile void* memaddr);
 extern void kp_halt();
-extern void invalidate_address(uintptr_t address);
 extern uintptr_t get_active_page();
-extern void set_active_page(uintptr_t address);
-
-uint64_t tlb_shootdown_processor;
-uint64_t tlb_shootdown_counter;
 
 void ipi_received(ruint_t ecode, registers_t* registers) {
     // WATCH OUT: registers might be null if it is local interrupt
@@ -52,31 +47,10 @@ void ipi_received(ruint_t ecode, registers_t* registers) {
     case IPI_WAKE_UP_FROM_WUA:
         registers->rax = cpu->apic_message; // unlocking from wait_until_activation if message was nonzero
         break;
-    case IPI_INVALIDATE_PAGE: {
-            uintptr_t active_page = get_active_page();
-            uintptr_t target_page = cpu->apic_message3;
-            if (active_page == target_page) {
-                for (uintptr_t i=cpu->apic_message; i<cpu->apic_message+cpu->apic_message2; i+=0x1000)
-                    invalidate_address(i);
-
-                __atomic_fetch_add(&tlb_shootdown_counter, 1, __ATOMIC_SEQ_CST);
-                if (tlb_shootdown_processor != get_local_apic_id()) {
-                	while (true) {
-                		uint64_t cnt = __atomic_load_n(&tlb_shootdown_counter, __ATOMIC_SEQ_CST);
-                		if (cnt == 0)
-                			break;
-                		__asm__ ("pause");
-                	}
-                }
-            } else {
-            	__atomic_fetch_add(&tlb_shootdown_counter, 1, __ATOMIC_SEQ_CST);
-            }
-        }
-        break;
     case IPI_INVLD_PML: {
         uintptr_t active_page = get_active_page();
         if (active_page == cpu->apic_message) {
-            set_active_page(active_page);
+            tlb_flush_local(cpu);
         }
         break;
     }
@@ -188,8 +162,15 @@ void broadcast_ipi_message(bool self, uint8_t message_type, ruint_t message, rui
         send_ipi_message(self_apic, message_type, message, message2, message3, internalcall);
 }
 
+/**
+ * TLB shootdown requests use separate vector, so they do not contend
+ * for single message slot with other ipi messages.
+ */
+static void tlb_ipi_received(ruint_t ecode, registers_t* registers) {
+    tlb_shootdown_poll(get_current_cput());
+}
+
 void initialize_ipi_subsystem() {
-	tlb_shootdown_processor = 0;
-	tlb_shootdown_counter = 0;
     register_interrupt_handler(EXC_IPI, ipi_received);
+    register_interrupt_handler(EXC_TLB_IPI, tlb_ipi_received);
 }
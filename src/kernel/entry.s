@@ -169,6 +169,7 @@ after_pages_set:
 
     mov eax, cr0                 ; Set the A-register to control register 0.
     or eax, 1 << 31 | 1 << 0     ; Set the PG-bit, which is the 31nd bit, and the PM-bit, which is the 0th bit.
+    or eax, 1 << 16              ; Set the WP-bit, so kernel writes respect read only (copy on write) pages.
     mov cr0, eax                 ; Set control register 0 to the A-register.
 
     mov ecx, 0xC0000080          ; Set the C-register to 0xC0000080, which is the EFER MSR.
@@ -282,6 +283,7 @@ ap_protected_mode:
 
     mov eax, cr0                 ; Set the A-register to control register 0.
     or eax, 1 << 31 | 1 << 0     ; Set the PG-bit, which is the 31nd bit, and the PM-bit, which is the 0th bit.
+    or eax, 1 << 16              ; Set the WP-bit, so kernel writes respect read only (copy on write) pages.
     mov cr0, eax                 ; Set control register 0 to the A-register.
 
     lgdt [GDT64.Pointer]         ; Load the 64-bit global descriptor table.
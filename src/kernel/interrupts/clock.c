@@ -41,7 +41,33 @@ volatile uintmax_t clock_s;
 /** Stores ms of current ticker */
 volatile uintmax_t clock_ms;
 
+/** Local apic timer counts per millisecond, with LAPIC_DIVIDE_16 */
+uint64_t lapic_ticks_per_ms;
+/** Time stamp counter increments per millisecond */
+uint64_t tsc_per_ms;
+/** Unix time in ms and tsc value at the moment PIT ticker was stopped */
+uint64_t tsc_epoch_ms;
+uint64_t tsc_epoch;
+/** Whether local timers run in TSC-deadline mode */
+bool tsc_deadline_mode;
+
 extern bool scheduler_enabled;
+extern uint64_t read_tsc();
+extern uint64_t is_tsc_deadline_supported();
+extern void write_msr(uint32_t msr, uint64_t value);
+
+#define LAPIC_REGISTER(offset) ((volatile uint32_t*)physical_to_virtual(apicaddr+(offset)))
+#define LAPIC_TIMER_LVT          (0x320)
+#define LAPIC_TIMER_INITIAL      (0x380)
+#define LAPIC_TIMER_CURRENT      (0x390)
+#define LAPIC_TIMER_DIVIDE       (0x3E0)
+#define LAPIC_TIMER_MASKED       (1<<16)
+#define LAPIC_TIMER_PERIODIC     (1<<17)
+#define LAPIC_TIMER_TSC_DEADLINE (2<<17)
+#define LAPIC_DIVIDE_16          (0x3)
+#define MSR_TSC_DEADLINE         (0x6E0)
+/** Number of PIT ticks local timer and tsc are measured against */
+#define TIMER_CALIBRATION_MS     (50)
 
 enum {
     cmos_address = 0x70,
@@ -85,46 +111,50 @@ void timer_tick(ruint_t error_code, registers_t* r) {
         ++clock_s;
         clock_ms -= 1000;
     }
-    if (scheduler_enabled && clock_ms % 2 == 0) {
-        attemp_to_run_scheduler(r);
+}
+
+/**
+ * Local timer callback for ISR, every cpu runs its own scheduler tick.
+ */
+void local_timer_tick(ruint_t error_code, registers_t* r) {
+    if (tsc_deadline_mode) {
+        write_msr(MSR_TSC_DEADLINE, read_tsc() + tsc_per_ms*SCHED_TICK_MS);
+    }
+    if (scheduler_enabled) {
+        scheduler_tick(r);
     }
 }
 
 /**
- * Busy waits for X milliseconds.
+ * Returns milliseconds since 1970.
  *
- * TODO: Fix it, might not be correct
+ * Once local timer is calibrated, time is counted from tsc and PIT ticker
+ * is stopped.
+ */
+uint64_t clock_time_ms() {
+    if (tsc_per_ms == 0)
+        return (uint64_t)(clock_s*1000 + clock_ms);
+    return tsc_epoch_ms + (read_tsc() - tsc_epoch) / tsc_per_ms;
+}
+
+/**
+ * Busy waits for X milliseconds.
  */
 void busy_wait_milis(size_t milis) {
-    uintmax_t oclocks = clock_s;
-    uintmax_t oclockms = clock_ms;
-    while (milis > 0) {
-        uintmax_t clocks = clock_s;
-        uintmax_t clockms = clock_ms;
-
-        uintmax_t diff_s = clocks-oclocks;
-        intmax_t diff_ms = clockms-oclockms;
-
-        size_t totaldiff = (diff_s*1000)+diff_ms;
-        if (totaldiff > milis)
-            return;
-        else
-            milis -= totaldiff;
-
-        oclocks=clocks;
-        oclockms=clockms;
-    }
+    uint64_t end = clock_time_ms() + milis;
+    while (clock_time_ms() < end)
+        ;
 }
 
 /**
  * Returns current unix time.
  */
 uint64_t get_unix_time() {
-    return (uint64_t)clock_s;
+    return clock_time_ms() / 1000;
 }
 
 uint64_t get_unix_time_ms() {
-    return (uint64_t)clock_ms;
+    return clock_time_ms() % 1000;
 }
 
 /**
@@ -138,6 +168,7 @@ void initialize_ticker() {
     clock_ms = 0;
 
     register_interrupt_handler(IRQ0, &timer_tick);
+    register_interrupt_handler(LOCAL_TIMER_VECTOR, &local_timer_tick);
 
     uint32_t divisor = 1193180 / 1193;
     outb(0x43, 0x36);
@@ -150,6 +181,72 @@ void initialize_ticker() {
     ENABLE_INTERRUPTS();
 }
 
+/**
+ * Measures local apic timer and tsc frequency against PIT ticker.
+ *
+ * Requires ticker to be running and interrupts enabled. Frequencies are
+ * assumed to be same on all cpus.
+ */
+static void calibrate_local_timer() {
+    *LAPIC_REGISTER(LAPIC_TIMER_DIVIDE) = LAPIC_DIVIDE_16;
+    *LAPIC_REGISTER(LAPIC_TIMER_LVT) = LAPIC_TIMER_MASKED;
+
+    // start at the edge of PIT tick
+    uintmax_t last = clock_ms;
+    while (clock_ms == last)
+        ;
+    last = clock_ms;
+
+    *LAPIC_REGISTER(LAPIC_TIMER_INITIAL) = 0xFFFFFFFF;
+    uint64_t tsc_start = read_tsc();
+    for (uint32_t ticks=0; ticks<TIMER_CALIBRATION_MS; ) {
+        if (clock_ms != last) {
+            last = clock_ms;
+            ++ticks;
+        }
+    }
+    uint32_t lapic_elapsed = 0xFFFFFFFF - *LAPIC_REGISTER(LAPIC_TIMER_CURRENT);
+    uint64_t tsc_rate = (read_tsc() - tsc_start) / TIMER_CALIBRATION_MS;
+    *LAPIC_REGISTER(LAPIC_TIMER_INITIAL) = 0;
+
+    lapic_ticks_per_ms = lapic_elapsed / TIMER_CALIBRATION_MS;
+    tsc_deadline_mode = is_tsc_deadline_supported() != 0;
+
+    // wall clock continues from tsc, so PIT does not interrupt boot cpu anymore
+    DISABLE_INTERRUPTS();
+    tsc_epoch = read_tsc();
+    tsc_epoch_ms = (uint64_t)(clock_s*1000 + clock_ms);
+    tsc_per_ms = tsc_rate;
+    IRQ_set_mask(0);
+    ENABLE_INTERRUPTS();
+}
+
+void initialize_local_timer() {
+    if (tsc_deadline_mode) {
+        *LAPIC_REGISTER(LAPIC_TIMER_LVT) = LAPIC_TIMER_TSC_DEADLINE | LOCAL_TIMER_VECTOR;
+        // lvt write must be visible before deadline is armed
+        __asm__ __volatile__ ("mfence" ::: "memory");
+    } else {
+        *LAPIC_REGISTER(LAPIC_TIMER_DIVIDE) = LAPIC_DIVIDE_16;
+        *LAPIC_REGISTER(LAPIC_TIMER_LVT) = LAPIC_TIMER_PERIODIC | LOCAL_TIMER_VECTOR;
+    }
+    local_timer_start();
+}
+
+void local_timer_start() {
+    if (tsc_deadline_mode)
+        write_msr(MSR_TSC_DEADLINE, read_tsc() + tsc_per_ms*SCHED_TICK_MS);
+    else
+        *LAPIC_REGISTER(LAPIC_TIMER_INITIAL) = (uint32_t)(lapic_ticks_per_ms*SCHED_TICK_MS);
+}
+
+void local_timer_stop() {
+    if (tsc_deadline_mode)
+        write_msr(MSR_TSC_DEADLINE, 0);
+    else
+        *LAPIC_REGISTER(LAPIC_TIMER_INITIAL) = 0;
+}
+
 /**
  * Initializes clock module
  *
@@ -246,4 +343,7 @@ void initialize_clock() {
     }
 
     initialize_ticker();
+    calibrate_local_timer();
+    vlog_msg("Local timer calibrated, %lu timer ticks and %lu tsc ticks per ms, tsc deadline %s",
+            lapic_ticks_per_ms, tsc_per_ms, tsc_deadline_mode ? "enabled" : "disabled");
 }
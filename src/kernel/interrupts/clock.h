@@ -35,12 +35,34 @@
  * Initializes clock subsystem.
  */
 void initialize_clock();
+/**
+ * Starts scheduler tick of current cpu with local apic timer.
+ *
+ * Uses TSC-deadline mode if available, periodic mode otherwise.
+ */
+void initialize_local_timer();
+/**
+ * Rearms scheduler tick of current cpu after it was stopped.
+ */
+void local_timer_start();
+/**
+ * Stops scheduler tick of current cpu, pending deadline is discarded.
+ */
+void local_timer_stop();
 /**
  * Returns unix time since 1970.
  */
 uint64_t get_unix_time();
 uint64_t get_unix_time_ms();
 /**
- * Busy waits for milis time in milis.
+ * Returns unix time in milliseconds.
+ */
+uint64_t clock_time_ms();
+/**
+ * Busy waits for milis time in milis. Requires interrupts enabled
+ * until local timer is calibrated.
  */
 void busy_wait_milis(size_t milis);
+
+/** Time stamp counter increments per millisecond, set up by initialize_clock */
+extern uint64_t tsc_per_ms;
@@ -62,7 +62,7 @@ void idt_set_gate(uint8_t gn, uintptr_t funcall) {
         gate->flags.ist = 1;
     if (gn == 8) // double fault
         gate->flags.ist = 2;
-    if (gn == 255) // ipi fault
+    if (gn == 255 || gn == 254) // ipi fault
         gate->flags.ist = 3;
 }
 
@@ -119,6 +119,8 @@ void initialize_interrupts() {
 
     idt_set_gate(30, (uintptr_t) isr30);
     idt_set_gate(31, (uintptr_t) isr31);
+    idt_set_gate(LOCAL_TIMER_VECTOR, (uintptr_t) isr253);
+    idt_set_gate(254, (uintptr_t) isr254);
     idt_set_gate(255, (uintptr_t) isr255);
 
     for (unsigned int i=32; i<47; i++)
@@ -204,8 +206,8 @@ void isr_handler(registers_t* r) {
             pic_sendeoi(PIC_EOI_SLAVE);
         if (r->type != 39)
             pic_sendeoi(PIC_EOI_MASTER);
-    } else if (r->type == 255) {
-        // ipi interrupt
+    } else if (r->type == 255 || r->type == 254 || r->type == LOCAL_TIMER_VECTOR) {
+        // ipi or local timer interrupt
         volatile uint32_t* eoi = (uint32_t*)physical_to_virtual(apicaddr+0xB0);
         *eoi = 0;
     }
@@ -105,6 +105,8 @@ extern void isr45();
 extern void isr46();
 extern void isr47();
 
+extern void isr253();
+extern void isr254();
 extern void isr255();
 
 #define IRQ0  32
@@ -124,6 +126,9 @@ extern void isr255();
 #define IRQ14 46
 #define IRQ15 47
 
+/** Vector of per cpu local apic timer */
+#define LOCAL_TIMER_VECTOR 253
+
 #define PIC1_LOCATION 0x20 /* Master PIC Address */
 #define PIC2_LOCATION 0xA0 /* Slave PIC Address */
 #define PIC1_COMMAND (PIC1_LOCATION+0) /* Master Command */
@@ -63,6 +63,8 @@ ISR_NOERRCODE 44
 ISR_NOERRCODE 45
 ISR_NOERRCODE 46
 ISR_NOERRCODE 47
+ISR_NOERRCODE 253
+ISR_NOERRCODE 254
 ISR_NOERRCODE 255
 
 [EXTERN isr_handler]
@@ -30,7 +30,10 @@
 #include <stdio.h>
 #include "../interrupts/interrupts.h"
 #include "../memory/paging.h"
+#include "../memory/usercopy.h"
+#include "../memory/swap.h"
 #include "../cpus/cpu_mgmt.h"
+#include "../processes/scheduler.h"
 
 extern void* get_faulting_address();
 extern void kp_halt();
@@ -91,13 +94,20 @@ void gp_exception(ruint_t ecode, registers_t* registers) {
 void pf_exception(ruint_t ecode, registers_t* registers) {
     void* fa = get_faulting_address();
     if (registers->cs == 0x8) {
-        // kernel page fault
-        // TODO: add swap
+        // kernel page fault, user memory touched by user copy is fine
+        if (user_copy_fault(fa, registers->ecode))
+            return;
         debug_break;
         return;
         // error(ERROR_KERNEL_PAGE_FAULT_IN_NONPAGED_AREA, (ruint_t)fa, ecode, (void*)registers->rip);
     } else {
-        if (!page_fault((uintptr_t)fa, registers->ecode)) {
+        faultstate_t state = page_fault((uintptr_t)fa, registers->ecode);
+        if (state == fs_nomem) {
+            // faulting access is retried on return, if swapper can't make room
+            // now, other threads run meanwhile
+            if (swapper_reclaim(SWAP_OUT_BATCH) == 0)
+                schedule(registers);
+        } else if (state == fs_invalid) {
             // TODO: add abort
             debug_break;
         }
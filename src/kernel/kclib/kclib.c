@@ -45,15 +45,20 @@ void* __kclib_heap_start() {
 }
 
 void*     __kclib_allocate(size_t aamount) {
-    uintptr_t ha = heap_start_address;
-    if (!allocate(heap_start_address, aamount, true, false, get_active_page()))
+    size_t size = ALIGN_UP(aamount, 0x1000);
+    uintptr_t ha = vmem_alloc(&heap_arena, size);
+    if (ha == 0)
         return NULL;
-    heap_start_address += ALIGN_UP(aamount, 0x1000); // fix deallocation
+    if (!allocate(ha, size, true, false, get_active_page())) {
+        vmem_free(&heap_arena, ha, size);
+        return NULL;
+    }
     return (void*)ha;
 }
 
 void      __kclib_deallocate(uintptr_t afrom, size_t aamount) {
     deallocate(afrom, aamount, get_active_page());
+    vmem_free(&heap_arena, afrom, aamount);
 }
 
 void*     __kclib_open_std_stream(uint8_t request_mode) {
@@ -35,6 +35,8 @@
 #include "utils/rsod.h"
 #include "memory/heap.h"
 #include "memory/paging.h"
+#include "memory/slab.h"
+#include "memory/swap.h"
 #include "structures/acpi.h"
 #include "syscalls/sys.h"
 #include "cpus/cpu_mgmt.h"
@@ -69,6 +71,7 @@ void kernel_main(struct multiboot_info* mboot_addr, ruint_t heap_start) {
 
     initialize_temporary_heap(heap_start);
     initialize_physical_memory_allocation(mboot_addr);
+    initialize_slab();
     initialize_standard_heap();
 
     initialize_logger();
@@ -116,6 +119,7 @@ void kernel_main(struct multiboot_info* mboot_addr, ruint_t heap_start) {
 
     initialize_ipi_subsystem();
     initialize_lapic();
+    initialize_local_timer();
     multiprocessing_ready = true;
     log_msg("Inter-processor interrupts initialized");
 
@@ -128,6 +132,9 @@ void kernel_main(struct multiboot_info* mboot_addr, ruint_t heap_start) {
     initialize_processes();
     log_msg("Process subsystem initialized");
 
+    initialize_swap();
+    log_msg("Swap area initialized");
+
     initialize_daemon_services();
     log_msg("Daemon services initialized");
 
@@ -164,9 +171,6 @@ void kernel_main(struct multiboot_info* mboot_addr, ruint_t heap_start) {
 
     DISABLE_INTERRUPTS();
     enschedule_to_self(array_get_at(initp->threads, 0));
-
-    cpu_t* cpu = get_current_cput();
-    queue_push(cpu->priority_0, array_get_at(initp->threads, 0));
     scheduler_enabled = true;
     schedule(NULL);
 }
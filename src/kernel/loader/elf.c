@@ -151,8 +151,7 @@ int32_t load_elf_stage_one(Elf64_Ehdr* header, uintptr_t base_address, proc_t* p
                     continue;
 
                 // must appear at this address
-                mmap_area_t** _mmap_area = request_va_hole(process, section->sh_addr, section->sh_size);
-                mmap_area_t* mmap_area = *_mmap_area;
+                mmap_area_t* mmap_area = request_va_hole(process, section->sh_addr, section->sh_size);
                 if (mmap_area == NULL) {
                     return ELF_ERROR_SECTION_OVERLAPS;
                 }
@@ -188,8 +187,7 @@ int32_t load_elf_stage_one(Elf64_Ehdr* header, uintptr_t base_address, proc_t* p
                     continue;
 
                 // must appear at this address
-                mmap_area_t** _mmap_area = find_va_hole(process, section->sh_size, section->sh_addralign);
-                mmap_area_t* mmap_area = *_mmap_area;
+                mmap_area_t* mmap_area = find_va_hole(process, section->sh_size, section->sh_addralign);
                 if (mmap_area == NULL) {
                     return ELF_ERROR_SECTION_OVERLAPS;
                 }
@@ -274,19 +272,26 @@ int32_t load_elf_exec(uintptr_t elf_file_data, proc_t* process) {
         return err;
     }
 
-    // TODO: support alloc size
-    size_t ssize = BASE_STACK_SIZE;
-    mmap_area_t** _mmap_area = find_va_hole(process, ssize, 0x1000);
-    mmap_area_t* mmap_area = *_mmap_area;
+    // stack is only reserved, pages are allocated on demand when stack grows,
+    // lowest page is left unmapped as guard page
+    size_t ssize = process->stack_size != 0 ? ALIGN_UP(process->stack_size, 0x1000) : BASE_STACK_SIZE;
+    mmap_area_t* mmap_area = find_va_hole(process, ssize + STACK_GUARD_SIZE, 0x1000);
     if (mmap_area == NULL) {
         return ELF_ERROR_ENOMEM;
     }
     mmap_area->mtype = stack_data;
-    if (!allocate(mmap_area->vastart, ssize, false, false, process->pml4)) {
+
+    alloc_info_t ainfo;
+    ainfo.from = mmap_area->vastart + STACK_GUARD_SIZE;
+    ainfo.amount = ssize;
+    ainfo.exec = false;
+    ainfo.finished = false;
+    ainfo.aod = true;
+    allocate_mem(&ainfo, false, false, process->pml4);
+    if (!ainfo.finished) {
         return ELF_ERROR_ENOMEM;
     }
-    memset_dpgs(process->pml4, (void*)mmap_area->vastart, 0, ssize);
-    thread->stack_bottom_address = mmap_area->vastart;
+    thread->stack_bottom_address = mmap_area->vastart + STACK_GUARD_SIZE;
     thread->stack_top_address = mmap_area->vaend;
     thread->last_rsp = thread->stack_top_address;
 
@@ -39,10 +39,16 @@ uintptr_t heap_start_address;
  * End of the heap address
  */
 uintptr_t heap_end_address;
+/**
+ * Address ranges of kernel heap block, backs kclib allocations
+ */
+vmem_t heap_arena;
+
+extern uint64_t get_active_page();
 
 /**
- * Allocates the memory amount increased by align count, then aligns it and
- * returns it.
+ * Allocates the memory from temporary heap, aligned to align. Otherwise
+ * aligned range is taken from heap_arena and allocated.
  */
 aligned_ptr_t malign(size_t amount, uint16_t align) {
     if (tmp_heap != 0) {
@@ -54,13 +60,14 @@ aligned_ptr_t malign(size_t amount, uint16_t align) {
         return (void*)(uintptr_t)head;
     }
 
-    uintptr_t unaligned = (uintptr_t) malloc(amount+align+sizeof(uintptr_t));
-    uintptr_t aligned = unaligned + sizeof(uintptr_t);
-    if (!(aligned % align == 0)) {
-        aligned = aligned + (align - (aligned % align));
+    size_t size = ALIGN_UP(amount, 0x1000);
+    uintptr_t aligned = vmem_xalloc(&heap_arena, size, align > 0x1000 ? align : 0x1000);
+    if (aligned == 0)
+        return NULL;
+    if (!allocate(aligned, size, true, false, get_active_page())) {
+        vmem_free(&heap_arena, aligned, size);
+        return NULL;
     }
-    uintptr_t* ptr = (uintptr_t*) aligned;
-    *(ptr-1) = unaligned;
     return (void*)aligned;
 }
 
@@ -69,6 +76,11 @@ void initialize_temporary_heap(puint_t temp_heap_start) {
 }
 
 void initialize_standard_heap() {
-    heap_end_address = heap_start_address = ADDRESS_OFFSET(RESERVED_KBLOCK_KHEAP_MAPPINGS);
+    heap_start_address = ADDRESS_OFFSET(RESERVED_KBLOCK_KHEAP_MAPPINGS);
+    heap_end_address = heap_start_address + (1UL<<39);
+    if (!vmem_init(&heap_arena, "kernel_heap", heap_start_address,
+            heap_end_address-heap_start_address, 0x1000)) {
+        error(ERROR_MINIMAL_MEMORY_FAILURE, 0, 0, &initialize_standard_heap);
+    }
     tmp_heap = 0;
 }
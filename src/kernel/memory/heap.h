@@ -29,6 +29,7 @@
 #include "../commons.h"
 #include "../utils/rsod.h"
 #include "paging.h"
+#include "vmem.h"
 
 #include <stdlib.h>
 
@@ -41,7 +42,10 @@ void initialize_temporary_heap(puint_t temp_heap_start);
  */
 void initialize_standard_heap();
 /**
- * Returns allocated address which is aligned to align parameter
+ * Returns allocated address which is aligned to align parameter.
+ *
+ * Once standard heap is initialized, memory is taken directly from
+ * heap_arena, so it is page granular.
  */
 void* malign(size_t amount, uint16_t align);
 
@@ -49,3 +53,7 @@ void* malign(size_t amount, uint16_t align);
  * Start of the heap address
  */
 extern uintptr_t heap_start_address;
+/**
+ * Address ranges of kernel heap block
+ */
+extern vmem_t heap_arena;
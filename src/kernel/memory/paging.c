@@ -26,6 +26,7 @@
  */
 #include "paging.h"
 #include "heap.h"
+#include "swap.h"
 #include "../cpus/ipi.h"
 #include "../cpus/cpu_mgmt.h"
 #include "../processes/process.h"
@@ -33,6 +34,8 @@
 /** aligns the address to 0x1000 and then casts it to type */
 #define PALIGN(type, addr) ((type)ALIGN(addr))
 #define _ALIGN_UP(v) ((v) % 0x1000 == 0 ? (v) : ALIGN((v) + 0x1000))
+/** physical frame address of page entry, without flags and xd bit */
+#define PAGE_FRAME(entry) (((uint64_t)(entry)) & 0x000FFFFFFFFFF000UL)
 
 
 /** Maximum physical bits in page structures */
@@ -41,10 +44,34 @@ uint64_t maxphyaddr;
 uint64_t maxram;
 
 section_info_t* frame_pool;
+/** Sections of frame_pool by their section_id */
+section_info_t* pool_sections[MAX_POOL_SECTIONS];
+size_t pool_section_count;
+/** Frame info for every frame up to frame_map_frames, indexed by frame number */
+frame_info_t* frame_map;
+size_t frame_map_frames;
+/** Physical ranges used at boot, sorted and disjoint after merge_reserved_ranges */
+static reserved_range_t reserved_ranges[MAX_RESERVED_RANGES];
+static size_t reserved_range_count;
+/** Time spent building frame map and frame pool at boot, in TSC ticks */
+uint64_t frame_pool_build_time;
 
 bool __mem_mirror_present;
 struct multiboot_info multiboot_info;
-ruint_t __frame_lock;
+/** Guards section stacks of frame_pool */
+ruint_t __pool_lock;
+/** Frames in free lists of all sections, guarded by __pool_lock */
+size_t free_frame_count;
+/** Frames zeroed in advance by idle cpus, guarded by __zero_lock */
+puint_t zero_pool[ZERO_POOL_SIZE];
+size_t  zero_pool_count;
+ruint_t __zero_lock;
+/** Shared read only zero frame, mapped by read faults on allocate on demand pages */
+puint_t zero_frame;
+/** Zeroed frame requests served from zero_pool and served by zeroing inline */
+large_page_stats_t large_page_stats;
+uint64_t zero_pool_hits;
+uint64_t zero_pool_misses;
 
 extern uint64_t detect_maxphyaddr();
 extern uint64_t get_active_page();
@@ -59,6 +86,86 @@ extern unsigned char _frame_block[0];
 extern void proc_spinlock_lock(void* address);
 extern void proc_spinlock_unlock(void* address);
 extern void kp_halt();
+extern bool multiprocessing_ready;
+extern uint64_t read_tsc();
+extern void fill_frame_info_nt(frame_info_t* frames, frame_info_t* pattern, size_t count);
+
+/**
+ * Spinlock with hold time instrumentation, statistics are updated by lock holder.
+ */
+typedef struct paging_lock {
+    ruint_t      lock;
+    uint64_t     acquired; // tsc of acquisition, valid while held
+    lock_stats_t stats;
+} paging_lock_t;
+
+/**
+ * Guards frame reference counts (usage_count, cow_count) and page structures
+ * shared between address spaces. Always taken inside address space lock, never
+ * the other way around.
+ */
+paging_lock_t __frame_lock;
+/** Number of address space lock stripes, see space_lock */
+#define SPACE_LOCKS (64)
+/** Guard page structures of user half of address spaces */
+paging_lock_t __space_locks[SPACE_LOCKS];
+/** Guards kernel half of page structures, it is the same in every address space */
+paging_lock_t __kernel_space_lock;
+
+static void paging_lock(paging_lock_t* lock) {
+    uint64_t start = read_tsc();
+    bool contended = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED) != 0;
+    proc_spinlock_lock(&lock->lock);
+    lock->acquired = read_tsc();
+    ++lock->stats.acquired;
+    if (contended)
+        ++lock->stats.contended;
+    lock->stats.wait_time += lock->acquired - start;
+}
+
+static void paging_unlock(paging_lock_t* lock) {
+    uint64_t held = read_tsc() - lock->acquired;
+    lock->stats.hold_time += held;
+    if (held > lock->stats.max_hold)
+        lock->stats.max_hold = held;
+    proc_spinlock_unlock(&lock->lock);
+}
+
+/**
+ * Returns lock guarding page structures of vaddress in address space cr3.
+ *
+ * Address spaces are locked independently, lock is selected by pml4 frame,
+ * so unrelated processes only share it on stripe collision. Kernel half is
+ * shared by every address space, so it has single lock.
+ *
+ * Entry pointer returned by get_page is only valid while the lock is held,
+ * its page table can be released (see deallocate) as soon as it is dropped.
+ * Code that drops the lock must walk to the entry again after relocking.
+ */
+static paging_lock_t* space_lock(uintptr_t cr3, uintptr_t vaddress) {
+    if ((vaddress >> 47) != 0)
+        return &__kernel_space_lock;
+    return &__space_locks[(PAGE_FRAME(cr3) >> 12) % SPACE_LOCKS];
+}
+
+static void add_lock_stats(lock_stats_t* sum, lock_stats_t* stats) {
+    sum->acquired += stats->acquired;
+    sum->contended += stats->contended;
+    sum->wait_time += stats->wait_time;
+    sum->hold_time += stats->hold_time;
+    if (stats->max_hold > sum->max_hold)
+        sum->max_hold = stats->max_hold;
+}
+
+void get_paging_lock_stats(lock_stats_t* frame, lock_stats_t* spaces, lock_stats_t* kernel) {
+    memset(frame, 0, sizeof(lock_stats_t));
+    memset(spaces, 0, sizeof(lock_stats_t));
+    memset(kernel, 0, sizeof(lock_stats_t));
+    add_lock_stats(frame, &__frame_lock.stats);
+    add_lock_stats(kernel, &__kernel_space_lock.stats);
+    for (size_t i=0; i<SPACE_LOCKS; i++)
+        add_lock_stats(spaces, &__space_locks[i].stats);
+}
 
 /**
  * Virtual address structure for standard paging.
@@ -84,6 +191,18 @@ typedef struct v_address1GB {
 
 /** Checks if page structure at addr is present or not */
 #define PRESENT(addr) (((uint64_t)addr) & 1)
+/** Checks if page structure at addr is writable */
+#define RW(addr) ((((uint64_t)addr) >> 1) & 1)
+/** Accessed bit, set by cpu when page (structure) is used for translation */
+#define PAGE_ACCESSED (1UL << 5)
+/** Dirty bit, set by cpu on first write to the page */
+#define PAGE_DIRTY (1UL << 6)
+/** Checks if page at addr is user page */
+#define US(addr) ((((uint64_t)addr) >> 2) & 1)
+/** Page size bit, page directory (pointer) entry maps large page directly */
+#define PAGE_PS (1UL << 7)
+/** Checks if page directory (pointer) entry at addr maps large page */
+#define PS(addr) ((((uint64_t)addr) >> 7) & 1)
 
 /**
  * Computes virtual to physical mapping.
@@ -92,52 +211,43 @@ typedef struct v_address1GB {
  * If page structures are missing on the way to decode, physical address cannot
  * be found and this valid will contain 0, otherwise valid will contain 1
  *
- * 1GB page sector (ram identity map) behaves slightly different, because it
- * needs different v_address_t type.
+ * 1GB pages (ram identity map) and 2MB pages end the walk early, offset is
+ * then taken from the rest of the address.
  */
 ruint_t virtual_to_physical(uintptr_t vaddress, uintptr_t cr3, uint8_t* valid) {
-    *valid = 1;
+    *valid = 0;
     v_address_t va;
     memcpy(&va, &vaddress, 8);
 
-    puint_t* address = (puint_t*)ALIGN(physical_to_virtual(cr3));
-    address = (puint_t*)ALIGN(physical_to_virtual(address[va.pml]));
-
-    if (!PRESENT(address)) {
-        *valid = 0;
+    puint_t* pml4 = (puint_t*)ALIGN(physical_to_virtual(cr3));
+    if (!PRESENT(pml4[va.pml]))
         return 0;
-    }
 
-    if (vaddress > ADDRESS_OFFSET(RESERVED_KBLOCK_RAM_MAPPINGS) &&
-                vaddress < ADDRESS_OFFSET((RESERVED_KBLOCK_RAM_MAPPINGS+1)) &&
-                is_1GB_paging_supported()) {
-        v_address1GB_t va = *((v_address1GB_t*) &vaddress);
-        page_directory1GB_t pd1gb;
-        pd1gb.number = (uint64_t) address;
-        return pd1gb.flaggable.address + va.offset;
-    }
-
-    address = (puint_t*)ALIGN(physical_to_virtual(address[va.directory_ptr]));
-
-    if (!PRESENT(address)) {
-        *valid = 0;
+    puint_t* pdpt = (puint_t*)ALIGN(physical_to_virtual(pml4[va.pml]));
+    puint_t entry = pdpt[va.directory_ptr];
+    if (!PRESENT(entry))
         return 0;
+    if (PS(entry)) {
+        *valid = 1;
+        return (entry & 0x000FFFFFC0000000UL) + (vaddress & 0x3FFFFFFF);
     }
 
-    address = (puint_t*)ALIGN(physical_to_virtual(address[va.directory]));
-
-    if (!PRESENT(address)) {
-        *valid = 0;
+    puint_t* pdir = (puint_t*)ALIGN(physical_to_virtual(entry));
+    entry = pdir[va.directory];
+    if (!PRESENT(entry))
         return 0;
+    if (PS(entry)) {
+        *valid = 1;
+        return (entry & 0x000FFFFFFFE00000UL) + (vaddress & (LARGE_PAGE_SIZE-1));
     }
 
-    if (!PRESENT(*address)) {
-        *valid = 0;
+    puint_t* pt = (puint_t*)ALIGN(physical_to_virtual(entry));
+    entry = pt[va.table];
+    if (!PRESENT(entry))
         return 0;
-    }
 
-    puint_t physadd = *address;
-    return ALIGN(physadd) + va.offset;
+    *valid = 1;
+    return (entry & 0x000FFFFFFFFFF000UL) + va.offset;
 }
 
 /**
@@ -152,158 +262,786 @@ uintptr_t physical_to_virtual(puint_t paddress) {
 }
 
 /**
- * Always returns free frame
- * TODO: add paging to swap
+ * Returns frame info of frame at fa and optionally its section.
+ *
+ * Frame map is indexed directly by frame number, so lookup is O(1). Returns NULL
+ * for frames that are not part of any pool section.
+ */
+static frame_info_t* __get_frame_info(puint_t fa, section_info_t** fsection) {
+    puint_t pfn = fa >> 12;
+    if (frame_map == NULL || pfn >= frame_map_frames)
+        return NULL;
+
+    frame_info_t* fi = &((frame_info_t*)physical_to_virtual((puint_t)frame_map))[pfn];
+    if ((fi->flags & FRAME_FLAG_POOL) == 0)
+        return NULL;
+    if (fsection != NULL)
+        *fsection = (section_info_t*)physical_to_virtual((puint_t)pool_sections[fi->section_id]);
+    return fi;
+}
+
+static frame_info_t* get_frame_info(puint_t fa) {
+    return __get_frame_info(fa, NULL);
+}
+
+#define SECTION_FRAMES(section) ((frame_info_t*)physical_to_virtual((puint_t)(section)->frame_array))
+#define SECTION_FRAME_ADDRESS(section, idx) ((section)->start_word + ((puint_t)(idx) * 0x1000))
+
+/**
+ * Links free block at idx into free list of its order.
+ */
+static void buddy_list_add(section_info_t* section, uint32_t idx, uint8_t order) {
+    frame_info_t* frames = SECTION_FRAMES(section);
+    frame_info_t* fi = &frames[idx];
+
+    fi->flags |= FRAME_FLAG_FREE;
+    fi->order = order;
+    fi->prev_free = FRAME_NONE;
+    fi->next_free = section->free_list[order];
+    if (fi->next_free != FRAME_NONE)
+        frames[fi->next_free].prev_free = idx;
+    section->free_list[order] = idx;
+    section->free_frames += 1UL << order;
+    free_frame_count += 1UL << order;
+}
+
+/**
+ * Unlinks free block at idx from free list of its order.
+ */
+static void buddy_list_remove(section_info_t* section, uint32_t idx) {
+    frame_info_t* frames = SECTION_FRAMES(section);
+    frame_info_t* fi = &frames[idx];
+
+    if (fi->prev_free != FRAME_NONE)
+        frames[fi->prev_free].next_free = fi->next_free;
+    else
+        section->free_list[fi->order] = fi->next_free;
+    if (fi->next_free != FRAME_NONE)
+        frames[fi->next_free].prev_free = fi->prev_free;
+
+    fi->flags &= ~FRAME_FLAG_FREE;
+    fi->next_free = FRAME_NONE;
+    fi->prev_free = FRAME_NONE;
+    section->free_frames -= 1UL << fi->order;
+    free_frame_count -= 1UL << fi->order;
+}
+
+/**
+ * Returns index of buddy block of block at idx, or FRAME_NONE if buddy
+ * lies outside of the section.
+ *
+ * Buddies are computed from physical frame numbers, so every block of order n is
+ * aligned to 2^n frames physically.
+ */
+static uint32_t buddy_of(section_info_t* section, uint32_t idx, uint8_t order) {
+    puint_t pfn = SECTION_FRAME_ADDRESS(section, idx) >> 12;
+    puint_t bpfn = pfn ^ (1UL << order);
+    puint_t spfn = section->start_word >> 12;
+    if (bpfn < spfn || bpfn - spfn + (1UL << order) > section->total_frames)
+        return FRAME_NONE;
+    return (uint32_t)(bpfn - spfn);
+}
+
+/**
+ * Takes block of 2^order frames from section, splitting bigger blocks if needed.
+ *
+ * Returns index of first frame or FRAME_NONE. __pool_lock must be held.
+ */
+static uint32_t buddy_alloc(section_info_t* section, uint8_t order) {
+    uint8_t corder = order;
+    while (corder <= BUDDY_MAX_ORDER && section->free_list[corder] == FRAME_NONE)
+        ++corder;
+    if (corder > BUDDY_MAX_ORDER)
+        return FRAME_NONE;
+
+    uint32_t idx = section->free_list[corder];
+    buddy_list_remove(section, idx);
+
+    // return upper halves back until block is of requested order
+    while (corder > order) {
+        --corder;
+        buddy_list_add(section, idx + (1U << corder), corder);
+    }
+
+    frame_info_t* frames = SECTION_FRAMES(section);
+    for (uint32_t i=0; i<(1U << order); i++) {
+        frames[idx+i].usage_count = 1;
+        frames[idx+i].cow_count = 0;
+        frames[idx+i].swap_slot = SWAP_SLOT_NONE; // stale free list links
+    }
+    return idx;
+}
+
+/**
+ * Returns block of 2^order frames at idx back to section, merging it with
+ * its buddies while possible. __pool_lock must be held.
+ */
+static void buddy_free(section_info_t* section, uint32_t idx, uint8_t order) {
+    frame_info_t* frames = SECTION_FRAMES(section);
+    for (uint32_t i=0; i<(1U << order); i++) {
+        frames[idx+i].usage_count = 0;
+        frames[idx+i].cow_count = 0;
+    }
+
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t buddy = buddy_of(section, idx, order);
+        if (buddy == FRAME_NONE)
+            break;
+        frame_info_t* bi = &frames[buddy];
+        if ((bi->flags & FRAME_FLAG_FREE) == 0 || bi->order != order)
+            break;
+        buddy_list_remove(section, buddy);
+        if (buddy < idx)
+            idx = buddy;
+        ++order;
+    }
+
+    buddy_list_add(section, idx, order);
+}
+
+size_t get_free_frame_count() {
+    return __atomic_load_n(&free_frame_count, __ATOMIC_RELAXED) +
+            __atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED);
+}
+
+/**
+ * Pops free frame from section free lists, __pool_lock must be held.
+ */
+static puint_t pool_pop_frame() {
+    section_info_t* section = (section_info_t*)physical_to_virtual((puint_t)frame_pool);
+    while (section != NULL) {
+        uint32_t idx = buddy_alloc(section, 0);
+        if (idx != FRAME_NONE)
+            return SECTION_FRAME_ADDRESS(section, idx);
+        section = (section_info_t*)physical_to_virtual((puint_t)section->next_section);
+    }
+    return 0;
+}
+
+/**
+ * Returns frame back to its section, __pool_lock must be held.
+ */
+static void pool_push_frame(puint_t fa) {
+    section_info_t* section;
+    frame_info_t* fi = __get_frame_info(fa, &section);
+    if (fi == NULL)
+        return; // unmapped address not in a pool, most likely <2MB.
+
+    buddy_free(section, (uint32_t)((fa-section->start_word) / 0x1000), 0);
+}
+
+/**
+ * Returns frame cache of current cpu or NULL, if cpus are not yet ready.
+ *
+ * Cache is only ever touched by owning cpu and kernel code is not preempted,
+ * so no lock is required.
+ */
+static frame_cache_t* get_frame_cache() {
+    if (!multiprocessing_ready)
+        return NULL;
+    return &get_current_cput()->frame_cache;
+}
+
+/**
+ * Returns free frame or 0, if there is none. Faults that could not get a frame
+ * wait for swapper to release some (see swapper_wait).
+ *
+ * Frames are served from per cpu frame cache, which is refilled by
+ * FRAME_CACHE_BATCH frames at once, so __pool_lock is only taken once per batch.
  */
 extern void kp_halt();
+extern void zero_frame_nt(void* address);
+
+/**
+ * Pops frame from zeroed frame pool, returns 0 if pool is empty.
+ */
+static puint_t zero_pool_pop() {
+    puint_t frame = 0;
+    proc_spinlock_lock(&__zero_lock);
+    if (zero_pool_count > 0)
+        frame = zero_pool[--zero_pool_count];
+    proc_spinlock_unlock(&__zero_lock);
+    return frame;
+}
+
 static puint_t get_free_frame() {
     if (frame_pool == NULL) {
         return ((puint_t)malign(0x1000, 0x1000)-0xFFFFFFFF80000000);
     } else {
-        section_info_t* section = (section_info_t*)physical_to_virtual((puint_t)frame_pool);
-        while (section != NULL) {
-            if (section->head != NULL) {
-                stack_element_t* se = (stack_element_t*) physical_to_virtual((puint_t)section->head);
-                section->head = se->next;
-                ((frame_info_t*)physical_to_virtual((puint_t)section->frame_array))
-                        [se->array_ord].usage_count = 1;
-                return se->frame_address;
+        frame_cache_t* cache = get_frame_cache();
+        if (cache == NULL) {
+            proc_spinlock_lock(&__pool_lock);
+            puint_t frame = pool_pop_frame();
+            proc_spinlock_unlock(&__pool_lock);
+            if (frame == 0)
+                frame = zero_pool_pop();
+            return frame;
+        }
+
+        if (cache->count == 0) {
+            proc_spinlock_lock(&__pool_lock);
+            while (cache->count < FRAME_CACHE_BATCH) {
+                puint_t frame = pool_pop_frame();
+                if (frame == 0)
+                    break;
+                cache->frames[cache->count++] = frame;
             }
-            section = (section_info_t*)physical_to_virtual((puint_t)section->next_section);
+            proc_spinlock_unlock(&__pool_lock);
+
+            if (cache->count == 0)
+                return zero_pool_pop(); // last resort, zeroing was wasted
         }
 
-        proc_spinlock_unlock(&__frame_lock);
-        return 0;
+        return cache->frames[--cache->count];
     }
 }
 
+/**
+ * Returns zeroed free frame.
+ *
+ * Frame is taken from zeroed frame pool, if it is empty, free frame is
+ * zeroed inline.
+ */
+static puint_t get_zeroed_frame() {
+    if (frame_pool != NULL) {
+        puint_t frame = zero_pool_pop();
+        if (frame != 0) {
+            __atomic_add_fetch(&zero_pool_hits, 1, __ATOMIC_RELAXED);
+            return frame;
+        }
+    }
+
+    puint_t frame = get_free_frame();
+    if (frame != 0) {
+        __atomic_add_fetch(&zero_pool_misses, 1, __ATOMIC_RELAXED);
+        memset((void*)physical_to_virtual(frame), 0, 0x1000);
+    }
+    return frame;
+}
+
+bool zero_frames_idle() {
+    if (frame_pool == NULL || !__mem_mirror_present)
+        return false;
+    if (__atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) >= ZERO_POOL_SIZE)
+        return false;
+
+    puint_t frames[ZERO_POOL_BATCH];
+    size_t count = 0;
+    proc_spinlock_lock(&__pool_lock);
+    while (count < ZERO_POOL_BATCH) {
+        puint_t frame = pool_pop_frame();
+        if (frame == 0)
+            break;
+        frames[count++] = frame;
+    }
+    proc_spinlock_unlock(&__pool_lock);
+
+    if (count == 0)
+        return false;
+
+    for (size_t i=0; i<count; i++)
+        zero_frame_nt((void*)physical_to_virtual(frames[i]));
+
+    size_t i = 0;
+    proc_spinlock_lock(&__zero_lock);
+    while (i < count && zero_pool_count < ZERO_POOL_SIZE)
+        zero_pool[zero_pool_count++] = frames[i++];
+    proc_spinlock_unlock(&__zero_lock);
+
+    if (i < count) {
+        // other cpu filled the pool meanwhile
+        proc_spinlock_lock(&__pool_lock);
+        for (; i<count; i++)
+            pool_push_frame(frames[i]);
+        proc_spinlock_unlock(&__pool_lock);
+    }
+    return true;
+}
+
 /**
  * Deallocates frame from frame_map.
+ *
+ * Frame is not zeroed, allocations requiring zeroed memory use get_zeroed_frame.
+ *
+ * Freed frame is put into per cpu frame cache, if cache is full, FRAME_CACHE_BATCH
+ * frames are returned to section stacks under single __pool_lock.
  */
 static void free_frame(puint_t frame_address) {
-    puint_t fa = ALIGN(frame_address);
+    puint_t fa = PAGE_FRAME(frame_address);
+    if (fa == zero_frame)
+        return; // pinned forever
+
+    frame_info_t* fi = get_frame_info(fa);
+    if (fi == NULL)
+        return; // unmapped address not in a pool, most likely <2MB.
+
+    --fi->usage_count;
+    if (fi->cow_count > 0)
+        --fi->cow_count;
+    if (fi->usage_count != 0)
+        return;
+    if ((fi->flags & FRAME_FLAG_TABLE) == 0 && fi->swap_slot != SWAP_SLOT_NONE) {
+        // swap copy of released page is not needed anymore
+        swap_slot_put(fi->swap_slot - 1);
+    }
+    fi->swap_slot = SWAP_SLOT_NONE; // also drops live entries of page structure
+    fi->flags &= ~FRAME_FLAG_TABLE;
+
+    frame_cache_t* cache = get_frame_cache();
+    if (cache == NULL) {
+        proc_spinlock_lock(&__pool_lock);
+        pool_push_frame(fa);
+        proc_spinlock_unlock(&__pool_lock);
+        return;
+    }
 
-    section_info_t* section = (section_info_t*)physical_to_virtual((puint_t)frame_pool);
-    while (section != NULL) {
-        if (fa >= section->start_word && fa < section->end_word) {
-            uint32_t idx = (fa-section->start_word) / 0x1000;
-            frame_info_t* fi = &((frame_info_t*)
-                        physical_to_virtual((puint_t)section->frame_array))[idx];
-            --fi->usage_count;
-            if (fi->cow_count > 0)
-                --fi->cow_count;
-            if (fi->usage_count == 0) {
-                stack_element_t* se = (stack_element_t*)
-                                        physical_to_virtual((puint_t)fi->bound_stack_element);
-                se->next = section->head;
-                section->head = fi->bound_stack_element;
-                memset((void*)physical_to_virtual(
-                        ((stack_element_t*)physical_to_virtual((puint_t)section->head))->frame_address),
-                        0x0, 0x1000);
-            }
-            return;
-        } else {
-            section = (section_info_t*)physical_to_virtual((puint_t)section->next_section);
+    if (cache->count == FRAME_CACHE_SIZE) {
+        proc_spinlock_lock(&__pool_lock);
+        for (size_t i=0; i<FRAME_CACHE_BATCH; i++) {
+            pool_push_frame(cache->frames[--cache->count]);
         }
+        proc_spinlock_unlock(&__pool_lock);
     }
-    // unmapped address not in a pool, most likely <2MB.
+
+    // frame is held by the cache now
+    fi->usage_count = 1;
+    cache->frames[cache->count++] = fa;
 }
 
-static frame_info_t* get_frame_info(puint_t fa) {
+/**
+ * Takes 2^order frames block from buddy sections, contents are undefined.
+ */
+static puint_t __alloc_frames(uint8_t order) {
+    if (order > BUDDY_MAX_ORDER || frame_pool == NULL)
+        return 0;
 
+    puint_t frames = 0;
+    proc_spinlock_lock(&__pool_lock);
     section_info_t* section = (section_info_t*)physical_to_virtual((puint_t)frame_pool);
     while (section != NULL) {
-        if (section->start_word <= fa && section->end_word > fa) {
-            uint32_t idx = (fa-section->start_word) / 0x1000;
-            frame_info_t* fi = (frame_info_t*)physical_to_virtual((puint_t)section->frame_array);
-            return &fi[idx];
-        } else {
-            section = (section_info_t*)physical_to_virtual((puint_t)section->next_section);
+        uint32_t idx = buddy_alloc(section, order);
+        if (idx != FRAME_NONE) {
+            frames = SECTION_FRAME_ADDRESS(section, idx);
+            break;
         }
+        section = (section_info_t*)physical_to_virtual((puint_t)section->next_section);
     }
+    proc_spinlock_unlock(&__pool_lock);
+    return frames;
+}
+
+puint_t alloc_frames(uint8_t order) {
+    if (order == 0 && frame_pool != NULL)
+        return get_zeroed_frame();
 
-    return NULL;
+    puint_t frames = __alloc_frames(order);
+    if (frames != 0)
+        memset((void*)physical_to_virtual(frames), 0, 0x1000UL << order);
+    return frames;
 }
 
 /**
- * Returns page allocated for that virtual address.
+ * Frames are released one by one, because parts of the block might still be
+ * referenced by other mappings. Block is merged back in buddy free lists.
+ *
+ * Requires __frame_lock.
+ */
+static void __free_frames(puint_t frames, uint8_t order) {
+    for (size_t i=0; i<(1UL << order); i++)
+        free_frame(frames + (i*0x1000));
+}
+
+void free_frames(puint_t frames, uint8_t order) {
+    paging_lock(&__frame_lock);
+    __free_frames(frames, order);
+    paging_unlock(&__frame_lock);
+}
+
+/** Bits of page structure entry that hold the frame address */
+#define ENTRY_FRAME_MASK (0x000FFFFFFFFFF000UL)
+
+/**
+ * Checks whether page entry was swapped out, slot will contain its swap slot.
+ *
+ * Swapped entry holds reference to its swap slot.
+ */
+static bool swapped_entry(puint_t entry, size_t* slot) {
+    page_t page;
+    page.address = entry;
+    if (page.internal.present || !page.internal.valid || !page.internal.swapped)
+        return false;
+    *slot = page.internal.gps_id;
+    return true;
+}
+
+/**
+ * Returns entry of table being shared by another reference.
+ *
+ * Referenced frame gains a reference. Page tables are shared read only, so
+ * is every writable frame, which then becomes copy on write. Large page is
+ * a leaf, every frame of it is shared. Swapped page shares its swap slot.
+ */
+static puint_t share_entry(puint_t entry, bool leaf) {
+    size_t slot;
+    if (leaf && swapped_entry(entry, &slot)) {
+        swap_slot_get(slot);
+        return entry;
+    }
+    if (!PRESENT(entry) || PAGE_FRAME(entry) == zero_frame)
+        return entry;
+    frame_info_t* fi = get_frame_info(PAGE_FRAME(entry));
+    if (fi == NULL)
+        return entry; // not a pool frame, mapped device memory
+
+    page_t page;
+    page.address = entry;
+    if (!leaf && !PS(entry)) {
+        ++fi->usage_count;
+        page.flaggable.rw = 0;
+        return page.address;
+    }
+
+    size_t frames = leaf ? 1 : (LARGE_PAGE_SIZE / 0x1000);
+    for (size_t i=0; i<frames; i++) {
+        fi = get_frame_info(PAGE_FRAME(entry) + (i*0x1000));
+        ++fi->usage_count;
+        if (page.flaggable.rw == 1 || fi->cow_count > 0) {
+            if (fi->cow_count == 0)
+                ++fi->cow_count;
+            ++fi->cow_count;
+        }
+    }
+    page.flaggable.rw = 0;
+    return page.address;
+}
+
+/**
+ * Returns frame info of page structure holding entry, if its live entries are
+ * tracked. Page structures are accessed via memory mirror once it is present.
+ */
+static frame_info_t* table_info(puint_t* entry) {
+    uintptr_t table = ALIGN(entry);
+    if (__mem_mirror_present) {
+        if (table < ADDRESS_OFFSET(RESERVED_KBLOCK_RAM_MAPPINGS) ||
+                table >= ADDRESS_OFFSET((RESERVED_KBLOCK_RAM_MAPPINGS+1)))
+            return NULL;
+        table -= ADDRESS_OFFSET(RESERVED_KBLOCK_RAM_MAPPINGS);
+    }
+    frame_info_t* fi = get_frame_info(table);
+    if (fi == NULL || (fi->flags & FRAME_FLAG_TABLE) == 0)
+        return NULL;
+    return fi;
+}
+
+/**
+ * Starts tracking live entries of page structure frame. Frames outside
+ * of pool are not tracked and are scanned instead.
+ */
+static void table_track(puint_t table, uint32_t live) {
+    frame_info_t* fi = get_frame_info(table);
+    if (fi == NULL)
+        return;
+    fi->flags |= FRAME_FLAG_TABLE;
+    fi->live_entries = live;
+}
+
+/**
+ * Writes page structure entry, keeping live entry count of the structure.
+ *
+ * Every entry of page tables, directories and directory pointer tables must
+ * be written through this once structure is tracked. Pml4 is never tracked.
+ */
+static void set_entry(puint_t* entry, puint_t value) {
+    frame_info_t* fi = table_info(entry);
+    if (fi != NULL) {
+        if (*entry == 0 && value != 0)
+            ++fi->live_entries;
+        else if (*entry != 0 && value == 0)
+            --fi->live_entries;
+    }
+    *entry = value;
+}
+
+/**
+ * Returns whether page structure has no non zero entries.
+ *
+ * O(1) for tracked structures, untracked ones (boot structures) are scanned.
+ */
+static bool table_empty(puint_t* table) {
+    frame_info_t* fi = table_info(table);
+    if (fi != NULL)
+        return fi->live_entries == 0;
+    for (size_t i=0; i<512; i++) {
+        if (table[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Replaces large page mapped by directory entry with page table mapping the
+ * same frames with the same attributes. Frames are already accounted one by
+ * one, so nothing else changes. Translations stay the same, thus TLB can keep
+ * using the large entry until next flush. Address space lock must be held.
+ */
+static bool split_large_page(puint_t* entry) {
+    puint_t table = get_free_frame();
+    if (table == 0)
+        return false;
+
+    // bit 7 is PAT bit in page table entry
+    puint_t leaf = *entry & ~PAGE_PS;
+    puint_t* pt = (puint_t*)physical_to_virtual(table);
+    for (size_t i=0; i<512; i++)
+        pt[i] = leaf + (i*0x1000);
+    table_track(table, 512);
+
+    page_t large;
+    large.address = *entry;
+    page_table_t ptentry;
+    memset(&ptentry, 0, sizeof(page_table_t));
+    ptentry.number = table;
+    ptentry.flaggable.present = 1;
+    ptentry.flaggable.us = large.flaggable.us;
+    ptentry.flaggable.rw = 1;
+    set_entry(entry, ptentry.number);
+    ++large_page_stats.split;
+    return true;
+}
+
+/**
+ * Makes page structure referenced by entry private to this address space.
+ *
+ * User page structures with read only entry are shared between address spaces
+ * (see clone_paging_structures). If table is still referenced elsewhere, it is
+ * copied and all its entries are shared one level down. Address space lock must
+ * be held, shared table itself is only touched under __frame_lock.
+ * Only ever upgrades entry to writable, so no TLB flush is required.
+ */
+static bool unshare_table(puint_t* entry, bool leaf) {
+    puint_t table = PAGE_FRAME(*entry);
+    frame_info_t* fi = get_frame_info(table);
+    paging_lock(&__frame_lock);
+    if (fi != NULL && fi->usage_count > 1) {
+        puint_t ntable = get_free_frame();
+        if (ntable == 0) {
+            paging_unlock(&__frame_lock);
+            return false;
+        }
+        puint_t* source = (puint_t*)physical_to_virtual(table);
+        puint_t* target = (puint_t*)physical_to_virtual(ntable);
+        uint32_t live = 0;
+        for (size_t i=0; i<512; i++) {
+            source[i] = share_entry(source[i], leaf);
+            target[i] = source[i];
+            if (target[i] != 0)
+                ++live;
+        }
+        table_track(ntable, live);
+        --fi->usage_count;
+        set_entry(entry, (*entry & ~ENTRY_FRAME_MASK) | ntable);
+    }
+    paging_unlock(&__frame_lock);
+
+    page_t page;
+    page.address = *entry;
+    page.flaggable.rw = 1;
+    set_entry(entry, page.address);
+    return true;
+}
+
+/**
+ * Returns page directory for that virtual address.
  *
  * If allocate_new is specified to true, it will allocate substructures,
- * if not present.Otherwise returns NULL if page structures are not present
- * on the way to the virtual address. Returned pointer points to page in page
- * table.
+ * if not present. Otherwise returns NULL if page structures are not present
+ * on the way to the virtual address, and next will contain first address
+ * after the missing structure. If allocation fails, next will be vaddress.
+ *
+ * Page structures shared with other address space are made private on the way.
+ * Address space lock of vaddress must be held (see space_lock).
  */
-static puint_t* __get_page(uintptr_t vaddress, uintptr_t cr3, bool allocate_new, bool user) {
+static puint_t* __get_directory(uintptr_t vaddress, uintptr_t cr3, bool allocate_new, bool user, uintptr_t* next) {
 
     v_address_t va;
     memcpy(&va, &vaddress, 8);
+    *next = vaddress;
 
     puint_t* pml4 = (puint_t*)ALIGN(physical_to_virtual(cr3));
     if (!PRESENT(pml4[va.pml])) {
         if (!allocate_new) {
+            *next = ((vaddress >> 39) + 1) << 39;
             return 0;
         }
         pdpt_t pdpt;
         memset(&pdpt, 0, sizeof(pdpt_t));
-        pdpt.number = get_free_frame();
+        pdpt.number = get_zeroed_frame();
         if (pdpt.number == 0)
             return 0;
         pdpt.flaggable.present = 1;
         pdpt.flaggable.us = user;
         pdpt.flaggable.rw = 1;
+        table_track(pdpt.number, 0);
         pml4[va.pml] = pdpt.number;
-        memset((void*)physical_to_virtual(ALIGN(pdpt.number)), 0, 0x1000);
+    } else if (va.pml < 256 && !RW(pml4[va.pml])) {
+        if (!unshare_table(&pml4[va.pml], false))
+            return 0;
     }
 
     puint_t* pdpt = (puint_t*)ALIGN(physical_to_virtual(pml4[va.pml]));
 
     if (!PRESENT(pdpt[va.directory_ptr])) {
-        if (!allocate_new)
+        if (!allocate_new) {
+            *next = ((vaddress >> 30) + 1) << 30;
             return 0;
+        }
         page_directory_t dir;
         memset(&dir, 0, sizeof(page_directory_t));
-        dir.number = get_free_frame();
+        dir.number = get_zeroed_frame();
         if (dir.number == 0) {
             return 0;
         }
         dir.flaggable.present = 1;
         dir.flaggable.us = user;
         dir.flaggable.rw = 1;
-        pdpt[va.directory_ptr] = dir.number;
-        memset((void*)physical_to_virtual(ALIGN(dir.number)), 0, 0x1000);
+        table_track(dir.number, 0);
+        set_entry(&pdpt[va.directory_ptr], dir.number);
+    } else if (PS(pdpt[va.directory_ptr])) {
+        // 1GB page of memory mirror, there is nothing to descend to
+        *next = ((vaddress >> 30) + 1) << 30;
+        return 0;
+    } else if (va.pml < 256 && !RW(pdpt[va.directory_ptr])) {
+        if (!unshare_table(&pdpt[va.directory_ptr], false))
+            return 0;
     }
 
-    puint_t* pdir = (puint_t*)ALIGN(physical_to_virtual(pdpt[va.directory_ptr]));
+    return (puint_t*)ALIGN(physical_to_virtual(pdpt[va.directory_ptr]));
+}
+
+/**
+ * Returns page directory entry for that virtual address, see __get_directory.
+ */
+static puint_t* get_directory_entry(uintptr_t vaddress, uintptr_t cr3, bool allocate_new, bool user, uintptr_t* next) {
+    puint_t* pdir = __get_directory(vaddress, cr3, allocate_new, user, next);
+    if (pdir == NULL)
+        return NULL;
+    return &pdir[(vaddress >> 21) & 0x1FF];
+}
+
+/**
+ * Returns page table for that virtual address.
+ *
+ * If allocate_new is specified to true, it will allocate substructures,
+ * if not present. Otherwise returns NULL if page structures are not present
+ * on the way to the virtual address, and next will contain first address
+ * after the missing structure. If allocation fails, next will be vaddress.
+ *
+ * Large page on the way is split into page table (see split_large_page).
+ * Page structures shared with other address space are made private on the way.
+ * Address space lock of vaddress must be held (see space_lock).
+ */
+static puint_t* __get_table(uintptr_t vaddress, uintptr_t cr3, bool allocate_new, bool user, uintptr_t* next) {
+    v_address_t va;
+    memcpy(&va, &vaddress, 8);
+
+    puint_t* pdir = __get_directory(vaddress, cr3, allocate_new, user, next);
+    if (pdir == NULL)
+        return 0;
 
     if (!PRESENT(pdir[va.directory])) {
-        if (!allocate_new)
+        if (!allocate_new) {
+            *next = ((vaddress >> 21) + 1) << 21;
             return 0;
+        }
         page_table_t pt;
         memset(&pt, 0, sizeof(page_table_t));
-        pt.number = get_free_frame();
+        pt.number = get_zeroed_frame();
         if (pt.number == 0) {
             return 0;
         }
         pt.flaggable.present = 1;
         pt.flaggable.us = user;
         pt.flaggable.rw = 1;
-        pdir[va.directory] = pt.number;
-        memset((void*)physical_to_virtual(ALIGN(pt.number)), 0, 0x1000);
+        table_track(pt.number, 0);
+        set_entry(&pdir[va.directory], pt.number);
+    } else if (PS(pdir[va.directory])) {
+        if (!split_large_page(&pdir[va.directory]))
+            return 0;
+    } else if (va.pml < 256 && !RW(pdir[va.directory])) {
+        if (!unshare_table(&pdir[va.directory], true))
+            return 0;
     }
 
-    puint_t* pt = (puint_t*)ALIGN(physical_to_virtual(pdir[va.directory]));
-    return &pt[va.table];
+    return (puint_t*)ALIGN(physical_to_virtual(pdir[va.directory]));
+}
+
+/**
+ * Returns page allocated for that virtual address.
+ *
+ * If allocate_new is specified to true, it will allocate substructures,
+ * if not present.Otherwise returns NULL if page structures are not present
+ * on the way to the virtual address. Returned pointer points to page in page
+ * table.
+ */
+static puint_t* __get_page(uintptr_t vaddress, uintptr_t cr3, bool allocate_new, bool user) {
+    uintptr_t next;
+    puint_t* pt = __get_table(vaddress, cr3, allocate_new, user, &next);
+    if (pt == NULL)
+        return NULL;
+    return &pt[(vaddress >> 12) & 0x1FF];
+}
+
+/**
+ * Range page walker.
+ *
+ * Descends page structures once and returns pointer to page of vaddress, count
+ * will contain number of consecutive pages in the same page table, up to end.
+ * Thus caller can process up to 512 pages per single walk.
+ *
+ * If page table is not present (and allocate_new is false), returns NULL and
+ * count will contain number of pages that can be skipped, because they have no
+ * page structures at all. If allocation of page structures fails, returns NULL
+ * and count is 0.
+ */
+static puint_t* walk_page_range(uintptr_t vaddress, uintptr_t end, uintptr_t cr3,
+        bool allocate_new, bool user, size_t* count) {
+    uintptr_t next;
+    puint_t* pt = __get_table(vaddress, cr3, allocate_new, user, &next);
+    if (pt == NULL) {
+        if (next == vaddress)
+            *count = 0;
+        else
+            *count = ((next == 0 || next > end ? end : next) - vaddress) / 0x1000;
+        return NULL;
+    }
+
+    uintptr_t table_end = ((vaddress >> 21) + 1) << 21;
+    if (table_end == 0 || table_end > end)
+        table_end = end;
+    *count = (table_end - vaddress) / 0x1000;
+    return &pt[(vaddress >> 12) & 0x1FF];
 }
 
 static puint_t* get_page(uintptr_t vaddress, uintptr_t cr3, bool allocate_new) {
     return __get_page(vaddress, cr3, allocate_new, false);
 }
 
-static puint_t* get_page_user(uintptr_t vaddress, uintptr_t cr3, bool allocate_new) {
-    return __get_page(vaddress, cr3, allocate_new, true);
-}
+/**
+ * Number of frames free_page_structure can release at most.
+ */
+#define PAGE_STRUCTURE_LEVELS (3)
 
-void free_page_structure(uintptr_t vaddress, uintptr_t cr3) {
+static void tlb_batch_free_frame(tlb_batch_t* batch, puint_t frame);
+
+/**
+ * Releases page structures of vaddress that have no entries left. Structure
+ * frames are released via batch, since other cpus might still walk them.
+ * Large page of vaddress is unmapped, its frames must be released by caller.
+ *
+ * Emptiness is decided by live entry counts, so no structure is scanned.
+ */
+static void free_page_structure(uintptr_t vaddress, tlb_batch_t* batch) {
+    uintptr_t cr3 = batch->cr3;
     v_address_t va;
     memcpy(&va, &vaddress, 8);
 
@@ -320,37 +1058,32 @@ void free_page_structure(uintptr_t vaddress, uintptr_t cr3) {
 
     puint_t* pdir = (puint_t*)ALIGN(physical_to_virtual(pdpt[va.directory_ptr]));
 
-    if (!PRESENT(pdir[va.directory])) {
-        return;
-    }
+    // directory entry might already be cleared by caller (whole page table released)
+    if (PRESENT(pdir[va.directory])) {
+        if (PS(pdir[va.directory])) {
+            set_entry(&pdir[va.directory], 0); // free large page
+        } else {
+            puint_t* pt = (puint_t*)ALIGN(physical_to_virtual(pdir[va.directory]));
+            set_entry(&pt[va.table], 0); // free table entry
 
-    puint_t* pt = (puint_t*)ALIGN(physical_to_virtual(pdir[va.directory]));
-    pt[va.table] = 0; // free table entry
+            if (!table_empty(pt))
+                return;
 
-    // check for other table entries
-    for (size_t i=0; i<512; i++) {
-        if (pt[i] != 0)
-            return;
+            tlb_batch_free_frame(batch, PAGE_FRAME(pdir[va.directory]));
+            set_entry(&pdir[va.directory], 0); // free pt address
+        }
     }
 
-    free_frame(ALIGN(pdir[va.directory]));
-    pdir[va.directory] = 0; // free pt address
-
-    // check for other pdir adresses
-    for (size_t i=0; i<512; i++) {
-        if (pdir[i] != 0)
-            return;
-    }
+    if (!table_empty(pdir))
+        return;
 
-    free_frame(ALIGN(pdpt[va.directory_ptr]));
-    pdpt[va.directory_ptr] = 0; // free pdir address
+    tlb_batch_free_frame(batch, PAGE_FRAME(pdpt[va.directory_ptr]));
+    set_entry(&pdpt[va.directory_ptr], 0); // free pdir address
 
-    for (size_t i=0; i<512; i++) {
-        if (pdpt[i] != 0)
-            return;
-    }
+    if (!table_empty(pdpt))
+        return;
 
-    free_frame(ALIGN(pml4[va.pml]));
+    tlb_batch_free_frame(batch, PAGE_FRAME(pml4[va.pml]));
     pml4[va.pml] = 0; // free pdpt address
 }
 
@@ -421,7 +1154,7 @@ static void* remap(puint_t phys_address) {
     page.flaggable.present = 1;
     page.flaggable.rw = 1;
     page.flaggable.us = 0;
-    *paddress = page.address;
+    set_entry(paddress, page.address);
 
     paddress = get_page(map_address+0x1000, get_active_page(), false);
     memset(&page, 0, sizeof(page_t));
@@ -429,7 +1162,7 @@ static void* remap(puint_t phys_address) {
     page.flaggable.present = 1;
     page.flaggable.rw = 1;
     page.flaggable.us = 0;
-    *paddress = page.address;
+    set_entry(paddress, page.address);
 
     invalidate_address((void*)map_address);
     invalidate_address((void*)(map_address+0x1000));
@@ -451,88 +1184,226 @@ size_t __strlen(char* c) {
     return len;
 }
 
-bool check_used_range(puint_t test, puint_t fa, size_t sa) {
-    ruint_t from = ALIGN(fa);
-    sa += fa - from;
-    ruint_t size = _ALIGN_UP(sa);
-    if (from <= test && test < from + size) {
-        return true;
+/**
+ * Reserves physical range used by boot structures.
+ *
+ * Range is extended to whole frames and inserted into sorted reserved list.
+ */
+static void reserve_range(puint_t address, size_t size) {
+    if (size == 0)
+        return;
+    if (reserved_range_count == MAX_RESERVED_RANGES)
+        kp_halt(); // can't tell which memory is free
+
+    puint_t start = ALIGN(address);
+    puint_t end = _ALIGN_UP(address + size);
+    size_t i = reserved_range_count++;
+    while (i > 0 && reserved_ranges[i-1].start > start) {
+        reserved_ranges[i] = reserved_ranges[i-1];
+        --i;
     }
-    return false;
+    reserved_ranges[i].start = start;
+    reserved_ranges[i].end = end;
+}
+
+/**
+ * Merges overlapping and adjacent reserved ranges, so both starts and ends
+ * of reserved list are sorted.
+ */
+static void merge_reserved_ranges() {
+    if (reserved_range_count == 0)
+        return;
+    size_t last = 0;
+    for (size_t i=1; i<reserved_range_count; i++) {
+        if (reserved_ranges[i].start <= reserved_ranges[last].end) {
+            reserved_ranges[last].end = _MAX(reserved_ranges[last].end, reserved_ranges[i].end);
+        } else {
+            reserved_ranges[++last] = reserved_ranges[i];
+        }
+    }
+    reserved_range_count = last + 1;
 }
 
-bool check_if_used_string(puint_t test, char* string) {
-    return check_used_range(test, (puint_t)string, __strlen(string)+1);
+/**
+ * Returns index of first reserved range ending above address, or
+ * reserved_range_count if there is none.
+ */
+static size_t first_reserved_after(puint_t address) {
+    size_t lo = 0, hi = reserved_range_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (reserved_ranges[mid].end <= address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
-bool check_if_used(struct multiboot_info* mbheader, puint_t test) {
+/**
+ * Collects physical memory used by kernel and multiboot structures into
+ * reserved list.
+ */
+static void collect_reserved_ranges(struct multiboot_info* mbheader) {
+    reserved_range_count = 0;
+
     puint_t kend = kernel_tmp_heap_start - 0xFFFFFFFF80000000 + 0x40000;
-    if (check_used_range(test, 0, kend))
-        return true;
+    reserve_range(0, kend);
 
-    if (check_used_range(test, (puint_t)mbheader, sizeof(struct multiboot_info)))
-        return true;
+    reserve_range((puint_t)mbheader, sizeof(struct multiboot_info));
 
     char* cmdline = (char*)(puint_t)mbheader->cmdline;
-    if (check_if_used_string(test, cmdline))
-        return true;
+    reserve_range((puint_t)cmdline, __strlen(cmdline)+1);
 
-    size_t mods_size = mbheader->mods_count * sizeof(struct multiboot_mod_list);
-    if (check_used_range(test, mbheader->mods_addr, mods_size))
-        return true;
+    reserve_range(mbheader->mods_addr, mbheader->mods_count * sizeof(struct multiboot_mod_list));
 
     struct multiboot_mod_list* modules = (struct multiboot_mod_list*) (puint_t) mbheader->mods_addr;
     for (uint32_t i=0; i<mbheader->mods_count; i++) {
         struct multiboot_mod_list* module = (struct multiboot_mod_list*)remap((puint_t)&modules[i]);
+        puint_t mod_start = module->mod_start;
         size_t mod_size = module->mod_end-module->mod_start;
-        if (check_used_range(test, (puint_t)module->mod_start, mod_size))
-            return true;
         char* mod_name = (char*)(puint_t)module->cmdline;
-        if (check_if_used_string(test, mod_name))
-            return true;
+        reserve_range(mod_start, mod_size);
+        reserve_range((puint_t)mod_name, __strlen(mod_name)+1);
     }
 
-    if ((mbheader->flags & (1<<11)) != 0 && (mbheader->flags & (1<12)) != 0) {
-        if (check_used_range(test, mbheader->framebuffer_addr,
-                mbheader->framebuffer_bpp * mbheader->framebuffer_width * mbheader->framebuffer_height))
-            return true;
+    if ((mbheader->flags & (1<<11)) != 0 && (mbheader->flags & (1<<12)) != 0) {
+        reserve_range(mbheader->framebuffer_addr,
+                mbheader->framebuffer_bpp * mbheader->framebuffer_width * mbheader->framebuffer_height);
         if (mbheader->framebuffer_type == 0)
-            if (check_used_range(test, mbheader->framebuffer_palette_addr,
-                    mbheader->framebuffer_palette_num_colors * 3))
-                return true;
+            reserve_range(mbheader->framebuffer_palette_addr,
+                    mbheader->framebuffer_palette_num_colors * 3);
     }
 
-    if (check_used_range(test, mbheader->mmap_addr, mbheader->mmap_length))
-        return true;
+    reserve_range(mbheader->mmap_addr, mbheader->mmap_length);
 
-    return false;
+    merge_reserved_ranges();
 }
 
 /**
- * Creates pool from bound adresses
+ * Finds place for frame map in ram and maps it.
+ *
+ * Frame map holds frame_info_t for every frame up to highest ram address. It is
+ * placed into first ram block (above 2MB) which has enough unused space.
  */
-section_info_t* make_pool(size_t length, puint_t base_addr, section_info_t* lastfp, section_info_t** firstfp) {
-    // total amount of frames available if we count in metadata
-    size_t uframes = (length-sizeof(section_info_t))/(0x1000+(sizeof(stack_element_t)+sizeof(frame_info_t)))-1;
-    // total size of metadata header
-    size_t total_size = sizeof(section_info_t) + (uframes * sizeof(stack_element_t)) + (uframes * sizeof(frame_info_t));
-    // address of first effective frame
-    puint_t after_address = (base_addr + total_size + 0x1000) & ~0xFFF;
+static void create_frame_map(struct multiboot_info* mboot_addr) {
+    if ((mboot_addr->flags & 0b100000) != 0b100000)
+        return;
+
+    puint_t highest = 0;
+    uint32_t mem = mboot_addr->mmap_addr + 4;
+    while (mem < (mboot_addr->mmap_addr + mboot_addr->mmap_length)) {
+        mboot_mem_t data = *((mboot_mem_t*) (uint64_t) mem);
+        uint32_t size = *((uint32_t*) (uint64_t) (mem - 4));
+        mem += size + 4;
+
+        if (data.type == 1 && data.address + data.size > highest)
+            highest = data.address + data.size;
+    }
+
+    size_t frames = highest / 0x1000;
+    size_t map_size = _ALIGN_UP(frames * sizeof(frame_info_t));
+
+    puint_t map_address = 0;
+    mem = mboot_addr->mmap_addr + 4;
+    while (mem < (mboot_addr->mmap_addr + mboot_addr->mmap_length) && map_address == 0) {
+        mboot_mem_t data = *((mboot_mem_t*) (uint64_t) mem);
+        uint32_t size = *((uint32_t*) (uint64_t) (mem - 4));
+        mem += size + 4;
+
+        if (data.type != 1) // not a ram
+            continue;
+
+        // reserved ranges are frame aligned, so candidate stays aligned
+        puint_t candidate = _ALIGN_UP(_MAX(data.address, 0x200000));
+        size_t r = first_reserved_after(candidate);
+        while (candidate + map_size <= data.address + data.size) {
+            if (r == reserved_range_count || reserved_ranges[r].start >= candidate + map_size) {
+                map_address = candidate;
+                break;
+            }
+            candidate = _MAX(candidate, reserved_ranges[r++].end);
+        }
+    }
+
+    if (map_address == 0)
+        kp_halt();
 
-    // allocate base_addr and size of metadata header in virt. memory
-    for (puint_t addr = base_addr; addr < base_addr + total_size; addr += 0x1000) {
+    for (puint_t addr = map_address; addr < map_address + map_size; addr += 0x1000) {
         puint_t* paddress = get_page(addr, get_active_page(), true);
         page_t page;
         memset(&page, 0, sizeof(page_t));
         page.address = addr;
         page.flaggable.present = 1;
         page.flaggable.rw = 1;
-        page.flaggable.us = 1;
-        *paddress = page.address;
+        set_entry(paddress, page.address);
     }
+    // map is written once here and then by make_pool, keep it out of cache
+    for (puint_t addr = map_address; addr < map_address + map_size; addr += 0x1000)
+        zero_frame_nt((void*)addr);
+
+    frame_map_frames = frames;
+    frame_map = (frame_info_t*)map_address;
+    reserve_range(map_address, map_size);
+    merge_reserved_ranges();
+}
+
+/**
+ * Returns number of frames section at base_addr of length would hold, after
+ * its header, and stores address of first of them to after_address.
+ */
+static size_t section_frames(size_t length, puint_t base_addr, puint_t* after_address) {
+    // address of first effective frame
+    *after_address = (base_addr + sizeof(section_info_t) + 0x1000) & ~0xFFF;
+    // total amount of frames available, limited by frame map
+    puint_t end_address = _MIN(base_addr + length, frame_map_frames * 0x1000);
+    if (end_address <= *after_address)
+        return 0;
+    return (end_address - *after_address) / 0x1000;
+}
+
+/**
+ * Maps header of section at base_addr, returns NULL if section would hold
+ * no frames.
+ *
+ * Mapping might need new page structures, which come from frame pool, so
+ * __pool_lock must not be held.
+ */
+static section_info_t* map_section_header(size_t length, puint_t base_addr) {
+    puint_t after_address;
+    if (section_frames(length, base_addr, &after_address) == 0)
+        return NULL;
+
+    // allocate section header in virt. memory
+    puint_t* paddress = get_page(base_addr, get_active_page(), true);
+    page_t page;
+    memset(&page, 0, sizeof(page_t));
+    page.address = ALIGN(base_addr);
+    page.flaggable.present = 1;
+    page.flaggable.rw = 1;
+    page.flaggable.us = 1;
+    set_entry(paddress, page.address);
+
+    return (section_info_t*)base_addr;
+}
+
+/**
+ * Fills header of mapped section of length, links it after lastfp and puts
+ * its frames into buddy free lists.
+ *
+ * Section header is followed by frames themselves, which are put into buddy
+ * free lists as biggest aligned blocks possible. Frame info of those frames
+ * lives in frame_map. __pool_lock must be held once frame pool is in use.
+ */
+static section_info_t* link_section(section_info_t* section, size_t length,
+        section_info_t* lastfp, section_info_t** firstfp) {
+    if (pool_section_count == MAX_POOL_SECTIONS)
+        return NULL; // no more sections can be described, leave memory as dead memory
+
+    puint_t after_address;
+    size_t uframes = section_frames(length, (puint_t)section, &after_address);
 
     // section starts at base address
-    section_info_t* section = (section_info_t*)base_addr;
     if (lastfp != NULL) { // link previous section and this one
         lastfp->next_section = section;
     } else if (*firstfp == NULL) { // first section will be this one
@@ -541,58 +1412,78 @@ section_info_t* make_pool(size_t length, puint_t base_addr, section_info_t* last
 
     // fill up section with information
     section->start_word = after_address;
-    section->end_word = base_addr + length;
+    section->end_word = after_address + (uframes*0x1000);
     section->total_frames = uframes;
+    section->free_frames = 0;
     section->next_section = NULL;
-    section->frame_array = (frame_info_t*) (base_addr + sizeof(section_info_t)); // starts at end of this structure
-    puint_t stack_el_addr = (base_addr + sizeof(section_info_t) +
-            (sizeof(frame_info_t) * uframes)); // first stack element describing the memory
-    section->head = NULL;
-
-    stack_element_t* prev_se = NULL;
-    for (size_t i=0; i<uframes; i++) {
-        // Fill up information for stack element.
-        // Stack element contains frame address of free frame in this memory section
-        stack_element_t* se = (stack_element_t*)stack_el_addr;
-        stack_el_addr += sizeof(stack_element_t);
-        se->frame_address = after_address + (i*0x1000);
-        frame_info_t* fi = &section->frame_array[i];
-
-        if (se->frame_address < 0x200000) {
-            // "already used" stack element
-            // so do not link this stack element at all
-            // link stack elements together
-            // fill up frame info with this stack element and number of times it has been used (0)
-
-            fi->usage_count = 1;
-        } else {
-            // normal stack element
-            // link stack elements together
-            if (prev_se != NULL)
-                prev_se->next = se;
-            else
-                section->head = se;
-            se->next = NULL;
-            se->array_ord = i;
-            prev_se = se;
-
-            // fill up frame info with this stack element and number of times it has been used (0)
-            fi->usage_count = 0;
-            fi->cow_count = 0;
+    section->section_id = (uint16_t)pool_section_count;
+    section->frame_array = &frame_map[after_address >> 12];
+    for (uint8_t order=0; order<=BUDDY_MAX_ORDER; order++)
+        section->free_list[order] = FRAME_NONE;
+    pool_sections[pool_section_count++] = section;
+
+    // frame infos are only read back for buddy block heads, stream them
+    // past the cache instead of pulling whole frame map through it
+    frame_info_t* frames = SECTION_FRAMES(section);
+    STATIC_ASSERT(sizeof(frame_info_t) == 20); // layout of fill_frame_info_nt
+    frame_info_t pattern;
+    memset(&pattern, 0, sizeof(frame_info_t));
+    pattern.next_free = FRAME_NONE;
+    pattern.prev_free = FRAME_NONE;
+    pattern.flags = FRAME_FLAG_POOL;
+    pattern.section_id = section->section_id;
+    fill_frame_info_nt(frames, &pattern, uframes);
+    for (size_t i=0; i<uframes && SECTION_FRAME_ADDRESS(section, i) < 0x200000; i++) {
+        // "already used" frame, never put into free lists
+        frames[i].usage_count = 1;
+    }
+
+    for (size_t i=0; i<uframes; ) {
+        puint_t fa = SECTION_FRAME_ADDRESS(section, i);
+        if (fa < 0x200000) {
+            ++i;
+            continue;
         }
-        fi->bound_stack_element = se;
+
+        // biggest block aligned to its size that still fits the section
+        uint8_t order = BUDDY_MAX_ORDER;
+        while (order > 0 && ((((fa >> 12) & ((1UL << order)-1)) != 0) || (i + (1UL << order) > uframes)))
+            --order;
+        buddy_list_add(section, (uint32_t)i, order);
+        i += 1UL << order;
     }
 
     return section;
 }
 
+/**
+ * Creates pool from bound adresses, used while frame pool is being built.
+ */
+section_info_t* make_pool(size_t length, puint_t base_addr, section_info_t* lastfp, section_info_t** firstfp) {
+    if (pool_section_count == MAX_POOL_SECTIONS)
+        return NULL; // no more sections can be described, leave memory as dead memory
+
+    section_info_t* section = map_section_header(length, base_addr);
+    if (section == NULL)
+        return NULL;
+    return link_section(section, length, lastfp, firstfp);
+}
+
 void deallocate_starting_address(puint_t address, size_t size) {
     if (size < 0x10000)
         return; // ignore section and just leave it as dead memory
-    section_info_t* se = frame_pool;
+
+    // page structures for header are allocated before pool is locked
+    section_info_t* section = map_section_header(size, address);
+    if (section == NULL)
+        return;
+
+    proc_spinlock_lock(&__pool_lock);
+    section_info_t* se = (section_info_t*)physical_to_virtual((puint_t)frame_pool);
     while (se->next_section != NULL)
-        se = se->next_section;
-    make_pool(size, address, se, NULL);
+        se = (section_info_t*)physical_to_virtual((puint_t)se->next_section);
+    link_section(section, size, se, NULL);
+    proc_spinlock_unlock(&__pool_lock);
 }
 
 /**
@@ -612,68 +1503,30 @@ static void create_frame_pool(struct multiboot_info* mboot_addr) {
             uint32_t size = *((uint32_t*) (uint64_t) (mem - 4));
             mem += size + 4;
 
-            puint_t ba = data.address;
-            size_t len = data.size;
-
             if (data.type != 1) // not a ram
                 continue;
-            if (len < 0x10000)
+            if (data.size < 0x10000)
                 continue; // waste of a section
 
-            puint_t base_addr = ba;
-            size_t length = len;
-
-            while (true) {
-                // if we fail to find any useful starting address but there is more to search
-                // restart the search here
-start_search_again:;
-
-                // search from current base_addr up to maximum in the block
-                if (base_addr >= len+ba)
-                    break; // end of search
-                for (puint_t test = base_addr; test<len; test+=0x1000) {
-                    if (check_if_used(mboot_addr, test)) {
-                        // memory address is used by some internal structure
-                        // write up how much size we have for this pool and then
-                        // decide upon it
-                        length = test - base_addr;
-                        if (length == 0) {
-                            // first 0x1000 already used
-                            // check if there is more, if so, continue from 0x1000 onwards
-                            // if not, this section is garbage
-                            if (base_addr+0x1000<ba+len) {
-                                base_addr += 0x1000;
-                                goto start_search_again;
-                            } else {
-                                goto finish_this_section;
-                            }
-                        } else if (length < 0x10000) {
-                            // pool with size <0x10000, same as above
-                            // but add length, skipping good but too small pool
-                            if (base_addr+length<ba+len) {
-                                base_addr += length;
-                                goto start_search_again;
-                            } else {
-                                goto finish_this_section;
-                            }
-                        }
-                        // found a barrier, can only use this much in a block
-                        goto use_length_found;
-                    }
+            // carve ram block into pools between reserved ranges
+            puint_t base_addr = data.address;
+            puint_t end_addr = data.address + data.size;
+            for (size_t r = first_reserved_after(base_addr); base_addr < end_addr; r++) {
+                puint_t limit = end_addr;
+                if (r < reserved_range_count)
+                    limit = _MIN(reserved_ranges[r].start, end_addr);
+
+                // pool with size <0x10000 is skipped as dead memory
+                if (limit > base_addr && limit - base_addr >= 0x10000) {
+                    section_info_t* section = make_pool(limit - base_addr, base_addr, lastfp, &firstfp);
+                    if (section != NULL)
+                        lastfp = section;
                 }
-                // no used address up to len, awesome, use this as a pool
-                length = len;
-
-use_length_found:;
-                section_info_t* section = make_pool(length, base_addr, lastfp, &firstfp);
-
-                lastfp = section;
 
-                // increment base address by length
-                base_addr += length;
+                if (r >= reserved_range_count)
+                    break;
+                base_addr = _MAX(base_addr, reserved_ranges[r].end);
             }
-finish_this_section:;
-
         }
 
     }
@@ -686,8 +1539,8 @@ finish_this_section:;
  * Initializes memory mirror.
  *
  * Memory mirror allocates all available ram to specific range address.
- * If 1GB paging is supported, 1GB paging is used, otherwise only 4KB
- * paging is used, which means much more physical ram is used.
+ * If 1GB paging is supported, 1GB paging is used, otherwise 2MB pages
+ * are used, which costs one page directory per 1GB of ram.
  */
 void initialize_memory_mirror() {
     section_info_t* head = frame_pool;
@@ -719,7 +1572,7 @@ void initialize_memory_mirror() {
             dir.flaggable.present = 1;
             dir.flaggable.ps = 1;
             dir.flaggable.rw = 1;
-            pdpt[va.directory_ptr] = dir.number;
+            set_entry(&pdpt[va.directory_ptr], dir.number);
 
             if (!first_set) {
                 first_set = true;
@@ -727,7 +1580,7 @@ void initialize_memory_mirror() {
             }
         }
     } else {
-        for (puint_t start=0; start < maxram; start+=0x1000) {
+        for (puint_t start=0; start < maxram; start+=LARGE_PAGE_SIZE) {
             puint_t kend = kernel_tmp_heap_start - 0xFFFFFFFF80000000 + 0x40000;
             if (kend+0x4000 >= tmp_heap && !first_set) {
                 first_set = true;
@@ -735,14 +1588,15 @@ void initialize_memory_mirror() {
             }
 
             puint_t vaddress = start + ADDRESS_OFFSET(RESERVED_KBLOCK_RAM_MAPPINGS);
-            puint_t* paddress = get_page(vaddress, get_active_page(), true);
+            uintptr_t next;
+            puint_t* paddress = get_directory_entry(vaddress, get_active_page(), true, false, &next);
             page_t page;
             memset(&page, 0, sizeof(page_t));
-            page.address = start;
+            page.address = start | PAGE_PS;
             page.flaggable.present = 1;
             page.flaggable.rw = 1;
             page.flaggable.us = 0;
-            *paddress = page.address;
+            set_entry(paddress, page.address);
         }
 
     }
@@ -754,26 +1608,63 @@ void initialize_memory_mirror() {
  * Performs it by these steps:
  *
  *  1. detects max ram via detect_maxram
- *  2. creates frame pool stack and array structure for all available ram
+ *  2. creates frame map for all ram and frame pool buddy sections for all available ram
  *  3. detects maxphyaddr
  *  4. initializes memory mirror
  *  5- deallocates old memory (frames are not returned).
  */
 void initialize_physical_memory_allocation(struct multiboot_info* mboot_addr) {
-    __frame_lock = 0;
+    memset(&__frame_lock, 0, sizeof(paging_lock_t));
+    memset(&__kernel_space_lock, 0, sizeof(paging_lock_t));
+    memset(__space_locks, 0, sizeof(__space_locks));
+    __pool_lock = 0;
+    __zero_lock = 0;
+    zero_pool_count = 0;
+    memset(&large_page_stats, 0, sizeof(large_page_stats_t));
+    zero_pool_hits = 0;
+    zero_pool_misses = 0;
+    zero_frame = 0;
 
     struct multiboot_info* msource = (struct multiboot_info*)remap((uint64_t)mboot_addr);
     memcpy(&multiboot_info, msource, sizeof(struct multiboot_info));
 
     __mem_mirror_present = false;
     frame_pool = NULL;
+    frame_map = NULL;
+    frame_map_frames = 0;
+    pool_section_count = 0;
     maxram = detect_maxram(&multiboot_info);
 
+    uint64_t pool_start = read_tsc();
+    collect_reserved_ranges(&multiboot_info);
+    create_frame_map(&multiboot_info);
     create_frame_pool(&multiboot_info);
+    frame_pool_build_time = read_tsc() - pool_start;
     maxphyaddr = detect_maxphyaddr();
 
     initialize_memory_mirror();
     __mem_mirror_present = true;
+
+    // zero frame is always copy on write, cow_count is never decremented
+    zero_frame = get_zeroed_frame();
+    frame_info_t* zfi = get_frame_info(zero_frame);
+    if (zfi != NULL)
+        zfi->cow_count = 1;
+}
+
+/**
+ * Returns whether present page entry is copy on write.
+ */
+static bool is_cow_page(puint_t entry) {
+    if (RW(entry))
+        return false;
+    frame_info_t* fi = get_frame_info(PAGE_FRAME(entry));
+    if (fi == NULL)
+        return false;
+    paging_lock(&__frame_lock);
+    bool cow = fi->cow_count > 0;
+    paging_unlock(&__frame_lock);
+    return cow;
 }
 
 /**
@@ -797,9 +1688,22 @@ static puint_t allocate_frame(puint_t* paddress, bool kernel, bool readonly, boo
             }
         }
         new = true;
-        page.address = get_free_frame();
+#ifdef KERNEL_DEBUG_MODE
+        page.address = get_free_frame(); // filled with 0xCC below
+#else
+        page.address = get_zeroed_frame();
+#endif
         if (page.address == 0)
             return 0;
+    } else if (PAGE_FRAME(*paddress) == zero_frame) {
+        // shared zero frame must never become writable, replace it
+        new = true;
+        page.address = get_zeroed_frame();
+        if (page.address == 0)
+            return 0;
+    } else if (is_cow_page(*paddress)) {
+        // copy on write page stays read only until written to
+        return ALIGN(*paddress);
     } else {
         new = false;
         page.address = ALIGN(*paddress);
@@ -808,8 +1712,9 @@ static puint_t allocate_frame(puint_t* paddress, bool kernel, bool readonly, boo
     page.flaggable.rw = readonly ? 0 : 1;
     page.flaggable.us = kernel ? 0 : 1;
     page.flaggable.xd = exec ? 1 : 0;
-    *paddress = page.address;
+    set_entry(paddress, page.address);
 
+#ifdef KERNEL_DEBUG_MODE
     if (new) {
         if (__mem_mirror_present) {
             if (page.flaggable.xd) {
@@ -819,327 +1724,952 @@ static puint_t allocate_frame(puint_t* paddress, bool kernel, bool readonly, boo
                 memset((void*)physical_to_virtual(ALIGN(page.address)), 0xCC, 0x1000);
             }
         }
-
     }
+#else
+    (void)new;
+#endif
 
     return ALIGN(*paddress);
 }
 
 /**
- * Deallocates frame from page, clearing the page.
- *
- * If paddress is NULL or is already free, does nothing.
+ * Returns large page directory entry for frames, attributes are derived
+ * same as in allocate_frame.
  */
-static void deallocate_frame(puint_t* paddress, uintptr_t va, uintptr_t cr3) {
-    if (paddress == 0)
-        return; // no upper memory structures, we are done
-    if (!PRESENT(*paddress))
-        return; // already cleared
+static puint_t large_page_entry(puint_t frames, bool kernel, bool readonly, bool exec) {
     page_t page;
-    page.address = *paddress;
-    puint_t address = ALIGN(page.address);
-    free_frame(address);
-    *paddress = 0;
-    free_page_structure(va, cr3);
+    memset(&page, 0, sizeof(page_t));
+    page.address = frames | PAGE_PS;
+    page.flaggable.present = 1;
+    page.flaggable.rw = readonly ? 0 : 1;
+    page.flaggable.us = kernel ? 0 : 1;
+    page.flaggable.xd = exec ? 1 : 0;
+    return page.address;
+}
+
+/**
+ * Maps zeroed large page at vaddress, if whole large page fits below end and
+ * there are no page structures for it yet.
+ *
+ * Frames are allocated and zeroed without address space lock held, so slot is
+ * checked again before it is used. Returns false if 4KB pages must be used.
+ */
+static bool allocate_large_page(uintptr_t vaddress, uintptr_t end, bool kernel,
+        bool readonly, bool exec, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, vaddress);
+    if ((vaddress % LARGE_PAGE_SIZE) != 0 || end - vaddress < LARGE_PAGE_SIZE || frame_pool == NULL)
+        return false;
+
+    uintptr_t next;
+    paging_lock(lock);
+    puint_t* pde = get_directory_entry(vaddress, cr3, false, !kernel, &next);
+    bool empty = pde == NULL ? next != vaddress : !PRESENT(*pde);
+    paging_unlock(lock);
+    if (!empty)
+        return false;
+
+    puint_t frames = alloc_frames(LARGE_PAGE_ORDER);
+    if (frames == 0)
+        return false;
+
+    paging_lock(lock);
+    pde = get_directory_entry(vaddress, cr3, true, !kernel, &next);
+    if (pde == NULL || PRESENT(*pde)) {
+        paging_unlock(lock);
+        free_frames(frames, LARGE_PAGE_ORDER);
+        return false;
+    }
+    set_entry(pde, large_page_entry(frames, kernel, readonly, exec));
+    paging_unlock(lock);
+    return true;
 }
 
 /**
  * Allocates memory from address from, with amount amount and with
  * provided flags.
  *
- * Repeatedly calls allocate_frame for every frame.
+ * Aligned 2MB chunks are mapped with large pages where possible, rest
+ * walks page structures once per page table and calls allocate_frame
+ * for every frame in it.
  */
 bool allocate(uintptr_t from, size_t amount, bool kernel, bool readonly, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, from);
     size_t dif = from-ALIGN(from);
     amount = _ALIGN_UP(amount+dif);
     from = ALIGN(from);
-    uintptr_t addr;
-    for (addr = from; addr < from + amount; addr += 0x1000) {
-        proc_spinlock_lock(&__frame_lock);
-        uint64_t* frame = kernel ? get_page(addr, cr3, true) : get_page_user(addr, cr3, true);
-        if (frame == NULL) {
-            goto dealloc;
+    uintptr_t addr = from;
+    while (addr < from + amount) {
+        if (allocate_large_page(addr, from + amount, kernel, readonly, false, cr3)) {
+            addr += LARGE_PAGE_SIZE;
+            continue;
         }
-        if (allocate_frame(frame, kernel, readonly, false) == 0) {
+
+        size_t count;
+        paging_lock(lock);
+        puint_t* pages = walk_page_range(addr, from + amount, cr3, true, !kernel, &count);
+        if (pages == NULL) {
             goto dealloc;
         }
-        proc_spinlock_unlock(&__frame_lock);
+        for (size_t i=0; i<count; i++) {
+            if (allocate_frame(&pages[i], kernel, readonly, false) == 0) {
+                goto dealloc;
+            }
+            addr += 0x1000;
+        }
+        paging_unlock(lock);
     }
     return true;
 
 dealloc:
-    proc_spinlock_unlock(&__frame_lock);
+    paging_unlock(lock);
     deallocate(from, addr-from, cr3);
     return false;
 }
 
 void allocate_mem(alloc_info_t* ainfo, bool kernel, bool readonly, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, ainfo->from);
     size_t dif = ainfo->from-ALIGN(ainfo->from);
     ainfo->amount = _ALIGN_UP(ainfo->amount+dif);
     ainfo->from = ALIGN(ainfo->from);
-    for (uintptr_t addr = ainfo->from; addr < ainfo->from + ainfo->amount; addr += 0x1000) {
-        proc_spinlock_lock(&__frame_lock);
-        uint64_t* frame = kernel ? get_page(addr, cr3, true) : get_page_user(addr, cr3, true);
-        if (frame == NULL) {
-            ainfo->finished = false;
-            proc_spinlock_unlock(&__frame_lock);
-            return;
+    while (ainfo->amount > 0) {
+        if (!ainfo->aod && allocate_large_page(ainfo->from, ainfo->from + ainfo->amount,
+                kernel, readonly, ainfo->exec, cr3)) {
+            ainfo->from += LARGE_PAGE_SIZE;
+            ainfo->amount -= LARGE_PAGE_SIZE;
+            continue;
         }
-        if (ainfo->aod) {
-            page_t page;
-            page.internal.present = 0;
-            page.internal.valid = 1;
-            page.internal.allocondem = 1;
-            page.internal.exec = ainfo->exec;
-            *frame = page.address;
-        } else if (allocate_frame(frame, kernel, readonly, ainfo->exec) == 0) {
+
+        size_t count;
+        paging_lock(lock);
+        puint_t* pages = walk_page_range(ainfo->from, ainfo->from + ainfo->amount, cr3, true, !kernel, &count);
+        if (pages == NULL) {
             ainfo->finished = false;
-            proc_spinlock_unlock(&__frame_lock);
+            paging_unlock(lock);
             return;
         }
-        ainfo->from += 0x1000;
-        ainfo->amount -= 0x1000;
-
-        proc_spinlock_unlock(&__frame_lock);
+        for (size_t i=0; i<count; i++) {
+            if (ainfo->aod) {
+                page_t page;
+                page.address = 0;
+                page.internal.present = 0;
+                page.internal.valid = 1;
+                page.internal.allocondem = 1;
+                page.internal.exec = ainfo->exec;
+                set_entry(&pages[i], page.address);
+            } else if (allocate_frame(&pages[i], kernel, readonly, ainfo->exec) == 0) {
+                ainfo->finished = false;
+                paging_unlock(lock);
+                return;
+            }
+            ainfo->from += 0x1000;
+            ainfo->amount -= 0x1000;
+        }
+        paging_unlock(lock);
     }
     ainfo->finished = true;
 }
 
+void tlb_batch_init(tlb_batch_t* batch, uintptr_t cr3) {
+    batch->cr3 = cr3;
+    batch->from = UINTPTR_MAX;
+    batch->to = 0;
+    batch->pages = 0;
+    batch->frame_count = 0;
+}
+
+/**
+ * Adds range to be invalidated on batch flush.
+ *
+ * Batch only keeps bounding range, sparse batch with range over
+ * tlb_flush_threshold pages is flushed completely.
+ */
+static void tlb_batch_add_range(tlb_batch_t* batch, uintptr_t from, size_t amount) {
+    if (amount == 0)
+        return;
+    if (from < batch->from)
+        batch->from = from;
+    if (from + amount > batch->to)
+        batch->to = from + amount;
+    batch->pages += amount / 0x1000;
+}
+
+/** Batch entry is detached page table, see __free_table */
+#define TLB_BATCH_TABLE (1UL << 11)
+/** Bits of batch entry holding order of frame block */
+#define TLB_BATCH_ORDER (0xFFUL)
+
+/**
+ * Defers release of the frame block until batch is flushed, batch must have
+ * space left.
+ */
+static void tlb_batch_free_frames(tlb_batch_t* batch, puint_t frames, uint8_t order) {
+    batch->frames[batch->frame_count++] = PAGE_FRAME(frames) | order;
+}
+
+static void tlb_batch_free_frame(tlb_batch_t* batch, puint_t frame) {
+    tlb_batch_free_frames(batch, frame, 0);
+}
+
+/**
+ * Defers release of page table that was unlinked from its directory entry
+ * together with the frames it maps, see __free_table.
+ */
+static void tlb_batch_free_table(tlb_batch_t* batch, puint_t table) {
+    batch->frames[batch->frame_count++] = PAGE_FRAME(table) | TLB_BATCH_TABLE;
+}
+
+/**
+ * Releases reference of detached page table. If it was the last reference,
+ * frames and swap slots mapped by the table are released as well, otherwise table
+ * is still used by other address space and keeps them. Requires __frame_lock.
+ */
+static void __free_table(puint_t table) {
+    frame_info_t* fi = get_frame_info(table);
+    if (fi == NULL || fi->usage_count == 1) {
+        puint_t* pt = (puint_t*)physical_to_virtual(table);
+        for (size_t i=0; i<512; i++) {
+            size_t slot;
+            if (PRESENT(pt[i]))
+                free_frame(PAGE_FRAME(pt[i]));
+            else if (swapped_entry(pt[i], &slot))
+                swap_slot_put(slot);
+        }
+    }
+    free_frame(table);
+}
+
+static size_t tlb_batch_space(tlb_batch_t* batch) {
+    return TLB_BATCH_FRAMES - batch->frame_count;
+}
+
+/**
+ * Must be called without any paging lock held, other cpus might spin on it with
+ * interrupts disabled and would never acknowledge the shootdown.
+ */
+void tlb_batch_flush(tlb_batch_t* batch) {
+    if (batch->pages == 0 && batch->frame_count == 0)
+        return;
+
+    // invlpg also drops cached page structures, so released
+    // structure frames are covered by the range
+    tlb_shootdown(batch->cr3, batch->from, batch->to - batch->from);
+    tlb_shootdown_end();
+
+    paging_lock(&__frame_lock);
+    for (size_t i=0; i<batch->frame_count; i++) {
+        puint_t entry = batch->frames[i];
+        if ((entry & TLB_BATCH_TABLE) != 0)
+            __free_table(PAGE_FRAME(entry));
+        else
+            __free_frames(PAGE_FRAME(entry), entry & TLB_BATCH_ORDER);
+    }
+    paging_unlock(&__frame_lock);
+
+    tlb_batch_init(batch, batch->cr3);
+}
+
+/**
+ * Deallocates memory from address from with amount amount.
+ *
+ * Aligns the addresses to page boundaries and then
+ * deallocates them all, page table by page table. Ranges
+ * without page structures are skipped entirely, large pages
+ * fully inside the range are released whole, partially covered
+ * ones are split first. Page tables fully inside the range are
+ * unlinked whole, without touching their entries (see __free_table).
+ * Page table entries are cleared first, frames are released once
+ * batch is flushed.
+ */
+void deallocate_batched(uintptr_t from, size_t amount, tlb_batch_t* batch) {
+    paging_lock_t* lock = space_lock(batch->cr3, from);
+    uintptr_t aligned = from;
+    if ((from % 0x1000) != 0) {
+        amount += from-ALIGN(from);
+        aligned = ALIGN(from);
+    }
+    uintptr_t end_addr = aligned + amount;
+    if ((end_addr % 0x1000) != 0) {
+        end_addr = ALIGN(end_addr) + 0x1000;
+    }
+
+    uintptr_t addr = aligned;
+    while (addr < end_addr) {
+        if (tlb_batch_space(batch) <= PAGE_STRUCTURE_LEVELS)
+            tlb_batch_flush(batch);
+
+        size_t count;
+        paging_lock(lock);
+        if ((addr % LARGE_PAGE_SIZE) == 0 && end_addr - addr >= LARGE_PAGE_SIZE) {
+            uintptr_t next;
+            puint_t* pde = get_directory_entry(addr, batch->cr3, false, false, &next);
+            if (pde != NULL && PRESENT(*pde)) {
+                if (PS(*pde)) {
+                    tlb_batch_free_frames(batch, PAGE_FRAME(*pde), LARGE_PAGE_ORDER);
+                } else {
+                    // table might be shared, so it is not made private
+                    tlb_batch_free_table(batch, PAGE_FRAME(*pde));
+                    set_entry(pde, 0);
+                }
+                tlb_batch_add_range(batch, addr, LARGE_PAGE_SIZE);
+                free_page_structure(addr, batch);
+                paging_unlock(lock);
+                addr += LARGE_PAGE_SIZE;
+                continue;
+            }
+        }
+
+        puint_t* pages = walk_page_range(addr, end_addr, batch->cr3, false, false, &count);
+        if (pages == NULL && count == 0) {
+            // page structures could not be split or made private, rest is leaked
+            paging_unlock(lock);
+            break;
+        }
+        if (pages != NULL) {
+            size_t i;
+            for (i=0; i<count && tlb_batch_space(batch) > PAGE_STRUCTURE_LEVELS; i++) {
+                size_t slot;
+                if (PRESENT(pages[i]))
+                    tlb_batch_free_frame(batch, PAGE_FRAME(pages[i]));
+                else if (swapped_entry(pages[i], &slot))
+                    swap_slot_put(slot); // swap copy is never read again
+                set_entry(&pages[i], 0);
+            }
+            count = i;
+            tlb_batch_add_range(batch, addr, count * 0x1000);
+            free_page_structure(addr, batch);
+        }
+        paging_unlock(lock);
+        addr += count * 0x1000;
+    }
+}
+
+void deallocate(uintptr_t from, size_t amount, uintptr_t cr3) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, cr3);
+    deallocate_batched(from, amount, &batch);
+    tlb_batch_flush(&batch);
+}
+
+/**
+ * Checks whether virtual address is allocated or not
+ *
+ * Uses get_page to determine the address status.
+ */
+bool allocated(uintptr_t addr, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, addr);
+    paging_lock(lock);
+    puint_t* page = get_page(addr, cr3, false);
+    if (page == NULL) {
+        paging_unlock(lock);
+        return false;
+    }
+    if (!PRESENT(*page)) {
+        paging_unlock(lock);
+        return false;
+    }
+    paging_unlock(lock);
+    return true;
+}
+
+/**
+ * Clones user part of address space cr3 as copy on write.
+ *
+ * Only top level is copied, page structures are shared read only and are
+ * made private lazily, level by level, when they are walked (see unshare_table).
+ * Returns new cr3 or 0 if there is no memory.
+ */
+puint_t clone_paging_structures(uintptr_t cr3) {
+    puint_t target_page = get_zeroed_frame();
+    if (target_page == 0)
+        return 0;
+
+    cr3_page_entry_t apentry;
+    cr3_page_entry_t tentry;
+
+    apentry.number = cr3;
+    tentry.pml = target_page;
+    tentry.copyinfo.copy = apentry.copyinfo.copy;
+
+    uint64_t* sent = (uint64_t*) physical_to_virtual(ALIGN(cr3));
+    uint64_t* tent = (uint64_t*) physical_to_virtual(target_page);
+
+    paging_lock_t* lock = space_lock(cr3, 0);
+    paging_lock(lock);
+    paging_lock(&__frame_lock);
+    for (uint16_t i=0; i<256; i++) {
+        // user pages
+        sent[i] = share_entry(sent[i], false);
+        tent[i] = sent[i];
+    }
+    paging_unlock(&__frame_lock);
+    paging_unlock(lock);
+
+    paging_lock(&__kernel_space_lock);
+    for (uint16_t i=256; i<512; i++) {
+        tent[i] = sent[i];
+    }
+    paging_unlock(&__kernel_space_lock);
+
+    tlb_forget_address_space(target_page);
+    // source lost write access to whole user space
+    tlb_shootdown(ALIGN(cr3), 0, 0x0000800000000000);
+    tlb_shootdown_end();
+    return tentry.number;
+}
+
+puint_t create_pml4() {
+    puint_t active_page = get_active_page();
+    puint_t target_page = get_zeroed_frame();
+
+    if (target_page == 0)
+        return 0;
+
+    cr3_page_entry_t apentry;
+    cr3_page_entry_t tentry;
+
+    apentry.number = active_page;
+    tentry.pml = target_page;
+    tentry.copyinfo.copy = apentry.copyinfo.copy;
+
+    uint64_t* sent = (uint64_t*) physical_to_virtual(ALIGN(active_page));
+    uint64_t* tent = (uint64_t*) physical_to_virtual(target_page);
+    // frame might have been pml4 of dead process, still tagged in some pcid
+    tlb_forget_address_space(target_page);
+
+    paging_lock(&__kernel_space_lock);
+    for (uint16_t i=0; i<512; i++) {
+        if (i >= 256) {
+            // kernel pages
+            tent[i] = sent[i];
+        }
+    }
+    paging_unlock(&__kernel_space_lock);
+    return tentry.number;
+}
+
+// TODO: add swap?
+/**
+ * Returns whether page entry is untouched allocate on demand page.
+ */
+static bool is_on_demand_page(puint_t entry) {
+    page_t page;
+    page.address = entry;
+    return !page.internal.present && page.internal.valid && !page.internal.swapped &&
+            page.internal.allocondem;
+}
+
 /**
- * Deallocates memory from address from with amount amount.
+ * Maps shared zero frame read only to allocate on demand page.
  *
- * Aligns the addresses to page boundaries and then
- * deallocates them all.
+ * Frame is replaced by private one on first write, see copy_on_write.
  */
-void deallocate(uintptr_t from, size_t amount, uintptr_t cr3) {
-    uintptr_t aligned = from;
-    if ((from % 0x1000) != 0) {
-        amount += from-ALIGN(from);
-        aligned = ALIGN(from);
-    }
-    uintptr_t end_addr = aligned + amount;
-    if ((end_addr % 0x1000) != 0) {
-        end_addr = ALIGN(end_addr) + 0x1000;
-    }
+static void map_zero_frame(puint_t* paddress) {
+    page_t aod;
+    aod.address = *paddress;
 
-    if (aligned < end_addr) {
-    	tlb_shootdown(cr3, aligned, end_addr-aligned);
-        for (uintptr_t addr = aligned; addr < end_addr; addr += 0x1000) {
-            proc_spinlock_lock(&__frame_lock);
-            deallocate_frame(get_page(addr, cr3, false), addr, cr3);
-            proc_spinlock_unlock(&__frame_lock);
-        }
-        tlb_shootdown_end();
+    page_t page;
+    memset(&page, 0, sizeof(page_t));
+    page.address = zero_frame;
+    page.flaggable.present = 1;
+    page.flaggable.rw = 0;
+    page.flaggable.us = 1;
+    page.flaggable.xd = aod.internal.exec ? 1 : 0;
+    set_entry(paddress, page.address);
+}
+
+/**
+ * Checks whether page table of large page at base holds only untouched allocate
+ * on demand pages. exec will contain their exec flag. Address space lock must be held.
+ */
+static bool large_on_demand(uintptr_t base, uintptr_t cr3, bool* exec) {
+    uintptr_t next;
+    puint_t* pde = get_directory_entry(base, cr3, false, true, &next);
+    if (pde == NULL || !PRESENT(*pde) || PS(*pde) || !RW(*pde))
+        return false; // page table shared with other address space
+
+    puint_t* pt = (puint_t*)ALIGN(physical_to_virtual(*pde));
+    for (size_t i=0; i<512; i++) {
+        page_t page;
+        page.address = pt[i];
+        if (page.internal.present || !page.internal.valid || page.internal.swapped ||
+                !page.internal.allocondem)
+            return false;
+        if (i == 0)
+            *exec = page.internal.exec;
+        else if (*exec != page.internal.exec)
+            return false;
     }
+    return true;
 }
 
 /**
- * Checks whether virtual address is allocated or not
- *
- * Uses get_page to determine the address status.
+ * Commits whole large page on write fault to allocate on demand memory, if
+ * none of its pages were touched yet. Returns false if 4KB page should be
+ * allocated instead.
  */
-bool allocated(uintptr_t addr, uintptr_t cr3) {
-    proc_spinlock_lock(&__frame_lock);
-    puint_t* page = get_page(addr, cr3, false);
-    if (page == NULL) {
-        proc_spinlock_unlock(&__frame_lock);
+static bool allocate_large_on_demand(uintptr_t address, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, address);
+    uintptr_t base = address & ~(LARGE_PAGE_SIZE-1);
+    bool exec;
+
+    paging_lock(lock);
+    bool whole = large_on_demand(base, cr3, &exec);
+    paging_unlock(lock);
+    if (!whole)
         return false;
-    }
-    if (!PRESENT(*page)) {
-        proc_spinlock_unlock(&__frame_lock);
+
+    puint_t frames = alloc_frames(LARGE_PAGE_ORDER);
+    if (frames == 0)
+        return false;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, cr3);
+    paging_lock(lock);
+    if (!large_on_demand(base, cr3, &exec)) {
+        paging_unlock(lock);
+        free_frames(frames, LARGE_PAGE_ORDER);
         return false;
     }
-    proc_spinlock_unlock(&__frame_lock);
+    uintptr_t next;
+    puint_t* pde = get_directory_entry(base, cr3, false, true, &next);
+    // no page of the table was present, only cached page structures refer to it
+    tlb_batch_free_frame(&batch, PAGE_FRAME(*pde));
+    tlb_batch_add_range(&batch, base, LARGE_PAGE_SIZE);
+    set_entry(pde, large_page_entry(frames, false, false, exec));
+    ++large_page_stats.on_demand;
+    paging_unlock(lock);
+
+    tlb_batch_flush(&batch);
     return true;
 }
 
-/*
-puint_t clone_ptable(puint_t source_ptable, puint_t target_ptable) {
-    page_table_t sptable;
-    page_table_t tptable;
-
-    if (!PRESENT(target_ptable)) {
-        proc_spinlock_lock(&__frame_lock);
-        target_ptable = get_free_frame();
-        proc_spinlock_unlock(&__frame_lock);
-    }
+/** Page entry bits that must match in every page of promoted window */
+#define PROMOTE_FLAGS_MASK (0x800000000000001FUL)
 
-    sptable.number = source_ptable;
-    tptable.number = target_ptable;
+/**
+ * Checks whether page table of large page window at base maps 512 private
+ * frames with same attributes. Address space lock must be held, frames referenced
+ * only by this address space can't change their counts meanwhile.
+ */
+static bool large_page_promotable(uintptr_t base, uintptr_t cr3) {
+    uintptr_t next;
+    puint_t* pde = get_directory_entry(base, cr3, false, true, &next);
+    if (pde == NULL || !PRESENT(*pde) || PS(*pde) || !RW(*pde))
+        return false;
 
-    uint64_t* vsptable = (uint64_t*)physical_to_virtual(ALIGN(source_ptable));
-    uint64_t* vtptable = (uint64_t*)physical_to_virtual(target_ptable);
-    memset(vtptable, 0, 0x1000);
+    puint_t* pt = (puint_t*)ALIGN(physical_to_virtual(*pde));
+    for (size_t i=0; i<512; i++) {
+        if (!PRESENT(pt[i]) || (pt[i] & PROMOTE_FLAGS_MASK) != (pt[0] & PROMOTE_FLAGS_MASK))
+            return false;
+        if (PAGE_FRAME(pt[i]) == zero_frame)
+            return false;
+        frame_info_t* fi = get_frame_info(PAGE_FRAME(pt[i]));
+        if (fi == NULL || fi->usage_count != 1 || fi->cow_count != 0)
+            return false;
+    }
+    return true;
+}
 
-    for (uint16_t i=0; i<512; i++) {
-        if (PRESENT(vsptable[i])) {
+bool promote_large_page(uintptr_t base, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, base);
+    if ((base % LARGE_PAGE_SIZE) != 0 || base + LARGE_PAGE_SIZE > 0x0000800000000000UL)
+        return false;
+    __atomic_add_fetch(&large_page_stats.scanned, 1, __ATOMIC_RELAXED);
 
-            page_t page;
-            page.address = vsptable[i];
+    paging_lock(lock);
+    bool promotable = large_page_promotable(base, cr3);
+    paging_unlock(lock);
+    if (!promotable)
+        return false;
 
-            if (page.flaggable.rw == 1) {
-                puint_t frame = ALIGN(page.address);
-                proc_spinlock_lock(&__frame_lock);
-                frame_info_t* frame_info = get_frame_info(frame);
+    puint_t frames = __alloc_frames(LARGE_PAGE_ORDER);
+    if (frames == 0) {
+        __atomic_add_fetch(&large_page_stats.failed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
 
-                ++frame_info->usage_count;
-                if (frame_info->cow_count == 0)
-                    ++frame_info->cow_count;
-                ++frame_info->cow_count;
+    // cpus running cr3 are held in shootdown, so nothing writes to the
+    // window while it is copied
+    tlb_shootdown(cr3, base, LARGE_PAGE_SIZE);
+    paging_lock(lock);
+    if (!large_page_promotable(base, cr3)) {
+        paging_unlock(lock);
+        free_frames(frames, LARGE_PAGE_ORDER);
+        tlb_shootdown_end();
+        __atomic_add_fetch(&large_page_stats.failed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
 
-                page_t page;
-                page.address = vsptable[i];
-                page.flaggable.rw = 0;
-                vsptable[i] = page.address;
+    uintptr_t next;
+    puint_t* pde = get_directory_entry(base, cr3, false, true, &next);
+    puint_t table = PAGE_FRAME(*pde);
+    puint_t* pt = (puint_t*)physical_to_virtual(table);
+    for (size_t i=0; i<512; i++) {
+        memcpy((void*)physical_to_virtual(frames + (i*0x1000)),
+                (void*)physical_to_virtual(PAGE_FRAME(pt[i])), 0x1000);
+    }
 
-                proc_spinlock_unlock(&__frame_lock);
-            }
+    page_t page;
+    page.address = pt[0];
+    set_entry(pde, large_page_entry(frames, page.flaggable.us == 0, page.flaggable.rw == 0,
+            page.flaggable.xd == 1));
+    paging_unlock(lock);
+    tlb_shootdown_end();
 
-            vtptable[i] = page.address;
-        }
-    }
+    // old frames could be cached again while cpus were held, flush once
+    // more before they are released
+    tlb_shootdown(cr3, base, LARGE_PAGE_SIZE);
+    tlb_shootdown_end();
 
-    tptable.copyinfo.copy = sptable.copyinfo.copy;
-    tptable.copyinfo.copy2 = sptable.copyinfo.copy2;
+    paging_lock(&__frame_lock);
+    for (size_t i=0; i<512; i++)
+        free_frame(PAGE_FRAME(pt[i]));
+    free_frame(table);
+    paging_unlock(&__frame_lock);
 
-    return tptable.number;
+    __atomic_add_fetch(&large_page_stats.promoted, 1, __ATOMIC_RELAXED);
+    return true;
 }
 
-puint_t clone_pdir(puint_t source_pdir, puint_t target_pdir) {
-    page_directory_t spdir;
-    page_directory_t tpdir;
-
-    if (!PRESENT(target_pdir)) {
-        proc_spinlock_lock(&__frame_lock);
-        target_pdir = get_free_frame();
-        proc_spinlock_unlock(&__frame_lock);
+/**
+ * Resolves write fault to copy on write page.
+ *
+ * Page entry is changed under address space lock, counts of shared frame
+ * under __frame_lock. Frame is copied without __frame_lock, so two address
+ * spaces might both copy it, last one then releases it.
+ */
+faultstate_t copy_on_write(uintptr_t address, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, address);
+    paging_lock(lock);
+    uint64_t* page = get_page(address, cr3, false);
+    if (page == NULL || !PRESENT(*page)) {
+        paging_unlock(lock);
+        return fs_invalid;
     }
+    if (RW(*page)) {
+        // fault was caused by shared page structure, it was made private
+        paging_unlock(lock);
+        return fs_resolved;
+    }
+    puint_t frame = PAGE_FRAME(*page);
+    frame_info_t* frame_info = get_frame_info(frame);
+    if (frame_info == NULL || !is_cow_page(*page)) {
+        // invalid address or not copy on write
+        paging_unlock(lock);
+        return fs_invalid;
+    }
+    paging_unlock(lock);
 
-    spdir.number = source_pdir;
-    tpdir.number = target_pdir;
-
-    uint64_t* vspdir = (uint64_t*)physical_to_virtual(ALIGN(source_pdir));
-    uint64_t* vtpdir = (uint64_t*)physical_to_virtual(target_pdir);
-    memset(vtpdir, 0, 0x1000);
+    tlb_shootdown(cr3, ALIGN(address), 0x1000);
+    paging_lock(lock);
 
-    for (uint16_t i=0; i<512; i++) {
-        if (PRESENT(vspdir[i])) {
-            vtpdir[i] = clone_ptable(vspdir[i], vtpdir[i]);
-        }
+    // page table might have been released while unlocked, look entry up again
+    page = get_page(address, cr3, false);
+    if (page == NULL || !PRESENT(*page) || PAGE_FRAME(*page) != frame || !is_cow_page(*page)) {
+        // resolved or unmapped by other cpu meanwhile, access is retried
+        paging_unlock(lock);
+        tlb_shootdown_end();
+        return fs_resolved;
     }
 
-    tpdir.copyinfo.copy = spdir.copyinfo.copy;
-    tpdir.copyinfo.copy2 = spdir.copyinfo.copy2;
+    page_t porig;
+    porig.address = *page;
 
-    return tpdir.number;
-}
+    paging_lock(&__frame_lock);
+    uint32_t cow_count = frame_info->cow_count;
+    if (frame != zero_frame && cow_count == 1)
+        --frame_info->cow_count;
+    paging_unlock(&__frame_lock);
+
+    if (cow_count == 0) {
+        // resolved by other cpu meanwhile
+        paging_unlock(lock);
+        tlb_shootdown_end();
+        return fs_resolved;
+    }
 
+    if (frame != zero_frame && cow_count == 1) {
+        porig.flaggable.rw = 1;
+        set_entry(page, porig.address);
 
-puint_t clone_pdpt(puint_t source_pdpt, puint_t target_pdpt) {
-    pdpt_t spdpt;
-    pdpt_t tpdpt;
+        paging_unlock(lock);
+        tlb_shootdown_end();
+        return fs_resolved;
+    }
 
-    if (!PRESENT(target_pdpt)) {
-        proc_spinlock_lock(&__frame_lock);
-        target_pdpt = get_free_frame();
-        proc_spinlock_unlock(&__frame_lock);
+    // our entry still holds reference, so frame can't be released meanwhile
+    puint_t nframe;
+    if (frame == zero_frame) {
+        nframe = get_zeroed_frame();
+    } else {
+        nframe = get_free_frame();
+        if (nframe != 0)
+            memcpy((void*)physical_to_virtual(nframe), (void*)physical_to_virtual(frame), 0x1000);
+    }
+    if (nframe == 0) {
+        paging_unlock(lock);
+        tlb_shootdown_end();
+        return fs_nomem;
     }
 
-    spdpt.number = source_pdpt;
-    tpdpt.number = target_pdpt;
+    page_t pnew;
+    pnew.address = nframe;
 
-    uint64_t* vspdpt = (uint64_t*)physical_to_virtual(ALIGN(source_pdpt));
-    uint64_t* vtpdpt = (uint64_t*)physical_to_virtual(target_pdpt);
-    memset(vtpdpt, 0, 0x1000);
+    pnew.copyinfo.copy = porig.copyinfo.copy;
+    pnew.copyinfo.copy2 = porig.copyinfo.copy2;
 
-    for (uint16_t i=0; i<512; i++) {
-        if (PRESENT(vspdpt[i])) {
-            vtpdpt[i] = clone_pdir(vspdpt[i], vtpdpt[i]);
-        }
-    }
+    pnew.flaggable.rw = 1;
 
-    tpdpt.copyinfo.copy = spdpt.copyinfo.copy;
+    set_entry(page, pnew.address);
 
-    return tpdpt.number;
+    paging_lock(&__frame_lock);
+    free_frame(frame);
+    paging_unlock(&__frame_lock);
+
+    paging_unlock(lock);
+    tlb_shootdown_end();
+    return fs_resolved;
 }
 
-puint_t clone_paging_structures() {
-    puint_t active_page = get_active_page();
-    proc_spinlock_lock(&__frame_lock);
-    puint_t target_page = get_free_frame();
-    proc_spinlock_unlock(&__frame_lock);
+/**
+ * Reads swapped page at address back to new frame.
+ *
+ * Slot is read without address space lock, extra slot reference keeps it
+ * from being reused meanwhile. Frame keeps the reference of the entry, so clean
+ * page does not have to be written again (see swap_out_range).
+ */
+static faultstate_t swap_in(uintptr_t address, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, address);
+    puint_t frame = get_free_frame();
+    if (frame == 0)
+        return fs_nomem;
+
+    size_t slot;
+    paging_lock(lock);
+    puint_t* paddr = get_page(address, cr3, false);
+    if (paddr == NULL || !swapped_entry(*paddr, &slot)) {
+        // resolved by other cpu meanwhile, or access is retried and faults again
+        paging_unlock(lock);
+        free_frames(frame, 0);
+        return fs_resolved;
+    }
+    puint_t entry = *paddr;
+    swap_slot_get(slot);
+    paging_unlock(lock);
 
-    cr3_page_entry_t apentry;
-    cr3_page_entry_t tentry;
+    bool read = swap_read(slot, frame);
 
-    apentry.number = active_page;
-    tentry.pml = target_page;
-    tentry.copyinfo.copy = apentry.copyinfo.copy;
+    bool mapped = false;
+    paging_lock(lock);
+    paddr = get_page(address, cr3, false);
+    if (read && paddr != NULL && *paddr == entry) {
+        page_t swapped;
+        swapped.address = entry;
 
-    uint64_t* sent = (uint64_t*) physical_to_virtual(ALIGN(active_page));
-    uint64_t* tent = (uint64_t*) physical_to_virtual(target_page);
-    memset(tent, 0, 0x1000);
+        page_t page;
+        memset(&page, 0, sizeof(page_t));
+        page.address = frame;
+        page.flaggable.present = 1;
+        page.flaggable.rw = 1;
+        page.flaggable.us = 1;
+        page.flaggable.xd = swapped.internal.exec ? 1 : 0;
+        set_entry(paddr, page.address);
 
-    for (uint16_t i=0; i<512; i++) {
-        if (i < 256) {
-            // user pages
-            if (PRESENT(sent[i])) {
-                tent[i] = clone_pdpt(sent[i], tent[i]);
-            }
-        } else {
-            // kernel pages
-            tent[i] = sent[i];
-        }
+        frame_info_t* fi = get_frame_info(frame);
+        if (fi != NULL)
+            fi->swap_slot = slot + 1;
+        else
+            swap_slot_put(slot);
+        mapped = true;
     }
+    paging_unlock(lock);
 
-    // flush TLB to propagate any rw changes
-    broadcast_ipi_message(true, IPI_INVLD_PML, active_page, 0, NULL);
-    return tentry.number;
+    swap_slot_put(slot);
+    if (!mapped) {
+        free_frames(frame, 0);
+        return read ? fs_resolved : fs_invalid;
+    }
+    __atomic_add_fetch(&swap_stats.pages_in, 1, __ATOMIC_RELAXED);
+    return fs_resolved;
 }
-*/
-
-puint_t create_pml4() {
-    puint_t active_page = get_active_page();
-    proc_spinlock_lock(&__frame_lock);
-    puint_t target_page = get_free_frame();
-    proc_spinlock_unlock(&__frame_lock);
 
-    if (target_page == 0)
-        return 0;
+/**
+ * Returns page table of user address vaddress without changing any page
+ * structure. Page tables shared with other address space and large pages are
+ * skipped, next will contain first address after them.
+ * Address space lock of vaddress must be held.
+ */
+static puint_t* peek_table(uintptr_t vaddress, uintptr_t cr3, uintptr_t* next) {
+    v_address_t va;
+    memcpy(&va, &vaddress, 8);
 
-    cr3_page_entry_t apentry;
-    cr3_page_entry_t tentry;
+    puint_t* pml4 = (puint_t*)ALIGN(physical_to_virtual(cr3));
+    if (!PRESENT(pml4[va.pml]) || !RW(pml4[va.pml])) {
+        *next = ((vaddress >> 39) + 1) << 39;
+        return NULL;
+    }
+    puint_t* pdpt = (puint_t*)ALIGN(physical_to_virtual(pml4[va.pml]));
+    if (!PRESENT(pdpt[va.directory_ptr]) || PS(pdpt[va.directory_ptr]) || !RW(pdpt[va.directory_ptr])) {
+        *next = ((vaddress >> 30) + 1) << 30;
+        return NULL;
+    }
+    puint_t* pdir = (puint_t*)ALIGN(physical_to_virtual(pdpt[va.directory_ptr]));
+    if (!PRESENT(pdir[va.directory]) || PS(pdir[va.directory]) || !RW(pdir[va.directory])) {
+        *next = ((vaddress >> 21) + 1) << 21;
+        return NULL;
+    }
+    return (puint_t*)ALIGN(physical_to_virtual(pdir[va.directory]));
+}
 
-    apentry.number = active_page;
-    tentry.pml = target_page;
-    tentry.copyinfo.copy = apentry.copyinfo.copy;
+/**
+ * Returns frame info of page mapped by entry, if the page can be swapped out.
+ *
+ * Only private writable user pages are swapped, read only ones might be copy
+ * on write or program code. Address space lock must be held, frames referenced
+ * only by this address space can't change their counts meanwhile.
+ */
+static frame_info_t* swap_candidate(puint_t entry) {
+    if (!PRESENT(entry) || !RW(entry) || !US(entry) || PAGE_FRAME(entry) == zero_frame)
+        return NULL;
+    frame_info_t* fi = get_frame_info(PAGE_FRAME(entry));
+    if (fi == NULL || fi->usage_count != 1 || fi->cow_count != 0 ||
+            (fi->flags & FRAME_FLAG_TABLE) != 0)
+        return NULL;
+    return fi;
+}
 
-    uint64_t* sent = (uint64_t*) physical_to_virtual(ALIGN(active_page));
-    uint64_t* tent = (uint64_t*) physical_to_virtual(target_page);
-    memset(tent, 0, 0x1000);
+size_t swap_out_range(uintptr_t* address, uintptr_t end, uintptr_t cr3, size_t target) {
+    paging_lock_t* lock = space_lock(cr3, *address);
+    uintptr_t victims[SWAP_OUT_BATCH];
+    puint_t frames[SWAP_OUT_BATCH];
+    size_t count = 0;
+    if (target > SWAP_OUT_BATCH)
+        target = SWAP_OUT_BATCH;
+
+    uintptr_t addr = ALIGN(*address);
+    uintptr_t next;
+    paging_lock(lock);
+    puint_t* pt = peek_table(addr, cr3, &next);
+    if (pt == NULL) {
+        paging_unlock(lock);
+        *address = (next == 0 || next > end) ? end : next;
+        return 0;
+    }
+    uintptr_t table_end = ((addr >> 21) + 1) << 21;
+    if (table_end > end)
+        table_end = end;
+    for (; addr < table_end && count < target; addr += 0x1000) {
+        puint_t* page = &pt[(addr >> 12) & 0x1FF];
+        if (swap_candidate(*page) == NULL)
+            continue;
+        __atomic_add_fetch(&swap_stats.scanned, 1, __ATOMIC_RELAXED);
+        if ((*page & PAGE_ACCESSED) != 0) {
+            // second chance, cleared atomically since cpu might set dirty bit meanwhile,
+            // stale TLB entry only makes page look cold sooner, so it is not flushed
+            __atomic_and_fetch(page, ~PAGE_ACCESSED, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&swap_stats.referenced, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        victims[count++] = addr;
+    }
+    paging_unlock(lock);
+    *address = addr;
+    if (count == 0)
+        return 0;
 
-    for (uint16_t i=0; i<512; i++) {
-        if (i >= 256) {
-            // kernel pages
-            tent[i] = sent[i];
+    // cpus running cr3 are held in shootdown, so accessed and dirty
+    // bits can't change while pages are written out
+    uintptr_t from = victims[0];
+    size_t size = victims[count-1] + 0x1000 - from;
+    size_t released = 0;
+    tlb_shootdown(cr3, from, size);
+    paging_lock(lock);
+    pt = peek_table(from, cr3, &next);
+    for (size_t i=0; i<count && pt != NULL; i++) {
+        puint_t* page = &pt[(victims[i] >> 12) & 0x1FF];
+        frame_info_t* fi = swap_candidate(*page);
+        if (fi == NULL || (*page & PAGE_ACCESSED) != 0)
+            continue;
+
+        size_t slot;
+        if (fi->swap_slot != SWAP_SLOT_NONE && (*page & PAGE_DIRTY) == 0) {
+            // not written since it was read back, swap copy is still valid
+            slot = fi->swap_slot - 1;
+            __atomic_add_fetch(&swap_stats.clean_out, 1, __ATOMIC_RELAXED);
+        } else {
+            if (fi->swap_slot != SWAP_SLOT_NONE)
+                swap_slot_put(fi->swap_slot - 1);
+            fi->swap_slot = SWAP_SLOT_NONE;
+            int64_t nslot = swap_slot_alloc();
+            if (nslot < 0)
+                break;
+            if (!swap_write((size_t)nslot, PAGE_FRAME(*page))) {
+                swap_slot_put((size_t)nslot);
+                break;
+            }
+            slot = (size_t)nslot;
+            __atomic_add_fetch(&swap_stats.pages_out, 1, __ATOMIC_RELAXED);
         }
+        // slot reference is moved to the entry
+        fi->swap_slot = SWAP_SLOT_NONE;
+        frames[released++] = PAGE_FRAME(*page);
+
+        page_t mapped;
+        mapped.address = *page;
+        page_t swapped;
+        swapped.address = 0;
+        swapped.internal.valid = 1;
+        swapped.internal.swapped = 1;
+        swapped.internal.exec = mapped.flaggable.xd;
+        swapped.internal.gps_id = slot;
+        set_entry(page, swapped.address);
     }
-    return tentry.number;
-}
+    paging_unlock(lock);
+    tlb_shootdown_end();
 
-// TODO: add swap?
-bool page_fault(uintptr_t address, ruint_t errcode) {
+    if (released == 0)
+        return 0;
+
+    // frames could be cached again while cpus were held, flush once
+    // more before they are released
+    tlb_shootdown(cr3, from, size);
+    tlb_shootdown_end();
 
-    //proc_t* process = get_current_process();
+    paging_lock(&__frame_lock);
+    for (size_t i=0; i<released; i++)
+        free_frame(frames[i]);
+    paging_unlock(&__frame_lock);
+    return released;
+}
 
+/**
+ * Resolves fault at address of address space cr3, see page_fault.
+ */
+static faultstate_t resolve_fault(uintptr_t address, uintptr_t cr3, ruint_t errcode) {
     if ((errcode & (1<<0)) == 0) {
-    	uintptr_t cr3 = get_active_page();
+        paging_lock_t* lock = space_lock(cr3, address);
+        paging_lock(lock);
         uint64_t* paddr = get_page(address, cr3, false);
+        page_t page;
+        page.address = paddr != NULL ? *paddr : 0;
+        paging_unlock(lock);
         if (paddr != NULL) {
-            page_t page;
-            page.address = *paddr;
             if (page.internal.valid) {
                 if (page.internal.allocondem) {
+                    if ((errcode & (1<<1)) == 0 && zero_frame != 0) {
+                        // read fault, no need to commit memory yet, page table might
+                        // have been released while unlocked, so entry is looked up again
+                        paging_lock(lock);
+                        paddr = get_page(address, cr3, false);
+                        if (paddr != NULL && is_on_demand_page(*paddr))
+                            map_zero_frame(paddr);
+                        paging_unlock(lock);
+                        return fs_resolved;
+                    }
+
+                    if (allocate_large_on_demand(address, cr3))
+                        return fs_resolved;
+
                     alloc_info_t ainfo;
                     ainfo.amount = 0x1000;
                     ainfo.finished = false;
@@ -1147,101 +2677,75 @@ bool page_fault(uintptr_t address, ruint_t errcode) {
                     ainfo.exec = false;
                     ainfo.from = ALIGN(address);
                     allocate_mem(&ainfo, false, false, cr3);
-                    if (!ainfo.finished) {
-                        // TODO: send message to swapper
-                    }
-                    return true;
+                    return ainfo.finished ? fs_resolved : fs_nomem;
                 } else if (page.internal.swapped) {
-                    // TODO: send message to swapper
+                    return swap_in(ALIGN(address), cr3);
                 }
             }
         }
     } else if ((errcode & (1<<1)) != 0) {
         // write error
-    	uintptr_t cr3 = get_active_page();
-        uint64_t* page = get_page(address, cr3, false);
-        if (page != NULL) {
-        	tlb_shootdown(cr3, ALIGN(address), 0x1000);
-            ruint_t frame = ALIGN(*page);
-
-            proc_spinlock_lock(&__frame_lock);
-            frame_info_t* frame_info = get_frame_info(frame);
-
-            if (frame_info == NULL) {
-                // invalid address
-                return false;
-            }
-
-            if (frame_info->cow_count == 0) {
-                proc_spinlock_unlock(&__frame_lock);
-                return false;
-            }
-
-            if (frame_info->cow_count == 1) {
-                page_t porig;
-                porig.address = *page;
-
-                porig.flaggable.rw = 1;
-                --frame_info->cow_count;
-
-                *page = porig.address;
-
-                proc_spinlock_unlock(&__frame_lock);
-                tlb_shootdown_end();
-                return true;
-            }
-
-            puint_t nframe = get_free_frame();
-            memcpy((void*)physical_to_virtual(nframe), (void*)physical_to_virtual(frame), 0x1000);
-
-            page_t porig;
-            page_t pnew;
-
-            porig.address = *page;
-            pnew.address = nframe;
-
-            pnew.copyinfo.copy = porig.copyinfo.copy;
-            pnew.copyinfo.copy2 = porig.copyinfo.copy2;
-
-            pnew.flaggable.rw = 1;
-
-            *page = pnew.address;
-
-            --frame_info->cow_count;
-            --frame_info->usage_count;
-
-            proc_spinlock_unlock(&__frame_lock);
-            tlb_shootdown_end();
-            return true;
-        }
+        return copy_on_write(ALIGN(address), cr3);
     }
 
-    return false;
+    return fs_invalid;
+}
+
+faultstate_t page_fault(uintptr_t address, ruint_t errcode) {
+    return resolve_fault(address, get_active_page(), errcode);
 }
 
 void allocate_physret(uintptr_t block_addr, puint_t* physmem, bool kernel, bool rw, bool exec, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, block_addr);
+    paging_lock(lock);
     *physmem = allocate_frame(get_page(block_addr, cr3, true), kernel, rw, exec);
+    paging_unlock(lock);
 }
 
 void mem_change_type(uintptr_t from, size_t amount,
         int change_type, bool new_value, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, from);
     amount = _ALIGN_UP(amount);
+    uintptr_t end = ALIGN(from + amount - 1) + 0x1000;
 
     tlb_shootdown(cr3, from, amount);
 
-    for (uintptr_t addr = from; addr < from + amount; addr += 0x1000) {
-        puint_t* paddress = get_page(addr, cr3, true);
-        if (!PRESENT(*paddress)) {
-            page_t page;
-            memset(&page, 0, sizeof(page_t));
-            page.address = *paddress;
-
-            if (change_type == CHNG_TYPE_RW)
-                page.flaggable.rw = new_value;
-            if (change_type == CHNG_TYPE_SU)
-                page.flaggable.us = new_value;
-            *paddress = page.address;
+    uintptr_t addr = ALIGN(from);
+    while (addr < end) {
+        size_t count;
+        paging_lock(lock);
+        if ((addr % LARGE_PAGE_SIZE) == 0 && end - addr >= LARGE_PAGE_SIZE) {
+            uintptr_t next;
+            puint_t* pde = get_directory_entry(addr, cr3, false, false, &next);
+            if (pde != NULL && PRESENT(*pde) && PS(*pde)) {
+                // large page is fully present, nothing to change,
+                // partially covered one is split by the walk below
+                paging_unlock(lock);
+                addr += LARGE_PAGE_SIZE;
+                continue;
+            }
+        }
+        puint_t* pages = walk_page_range(addr, end, cr3, true, false, &count);
+        if (pages == NULL) {
+            paging_unlock(lock);
+            break;
         }
+        for (size_t i=0; i<count; i++) {
+            size_t slot;
+            if (!PRESENT(pages[i]) && !swapped_entry(pages[i], &slot)) {
+                page_t page;
+                memset(&page, 0, sizeof(page_t));
+                page.address = pages[i];
+
+                if (change_type == CHNG_TYPE_RW)
+                    page.flaggable.rw = new_value;
+                if (change_type == CHNG_TYPE_SU)
+                    page.flaggable.us = new_value;
+                set_entry(&pages[i], page.address);
+            }
+        }
+        paging_unlock(lock);
+        addr += count * 0x1000;
     }
 
     tlb_shootdown_end();
@@ -1250,71 +2754,118 @@ void mem_change_type(uintptr_t from, size_t amount,
 // only works within same cr3!
 bool map_range(uintptr_t* _start, uintptr_t end, uintptr_t* _tostart, uintptr_t toend, bool virtual_memory,
         bool readonly, bool kernel, uintptr_t cr3) {
+    paging_lock_t* lock = space_lock(cr3, *_tostart);
     uintptr_t tostart = *_tostart;
     uintptr_t start = *_start;
     uintptr_t offs=0;
+    puint_t* source = NULL;
+    size_t source_count = 0;
 
     tlb_shootdown(cr3, start, end-start);
 
-    for (; offs<(end-start); offs+=0x1000) {
-        uintptr_t smem = start+offs;
-        uintptr_t tmem = tostart+offs;
-
-        uint64_t* tp = kernel ? get_page(tmem, cr3, true) : get_page_user(tmem, cr3, true);
-        if (tp == NULL) {
+    while (offs<(end-start)) {
+        size_t count;
+        paging_lock(lock);
+        if (!virtual_memory && ((tostart+offs) % LARGE_PAGE_SIZE) == 0 &&
+                ((start+offs) % LARGE_PAGE_SIZE) == 0 && (end-start)-offs >= LARGE_PAGE_SIZE) {
+            uintptr_t next;
+            puint_t* pde = get_directory_entry(tostart+offs, cr3, true, !kernel, &next);
+            if (pde != NULL && !PRESENT(*pde)) {
+                set_entry(pde, large_page_entry(start+offs, kernel, readonly, false));
+                paging_unlock(lock);
+                offs += LARGE_PAGE_SIZE;
+                continue;
+            }
+        }
+        puint_t* pages = walk_page_range(tostart+offs, tostart+(end-start), cr3, true, !kernel, &count);
+        if (pages == NULL) {
             goto on_error;
         }
 
-        puint_t frame;
-        if (virtual_memory) {
-            frame = ALIGN(*get_page(smem, cr3, true));
-            if (frame == 0) {
-                goto on_error;
-            }
-            proc_spinlock_lock(&__frame_lock);
-            frame_info_t* fi = get_frame_info(frame);
-            if (fi != NULL) {
-                ++fi->usage_count;
+        for (size_t i=0; i<count; i++) {
+            puint_t frame;
+            if (virtual_memory) {
+                if (source_count == 0) {
+                    source = walk_page_range(start+offs, end, cr3, true, false, &source_count);
+                    if (source == NULL) {
+                        goto on_error;
+                    }
+                }
+                frame = ALIGN(*source);
+                ++source;
+                --source_count;
+                if (frame == 0) {
+                    goto on_error;
+                }
+                frame_info_t* fi = get_frame_info(PAGE_FRAME(frame));
+                if (fi != NULL) {
+                    paging_lock(&__frame_lock);
+                    ++fi->usage_count;
+                    paging_unlock(&__frame_lock);
+                }
+            } else {
+                frame = start+offs;
             }
-            proc_spinlock_unlock(&__frame_lock);
-        } else {
-            frame = smem;
-        }
 
-        page_t page;
-        memset(&page, 0, sizeof(page_t));
-        page.address = ALIGN(frame);
-        page.flaggable.present = 1;
-        page.flaggable.rw = readonly ? 0 : 1;
-        page.flaggable.us = kernel ? 0 : 1;
-        *tp = page.address;
-
-        continue;
-    on_error:
-        *_tostart += offs;
-        *_start += offs;
-        tlb_shootdown_end();
-        return false;
+            page_t page;
+            memset(&page, 0, sizeof(page_t));
+            page.address = ALIGN(frame);
+            page.flaggable.present = 1;
+            page.flaggable.rw = readonly ? 0 : 1;
+            page.flaggable.us = kernel ? 0 : 1;
+            set_entry(&pages[i], page.address);
+
+            offs += 0x1000;
+        }
+        paging_unlock(lock);
     }
 
     tlb_shootdown_end();
     return true;
+
+on_error:
+    paging_unlock(lock);
+    *_tostart += offs;
+    *_start += offs;
+    tlb_shootdown_end();
+    return false;
 }
 
 memstate_t check_mem_state(uintptr_t address, size_t size, uint64_t* storeptr,
         size_t maxc, size_t* usedentries) {
+    paging_lock_t* lock = space_lock(get_active_page(), address);
     memstate_t mstate = ms_einvalid;
 
     for (uintptr_t addr=address; addr<address+size; addr+=0x1000) {
+        uintptr_t next;
+        paging_lock(lock);
+        puint_t* pde = get_directory_entry(addr, get_active_page(), false, false, &next);
+        if (pde != NULL && PRESENT(*pde) && PS(*pde) && RW(*pde)) {
+            // writable large page is okay as whole, skip to its last page
+            paging_unlock(lock);
+            addr = (ALIGN(addr) | (LARGE_PAGE_SIZE-0x1000)) + (addr & 0xFFF);
+            continue;
+        }
         puint_t* entry = get_page(addr, get_active_page(), false);
+        paging_unlock(lock);
         if (entry == NULL) {
             return ms_notpresent;
         }
         page_t page;
         page.address = *entry;
         if (page.flaggable.present == 1) {
-            // page is present and thus valid
-            // TODO: check for CoW
+            // page is present and thus valid, unless it is copy on write
+            if (is_cow_page(page.address)) {
+                if (mstate == ms_einvalid) {
+                    mstate = ms_cow;
+                }
+                if (mstate == ms_cow || *usedentries >= maxc) {
+                    storeptr[*usedentries] = addr;
+                    ++*usedentries;
+                } else {
+                    return mstate;
+                }
+            }
         } else {
             if (page.internal.valid == 1) {
                 // not present but valid, find out why
@@ -1353,6 +2904,65 @@ bool is_physical(uintptr_t mem) {
 	return mem >= 0xFFFF000000000000;
 }
 
+/**
+ * Returns frame backing user address, making its page structures private.
+ *
+ * Large page is used directly, unless it is going to be written to and
+ * is copy on write. Then it is split and copy on write is broken for
+ * the single page. Page that is not present is faulted in first, frame
+ * written through memory mirror loses its swap copy, since dirty bit is not set.
+ * Returns false if there are no page structures, page can't be faulted in or
+ * copy on write frame can't be copied for write.
+ */
+static bool get_user_frame(uintptr_t vaddress, uintptr_t cr3, bool write, puint_t* frame) {
+	paging_lock_t* lock = space_lock(cr3, vaddress);
+	for (;;) {
+		uintptr_t next;
+		paging_lock(lock);
+		puint_t* pde = get_directory_entry(vaddress, cr3, false, false, &next);
+		if (pde != NULL && PRESENT(*pde) && PS(*pde) && (!write || RW(*pde))) {
+			*frame = PAGE_FRAME(*pde) + (vaddress & (LARGE_PAGE_SIZE-0x1000));
+			paging_unlock(lock);
+			return true;
+		}
+		puint_t* page = get_page(vaddress, cr3, false);
+		// entry pointer is not valid once lock is dropped, keep its value
+		puint_t entry = page != NULL ? *page : 0;
+		bool missing = page != NULL && !PRESENT(entry);
+		bool cow = page != NULL && write && PRESENT(entry) && !RW(entry);
+		paging_unlock(lock);
+
+		if (page == NULL)
+			return false;
+		if (missing) {
+			if (resolve_fault(ALIGN(vaddress), cr3, write ? (1<<1) : 0) != fs_resolved)
+				return false;
+			continue;
+		}
+		if (cow) {
+			// frame is still shared unless it was copied, entry is read again under lock
+			if (copy_on_write(ALIGN(vaddress), cr3) != fs_resolved)
+				return false;
+			continue;
+		}
+		*frame = PAGE_FRAME(entry);
+
+		if (write) {
+			// swap copy of private frame is only touched under address space lock
+			paging_lock(lock);
+			page = get_page(vaddress, cr3, false);
+			frame_info_t* fi = get_frame_info(*frame);
+			if (page != NULL && PRESENT(*page) && PAGE_FRAME(*page) == *frame &&
+					fi != NULL && fi->usage_count == 1 && fi->swap_slot != SWAP_SLOT_NONE) {
+				swap_slot_put(fi->swap_slot - 1);
+				fi->swap_slot = SWAP_SLOT_NONE;
+			}
+			paging_unlock(lock);
+		}
+		return true;
+	}
+}
+
 void memcpy_dpgs(uintptr_t cr3a, uintptr_t cr3b, void* _to, void* _from, size_t n) {
 	uint8_t* from = (uint8_t*)_from;
 	uintptr_t offs = ((uintptr_t)from) - ((uintptr_t)ALIGN(from));
@@ -1364,43 +2974,42 @@ void memcpy_dpgs(uintptr_t cr3a, uintptr_t cr3b, void* _to, void* _from, size_t
 			return;
 		}
 
-		puint_t* phys = NULL;
+		puint_t phys, phys2;
+		bool user = false, user2 = false;
 		if (!is_physical((uintptr_t)from))
-			phys = get_page((uintptr_t)from, cr3b, false);
-		puint_t* phys2 = NULL;
+			user = get_user_frame((uintptr_t)from, cr3b, false, &phys);
 		if (!is_physical((uintptr_t)to))
-			phys2 = get_page((uintptr_t)to, cr3a, false);
-		if (phys != NULL || phys2 != NULL) {
-			uintptr_t pos1, pos2;
+			user2 = get_user_frame((uintptr_t)to, cr3a, true, &phys2);
+		if ((!is_physical((uintptr_t)from) && !user) || (!is_physical((uintptr_t)to) && !user2))
+			return; // user page could not be resolved
 
-			if (phys != NULL) {
-				pos1 = physical_to_virtual(ALIGN(*phys))+offs;
-			} else {
-				pos1 = ((uintptr_t)from);
-			}
+		uintptr_t pos1, pos2;
 
-			if (phys2 != NULL) {
-				pos2 = physical_to_virtual(ALIGN(*phys2))+offs2;
-			} else {
-				pos2 = ((uintptr_t)to);
-			}
+		if (user) {
+			pos1 = physical_to_virtual(phys)+offs;
+		} else {
+			pos1 = ((uintptr_t)from);
+		}
 
-			size_t maxcpy = offs < offs2 ? (0x1000-offs2) : (0x1000-offs);
+		if (user2) {
+			pos2 = physical_to_virtual(phys2)+offs2;
+		} else {
+			pos2 = ((uintptr_t)to);
+		}
 
-			memcpy(((void*)pos2), ((void*)pos1),
-					n > maxcpy ? maxcpy : n);
-			if (n <= maxcpy) {
-				n = 0;
-			} else {
-				n -= maxcpy;
-				from += maxcpy;
-				to += maxcpy;
+		size_t maxcpy = offs < offs2 ? (0x1000-offs2) : (0x1000-offs);
 
-				offs = ((uintptr_t)from) - ((uintptr_t)ALIGN(from));
-				offs2 = ((uintptr_t)to) - ((uintptr_t)ALIGN(to));
-			}
+		memcpy(((void*)pos2), ((void*)pos1),
+				n > maxcpy ? maxcpy : n);
+		if (n <= maxcpy) {
+			n = 0;
 		} else {
-			return;
+			n -= maxcpy;
+			from += maxcpy;
+			to += maxcpy;
+
+			offs = ((uintptr_t)from) - ((uintptr_t)ALIGN(from));
+			offs2 = ((uintptr_t)to) - ((uintptr_t)ALIGN(to));
 		}
 	}
 }
@@ -1415,9 +3024,8 @@ void memset_dpgs(uintptr_t cr3, void* _from, int v, size_t n) {
 			return;
 		}
 
-		puint_t* phys = get_page((uintptr_t)from, cr3, false);
-		if (phys != NULL) {
-			puint_t pl = ALIGN(*phys);
+		puint_t pl;
+		if (get_user_frame((uintptr_t)from, cr3, true, &pl)) {
 			memset((void*)(physical_to_virtual(pl)+offs), v, n > 0x1000-offs ? 0x1000-offs : n);
 			if (n <= 0x1000-offs) {
 				n = 0;
@@ -1435,10 +3043,10 @@ void memset_dpgs(uintptr_t cr3, void* _from, int v, size_t n) {
 void* different_page_mem(uintptr_t cr3, void* addr) {
 	uintptr_t mem = (uintptr_t)addr;
 	uintptr_t offs = mem - ALIGN(mem);
-	puint_t* phys = get_page((uintptr_t)addr, cr3, false);
-	if (phys == NULL) {
+	puint_t phys;
+	if (!get_user_frame((uintptr_t)addr, cr3, true, &phys)) {
 		return NULL;
 	} else {
-		return (void*)physical_to_virtual(ALIGN(*phys)+offs);
+		return (void*)physical_to_virtual(phys+offs);
 	}
 }
@@ -38,6 +38,12 @@ typedef enum memory_state {
     ms_okay, ms_swapped, ms_allocondem, ms_cow, ms_notpresent, ms_einvalid
 } memstate_t;
 
+typedef enum fault_state {
+    fs_resolved, // page is mapped, faulting access can be retried
+    fs_invalid,  // access is not allowed
+    fs_nomem     // there was no free frame, retry once swapper made room
+} faultstate_t;
+
 #define BITMASK(b) (1 << ((b) % CHAR_BIT))
 #define BITSLOT(b) ((b) / CHAR_BIT)
 #define BITSET(a, b) ((a)[BITSLOT(b)] |= BITMASK(b))
@@ -190,30 +196,124 @@ typedef union cr3_page_entry
    uint64_t                 pml;
 } cr3_page_entry_t;
 
-typedef struct stack_element {
-    uint64_t frame_address;
-    uint64_t array_ord;
-    struct stack_element* next;
-} stack_element_t;
-
 typedef struct frame_info frame_info_t;
 
+/** Highest order of buddy block, 2^9 frames is 2MB */
+#define BUDDY_MAX_ORDER (9)
+/** Empty index in buddy free lists */
+#define FRAME_NONE      (UINT32_MAX)
+/** Frame is first frame of free buddy block */
+#define FRAME_FLAG_FREE (1<<0)
+/** Frame belongs to a pool section */
+#define FRAME_FLAG_POOL (1<<1)
+/** Frame is page structure with live_entries maintained */
+#define FRAME_FLAG_TABLE (1<<2)
+/** Maximum number of pool sections */
+#define MAX_POOL_SECTIONS (1024)
+/** Maximum number of physical ranges reserved at boot */
+#define MAX_RESERVED_RANGES (512)
+
+/** Physical range used by kernel or boot structures, frame aligned */
+typedef struct reserved_range {
+    puint_t start;
+    puint_t end;
+} reserved_range_t;
+
 typedef struct section_info {
-    stack_element_t* head;
+    uint32_t free_list[BUDDY_MAX_ORDER+1];
     struct section_info* next_section;
-    frame_info_t* frame_array;
+    frame_info_t* frame_array; // part of frame_map starting at start_word
+    uint16_t section_id;
 
     uint64_t start_word;
     uint64_t end_word;
     uint64_t total_frames;
+    uint64_t free_frames;
 } section_info_t;
 
 struct frame_info {
     uint32_t usage_count;
     uint32_t cow_count;
-    stack_element_t* bound_stack_element;
+    union {
+        struct {
+            uint32_t next_free; // index of next free block of same order in section
+            uint32_t prev_free; // index of previous free block of same order in section
+        };
+        uint32_t live_entries;  // non zero entries of page structure, valid only with FRAME_FLAG_TABLE
+        uint32_t swap_slot;     // swap slot+1 still holding copy of the frame, valid only for mapped pages
+    };
+    uint8_t  order;     // order of free block, valid only with FRAME_FLAG_FREE
+    uint8_t  flags;
+    uint16_t section_id;
 };
 
+/**
+ * Per cpu frame cache.
+ *
+ * Frames held in cache are already taken from the section stacks (their
+ * usage_count is 1), so only owning cpu can hand them out or put them back.
+ */
+#define FRAME_CACHE_SIZE  (64)
+#define FRAME_CACHE_BATCH (32)
+
+typedef struct frame_cache {
+    size_t  count;
+    puint_t frames[FRAME_CACHE_SIZE];
+} frame_cache_t;
+
+/** Number of zeroed frames kept ready for allocation */
+#define ZERO_POOL_SIZE (512)
+/** Number of frames zeroed by idle cpu at once */
+#define ZERO_POOL_BATCH (16)
+
+/** Size of page mapped directly by page directory entry */
+#define LARGE_PAGE_SIZE  (0x200000UL)
+/** Buddy order of frames backing single large page */
+#define LARGE_PAGE_ORDER (9)
+
+/** Large page statistics, see promote_large_page */
+typedef struct large_page_stats {
+    uint64_t scanned;   // windows checked for promotion
+    uint64_t promoted;  // page tables collapsed into large page
+    uint64_t failed;    // promotions abandoned for lack of frames or on race
+    uint64_t on_demand; // large pages committed by write fault
+    uint64_t split;     // large pages split into page tables
+} large_page_stats_t;
+
+extern large_page_stats_t large_page_stats;
+/** Zeroed frame pool statistics */
+extern uint64_t zero_pool_hits;
+extern uint64_t zero_pool_misses;
+/** Boot time spent building frame map and frame pool, in TSC ticks */
+extern uint64_t frame_pool_build_time;
+
+/** Paging lock statistics, times are in TSC ticks */
+typedef struct lock_stats {
+    uint64_t acquired;  // number of acquisitions
+    uint64_t contended; // acquisitions that found lock held
+    uint64_t wait_time; // total time spent spinning for the lock
+    uint64_t hold_time; // total time lock was held
+    uint64_t max_hold;  // longest single hold
+} lock_stats_t;
+
+/** Number of frames released by single tlb batch flush */
+#define TLB_BATCH_FRAMES (64)
+
+/**
+ * Collects invalidations of one operation, so only single shootdown is sent
+ * for all of them. Frames unmapped by the operation are released only after
+ * all cpus flushed their TLBs. Low bits of frames entry hold buddy order
+ * of released block.
+ */
+typedef struct tlb_batch {
+    uintptr_t cr3;
+    uintptr_t from;
+    uintptr_t to;
+    size_t    pages;
+    size_t    frame_count;
+    puint_t   frames[TLB_BATCH_FRAMES];
+} tlb_batch_t;
+
 typedef struct alloc_info {
     uintptr_t from;
     size_t    amount;
@@ -248,6 +348,20 @@ void allocate_mem(alloc_info_t* ainfo, bool kernel, bool readonly, uintptr_t cr3
  * Deallocates memory from specified address and amount.
  */
 void deallocate(uintptr_t from, size_t amount, uintptr_t cr3);
+/**
+ * Deallocates memory from specified address and amount, invalidation and
+ * release of frames is deferred to batch.
+ */
+void deallocate_batched(uintptr_t from, size_t amount, tlb_batch_t* batch);
+/**
+ * Starts new tlb batch for address space cr3.
+ */
+void tlb_batch_init(tlb_batch_t* batch, uintptr_t cr3);
+/**
+ * Sends single shootdown for all collected invalidations and then releases
+ * collected frames.
+ */
+void tlb_batch_flush(tlb_batch_t* batch);
 /**
  * Returns whether specific virtual address is allocated or not.
  */
@@ -263,12 +377,75 @@ void deallocate_start_memory();
  */
 void deallocate_starting_address(uintptr_t address, size_t size);
 
-// TODO: fix with swap
-//puint_t clone_paging_structures();
+/**
+ * Zeroes batch of free frames into zeroed frame pool, called by idle cpus.
+ *
+ * Returns false if there was nothing to do.
+ */
+bool zero_frames_idle();
+
+/**
+ * Returns number of frames in buddy free lists and zeroed frame pool,
+ * without per cpu caches.
+ */
+size_t get_free_frame_count();
+
+/** Pages swapped out by single swap_out_range at most */
+#define SWAP_OUT_BATCH (32)
+
+/**
+ * Swapper step over single page table of address space cr3, starting at address.
+ *
+ * Clock over private user pages: accessed page loses its accessed bit and
+ * gets second chance, page not accessed since previous pass is written to swap
+ * area and its entry keeps swap slot in gps_id. Clean page read back from swap
+ * is not written again. At most target (up to SWAP_OUT_BATCH) pages are swapped
+ * out, address is advanced past checked pages, up to end.
+ *
+ * Returns number of released frames. Must be called without any lock held.
+ */
+size_t swap_out_range(uintptr_t* address, uintptr_t end, uintptr_t cr3, size_t target);
+
+/**
+ * Allocates 2^order physically contiguous frames, aligned to their size.
+ *
+ * Returns physical address of first frame or 0, if there is no such free block.
+ */
+puint_t alloc_frames(uint8_t order);
+/**
+ * Releases 2^order frames obtained via alloc_frames.
+ */
+void free_frames(puint_t frames, uint8_t order);
+
+/**
+ * Migrates 512 present 4KB user pages of large page window at base into
+ * single large page and collapses page table into page directory entry.
+ *
+ * Only private frames with same attributes are promoted. Returns true if
+ * window was promoted.
+ */
+bool promote_large_page(uintptr_t base, uintptr_t cr3);
+
+/**
+ * Fills statistics of frame lock, address space locks (summed over all
+ * address spaces) and kernel half lock.
+ */
+void get_paging_lock_stats(lock_stats_t* frame, lock_stats_t* spaces, lock_stats_t* kernel);
+
+/**
+ * Creates copy on write clone of user part of address space cr3.
+ */
+puint_t clone_paging_structures(uintptr_t cr3);
 
 puint_t create_pml4();
 
-bool page_fault(uintptr_t address, ruint_t errcode);
+/**
+ * Resolves page fault at address of current address space.
+ *
+ * Allocates on demand pages, reads swapped pages back and copies copy on
+ * write pages.
+ */
+faultstate_t page_fault(uintptr_t address, ruint_t errcode);
 
 void allocate_physret(uintptr_t block_addr, puint_t* physmem, bool kernel, bool rw, bool exec, uintptr_t cr3);
 
@@ -280,6 +457,12 @@ void mem_change_type(uintptr_t start, size_t len, int change_type, bool new_valu
 bool map_range(uintptr_t* start, uintptr_t end, uintptr_t* tostart, uintptr_t toend, bool virtual_memory,
         bool readonly, bool kernel, uintptr_t cr3);
 
+/**
+ * Replaces copy on write page at address with private writable copy.
+ *
+ * Returns fs_invalid if page is not copy on write.
+ */
+faultstate_t copy_on_write(uintptr_t address, uintptr_t cr3);
 memstate_t check_mem_state(uintptr_t address, size_t size, uint64_t* storeptr, size_t maxc, size_t* usedentries);
 
 void memcpy_dpgs(uintptr_t cr3a, uintptr_t cr3b, void* to, void* from, size_t n);
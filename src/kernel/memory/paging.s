@@ -58,13 +58,37 @@ is_1GB_paging_supported:
     and eax, 1<<26
     ret
 
+[GLOBAL is_pcid_supported]
+; Returns non-zero if process-context identifiers are supported
+;
+; uint64_t is_pcid_supported()
+is_pcid_supported:
+    push rbx
+    mov rax, 1
+    cpuid
+    mov eax, ecx
+    and eax, 1<<17
+    pop rbx
+    ret
+
+[GLOBAL enable_pcid]
+; Enables process-context identifiers (CR4.PCIDE), cr3 must have pcid 0
+;
+; extern void enable_pcid()
+enable_pcid:
+    mov rax, cr4
+    or rax, 1<<17
+    mov cr4, rax
+    ret
+
 [GLOBAL get_active_page]
-; Returns active page from cr3
+; Returns active page from cr3, without pcid
 ;
 ; extern void* get_active_page()
 get_active_page:
     xor rax, rax
     mov rax, cr3
+    and rax, ~0xFFF
     ret
 
 [GLOBAL set_active_page]
@@ -83,6 +107,28 @@ invalidate_address:
     invlpg [rdi]
     ret
 
+[GLOBAL zero_frame_nt]
+; Zeroes 4K frame with non temporal stores, so zeroing does not evict cache
+;
+; extern void zero_frame_nt(void* address)
+zero_frame_nt:
+    xor rax, rax
+    mov rcx, 64
+.zero_line:
+    movnti [rdi], rax
+    movnti [rdi+8], rax
+    movnti [rdi+16], rax
+    movnti [rdi+24], rax
+    movnti [rdi+32], rax
+    movnti [rdi+40], rax
+    movnti [rdi+48], rax
+    movnti [rdi+56], rax
+    add rdi, 64
+    dec rcx
+    jnz .zero_line
+    sfence
+    ret
+
 [GLOBAL get_faulting_address]
 ; Returns faulting address from cr2
 ;
@@ -91,3 +137,28 @@ get_faulting_address:
     xor rax, rax
     mov rax, cr2
     ret
+
+[GLOBAL fill_frame_info_nt]
+; Fills count frame infos with pattern using non temporal stores
+;
+; extern void fill_frame_info_nt(frame_info_t* frames, frame_info_t* pattern, size_t count)
+fill_frame_info_nt:
+    test rdx, rdx
+    jz .filled
+    mov r8d, [rsi]
+    mov r9d, [rsi+4]
+    mov r10d, [rsi+8]
+    mov r11d, [rsi+12]
+    mov eax, [rsi+16]
+.fill_info:
+    movnti [rdi], r8d
+    movnti [rdi+4], r9d
+    movnti [rdi+8], r10d
+    movnti [rdi+12], r11d
+    movnti [rdi+16], eax
+    add rdi, 20
+    dec rdx
+    jnz .fill_info
+    sfence
+.filled:
+    ret
@@ -0,0 +1,395 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * slab.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: typed object caches for kernel objects
+ */
+
+#include "slab.h"
+#include "../cpus/cpu_mgmt.h"
+
+extern void proc_spinlock_lock(volatile void* memaddr);
+extern void proc_spinlock_unlock(volatile void* memaddr);
+extern bool multiprocessing_ready;
+
+/** Cache of kmem_cache_t structures */
+kmem_cache_t kmem_cache_cache;
+/** Cache of magazines, has no magazine layer itself */
+kmem_cache_t kmem_magazine_cache;
+
+/** Size of slab block of cache */
+#define SLAB_SIZE(cache) (0x1000UL << (cache)->order)
+/** Free list link of object */
+#define SLAB_LINK(cache, object) (*(void**)((uintptr_t)(object) + (cache)->offset))
+
+/**
+ * Initializes cache layout.
+ *
+ * Free list link is placed behind the object, so constructed state of
+ * free object is never overwritten. Returns false if object does not
+ * fit into slab of SLAB_MAX_ORDER.
+ */
+static bool kmem_cache_init(kmem_cache_t* cache, const char* name, size_t size, size_t align,
+        kmem_ctor_t ctor, uint32_t flags) {
+    memset(cache, 0, sizeof(kmem_cache_t));
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+
+    cache->name = name;
+    cache->size = size;
+    cache->offset = ALIGN_UP(size, sizeof(void*));
+    cache->stride = ALIGN_UP(cache->offset + sizeof(void*), align);
+    cache->start = ALIGN_UP(sizeof(kmem_slab_t), align);
+    cache->flags = flags;
+    cache->ctor = ctor;
+
+    for (uint8_t order=0; order<=SLAB_MAX_ORDER; order++) {
+        cache->order = order;
+        if (SLAB_SIZE(cache) <= cache->start)
+            continue;
+        cache->objects = (SLAB_SIZE(cache) - cache->start) / cache->stride;
+        if (cache->objects >= SLAB_MIN_OBJECTS)
+            break;
+    }
+    return cache->objects > 0;
+}
+
+/**
+ * Returns slab containing object.
+ */
+static kmem_slab_t* slab_of(kmem_cache_t* cache, void* object) {
+    return (kmem_slab_t*)((uintptr_t)object & ~(SLAB_SIZE(cache)-1));
+}
+
+static void slab_list_push(kmem_slab_t** list, kmem_slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_remove(kmem_slab_t** list, kmem_slab_t* slab) {
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/**
+ * Returns list slab belongs to based on its usage.
+ */
+static kmem_slab_t** slab_list(kmem_cache_t* cache, kmem_slab_t* slab) {
+    if (slab->in_use == 0)
+        return &cache->empty;
+    if (slab->in_use == cache->objects)
+        return &cache->full;
+    return &cache->partial;
+}
+
+/**
+ * Creates new slab from frame allocator and constructs all its objects.
+ *
+ * Slab is accessed through memory mirror, so it uses no kernel heap
+ * address space. Called without __cache_lock.
+ */
+static kmem_slab_t* slab_create(kmem_cache_t* cache) {
+    puint_t frames = alloc_frames(cache->order);
+    if (frames == 0)
+        return NULL;
+
+    kmem_slab_t* slab = (kmem_slab_t*)physical_to_virtual(frames);
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->free_list = NULL;
+    slab->in_use = 0;
+
+    for (size_t i=cache->objects; i>0; i--) {
+        void* object = (void*)((uintptr_t)slab + cache->start + ((i-1) * cache->stride));
+        if (cache->ctor != NULL)
+            cache->ctor(object);
+        SLAB_LINK(cache, object) = slab->free_list;
+        slab->free_list = object;
+    }
+    return slab;
+}
+
+/**
+ * Returns slab frames back to frame allocator. Called without __cache_lock.
+ */
+static void slab_release(kmem_cache_t* cache, kmem_slab_t* slab) {
+    free_frames((uintptr_t)slab - ADDRESS_OFFSET(RESERVED_KBLOCK_RAM_MAPPINGS), cache->order);
+}
+
+/**
+ * Takes object from partial or empty slab, returns NULL if cache has
+ * no free object.
+ *
+ * Requires __cache_lock.
+ */
+static void* __slab_alloc(kmem_cache_t* cache) {
+    kmem_slab_t* slab = cache->partial;
+    if (slab == NULL) {
+        slab = cache->empty;
+        if (slab == NULL)
+            return NULL;
+        --cache->empty_count;
+    }
+
+    slab_list_remove(slab_list(cache, slab), slab);
+    void* object = slab->free_list;
+    slab->free_list = SLAB_LINK(cache, object);
+    ++slab->in_use;
+    slab_list_push(slab_list(cache, slab), slab);
+    return object;
+}
+
+/**
+ * Returns object to its slab. Empty slabs above SLAB_EMPTY_KEEP are
+ * unlinked and chained to release list, to be freed after lock is dropped.
+ *
+ * Requires __cache_lock.
+ */
+static void __slab_free(kmem_cache_t* cache, void* object, kmem_slab_t** release) {
+    kmem_slab_t* slab = slab_of(cache, object);
+
+    slab_list_remove(slab_list(cache, slab), slab);
+    SLAB_LINK(cache, object) = slab->free_list;
+    slab->free_list = object;
+    --slab->in_use;
+
+    if (slab->in_use == 0) {
+        if (cache->empty_count >= SLAB_EMPTY_KEEP) {
+            ++cache->slabs_released;
+            slab->next = *release;
+            *release = slab;
+            return;
+        }
+        ++cache->empty_count;
+    }
+    slab_list_push(slab_list(cache, slab), slab);
+}
+
+static void slab_release_all(kmem_cache_t* cache, kmem_slab_t* release) {
+    while (release != NULL) {
+        kmem_slab_t* next = release->next;
+        slab_release(cache, release);
+        release = next;
+    }
+}
+
+/**
+ * Allocates object from slab layer, growing cache when there is no
+ * free object.
+ *
+ * Requires __cache_lock, returns with it released.
+ */
+static void* slab_alloc_unlock(kmem_cache_t* cache) {
+    void* object = __slab_alloc(cache);
+    proc_spinlock_unlock(&cache->__cache_lock);
+    if (object != NULL)
+        return object;
+
+    kmem_slab_t* slab = slab_create(cache);
+    if (slab == NULL)
+        return NULL;
+
+    proc_spinlock_lock(&cache->__cache_lock);
+    ++cache->slabs_allocated;
+    ++cache->empty_count;
+    slab_list_push(&cache->empty, slab);
+    object = __slab_alloc(cache);
+    proc_spinlock_unlock(&cache->__cache_lock);
+    return object;
+}
+
+/**
+ * Returns magazines of current cpu or NULL, if magazines can't be used.
+ *
+ * Magazines are only ever touched by owning cpu and kernel code is not
+ * preempted, so no lock is required.
+ */
+static kmem_cpu_cache_t* get_cpu_cache(kmem_cache_t* cache) {
+    if (!multiprocessing_ready || (cache->flags & SLAB_NO_MAGAZINES) != 0)
+        return NULL;
+    size_t id = get_current_cput()->insert_id;
+    if (id >= SLAB_MAX_CPUS)
+        return NULL;
+    return &cache->cpu[id];
+}
+
+static void kmem_magazine_ctor(void* object) {
+    kmem_magazine_t* magazine = (kmem_magazine_t*)object;
+    magazine->next = NULL;
+    magazine->rounds = 0;
+}
+
+void initialize_slab() {
+    kmem_cache_init(&kmem_cache_cache, "kmem_cache", sizeof(kmem_cache_t), 64,
+            NULL, SLAB_NO_MAGAZINES);
+    kmem_cache_init(&kmem_magazine_cache, "kmem_magazine", sizeof(kmem_magazine_t), 64,
+            &kmem_magazine_ctor, SLAB_NO_MAGAZINES);
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align,
+        kmem_ctor_t ctor, uint32_t flags) {
+    kmem_cache_t* cache = kmem_cache_alloc(&kmem_cache_cache);
+    if (cache == NULL)
+        return NULL;
+    if (!kmem_cache_init(cache, name, size, align, ctor, flags)) {
+        kmem_cache_free(&kmem_cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/**
+ * Allocation is served from loaded magazine, then previous magazine, then
+ * full magazine from depot and only then from slabs.
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    kmem_cpu_cache_t* cc = get_cpu_cache(cache);
+    if (cc != NULL) {
+        if (cc->loaded != NULL && cc->loaded->rounds > 0)
+            return cc->loaded->objects[--cc->loaded->rounds];
+
+        if (cc->previous != NULL && cc->previous->rounds > 0) {
+            kmem_magazine_t* tmp = cc->loaded;
+            cc->loaded = cc->previous;
+            cc->previous = tmp;
+            return cc->loaded->objects[--cc->loaded->rounds];
+        }
+    }
+
+    proc_spinlock_lock(&cache->__cache_lock);
+    if (cc != NULL && cache->depot_full != NULL) {
+        kmem_magazine_t* full = cache->depot_full;
+        cache->depot_full = full->next;
+        --cache->depot_full_count;
+        if (cc->previous != NULL) {
+            cc->previous->next = cache->depot_empty;
+            cache->depot_empty = cc->previous;
+        }
+        cc->previous = cc->loaded;
+        cc->loaded = full;
+        proc_spinlock_unlock(&cache->__cache_lock);
+        return cc->loaded->objects[--cc->loaded->rounds];
+    }
+    return slab_alloc_unlock(cache);
+}
+
+/**
+ * Free goes to loaded magazine, then previous magazine if it is empty,
+ * then to an empty magazine exchanged with depot. Once depot holds
+ * SLAB_DEPOT_SIZE full magazines, objects go back to their slabs.
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    if (object == NULL)
+        return;
+
+    kmem_cpu_cache_t* cc = get_cpu_cache(cache);
+    if (cc != NULL) {
+        if (cc->loaded != NULL && cc->loaded->rounds < SLAB_MAGAZINE_SIZE) {
+            cc->loaded->objects[cc->loaded->rounds++] = object;
+            return;
+        }
+
+        if (cc->previous != NULL && cc->previous->rounds == 0) {
+            kmem_magazine_t* tmp = cc->loaded;
+            cc->loaded = cc->previous;
+            cc->previous = tmp;
+            cc->loaded->objects[cc->loaded->rounds++] = object;
+            return;
+        }
+    }
+
+    kmem_slab_t* release = NULL;
+    proc_spinlock_lock(&cache->__cache_lock);
+    if (cc != NULL && cache->depot_full_count < SLAB_DEPOT_SIZE) {
+        kmem_magazine_t* empty = cache->depot_empty;
+        if (empty != NULL) {
+            cache->depot_empty = empty->next;
+        } else {
+            proc_spinlock_unlock(&cache->__cache_lock);
+            empty = kmem_cache_alloc(&kmem_magazine_cache);
+            proc_spinlock_lock(&cache->__cache_lock);
+        }
+
+        if (empty != NULL) {
+            if (cc->previous != NULL) {
+                cc->previous->next = cache->depot_full;
+                cache->depot_full = cc->previous;
+                ++cache->depot_full_count;
+            }
+            cc->previous = cc->loaded;
+            cc->loaded = empty;
+            proc_spinlock_unlock(&cache->__cache_lock);
+            cc->loaded->objects[cc->loaded->rounds++] = object;
+            return;
+        }
+    }
+
+    __slab_free(cache, object, &release);
+    proc_spinlock_unlock(&cache->__cache_lock);
+    slab_release_all(cache, release);
+}
+
+void kmem_cache_reap(kmem_cache_t* cache) {
+    kmem_slab_t* release = NULL;
+
+    proc_spinlock_lock(&cache->__cache_lock);
+    kmem_magazine_t* magazines = cache->depot_empty;
+    cache->depot_empty = NULL;
+    while (cache->depot_full != NULL) {
+        kmem_magazine_t* full = cache->depot_full;
+        cache->depot_full = full->next;
+        while (full->rounds > 0)
+            __slab_free(cache, full->objects[--full->rounds], &release);
+        full->next = magazines;
+        magazines = full;
+    }
+    cache->depot_full_count = 0;
+
+    while (cache->empty != NULL) {
+        kmem_slab_t* slab = cache->empty;
+        slab_list_remove(&cache->empty, slab);
+        ++cache->slabs_released;
+        slab->next = release;
+        release = slab;
+    }
+    cache->empty_count = 0;
+    proc_spinlock_unlock(&cache->__cache_lock);
+
+    while (magazines != NULL) {
+        kmem_magazine_t* next = magazines->next;
+        magazines->next = NULL;
+        kmem_cache_free(&kmem_magazine_cache, magazines);
+        magazines = next;
+    }
+    slab_release_all(cache, release);
+}
@@ -0,0 +1,139 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * slab.h
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: typed object caches for kernel objects
+ */
+#pragma once
+
+#include "../commons.h"
+#include "paging.h"
+
+/** Maximum buddy order of single slab */
+#define SLAB_MAX_ORDER (4)
+/** Slab is grown until it holds at least this many objects or reaches SLAB_MAX_ORDER */
+#define SLAB_MIN_OBJECTS (8)
+/** Number of objects held by one magazine */
+#define SLAB_MAGAZINE_SIZE (14)
+/** Full magazines kept in depot, further frees go back to slabs */
+#define SLAB_DEPOT_SIZE (16)
+/** Empty slabs kept by cache, further empty slabs are returned to frame allocator */
+#define SLAB_EMPTY_KEEP (1)
+/** Maximum number of cpus with magazines */
+#define SLAB_MAX_CPUS (256)
+
+/** Cache has no magazine layer, every operation goes to slabs */
+#define SLAB_NO_MAGAZINES (1<<0)
+
+/**
+ * Object constructor, called once when slab is created. Objects
+ * must be returned to cache in constructed state.
+ */
+typedef void (*kmem_ctor_t)(void* object);
+
+typedef struct kmem_magazine {
+    struct kmem_magazine* next;
+    size_t                rounds;
+    void*                 objects[SLAB_MAGAZINE_SIZE];
+} kmem_magazine_t;
+
+/**
+ * Slab header, placed at the start of the slab block. Slab of an
+ * object is found by aligning object address down to slab size.
+ */
+typedef struct kmem_slab {
+    struct kmem_cache* cache;
+    struct kmem_slab*  next;
+    struct kmem_slab*  prev;
+    void*              free_list;
+    size_t             in_use;
+} kmem_slab_t;
+
+/**
+ * Per cpu magazines, only ever touched by owning cpu.
+ */
+typedef struct kmem_cpu_cache {
+    kmem_magazine_t* loaded;
+    kmem_magazine_t* previous;
+} kmem_cpu_cache_t;
+
+typedef struct kmem_cache {
+    const char* name;
+    size_t      size;
+    size_t      stride;  // distance between objects
+    size_t      offset;  // offset of free list link inside object slot
+    size_t      start;   // offset of first object in slab
+    size_t      objects; // objects per slab
+    uint8_t     order;
+    uint32_t    flags;
+    kmem_ctor_t ctor;
+
+    volatile ruint_t __cache_lock;
+    kmem_slab_t* partial;
+    kmem_slab_t* full;
+    kmem_slab_t* empty;
+    size_t       empty_count;
+
+    /* depot, guarded by __cache_lock */
+    kmem_magazine_t* depot_full;
+    kmem_magazine_t* depot_empty;
+    size_t           depot_full_count;
+
+    size_t slabs_allocated;
+    size_t slabs_released;
+
+    kmem_cpu_cache_t cpu[SLAB_MAX_CPUS];
+} kmem_cache_t;
+
+/**
+ * Initializes caches of caches and magazines.
+ *
+ * Requires memory mirror, slabs are accessed through it.
+ */
+void initialize_slab();
+
+/**
+ * Creates new object cache for objects of size size, aligned to align.
+ *
+ * ctor can be NULL. Returns NULL if there is no memory.
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align,
+        kmem_ctor_t ctor, uint32_t flags);
+
+/**
+ * Allocates object from cache, returns NULL if there is no memory.
+ *
+ * Object is not cleared, it is in constructed state or undefined if cache
+ * has no constructor.
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+/**
+ * Returns object to its cache. NULL is ignored.
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* object);
+
+/**
+ * Returns full magazines of depot and all empty slabs to frame allocator.
+ */
+void kmem_cache_reap(kmem_cache_t* cache);
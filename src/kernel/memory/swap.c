@@ -0,0 +1,180 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * swap.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: swap area on page sized block device
+ */
+
+#include "swap.h"
+#include "paging.h"
+
+extern void proc_spinlock_lock(volatile void* memaddr);
+extern void proc_spinlock_unlock(volatile void* memaddr);
+
+swap_stats_t swap_stats;
+
+static swap_device_t* swap_device;
+/** References of every slot, 0 is free slot */
+static uint32_t* slot_refs;
+/** Stack of free slots */
+static uint32_t* free_slots;
+static size_t    free_slot_count;
+/** Guards slot_refs and free_slots, taken after any paging lock */
+static volatile ruint_t __swap_lock;
+
+typedef struct ramdisk {
+    size_t   chunks;
+    puint_t* chunk_frames; // LARGE_PAGE_ORDER blocks of frames
+} ramdisk_t;
+
+static void* ramdisk_block(swap_device_t* device, size_t block) {
+    ramdisk_t* rd = (ramdisk_t*)device->data;
+    puint_t chunk = rd->chunk_frames[block / (LARGE_PAGE_SIZE / 0x1000)];
+    return (void*)physical_to_virtual(chunk + (block % (LARGE_PAGE_SIZE / 0x1000)) * 0x1000);
+}
+
+static bool ramdisk_read(swap_device_t* device, size_t block, puint_t frame) {
+    memcpy((void*)physical_to_virtual(frame), ramdisk_block(device, block), 0x1000);
+    return true;
+}
+
+static bool ramdisk_write(swap_device_t* device, size_t block, puint_t frame) {
+    memcpy(ramdisk_block(device, block), (void*)physical_to_virtual(frame), 0x1000);
+    return true;
+}
+
+swap_device_t* create_ramdisk_swap(size_t pages) {
+    size_t per_chunk = LARGE_PAGE_SIZE / 0x1000;
+    size_t chunks = (pages + per_chunk - 1) / per_chunk;
+
+    swap_device_t* device = malloc(sizeof(swap_device_t));
+    ramdisk_t* rd = malloc(sizeof(ramdisk_t));
+    puint_t* chunk_frames = malloc(sizeof(puint_t) * chunks);
+    if (device == NULL || rd == NULL || chunk_frames == NULL) {
+        free(device);
+        free(rd);
+        free(chunk_frames);
+        return NULL;
+    }
+
+    // ram disk is as big as frame pool allows
+    size_t allocated = 0;
+    for (; allocated < chunks; allocated++) {
+        chunk_frames[allocated] = alloc_frames(LARGE_PAGE_ORDER);
+        if (chunk_frames[allocated] == 0)
+            break;
+    }
+    if (allocated == 0) {
+        free(device);
+        free(rd);
+        free(chunk_frames);
+        return NULL;
+    }
+
+    rd->chunks = allocated;
+    rd->chunk_frames = chunk_frames;
+    device->name = "ramdisk";
+    device->blocks = allocated * per_chunk;
+    device->read = ramdisk_read;
+    device->write = ramdisk_write;
+    device->data = rd;
+    return device;
+}
+
+bool swap_attach(swap_device_t* device) {
+    uint32_t* refs = malloc(sizeof(uint32_t) * device->blocks);
+    uint32_t* slots = malloc(sizeof(uint32_t) * device->blocks);
+    if (refs == NULL || slots == NULL) {
+        free(refs);
+        free(slots);
+        return false;
+    }
+    memset(refs, 0, sizeof(uint32_t) * device->blocks);
+    // lowest slots are handed out first
+    for (size_t i=0; i<device->blocks; i++)
+        slots[i] = (uint32_t)(device->blocks - 1 - i);
+
+    proc_spinlock_lock(&__swap_lock);
+    uint32_t* old_refs = slot_refs;
+    uint32_t* old_slots = free_slots;
+    swap_device = device;
+    slot_refs = refs;
+    free_slots = slots;
+    free_slot_count = device->blocks;
+    swap_stats.slots = device->blocks;
+    swap_stats.slots_used = 0;
+    proc_spinlock_unlock(&__swap_lock);
+
+    free(old_refs);
+    free(old_slots);
+    return true;
+}
+
+void initialize_swap() {
+    __swap_lock = 0;
+    memset(&swap_stats, 0, sizeof(swap_stats_t));
+    swap_device = NULL;
+    slot_refs = NULL;
+    free_slots = NULL;
+    free_slot_count = 0;
+
+    // TODO: replace with swap partition once there are block device drivers
+    swap_device_t* device = create_ramdisk_swap(SWAP_RAMDISK_PAGES);
+    if (device != NULL)
+        swap_attach(device);
+}
+
+int64_t swap_slot_alloc() {
+    int64_t slot = -1;
+    proc_spinlock_lock(&__swap_lock);
+    if (free_slot_count > 0) {
+        slot = free_slots[--free_slot_count];
+        slot_refs[slot] = 1;
+        ++swap_stats.slots_used;
+    }
+    proc_spinlock_unlock(&__swap_lock);
+    return slot;
+}
+
+void swap_slot_get(size_t slot) {
+    proc_spinlock_lock(&__swap_lock);
+    ++slot_refs[slot];
+    proc_spinlock_unlock(&__swap_lock);
+}
+
+void swap_slot_put(size_t slot) {
+    proc_spinlock_lock(&__swap_lock);
+    if (--slot_refs[slot] == 0) {
+        free_slots[free_slot_count++] = (uint32_t)slot;
+        --swap_stats.slots_used;
+    }
+    proc_spinlock_unlock(&__swap_lock);
+}
+
+bool swap_write(size_t slot, puint_t frame) {
+    return swap_device->write(swap_device, slot, frame);
+}
+
+bool swap_read(size_t slot, puint_t frame) {
+    return swap_device->read(swap_device, slot, frame);
+}
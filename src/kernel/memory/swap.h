@@ -0,0 +1,110 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * swap.h
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: swap area on page sized block device
+ */
+#pragma once
+
+#include "../commons.h"
+
+/** Size of RAM disk standing in for swap block device, in pages */
+#define SWAP_RAMDISK_PAGES (0x1000)
+/** Marks frame without swap copy, see frame_info_t swap_slot */
+#define SWAP_SLOT_NONE (0)
+
+typedef struct swap_device swap_device_t;
+
+/**
+ * Transfers single page between block of swap device and frame.
+ */
+typedef bool (*swap_io_t)(swap_device_t* device, size_t block, puint_t frame);
+
+/**
+ * Block device holding swap area, blocks are page sized.
+ */
+struct swap_device {
+    const char* name;
+    size_t      blocks;
+    swap_io_t   read;
+    swap_io_t   write;
+    void*       data;
+};
+
+/** Swap statistics */
+typedef struct swap_stats {
+    uint64_t slots;      // slots of swap area
+    uint64_t slots_used; // slots referenced by page entries or clean frames
+    uint64_t pages_out;  // pages written to swap area
+    uint64_t clean_out;  // pages swapped out without write, their swap copy was still valid
+    uint64_t pages_in;   // pages read back from swap area
+    uint64_t scanned;    // pages checked by swapper
+    uint64_t referenced; // pages given second chance because they were accessed
+} swap_stats_t;
+
+extern swap_stats_t swap_stats;
+
+/**
+ * Initializes swap area on RAM disk stand in.
+ *
+ * Requires kernel heap and frame pool.
+ */
+void initialize_swap();
+
+/**
+ * Creates RAM disk swap device of pages pages backed by frames from frame
+ * pool. Returns NULL if there is no memory.
+ */
+swap_device_t* create_ramdisk_swap(size_t pages);
+
+/**
+ * Makes device the swap area, one slot per device block. Slots of previous
+ * device must not be in use. Returns false if there is no memory.
+ */
+bool swap_attach(swap_device_t* device);
+
+/**
+ * Allocates swap slot with single reference. Returns -1 if swap area is full.
+ */
+int64_t swap_slot_alloc();
+
+/**
+ * Adds reference to swap slot, slot is shared by another page entry.
+ */
+void swap_slot_get(size_t slot);
+
+/**
+ * Releases reference of swap slot, slot is freed with last reference.
+ */
+void swap_slot_put(size_t slot);
+
+/**
+ * Writes frame to swap slot, slot must be referenced by caller.
+ */
+bool swap_write(size_t slot, puint_t frame);
+
+/**
+ * Reads swap slot into frame. Read data is only valid if slot was referenced
+ * for whole read, caller checks the page entry again afterwards.
+ */
+bool swap_read(size_t slot, puint_t frame);
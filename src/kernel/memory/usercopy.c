@@ -0,0 +1,161 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * usercopy.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: copying between kernel and user memory
+ */
+
+#include "usercopy.h"
+#include "paging.h"
+#include "swap.h"
+#include "../cpus/cpu_mgmt.h"
+#include "../processes/process.h"
+#include "../syscalls/sys.h"
+
+/**
+ * Returns whether whole range lies in user half of address space.
+ */
+static bool user_range(const void* address, size_t n) {
+    uintptr_t start = (uintptr_t)address;
+    return start < USER_SPACE_END && n <= USER_SPACE_END - start;
+}
+
+/**
+ * Aborts user copy in progress, jumps back to its setjmp.
+ */
+static void abort_user_copy(jmp_buf b, void* fa, ruint_t errcode) {
+    longjmp(b, 1);
+}
+
+bool user_copy_fault(void* fa, ruint_t errcode) {
+    cpu_t* cpu = get_current_cput();
+    if (cpu->pf_handler.handler == NULL)
+        return false;
+
+    // fault is only expected on user memory, resolve it like user fault
+    if ((uintptr_t)fa < USER_SPACE_END && !cpu->pf_handler.nofault) {
+        faultstate_t state;
+        while ((state = page_fault((uintptr_t)fa, errcode)) == fs_nomem) {
+            if (swapper_reclaim(SWAP_OUT_BATCH) == 0)
+                break;
+        }
+        if (state == fs_resolved)
+            return true;
+        if (state == fs_nomem && cpu->ct != NULL) {
+            // user copies are only done by system calls, call is resumed
+            // via continuation once there is memory (see swapper_wait)
+            cpu->ct->continuation->present = true;
+        }
+    }
+
+    jmp_handler_t handler = cpu->pf_handler.handler;
+    cpu->pf_handler.handler = NULL;
+    handler(cpu->pf_handler.jmp, fa, errcode);
+    return true;
+}
+
+bool copy_from_user(void* to, const void* from, size_t n) {
+    if (!user_range(from, n))
+        return false;
+
+    cpu_t* cpu = get_current_cput();
+    if (setjmp(cpu->pf_handler.jmp) != 0)
+        return false;
+
+    cpu->pf_handler.handler = abort_user_copy;
+    memcpy(to, from, n);
+    cpu->pf_handler.handler = NULL;
+    return true;
+}
+
+bool copy_from_user_nofault(void* to, const void* from, size_t n) {
+    if (!user_range(from, n))
+        return false;
+
+    cpu_t* cpu = get_current_cput();
+    if (setjmp(cpu->pf_handler.jmp) != 0) {
+        cpu->pf_handler.nofault = false;
+        return false;
+    }
+
+    cpu->pf_handler.nofault = true;
+    cpu->pf_handler.handler = abort_user_copy;
+    memcpy(to, from, n);
+    cpu->pf_handler.handler = NULL;
+    cpu->pf_handler.nofault = false;
+    return true;
+}
+
+bool copy_to_user(void* to, const void* from, size_t n) {
+    if (!user_range(to, n))
+        return false;
+
+    cpu_t* cpu = get_current_cput();
+    if (setjmp(cpu->pf_handler.jmp) != 0)
+        return false;
+
+    cpu->pf_handler.handler = abort_user_copy;
+    memcpy(to, from, n);
+    cpu->pf_handler.handler = NULL;
+    return true;
+}
+
+bool clear_user(void* to, size_t n) {
+    if (!user_range(to, n))
+        return false;
+
+    cpu_t* cpu = get_current_cput();
+    if (setjmp(cpu->pf_handler.jmp) != 0)
+        return false;
+
+    cpu->pf_handler.handler = abort_user_copy;
+    memset(to, 0, n);
+    cpu->pf_handler.handler = NULL;
+    return true;
+}
+
+int64_t strncpy_from_user(char* to, const char* from, size_t n) {
+    if (!user_range(from, 1))
+        return -1;
+    // string must end before kernel half
+    size_t limit = USER_SPACE_END - (uintptr_t)from;
+
+    cpu_t* cpu = get_current_cput();
+    if (setjmp(cpu->pf_handler.jmp) != 0)
+        return -1;
+
+    cpu->pf_handler.handler = abort_user_copy;
+    size_t len = 0;
+    while (len < n) {
+        if (len == limit) {
+            cpu->pf_handler.handler = NULL;
+            return -1;
+        }
+        to[len] = from[len];
+        if (to[len] == '\0')
+            break;
+        ++len;
+    }
+    cpu->pf_handler.handler = NULL;
+    return (int64_t)len;
+}
@@ -0,0 +1,80 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * usercopy.h
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: copying between kernel and user memory
+ */
+#pragma once
+
+#include "../commons.h"
+
+/** First address above user half of address space */
+#define USER_SPACE_END  (0x0000800000000000UL)
+/** Maximum length of string accepted from user, including terminator */
+#define USER_STRING_MAX (0x1000)
+
+/**
+ * Copies n bytes from user address from to kernel buffer to.
+ *
+ * User memory is touched directly, page faults are resolved lazily by page
+ * fault handler (allocate on demand, copy on write). Returns false if source
+ * is not user memory or fault could not be resolved, to is then partially
+ * filled. Must not be called with spinlocks held, since fault resolution
+ * might need TLB shootdown.
+ */
+bool copy_from_user(void* to, const void* from, size_t n);
+
+/**
+ * Copies n bytes from user address from like copy_from_user, but any page
+ * fault aborts the copy instead of being resolved. Can be called with
+ * spinlocks held, caller faults the memory in with copy_from_user and retries.
+ */
+bool copy_from_user_nofault(void* to, const void* from, size_t n);
+
+/**
+ * Copies n bytes from kernel buffer from to user address to, see copy_from_user.
+ */
+bool copy_to_user(void* to, const void* from, size_t n);
+
+/**
+ * Clears n bytes at user address to, see copy_from_user.
+ */
+bool clear_user(void* to, size_t n);
+
+/**
+ * Copies string from user address from to kernel buffer to of size n.
+ *
+ * Returns length of string without terminator. If string is not terminated
+ * within n bytes, returns n and to is not terminated. Returns -1 if string is
+ * not in user memory or fault could not be resolved, see copy_from_user.
+ */
+int64_t strncpy_from_user(char* to, const char* from, size_t n);
+
+/**
+ * Handles page fault caused by kernel at address fa.
+ *
+ * If fault happened inside of user copy, it is either resolved or user copy
+ * is aborted and this never returns. Returns false if fault is not caused
+ * by user copy.
+ */
+bool user_copy_fault(void* fa, ruint_t errcode);
@@ -0,0 +1,325 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * vmem.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: virtual address range arenas
+ */
+
+#include "vmem.h"
+
+extern void proc_spinlock_lock(volatile void* memaddr);
+extern void proc_spinlock_unlock(volatile void* memaddr);
+
+/** Boundary tags of all arenas */
+static kmem_cache_t* vmem_segment_cache;
+
+/**
+ * Returns index of highest set bit, size must not be 0.
+ */
+static size_t highbit(size_t size) {
+    return 63 - __builtin_clzl(size);
+}
+
+static void freelist_insert(vmem_t* arena, vmem_segment_t* segment) {
+    size_t idx = highbit(segment->size);
+    segment->list_prev = NULL;
+    segment->list_next = arena->freelist[idx];
+    if (arena->freelist[idx] != NULL)
+        arena->freelist[idx]->list_prev = segment;
+    arena->freelist[idx] = segment;
+    arena->freemap |= 1UL << idx;
+}
+
+static void freelist_remove(vmem_t* arena, vmem_segment_t* segment) {
+    size_t idx = highbit(segment->size);
+    if (segment->list_prev != NULL)
+        segment->list_prev->list_next = segment->list_next;
+    else
+        arena->freelist[idx] = segment->list_next;
+    if (segment->list_next != NULL)
+        segment->list_next->list_prev = segment->list_prev;
+    if (arena->freelist[idx] == NULL)
+        arena->freemap &= ~(1UL << idx);
+}
+
+static vmem_segment_t** hash_bucket(vmem_t* arena, uintptr_t base) {
+    return &arena->hash[(base / arena->quantum) % VMEM_HASH_SIZE];
+}
+
+static void hash_insert(vmem_t* arena, vmem_segment_t* segment) {
+    vmem_segment_t** bucket = hash_bucket(arena, segment->base);
+    segment->list_prev = NULL;
+    segment->list_next = *bucket;
+    if (*bucket != NULL)
+        (*bucket)->list_prev = segment;
+    *bucket = segment;
+}
+
+static void hash_remove(vmem_t* arena, vmem_segment_t* segment) {
+    if (segment->list_prev != NULL)
+        segment->list_prev->list_next = segment->list_next;
+    else
+        *hash_bucket(arena, segment->base) = segment->list_next;
+    if (segment->list_next != NULL)
+        segment->list_next->list_prev = segment->list_prev;
+}
+
+static vmem_segment_t* hash_lookup(vmem_t* arena, uintptr_t base) {
+    vmem_segment_t* segment = *hash_bucket(arena, base);
+    while (segment != NULL && segment->base != base)
+        segment = segment->list_next;
+    return segment;
+}
+
+/**
+ * Inserts segment into address ordered list right after prev, or as
+ * first segment if prev is NULL.
+ */
+static void segment_insert(vmem_t* arena, vmem_segment_t* prev, vmem_segment_t* segment) {
+    segment->prev = prev;
+    segment->next = prev == NULL ? arena->segments : prev->next;
+    if (segment->next != NULL)
+        segment->next->prev = segment;
+    if (prev == NULL)
+        arena->segments = segment;
+    else
+        prev->next = segment;
+}
+
+static void segment_unlink(vmem_t* arena, vmem_segment_t* segment) {
+    if (segment->prev != NULL)
+        segment->prev->next = segment->next;
+    else
+        arena->segments = segment->next;
+    if (segment->next != NULL)
+        segment->next->prev = segment->prev;
+}
+
+static bool segment_fits(vmem_segment_t* segment, size_t size, size_t align) {
+    uintptr_t start = ALIGN_UP(segment->base, align);
+    return start + size <= segment->base + segment->size;
+}
+
+/**
+ * Finds free segment for allocation.
+ *
+ * Without alignment, first segment of smallest free list whose every
+ * segment is large enough is used (instant fit). Otherwise free lists that
+ * can hold large enough segment are searched first fit.
+ */
+static vmem_segment_t* find_fit(vmem_t* arena, size_t size, size_t align) {
+    size_t idx = highbit(size);
+    if (align == arena->quantum) {
+        size_t fit = (size & (size-1)) == 0 ? idx : idx+1;
+        uint64_t map = fit < 64 ? arena->freemap & (~0UL << fit) : 0;
+        if (map != 0)
+            return arena->freelist[__builtin_ctzl(map)];
+    }
+
+    for (; idx < VMEM_FREELISTS; idx++) {
+        if ((arena->freemap & (1UL << idx)) == 0)
+            continue;
+        for (vmem_segment_t* segment = arena->freelist[idx]; segment != NULL;
+                segment = segment->list_next) {
+            if (segment_fits(segment, size, align))
+                return segment;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Creates new boundary tag, slab never calls back into arenas, so
+ * it is safe to call with __vmem_lock held.
+ */
+static vmem_segment_t* segment_create(uintptr_t base, size_t size, uint8_t type) {
+    vmem_segment_t* segment = kmem_cache_alloc(vmem_segment_cache);
+    if (segment == NULL)
+        return NULL;
+    memset(segment, 0, sizeof(vmem_segment_t));
+    segment->base = base;
+    segment->size = size;
+    segment->type = type;
+    return segment;
+}
+
+bool vmem_init(vmem_t* arena, const char* name, uintptr_t base, size_t size, size_t quantum) {
+    memset(arena, 0, sizeof(vmem_t));
+    arena->name = name;
+    arena->quantum = quantum;
+
+    if (vmem_segment_cache == NULL) {
+        vmem_segment_cache = kmem_cache_create("vmem_segment", sizeof(vmem_segment_t), 8, NULL, 0);
+        if (vmem_segment_cache == NULL)
+            return false;
+    }
+
+    vmem_segment_t* segment = segment_create(base, size, VMEM_SEGMENT_FREE);
+    if (segment == NULL)
+        return false;
+    segment_insert(arena, NULL, segment);
+    freelist_insert(arena, segment);
+    arena->total = size;
+    return true;
+}
+
+uintptr_t vmem_alloc(vmem_t* arena, size_t size) {
+    return vmem_xalloc(arena, size, arena->quantum);
+}
+
+uintptr_t vmem_xalloc(vmem_t* arena, size_t size, size_t align) {
+    size = ALIGN_UP(size, arena->quantum);
+    if (size == 0)
+        return 0;
+    if (align < arena->quantum)
+        align = arena->quantum;
+
+    proc_spinlock_lock(&arena->__vmem_lock);
+    vmem_segment_t* segment = find_fit(arena, size, align);
+    if (segment == NULL) {
+        proc_spinlock_unlock(&arena->__vmem_lock);
+        return 0;
+    }
+
+    uintptr_t start = ALIGN_UP(segment->base, align);
+    vmem_segment_t* lead = NULL;
+    vmem_segment_t* tail = NULL;
+    if (start > segment->base) {
+        lead = segment_create(segment->base, start - segment->base, VMEM_SEGMENT_FREE);
+        if (lead == NULL)
+            goto nomem;
+    }
+    if (start + size < segment->base + segment->size) {
+        tail = segment_create(start + size, segment->base + segment->size - (start + size),
+                VMEM_SEGMENT_FREE);
+        if (tail == NULL)
+            goto nomem;
+    }
+
+    freelist_remove(arena, segment);
+    if (lead != NULL) {
+        segment_insert(arena, segment->prev, lead);
+        freelist_insert(arena, lead);
+    }
+    if (tail != NULL) {
+        segment_insert(arena, segment, tail);
+        freelist_insert(arena, tail);
+    }
+    segment->base = start;
+    segment->size = size;
+    segment->type = VMEM_SEGMENT_ALLOCATED;
+    hash_insert(arena, segment);
+    arena->in_use += size;
+    proc_spinlock_unlock(&arena->__vmem_lock);
+    return start;
+
+nomem:
+    kmem_cache_free(vmem_segment_cache, lead);
+    proc_spinlock_unlock(&arena->__vmem_lock);
+    return 0;
+}
+
+/**
+ * Returns allocated segment containing address or NULL.
+ */
+static vmem_segment_t* find_allocated(vmem_t* arena, uintptr_t address) {
+    vmem_segment_t* segment = hash_lookup(arena, address);
+    if (segment != NULL)
+        return segment;
+
+    for (segment = arena->segments; segment != NULL; segment = segment->next) {
+        if (segment->base > address)
+            break;
+        if (segment->type == VMEM_SEGMENT_ALLOCATED && address < segment->base + segment->size)
+            return segment;
+    }
+    return NULL;
+}
+
+void vmem_free(vmem_t* arena, uintptr_t address, size_t size) {
+    size += address % arena->quantum;
+    address = ALIGN_DOWN(address, arena->quantum);
+    size = ALIGN_UP(size, arena->quantum);
+    if (size == 0)
+        return;
+
+    proc_spinlock_lock(&arena->__vmem_lock);
+    vmem_segment_t* segment = find_allocated(arena, address);
+    if (segment == NULL || address + size > segment->base + segment->size) {
+        proc_spinlock_unlock(&arena->__vmem_lock);
+        return;
+    }
+
+    // only part of segment is released, rest stays allocated
+    vmem_segment_t* freed = segment;
+    vmem_segment_t* tail = NULL;
+    if (address > segment->base) {
+        freed = segment_create(address, size, VMEM_SEGMENT_FREE);
+        if (freed == NULL)
+            goto nomem;
+    }
+    if (address + size < segment->base + segment->size) {
+        tail = segment_create(address + size, segment->base + segment->size - (address + size),
+                VMEM_SEGMENT_ALLOCATED);
+        if (tail == NULL)
+            goto nomem;
+    }
+
+    if (freed == segment)
+        hash_remove(arena, segment);
+    else
+        segment_insert(arena, segment, freed);
+    if (tail != NULL) {
+        segment_insert(arena, freed, tail);
+        hash_insert(arena, tail);
+    }
+    if (freed != segment)
+        segment->size = address - segment->base;
+    freed->size = size;
+    freed->type = VMEM_SEGMENT_FREE;
+    arena->in_use -= size;
+
+    vmem_segment_t* next = freed->next;
+    if (next != NULL && next->type == VMEM_SEGMENT_FREE && next->base == freed->base + freed->size) {
+        freelist_remove(arena, next);
+        freed->size += next->size;
+        segment_unlink(arena, next);
+        kmem_cache_free(vmem_segment_cache, next);
+    }
+    vmem_segment_t* prev = freed->prev;
+    if (prev != NULL && prev->type == VMEM_SEGMENT_FREE && prev->base + prev->size == freed->base) {
+        freelist_remove(arena, prev);
+        prev->size += freed->size;
+        segment_unlink(arena, freed);
+        kmem_cache_free(vmem_segment_cache, freed);
+        freed = prev;
+    }
+    freelist_insert(arena, freed);
+    proc_spinlock_unlock(&arena->__vmem_lock);
+    return;
+
+nomem:
+    if (freed != segment)
+        kmem_cache_free(vmem_segment_cache, freed);
+    proc_spinlock_unlock(&arena->__vmem_lock);
+}
@@ -0,0 +1,101 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+ * FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * vmem.h
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: virtual address range arenas
+ */
+#pragma once
+
+#include "../commons.h"
+#include "slab.h"
+
+/** Number of power of two free lists */
+#define VMEM_FREELISTS (64)
+/** Number of buckets of allocated segment hash */
+#define VMEM_HASH_SIZE (1024)
+
+#define VMEM_SEGMENT_FREE      (0)
+#define VMEM_SEGMENT_ALLOCATED (1)
+
+/**
+ * Boundary tag of one segment of arena.
+ *
+ * Segments are kept in address order, free segments are also in free list
+ * of their size, allocated segments are in hash chain of their base.
+ */
+typedef struct vmem_segment {
+    uintptr_t base;
+    size_t    size;
+    uint8_t   type;
+    struct vmem_segment* prev;
+    struct vmem_segment* next;
+    struct vmem_segment* list_prev;
+    struct vmem_segment* list_next;
+} vmem_segment_t;
+
+typedef struct vmem {
+    const char* name;
+    size_t      quantum;
+
+    volatile ruint_t __vmem_lock;
+    vmem_segment_t*  segments;
+    vmem_segment_t*  freelist[VMEM_FREELISTS];
+    uint64_t         freemap; // bit i is set if freelist[i] is not empty
+    vmem_segment_t*  hash[VMEM_HASH_SIZE];
+
+    size_t total;
+    size_t in_use;
+} vmem_t;
+
+/**
+ * Initializes arena covering range base to base+size, managed in quantum
+ * sized units. Returns false if there is no memory for boundary tags.
+ *
+ * Boundary tags are allocated from slab, so arena never recurses into
+ * the heap it manages.
+ */
+bool vmem_init(vmem_t* arena, const char* name, uintptr_t base, size_t size, size_t quantum);
+
+/**
+ * Allocates size bytes of address range, rounded up to quantum.
+ *
+ * Returns 0 if arena has no free range large enough.
+ */
+uintptr_t vmem_alloc(vmem_t* arena, size_t size);
+
+/**
+ * Allocates size bytes of address range aligned to align, which must
+ * be multiple of quantum.
+ *
+ * Returns 0 if arena has no free range large enough.
+ */
+uintptr_t vmem_xalloc(vmem_t* arena, size_t size, size_t align);
+
+/**
+ * Returns address range to arena, freed range is coalesced with its free
+ * neighbours.
+ *
+ * Range must lie within a single allocated segment, part of segment can
+ * be released.
+ */
+void vmem_free(vmem_t* arena, uintptr_t address, size_t size);
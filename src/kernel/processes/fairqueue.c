@@ -0,0 +1,336 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * fairqueue.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: fair scheduling class ordered by virtual runtime
+ */
+
+#include "fairqueue.h"
+#include "runqueue.h"
+#include "../interrupts/clock.h"
+
+extern uint64_t read_tsc();
+extern void proc_spinlock_lock(volatile void* memaddr);
+extern void proc_spinlock_unlock(volatile void* memaddr);
+
+/** Weight of thread priority, every level gets about 1.4 times share of next one */
+static const uint64_t fair_weights[RUNQ_PRIORITIES] = { 2048, 1448, 1024, 724, 512 };
+
+void fair_queue_init(fair_queue_t* fq) {
+    memset(fq, 0, sizeof(fair_queue_t));
+}
+
+static void fair_replace_child(fair_queue_t* fq, thread_t* parent, thread_t* old,
+        thread_t* new) {
+    if (parent == NULL)
+        fq->root = new;
+    else if (parent->fair_left == old)
+        parent->fair_left = new;
+    else
+        parent->fair_right = new;
+}
+
+static void fair_rotate_left(fair_queue_t* fq, thread_t* t) {
+    thread_t* r = t->fair_right;
+    t->fair_right = r->fair_left;
+    if (r->fair_left != NULL)
+        r->fair_left->fair_parent = t;
+    r->fair_parent = t->fair_parent;
+    fair_replace_child(fq, t->fair_parent, t, r);
+    r->fair_left = t;
+    t->fair_parent = r;
+}
+
+static void fair_rotate_right(fair_queue_t* fq, thread_t* t) {
+    thread_t* l = t->fair_left;
+    t->fair_left = l->fair_right;
+    if (l->fair_right != NULL)
+        l->fair_right->fair_parent = t;
+    l->fair_parent = t->fair_parent;
+    fair_replace_child(fq, t->fair_parent, t, l);
+    l->fair_right = t;
+    t->fair_parent = l;
+}
+
+static bool fair_red(thread_t* t) {
+    return t != NULL && t->fair_red;
+}
+
+static void fair_insert_fixup(fair_queue_t* fq, thread_t* t) {
+    while (fair_red(t->fair_parent)) {
+        thread_t* parent = t->fair_parent;
+        thread_t* grandparent = parent->fair_parent;
+        if (parent == grandparent->fair_left) {
+            thread_t* uncle = grandparent->fair_right;
+            if (fair_red(uncle)) {
+                parent->fair_red = false;
+                uncle->fair_red = false;
+                grandparent->fair_red = true;
+                t = grandparent;
+                continue;
+            }
+            if (t == parent->fair_right) {
+                fair_rotate_left(fq, parent);
+                t = parent;
+                parent = t->fair_parent;
+            }
+            parent->fair_red = false;
+            grandparent->fair_red = true;
+            fair_rotate_right(fq, grandparent);
+        } else {
+            thread_t* uncle = grandparent->fair_left;
+            if (fair_red(uncle)) {
+                parent->fair_red = false;
+                uncle->fair_red = false;
+                grandparent->fair_red = true;
+                t = grandparent;
+                continue;
+            }
+            if (t == parent->fair_left) {
+                fair_rotate_right(fq, parent);
+                t = parent;
+                parent = t->fair_parent;
+            }
+            parent->fair_red = false;
+            grandparent->fair_red = true;
+            fair_rotate_left(fq, grandparent);
+        }
+    }
+    fq->root->fair_red = false;
+}
+
+static void fair_remove_fixup(fair_queue_t* fq, thread_t* t, thread_t* parent) {
+    while (t != fq->root && !fair_red(t)) {
+        if (t == parent->fair_left) {
+            thread_t* sibling = parent->fair_right;
+            if (fair_red(sibling)) {
+                sibling->fair_red = false;
+                parent->fair_red = true;
+                fair_rotate_left(fq, parent);
+                sibling = parent->fair_right;
+            }
+            if (!fair_red(sibling->fair_left) && !fair_red(sibling->fair_right)) {
+                sibling->fair_red = true;
+                t = parent;
+                parent = t->fair_parent;
+                continue;
+            }
+            if (!fair_red(sibling->fair_right)) {
+                sibling->fair_left->fair_red = false;
+                sibling->fair_red = true;
+                fair_rotate_right(fq, sibling);
+                sibling = parent->fair_right;
+            }
+            sibling->fair_red = parent->fair_red;
+            parent->fair_red = false;
+            sibling->fair_right->fair_red = false;
+            fair_rotate_left(fq, parent);
+        } else {
+            thread_t* sibling = parent->fair_left;
+            if (fair_red(sibling)) {
+                sibling->fair_red = false;
+                parent->fair_red = true;
+                fair_rotate_right(fq, parent);
+                sibling = parent->fair_left;
+            }
+            if (!fair_red(sibling->fair_left) && !fair_red(sibling->fair_right)) {
+                sibling->fair_red = true;
+                t = parent;
+                parent = t->fair_parent;
+                continue;
+            }
+            if (!fair_red(sibling->fair_left)) {
+                sibling->fair_right->fair_red = false;
+                sibling->fair_red = true;
+                fair_rotate_left(fq, sibling);
+                sibling = parent->fair_left;
+            }
+            sibling->fair_red = parent->fair_red;
+            parent->fair_red = false;
+            sibling->fair_left->fair_red = false;
+            fair_rotate_right(fq, parent);
+        }
+        t = fq->root;
+    }
+    if (t != NULL)
+        t->fair_red = false;
+}
+
+/**
+ * Inserts thread into tree, threads with same virtual runtime are kept in
+ * order they were inserted.
+ */
+static void fair_insert(fair_queue_t* fq, thread_t* t) {
+    thread_t* parent = NULL;
+    thread_t** link = &fq->root;
+    bool leftmost = true;
+    while (*link != NULL) {
+        parent = *link;
+        if (t->vruntime < parent->vruntime) {
+            link = &parent->fair_left;
+        } else {
+            link = &parent->fair_right;
+            leftmost = false;
+        }
+    }
+
+    t->fair_parent = parent;
+    t->fair_left = NULL;
+    t->fair_right = NULL;
+    t->fair_red = true;
+    *link = t;
+    if (leftmost)
+        fq->leftmost = t;
+    fair_insert_fixup(fq, t);
+}
+
+/**
+ * Removes leftmost thread from tree, it has no left child.
+ */
+static thread_t* fair_remove_leftmost(fair_queue_t* fq) {
+    thread_t* t = fq->leftmost;
+    if (t == NULL)
+        return NULL;
+
+    thread_t* child = t->fair_right;
+    thread_t* parent = t->fair_parent;
+    if (child != NULL) {
+        fq->leftmost = child;
+        while (fq->leftmost->fair_left != NULL)
+            fq->leftmost = fq->leftmost->fair_left;
+        child->fair_parent = parent;
+    } else {
+        fq->leftmost = parent;
+    }
+    fair_replace_child(fq, parent, t, child);
+    if (!t->fair_red)
+        fair_remove_fixup(fq, child, parent);
+
+    t->fair_parent = NULL;
+    t->fair_right = NULL;
+    return t;
+}
+
+/**
+ * Advances min_vruntime to lowest virtual runtime of running thread t and
+ * queued threads, t can be NULL.
+ */
+static void fair_update_min(fair_queue_t* fq, thread_t* t) {
+    uint64_t min = fq->min_vruntime;
+    bool set = false;
+    if (t != NULL) {
+        min = t->vruntime;
+        set = true;
+    }
+    if (fq->leftmost != NULL && (!set || fq->leftmost->vruntime < min))
+        min = fq->leftmost->vruntime;
+    if (min > fq->min_vruntime)
+        __atomic_store_n(&fq->min_vruntime, min, __ATOMIC_RELAXED);
+}
+
+static void fair_make_local(fair_queue_t* fq, thread_t* t) {
+    if (!t->vruntime_local) {
+        t->vruntime += fq->min_vruntime;
+        t->vruntime_local = true;
+    }
+}
+
+static void fair_make_relative(fair_queue_t* fq, thread_t* t) {
+    if (t->vruntime_local) {
+        t->vruntime = t->vruntime > fq->min_vruntime ? t->vruntime - fq->min_vruntime : 0;
+        t->vruntime_local = false;
+    }
+}
+
+void fair_queue_enqueue(fair_queue_t* fq, thread_t* t) {
+    proc_spinlock_lock(&fq->__lock);
+
+    fair_make_local(fq, t);
+    if (t->sleep_tsc != 0) {
+        // thread that slept competes as if it ran while cpu was busy, bounded
+        uint64_t credit = FAIR_SLEEPER_CREDIT_MS * tsc_per_ms;
+        uint64_t slept = read_tsc() - t->sleep_tsc;
+        if (slept < credit)
+            credit = slept;
+        uint64_t floor = fq->min_vruntime > FAIR_SLEEPER_CREDIT_MS * tsc_per_ms ?
+                fq->min_vruntime - FAIR_SLEEPER_CREDIT_MS * tsc_per_ms : 0;
+        t->vruntime = t->vruntime > credit ? t->vruntime - credit : 0;
+        if (t->vruntime < floor)
+            t->vruntime = floor;
+        t->sleep_tsc = 0;
+    }
+
+    fair_insert(fq, t);
+    ++fq->nr_running;
+    fq->load += RUNQ_WEIGHT(t->priority);
+
+    proc_spinlock_unlock(&fq->__lock);
+}
+
+thread_t* fair_queue_take(fair_queue_t* fq, bool migrate) {
+    if (__atomic_load_n(&fq->nr_running, __ATOMIC_RELAXED) == 0)
+        return NULL;
+
+    proc_spinlock_lock(&fq->__lock);
+    thread_t* t = fair_remove_leftmost(fq);
+    if (t != NULL) {
+        --fq->nr_running;
+        fq->load -= RUNQ_WEIGHT(t->priority);
+        if (migrate)
+            fair_make_relative(fq, t);
+    }
+    proc_spinlock_unlock(&fq->__lock);
+    return t;
+}
+
+void fair_queue_adopt(fair_queue_t* fq, thread_t* t) {
+    proc_spinlock_lock(&fq->__lock);
+    fair_make_local(fq, t);
+    proc_spinlock_unlock(&fq->__lock);
+}
+
+void fair_queue_detach(fair_queue_t* fq, thread_t* t) {
+    proc_spinlock_lock(&fq->__lock);
+    fair_make_relative(fq, t);
+    t->sleep_tsc = read_tsc();
+    proc_spinlock_unlock(&fq->__lock);
+}
+
+void fair_queue_charge(fair_queue_t* fq, thread_t* t, uint64_t delta) {
+    proc_spinlock_lock(&fq->__lock);
+    fair_make_local(fq, t);
+    t->vruntime += (delta * FAIR_WEIGHT_BASE) / fair_weights[t->priority];
+    fair_update_min(fq, t);
+    proc_spinlock_unlock(&fq->__lock);
+}
+
+bool fair_queue_should_preempt(fair_queue_t* fq, thread_t* t, uint64_t ran) {
+    if (ran < FAIR_GRANULARITY_MS * tsc_per_ms ||
+            __atomic_load_n(&fq->nr_running, __ATOMIC_RELAXED) == 0)
+        return false;
+
+    proc_spinlock_lock(&fq->__lock);
+    bool preempt = fq->leftmost != NULL && fq->leftmost->vruntime < t->vruntime;
+    proc_spinlock_unlock(&fq->__lock);
+    return preempt;
+}
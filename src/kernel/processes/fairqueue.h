@@ -0,0 +1,95 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * fairqueue.h
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: fair scheduling class ordered by virtual runtime
+ */
+
+#pragma once
+
+#include "../commons.h"
+#include "process.h"
+
+/** Weight of priority 2 thread, its virtual runtime advances with tsc */
+#define FAIR_WEIGHT_BASE (1024)
+/** Running thread is not preempted by fair thread before it ran this long */
+#define FAIR_GRANULARITY_MS (2)
+/** Most virtual runtime woken thread is credited for time it slept */
+#define FAIR_SLEEPER_CREDIT_MS (6)
+
+/**
+ * Fair threads of single cpu.
+ *
+ * Threads are kept in red black tree ordered by virtual runtime, which is
+ * tsc ticks run scaled by weight of thread priority. Thread with lowest
+ * virtual runtime runs next. Tree is guarded by __lock, since other cpus
+ * steal from it.
+ *
+ * Virtual runtime of thread is only comparable on cpu it is queued on.
+ * Thread leaving cpu keeps it relative to min_vruntime of that cpu.
+ */
+typedef struct fair_queue {
+    thread_t*         root;
+    thread_t*         leftmost;
+    volatile uint64_t min_vruntime; // only increases
+    volatile size_t   nr_running;  // queued threads, running one is not counted
+    volatile uint64_t load;        // sum of RUNQ_WEIGHT of queued threads
+    volatile ruint_t  __lock;
+} fair_queue_t;
+
+void fair_queue_init(fair_queue_t* fq);
+
+/**
+ * Queues thread. Relative virtual runtime is made absolute, woken thread
+ * is credited for time it slept.
+ */
+void fair_queue_enqueue(fair_queue_t* fq, thread_t* t);
+
+/**
+ * Removes thread with lowest virtual runtime or returns NULL.
+ *
+ * If migrate is set, thread leaves this cpu and its virtual runtime is
+ * made relative.
+ */
+thread_t* fair_queue_take(fair_queue_t* fq, bool migrate);
+
+/**
+ * Makes relative virtual runtime of thread that runs on this cpu absolute.
+ */
+void fair_queue_adopt(fair_queue_t* fq, thread_t* t);
+
+/**
+ * Thread running on this cpu blocked, its virtual runtime is made relative.
+ */
+void fair_queue_detach(fair_queue_t* fq, thread_t* t);
+
+/**
+ * Charges tsc ticks run by running fair thread t.
+ */
+void fair_queue_charge(fair_queue_t* fq, thread_t* t, uint64_t delta);
+
+/**
+ * Returns true if running thread t, that ran for ran tsc ticks, should give
+ * cpu to queued fair thread.
+ */
+bool fair_queue_should_preempt(fair_queue_t* fq, thread_t* t, uint64_t ran);
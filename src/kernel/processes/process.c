@@ -30,6 +30,7 @@
 #include "../interrupts/clock.h"
 #include "../utils/rsod.h"
 #include "../memory/paging.h"
+#include "../memory/swap.h"
 #include "scheduler.h"
 #include "../loader/elf.h"
 #include "../syscalls/sys.h"
@@ -49,10 +50,21 @@ typedef struct temp_proc {
 
 ruint_t __proclist_lock;
 ruint_t __proclist_lock2;
+ruint_t __promote_scan_lock;
+intmax_t promote_scan_pid;
+uintptr_t promote_scan_address;
+uint64_t promote_next_pass;
+ruint_t __swap_scan_lock;
+intmax_t swap_scan_pid;
+uintptr_t swap_scan_address;
 ruint_t process_id_num;
 ruint_t thread_id_num;
 list_t* processes;
 hash_table_t* temp_processes;
+kmem_cache_t* proc_cache;
+kmem_cache_t* thread_cache;
+kmem_cache_t* mmap_area_cache;
+kmem_cache_t* continuation_cache;
 
 extern void proc_spinlock_lock(volatile void* memaddr);
 extern void proc_spinlock_unlock(volatile void* memaddr);
@@ -101,7 +113,7 @@ static struct chained_element* __process_get_function(void* data) {
 }
 
 proc_t* create_init_process_structure(uintptr_t pml) {
-    proc_t* process = malloc(sizeof(proc_t));
+    proc_t* process = kmem_cache_alloc(proc_cache);
     if (process == NULL) {
         error(ERROR_MINIMAL_MEMORY_FAILURE, 0, 0, &create_init_process_structure);
     }
@@ -123,12 +135,15 @@ proc_t* create_init_process_structure(uintptr_t pml) {
     }
     process->pml4 = pml;
     process->mem_maps = NULL;
+    process->mem_map_tree = NULL;
     process->proc_random = rg_create_random_generator(get_unix_time());
     process->parent = NULL;
     process->priority = 0;
+    process->sched_class = SCHED_CLASS_FAIR;
     process->process_list.data = process;
     process->futexes = create_uint64_table();
     process->__ob_lock = 0;
+    process->__futex_lock = 0;
     if (process->futexes == NULL) {
         error(ERROR_MINIMAL_MEMORY_FAILURE, 0, 0, &create_init_process_structure);
     }
@@ -153,7 +168,7 @@ proc_t* create_init_process_structure(uintptr_t pml) {
 		error(ERROR_MINIMAL_MEMORY_FAILURE, 0, 0, &create_init_process_structure);
 	}
 
-    thread_t* main_thread = malloc(sizeof(thread_t));
+    thread_t* main_thread = kmem_cache_alloc(thread_cache);
     if (main_thread == NULL) {
         error(ERROR_MINIMAL_MEMORY_FAILURE, 0, 0, &create_init_process_structure);
     }
@@ -161,18 +176,18 @@ proc_t* create_init_process_structure(uintptr_t pml) {
     main_thread->parent_process = process;
     main_thread->tId = __atomic_add_fetch(&thread_id_num, 1, __ATOMIC_SEQ_CST);
     main_thread->priority = 0;
+    main_thread->sched_class = process->sched_class;
     main_thread->futex_block = create_list_static(__blocked_getter);
     if (main_thread->futex_block == NULL) {
         error(ERROR_MINIMAL_MEMORY_FAILURE, 0, 0, &create_init_process_structure);
     }
     main_thread->blocked = false;
     main_thread->blocked_list.data = main_thread;
-    main_thread->schedule_list.data = main_thread;
     main_thread->last_rdi = (ruint_t)(uintptr_t)process->argc;
     main_thread->last_rsi = (ruint_t)(uintptr_t)process->argv;
     main_thread->last_rdx = (ruint_t)(uintptr_t)process->environ;
 
-    main_thread->continuation = malloc(sizeof(continuation_t));
+    main_thread->continuation = kmem_cache_alloc(continuation_cache);
     if (main_thread->continuation == NULL) {
         error(ERROR_MINIMAL_MEMORY_FAILURE, 0, 0, &create_init_process_structure);
     }
@@ -211,177 +226,434 @@ void initialize_processes() {
     process_id_num = 0;
     thread_id_num = 0;
     __proclist_lock2 = 0;
+    __promote_scan_lock = 0;
+    promote_scan_pid = 0;
+    promote_scan_address = 0;
+    promote_next_pass = 0;
+    __swap_scan_lock = 0;
+    swap_scan_pid = 0;
+    swap_scan_address = 0;
     processes = create_list_static(__process_get_function);
     temp_processes = create_uint64_table();
+
+    proc_cache = kmem_cache_create("proc", sizeof(proc_t), 8, NULL, 0);
+    thread_cache = kmem_cache_create("thread", sizeof(thread_t), 8, NULL, 0);
+    mmap_area_cache = kmem_cache_create("mmap_area", sizeof(mmap_area_t), 8, NULL, 0);
+    continuation_cache = kmem_cache_create("continuation", sizeof(continuation_t), 8, NULL, 0);
+    if (proc_cache == NULL || thread_cache == NULL || mmap_area_cache == NULL
+            || continuation_cache == NULL) {
+        error(ERROR_MINIMAL_MEMORY_FAILURE, 0, 0, &initialize_processes);
+    }
 }
 
-mmap_area_t** mmap_area(proc_t* proc, uintptr_t address) {
-    mmap_area_t** lm = &proc->mem_maps;
-    uintptr_t x1, x2, y1, y2;
+/**
+ * Gap in address space right before area, gap before the lowest area
+ * starts at MMAP_LOWEST.
+ */
+static size_t mmap_gap(mmap_area_t* mm) {
+    return mm->vastart - (mm->prev == NULL ? MMAP_LOWEST : mm->prev->vaend);
+}
 
-    while (*lm != NULL) {
-        mmap_area_t* mmap = *lm;
+/**
+ * Recomputes largest gap of subtree from area and its children.
+ */
+static void mmap_augment(mmap_area_t* mm) {
+    size_t max_gap = mmap_gap(mm);
+    if (mm->left != NULL && mm->left->max_gap > max_gap)
+        max_gap = mm->left->max_gap;
+    if (mm->right != NULL && mm->right->max_gap > max_gap)
+        max_gap = mm->right->max_gap;
+    mm->max_gap = max_gap;
+}
 
-        x1 = address;
-        x2 = address;
-        y1 = mmap->vastart;
-        y2 = mmap->vaend;
+static void mmap_augment_up(mmap_area_t* mm) {
+    for (; mm != NULL; mm = mm->parent)
+        mmap_augment(mm);
+}
 
-        if (address >= mmap->vaend) {
-            lm = &mmap->next;
-            continue;
-        } else if (x1 <= y2 && y1 <= x2) {
-            // section overlaps
-            return lm;
+static void mmap_replace_child(proc_t* proc, mmap_area_t* parent, mmap_area_t* old,
+        mmap_area_t* new) {
+    if (parent == NULL)
+        proc->mem_map_tree = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+/**
+ * Rotates area down to the left, its right child takes its place. Subtree
+ * covers same areas afterwards, so only rotated areas are augmented.
+ */
+static void mmap_rotate_left(proc_t* proc, mmap_area_t* mm) {
+    mmap_area_t* r = mm->right;
+    mm->right = r->left;
+    if (r->left != NULL)
+        r->left->parent = mm;
+    r->parent = mm->parent;
+    mmap_replace_child(proc, mm->parent, mm, r);
+    r->left = mm;
+    mm->parent = r;
+    mmap_augment(mm);
+    mmap_augment(r);
+}
+
+static void mmap_rotate_right(proc_t* proc, mmap_area_t* mm) {
+    mmap_area_t* l = mm->left;
+    mm->left = l->right;
+    if (l->right != NULL)
+        l->right->parent = mm;
+    l->parent = mm->parent;
+    mmap_replace_child(proc, mm->parent, mm, l);
+    l->right = mm;
+    mm->parent = l;
+    mmap_augment(mm);
+    mmap_augment(l);
+}
+
+static bool mmap_red(mmap_area_t* mm) {
+    return mm != NULL && mm->red;
+}
+
+static void mmap_insert_fixup(proc_t* proc, mmap_area_t* mm) {
+    while (mmap_red(mm->parent)) {
+        mmap_area_t* parent = mm->parent;
+        mmap_area_t* grandparent = parent->parent;
+        if (parent == grandparent->left) {
+            mmap_area_t* uncle = grandparent->right;
+            if (mmap_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                mm = grandparent;
+                continue;
+            }
+            if (mm == parent->right) {
+                mmap_rotate_left(proc, parent);
+                mm = parent;
+                parent = mm->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            mmap_rotate_right(proc, grandparent);
         } else {
-            break;
+            mmap_area_t* uncle = grandparent->left;
+            if (mmap_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                mm = grandparent;
+                continue;
+            }
+            if (mm == parent->left) {
+                mmap_rotate_right(proc, parent);
+                mm = parent;
+                parent = mm->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            mmap_rotate_left(proc, grandparent);
         }
     }
-
-    return NULL;
+    proc->mem_map_tree->red = false;
 }
 
-mmap_area_t** request_va_hole(proc_t* proc, uintptr_t start_address, size_t req_size) {
-    mmap_area_t** lm = &proc->mem_maps;
-    uintptr_t x1, x2, y1, y2;
-
-    if (start_address < 0x1000)
-        return NULL;
+/**
+ * Inserts area right after prev in address order, or as lowest area if
+ * prev is NULL.
+ */
+static void mmap_insert(proc_t* proc, mmap_area_t* prev, mmap_area_t* mm) {
+    mm->prev = prev;
+    mm->next = prev == NULL ? proc->mem_maps : prev->next;
+    if (mm->next != NULL)
+        mm->next->prev = mm;
+    if (prev == NULL)
+        proc->mem_maps = mm;
+    else
+        prev->next = mm;
+
+    // in order neighbour without child on the facing side becomes parent
+    mm->left = NULL;
+    mm->right = NULL;
+    mm->red = true;
+    if (prev != NULL && prev->right == NULL) {
+        prev->right = mm;
+        mm->parent = prev;
+    } else if (mm->next != NULL) {
+        mm->next->left = mm;
+        mm->parent = mm->next;
+    } else {
+        proc->mem_map_tree = mm;
+        mm->parent = NULL;
+    }
 
-    while (*lm != NULL) {
-        mmap_area_t* mmap = *lm;
+    mmap_augment_up(mm);
+    if (mm->next != NULL)
+        mmap_augment_up(mm->next);
+    mmap_insert_fixup(proc, mm);
+}
 
-        x1 = start_address;
-        x2 = start_address + req_size;
-        y1 = mmap->vastart;
-        y2 = mmap->vaend;
+static void mmap_remove_fixup(proc_t* proc, mmap_area_t* mm, mmap_area_t* parent) {
+    while (mm != proc->mem_map_tree && !mmap_red(mm)) {
+        if (mm == parent->left) {
+            mmap_area_t* sibling = parent->right;
+            if (mmap_red(sibling)) {
+                sibling->red = false;
+                parent->red = true;
+                mmap_rotate_left(proc, parent);
+                sibling = parent->right;
+            }
+            if (!mmap_red(sibling->left) && !mmap_red(sibling->right)) {
+                sibling->red = true;
+                mm = parent;
+                parent = mm->parent;
+                continue;
+            }
+            if (!mmap_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                mmap_rotate_right(proc, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            mmap_rotate_left(proc, parent);
+        } else {
+            mmap_area_t* sibling = parent->left;
+            if (mmap_red(sibling)) {
+                sibling->red = false;
+                parent->red = true;
+                mmap_rotate_right(proc, parent);
+                sibling = parent->left;
+            }
+            if (!mmap_red(sibling->left) && !mmap_red(sibling->right)) {
+                sibling->red = true;
+                mm = parent;
+                parent = mm->parent;
+                continue;
+            }
+            if (!mmap_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                mmap_rotate_left(proc, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            mmap_rotate_right(proc, parent);
+        }
+        mm = proc->mem_map_tree;
+    }
+    if (mm != NULL)
+        mm->red = false;
+}
 
-        if (start_address >= mmap->vaend) {
-            lm = &mmap->next;
-            continue;
-        } else if (x1 <= y2 && y1 <= x2) {
-            // section overlaps
-            return NULL;
+/**
+ * Removes area from address ordered list and interval tree.
+ */
+static void mmap_remove(proc_t* proc, mmap_area_t* mm) {
+    mmap_area_t* next = mm->next;
+    if (mm->prev != NULL)
+        mm->prev->next = mm->next;
+    else
+        proc->mem_maps = mm->next;
+    if (mm->next != NULL)
+        mm->next->prev = mm->prev;
+
+    mmap_area_t* child;
+    mmap_area_t* parent;
+    bool red;
+    if (mm->left == NULL || mm->right == NULL) {
+        child = mm->left != NULL ? mm->left : mm->right;
+        parent = mm->parent;
+        red = mm->red;
+        if (child != NULL)
+            child->parent = parent;
+        mmap_replace_child(proc, parent, mm, child);
+    } else {
+        // successor has no left child, it takes place of removed area
+        child = next->right;
+        parent = next->parent;
+        red = next->red;
+        if (parent == mm) {
+            parent = next;
         } else {
-            // we have found the section above, therefore we are done with the search and we need to
-            // insert
-            break;
+            if (child != NULL)
+                child->parent = parent;
+            parent->left = child;
+            next->right = mm->right;
+            mm->right->parent = next;
         }
+        next->left = mm->left;
+        mm->left->parent = next;
+        next->parent = mm->parent;
+        next->red = mm->red;
+        mmap_replace_child(proc, mm->parent, mm, next);
     }
 
-    mmap_area_t* newmm = malloc(sizeof(mmap_area_t));
+    mmap_augment_up(parent);
+    if (!red)
+        mmap_remove_fixup(proc, child, parent);
+    // gap of next area now reaches to previous area
+    if (next != NULL)
+        mmap_augment_up(next);
+
+    mm->parent = mm->left = mm->right = mm->prev = mm->next = NULL;
+}
+
+static mmap_area_t* mmap_create(proc_t* proc, mmap_area_t* prev, uintptr_t vastart, size_t size) {
+    mmap_area_t* newmm = kmem_cache_alloc(mmap_area_cache);
+    if (newmm == NULL)
+        return NULL;
     memset(newmm, 0, sizeof(mmap_area_t));
-    newmm->next = *lm;
-    newmm->vastart = start_address;
-    newmm->vaend = start_address + req_size;
+    newmm->vastart = vastart;
+    newmm->vaend = vastart + size;
     newmm->count = 1;
-    *lm = newmm;
-    return lm;
+    mmap_insert(proc, prev, newmm);
+    return newmm;
 }
 
-mmap_area_t** find_va_hole(proc_t* proc, size_t req_size, size_t align_amount) {
-    mmap_area_t** lm = &proc->mem_maps;
-    uintptr_t start_address = 0x1000;
-    uintptr_t hole = 0;
+/**
+ * Returns area with highest start address, that is lower or equal to address.
+ */
+static mmap_area_t* mmap_floor(proc_t* proc, uintptr_t address) {
+    mmap_area_t* floor = NULL;
+    mmap_area_t* mm = proc->mem_map_tree;
+    while (mm != NULL) {
+        if (address < mm->vastart) {
+            mm = mm->left;
+        } else {
+            floor = mm;
+            mm = mm->right;
+        }
+    }
+    return floor;
+}
 
-    if (*lm == NULL)
-        hole = 0x800000000000;
+mmap_area_t* mmap_area(proc_t* proc, uintptr_t address) {
+    mmap_area_t* mm = mmap_floor(proc, address);
+    if (mm != NULL && address <= mm->vaend)
+        return mm;
+    return NULL;
+}
 
-    while (*lm != NULL) {
-        mmap_area_t* mmap = *lm;
+mmap_area_t* request_va_hole(proc_t* proc, uintptr_t start_address, size_t req_size) {
+    if (start_address < MMAP_LOWEST)
+        return NULL;
 
-        hole = mmap->vastart - start_address;
-        if (hole >= req_size+align_amount)
-            break; // hole found
+    // areas touching the requested range count as overlapping
+    mmap_area_t* prev = mmap_floor(proc, start_address);
+    if (prev != NULL && start_address <= prev->vaend)
+        return NULL;
+    mmap_area_t* next = prev == NULL ? proc->mem_maps : prev->next;
+    if (next != NULL && next->vastart <= start_address + req_size)
+        return NULL;
+
+    return mmap_create(proc, prev, start_address, req_size);
+}
 
-        start_address = mmap->vaend;
-        lm = &mmap->next;
-        if (*lm == NULL) {
-            hole = 0x800000000000 - start_address;
+/**
+ * Finds lowest hole which can hold req_size aligned to align_amount and places
+ * new area at random aligned offset inside of it.
+ *
+ * Holes are found by descending the tree by largest gap of subtrees, hole
+ * above the highest area is only used if there is no other.
+ */
+mmap_area_t* find_va_hole(proc_t* proc, size_t req_size, size_t align_amount) {
+    if (align_amount < 0x1000)
+        align_amount = 0x1000;
+    size_t required = req_size + align_amount;
+
+    mmap_area_t* prev;
+    uintptr_t hole_end;
+    mmap_area_t* mm = proc->mem_map_tree;
+    if (mm == NULL || mm->max_gap < required) {
+        prev = mm;
+        while (prev != NULL && prev->right != NULL)
+            prev = prev->right;
+        hole_end = MMAP_HIGHEST;
+    } else {
+        while (true) {
+            if (mm->left != NULL && mm->left->max_gap >= required) {
+                mm = mm->left;
+            } else if (mmap_gap(mm) >= required) {
+                break;
+            } else {
+                mm = mm->right;
+            }
         }
+        prev = mm->prev;
+        hole_end = mm->vastart;
     }
 
-    start_address = ALIGN_UP(start_address, align_amount);
-    size_t diff_holes = hole - req_size;
+    uintptr_t start_address = ALIGN_UP((prev == NULL ? MMAP_LOWEST : prev->vaend), align_amount);
+    if (start_address > hole_end || hole_end - start_address < req_size)
+        return NULL;
+
+    size_t diff_holes = hole_end - start_address - req_size;
     uintptr_t offset;
     if (diff_holes == 0)
         offset = 0;
     else
         offset = rg_next_uint_l(&proc->proc_random, diff_holes);
     offset = ALIGN_DOWN(offset, align_amount);
-    mmap_area_t* newmm = malloc(sizeof(mmap_area_t));
-    memset(newmm, 0, sizeof(mmap_area_t));
-    newmm->next = *lm;
-    newmm->vastart = start_address + offset;
-    newmm->vaend = start_address + req_size + offset;
-    newmm->count = 1;
-    *lm = newmm;
-    return lm;
+    return mmap_create(proc, prev, start_address + offset, req_size);
 }
 
 void* proc_alloc(size_t size) {
-    cpu_t* cpu = get_current_cput();
-    proc_spinlock_lock(&cpu->__cpu_lock);
-    proc_spinlock_lock(&cpu->__cpu_sched_lock);
-    proc_spinlock_lock(&__thread_modifier);
-
-    proc_t* proc = cpu->ct->parent_process;
+    proc_t* proc = get_current_cput()->ct->parent_process;
+    proc_spinlock_lock(&proc->__mmap_lock);
     void* addr = proc_alloc_direct(proc, size);
-
-    proc_spinlock_unlock(&__thread_modifier);
-    proc_spinlock_unlock(&cpu->__cpu_lock);
-    proc_spinlock_unlock(&cpu->__cpu_sched_lock);
+    proc_spinlock_unlock(&proc->__mmap_lock);
     return addr;
 }
 
 void* proc_alloc_direct(proc_t* proc, size_t size) {
-    mmap_area_t** _hole = find_va_hole(proc, size, 0x1000);
-    mmap_area_t* hole = *_hole;
+    mmap_area_t* hole = find_va_hole(proc, size, 0x1000);
+    if (hole == NULL)
+        return NULL;
     hole->mtype = kernel_allocated_heap_data;
     allocate(hole->vastart, size, false, false, proc->pml4);
     return (void*)hole->vastart;
 }
 
 
-mmap_area_t* free_mmap_area(mmap_area_t* mm, mmap_area_t** pmma, proc_t* proc) {
+mmap_area_t* free_mmap_area(mmap_area_t* mm, proc_t* proc, tlb_batch_t* batch) {
     uint64_t use_count = __atomic_sub_fetch(&mm->count, 1, __ATOMIC_SEQ_CST);
     switch (mm->mtype) {
     case program_data:
     case stack_data:
     case heap_data:
     case kernel_allocated_heap_data: {
-        deallocate(mm->vastart, mm->vaend-mm->vastart, proc->pml4);
+        if (batch != NULL)
+            deallocate_batched(mm->vastart, mm->vaend-mm->vastart, batch);
+        else
+            deallocate(mm->vastart, mm->vaend-mm->vastart, proc->pml4);
     } break;
     case nondealloc_map:
         break;
     }
     mmap_area_t* mmn = mm->next;
-    *pmma = mm->next;
+    mmap_remove(proc, mm);
     if (use_count == 0) {
-        free(mm);
+        kmem_cache_free(mmap_area_cache, mm);
     }
     return mmn;
 }
 
 void proc_dealloc(uintptr_t mem) {
-    cpu_t* cpu = get_current_cput();
-    proc_spinlock_lock(&cpu->__cpu_lock);
-    proc_spinlock_lock(&cpu->__cpu_sched_lock);
-    proc_spinlock_lock(&__thread_modifier);
-
-    proc_t* proc = cpu->ct->parent_process;
+    proc_t* proc = get_current_cput()->ct->parent_process;
+    proc_spinlock_lock(&proc->__mmap_lock);
     proc_dealloc_direct(proc, mem);
-
-    proc_spinlock_unlock(&__thread_modifier);
-    proc_spinlock_unlock(&cpu->__cpu_lock);
-    proc_spinlock_unlock(&cpu->__cpu_sched_lock);
+    proc_spinlock_unlock(&proc->__mmap_lock);
 }
 
 void proc_dealloc_direct(proc_t* proc, uintptr_t mem) {
-    mmap_area_t** _hole = mmap_area(proc, mem);
-    mmap_area_t* hole = *_hole;
+    mmap_area_t* hole = mmap_area(proc, mem);
     if (hole != NULL) {
-        free_mmap_area(hole, _hole, proc);
+        free_mmap_area(hole, proc, NULL);
     }
 }
 
@@ -430,10 +702,180 @@ static int cpy_array_user(int count, char*** a, proc_t* p) {
 }
 
 void free_proc_memory(proc_t* proc) {
+    proc_spinlock_lock(&proc->__mmap_lock);
     mmap_area_t* mm = proc->mem_maps;
-    mmap_area_t** pmm = &proc->mem_maps;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, proc->pml4);
     while (mm != NULL) {
-        mm = free_mmap_area(mm, pmm, proc);
+        mm = free_mmap_area(mm, proc, &batch);
+    }
+    tlb_batch_flush(&batch);
+    proc_spinlock_unlock(&proc->__mmap_lock);
+}
+
+/**
+ * Returns process with lowest pid not lower than pid, or NULL.
+ *
+ * Processes are never released, so process stays valid after __proclist_lock
+ * is released.
+ */
+static proc_t* process_from_pid(intmax_t pid) {
+    proc_t* found = NULL;
+    proc_spinlock_lock(&__proclist_lock);
+    list_iterator_t li;
+    list_create_iterator(processes, &li);
+    while (list_has_next(&li)) {
+        proc_t* process = list_next(&li);
+        if (process->proc_id >= pid && (found == NULL || process->proc_id < found->proc_id))
+            found = process;
+    }
+    proc_spinlock_unlock(&__proclist_lock);
+    return found;
+}
+
+/** Bit of area type in type mask of next_scan_area */
+#define AREA_TYPE_BIT(mtype) (1U << (mtype))
+
+/**
+ * Finds lowest area with type in types that ends above address and copies
+ * its bounds. Area is read under __mmap_lock, it can be released as soon as
+ * this returns, so scanners look it up again after each step.
+ */
+static bool next_scan_area(proc_t* proc, uintptr_t address, uint32_t types,
+        uintptr_t* vastart, uintptr_t* vaend) {
+    bool found = false;
+    proc_spinlock_lock(&proc->__mmap_lock);
+    mmap_area_t* mm = mmap_floor(proc, address);
+    if (mm == NULL)
+        mm = proc->mem_maps;
+    for (; mm != NULL; mm = mm->next) {
+        if (mm->vaend <= address || (AREA_TYPE_BIT(mm->mtype) & types) == 0)
+            continue;
+        *vastart = mm->vastart;
+        *vaend = mm->vaend;
+        found = true;
+        break;
+    }
+    proc_spinlock_unlock(&proc->__mmap_lock);
+    return found;
+}
+
+bool promote_large_pages_idle() {
+    if (__atomic_exchange_n(&__promote_scan_lock, 1, __ATOMIC_ACQUIRE) != 0)
+        return false; // other idle cpu is scanning
+
+    uint64_t now = clock_time_ms();
+    if (now < promote_next_pass) {
+        __atomic_store_n(&__promote_scan_lock, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    proc_t* proc = process_from_pid(promote_scan_pid);
+    if (proc == NULL) {
+        // pass is finished
+        promote_scan_pid = 0;
+        promote_scan_address = 0;
+        promote_next_pass = now + PROMOTE_SCAN_INTERVAL;
+        __atomic_store_n(&__promote_scan_lock, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    size_t budget = PROMOTE_SCAN_BATCH;
+    if (proc->proc_id != promote_scan_pid) {
+        promote_scan_pid = proc->proc_id;
+        promote_scan_address = 0;
+    }
+
+    // scan continues after last checked window
+    uintptr_t vastart, vaend;
+    while (proc->pml4 != 0 && next_scan_area(proc, promote_scan_address,
+            AREA_TYPE_BIT(heap_data) | AREA_TYPE_BIT(program_data), &vastart, &vaend)) {
+        uintptr_t base = ALIGN_UP(vastart, LARGE_PAGE_SIZE);
+        if (base < promote_scan_address)
+            base = promote_scan_address;
+        if (base + LARGE_PAGE_SIZE > vaend) {
+            // no window left in this area
+            promote_scan_address = vaend;
+            continue;
+        }
+        if (budget == 0)
+            goto done;
+        --budget;
+        promote_scan_address = base + LARGE_PAGE_SIZE;
+        if (promote_large_page(base, proc->pml4))
+            goto done;
+    }
+
+    // no windows left in this process
+    promote_scan_pid = proc->proc_id + 1;
+    promote_scan_address = 0;
+
+done:
+    __atomic_store_n(&__promote_scan_lock, 0, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t swapper_reclaim(size_t target) {
+    if (__atomic_load_n(&swap_stats.slots, __ATOMIC_RELAXED) == 0)
+        return 0; // no swap area
+    if (__atomic_exchange_n(&__swap_scan_lock, 1, __ATOMIC_ACQUIRE) != 0)
+        return 0; // other cpu is reclaiming
+
+    size_t released = 0;
+    size_t passes = 0;
+    while (released < target && passes < 2) {
+        proc_t* proc = process_from_pid(swap_scan_pid);
+        if (proc == NULL) {
+            // hand wrapped around
+            swap_scan_pid = 0;
+            swap_scan_address = 0;
+            ++passes;
+            continue;
+        }
+        if (proc->proc_id != swap_scan_pid) {
+            swap_scan_pid = proc->proc_id;
+            swap_scan_address = 0;
+        }
+
+        // scan continues after last checked page, area is looked up again
+        // after every batch since it can be released meanwhile
+        uintptr_t vastart, vaend;
+        while (proc->pml4 != 0 && next_scan_area(proc, swap_scan_address,
+                AREA_TYPE_BIT(heap_data) | AREA_TYPE_BIT(stack_data) | AREA_TYPE_BIT(program_data),
+                &vastart, &vaend)) {
+            if (released >= target)
+                goto done;
+            uintptr_t address = vastart < swap_scan_address ? swap_scan_address : vastart;
+            released += swap_out_range(&address, vaend, proc->pml4, target - released);
+            swap_scan_address = address;
+        }
+
+        // no pages left in this process
+        swap_scan_pid = proc->proc_id + 1;
+        swap_scan_address = 0;
+    }
+
+done:
+    __atomic_store_n(&__swap_scan_lock, 0, __ATOMIC_RELEASE);
+    return released;
+}
+
+bool swapper_idle() {
+    size_t free = get_free_frame_count();
+    if (free >= SWAPPER_FREE_TARGET)
+        return false;
+
+    size_t target = SWAPPER_FREE_TARGET - free;
+    return swapper_reclaim(target > SWAP_OUT_BATCH ? SWAP_OUT_BATCH : target) != 0;
+}
+
+void swapper_wait(registers_t* r) {
+    continuation_t* c = get_current_cput()->ct->continuation;
+    for (size_t i=0; i<SWAPPER_WAIT_RETRIES && c->present; i++) {
+        if (swapper_reclaim(SWAP_OUT_BATCH) == 0)
+            return;
+        c->present = false;
+        do_sys_handler(r, &c->continuation, c);
     }
 }
 
@@ -445,12 +887,13 @@ static void free_array(int count, char** a) {
 }
 
 int create_process_base(uint8_t* image_data, int argc, char** argv,
-        char** envp, proc_t** cpt, uint8_t asked_priority, registers_t* r) {
+        char** envp, proc_t** cpt, uint8_t asked_priority, size_t stack_size, registers_t* r) {
     proc_spinlock_lock(&__thread_modifier);
     uint8_t cpp = get_current_cput()->ct->parent_process->priority;
+    uint8_t cpc = get_current_cput()->ct->parent_process->sched_class;
     proc_spinlock_unlock(&__thread_modifier);
 
-    if (cpp > asked_priority) {
+    if (cpp > asked_priority || stack_size > MAX_STACK_SIZE) {
         return EINVAL;
     }
 
@@ -470,37 +913,41 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
     }
     // envp and argv are now kernel structures
 
-    proc_t* process = malloc(sizeof(proc_t));
+    proc_t* process = kmem_cache_alloc(proc_cache);
     if (process == NULL) {
         return ENOMEM_INTERNAL;
     }
     memset(process, 0, sizeof(proc_t));
 
     process->__ob_lock = 0;
+    process->__futex_lock = 0;
     process->process_list.data = process;
     process->pprocess = true;
 
     process->fds = create_array();
     if (process->fds == NULL) {
-        free(process);
+        kmem_cache_free(proc_cache, process);
         return ENOMEM_INTERNAL;
     }
 
     process->threads = create_array();
     if (process->fds == NULL) {
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         return ENOMEM_INTERNAL;
     }
 
     process->mem_maps = NULL;
+    process->mem_map_tree = NULL;
     process->proc_random = rg_create_random_generator(get_unix_time());
     process->parent = NULL;
     process->priority = asked_priority;
+    process->sched_class = cpc;
+    process->stack_size = stack_size != 0 ? ALIGN_UP(stack_size, 0x1000) : BASE_STACK_SIZE;
     process->pml4 = create_pml4();
     if (process->pml4 == 0) {
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         return ENOMEM_INTERNAL;
     }
 
@@ -509,7 +956,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
     if (process->futexes == NULL) {
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         return ENOMEM_INTERNAL;
     }
 
@@ -519,7 +966,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         return ENOMEM_INTERNAL;
     }
 
@@ -530,7 +977,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         return ENOMEM_INTERNAL;
     }
 
@@ -541,7 +988,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         return ENOMEM_INTERNAL;
     }
 
@@ -553,11 +1000,11 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
 		destroy_table(process->futexes);
 		destroy_array(process->threads);
 		destroy_array(process->fds);
-		free(process);
+		kmem_cache_free(proc_cache, process);
 		return ENOMEM_INTERNAL;
 	}
 
-    thread_t* main_thread = malloc(sizeof(thread_t));
+    thread_t* main_thread = kmem_cache_alloc(thread_cache);
     if (main_thread == NULL) {
     	free_list(process->temp_processes);
         free_list(process->blocked_wait_messages);
@@ -566,18 +1013,19 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         // TODO: free process address page
         return ENOMEM_INTERNAL;
     }
     memset(main_thread, 0, sizeof(thread_t));
     main_thread->parent_process = process;
     main_thread->priority = asked_priority;
+    main_thread->sched_class = process->sched_class;
     main_thread->blocked = false;
 
-    main_thread->continuation = malloc(sizeof(continuation_t));
+    main_thread->continuation = kmem_cache_alloc(continuation_cache);
     if (main_thread->continuation == NULL) {
-        free(main_thread);
+        kmem_cache_free(thread_cache, main_thread);
         free_list(process->temp_processes);
         free_list(process->blocked_wait_messages);
         free_queue(process->pq_input_buffer);
@@ -585,7 +1033,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         // TODO: free process address page
         return ENOMEM_INTERNAL;
     }
@@ -593,8 +1041,8 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
 
     main_thread->futex_block = create_list_static(__blocked_getter);
     if (main_thread->futex_block == NULL) {
-        free(main_thread->continuation);
-        free(main_thread);
+        kmem_cache_free(continuation_cache, main_thread->continuation);
+        kmem_cache_free(thread_cache, main_thread);
         free_list(process->temp_processes);
         free_list(process->blocked_wait_messages);
         free_queue(process->pq_input_buffer);
@@ -602,7 +1050,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         // TODO: free process address page
         return ENOMEM_INTERNAL;
     }
@@ -618,8 +1066,8 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
 
     if (err != 0) {
         free_list(main_thread->futex_block);
-        free(main_thread->continuation);
-        free(main_thread);
+        kmem_cache_free(continuation_cache, main_thread->continuation);
+        kmem_cache_free(thread_cache, main_thread);
         free_list(process->temp_processes);
         free_list(process->blocked_wait_messages);
         free_queue(process->pq_input_buffer);
@@ -627,7 +1075,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         // TODO: free process address page
         return err;
     }
@@ -636,8 +1084,8 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
     char** envpu = envp;
     if ((err = cpy_array_user(argc, &argvu, process)) != 0) {
         free_list(main_thread->futex_block);
-        free(main_thread->continuation);
-        free(main_thread);
+        kmem_cache_free(continuation_cache, main_thread->continuation);
+        kmem_cache_free(thread_cache, main_thread);
         free_list(process->temp_processes);
         free_list(process->blocked_wait_messages);
         free_queue(process->pq_input_buffer);
@@ -645,14 +1093,14 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         // TODO: free process address page
         return err;
     }
     if ((err = cpy_array_user(envc, &envpu, process)) != 0) {
         free_list(main_thread->futex_block);
-        free(main_thread->continuation);
-        free(main_thread);
+        kmem_cache_free(continuation_cache, main_thread->continuation);
+        kmem_cache_free(thread_cache, main_thread);
         free_list(process->temp_processes);
         free_list(process->blocked_wait_messages);
         free_queue(process->pq_input_buffer);
@@ -660,7 +1108,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         // TODO: free process address page
         return err;
     }
@@ -668,8 +1116,8 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
     main_thread->local_info = proc_alloc_direct(process, sizeof(tli_t));
     if (main_thread->local_info == NULL) {
         free_list(main_thread->futex_block);
-        free(main_thread->continuation);
-        free(main_thread);
+        kmem_cache_free(continuation_cache, main_thread->continuation);
+        kmem_cache_free(thread_cache, main_thread);
         free_list(process->temp_processes);
         free_list(process->blocked_wait_messages);
         free_queue(process->pq_input_buffer);
@@ -677,7 +1125,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         destroy_table(process->futexes);
         destroy_array(process->threads);
         destroy_array(process->fds);
-        free(process);
+        kmem_cache_free(proc_cache, process);
         // TODO: free process address page
         return ENOMEM_INTERNAL;
     }
@@ -691,8 +1139,8 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
         m->message = proc_alloc_direct(process, 0x200000);
         if (m->message == NULL) {
             free_list(main_thread->futex_block);
-            free(main_thread->continuation);
-            free(main_thread);
+            kmem_cache_free(continuation_cache, main_thread->continuation);
+            kmem_cache_free(thread_cache, main_thread);
             free_list(process->temp_processes);
             free_list(process->blocked_wait_messages);
             free_queue(process->pq_input_buffer);
@@ -700,7 +1148,7 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
             destroy_table(process->futexes);
             destroy_array(process->threads);
             destroy_array(process->fds);
-            free(process);
+            kmem_cache_free(proc_cache, process);
             // TODO: free process address page
             return ENOMEM_INTERNAL;
         }
@@ -735,7 +1183,6 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
     main_thread->last_rsi = (ruint_t)(uintptr_t)process->argv;
     main_thread->last_rdx = (ruint_t)(uintptr_t)process->environ;
     main_thread->blocked_list.data = main_thread;
-    main_thread->schedule_list.data = main_thread;
 
     free_array(argc, argv);
     free_array(envc, envp);
@@ -747,6 +1194,177 @@ int create_process_base(uint8_t* image_data, int argc, char** argv,
     return 0;
 }
 
+static void free_mmap_list(proc_t* proc) {
+    mmap_area_t* mm = proc->mem_maps;
+    while (mm != NULL) {
+        mmap_area_t* next = mm->next;
+        kmem_cache_free(mmap_area_cache, mm);
+        mm = next;
+    }
+    proc->mem_maps = NULL;
+    proc->mem_map_tree = NULL;
+}
+
+/**
+ * Copies memory areas of a process, returns false if there is no memory.
+ */
+static bool clone_mmap_list(proc_t* source, proc_t* target) {
+    mmap_area_t* tail = NULL;
+    for (mmap_area_t* sm = source->mem_maps; sm != NULL; sm = sm->next) {
+        mmap_area_t* mm = kmem_cache_alloc(mmap_area_cache);
+        if (mm == NULL) {
+            free_mmap_list(target);
+            return false;
+        }
+        memset(mm, 0, sizeof(mmap_area_t));
+        mm->vastart = sm->vastart;
+        mm->vaend = sm->vaend;
+        mm->mtype = sm->mtype;
+        mm->count = 1;
+        mmap_insert(target, tail, mm);
+        tail = mm;
+    }
+    return true;
+}
+
+/**
+ * Creates copy of current process, sharing its memory as copy on write.
+ *
+ * Child process has single thread, which continues from registers r with
+ * rax set to 0. Compared to create_process_base, no image is loaded, only
+ * top level page structure is copied.
+ */
+int create_process_clone(proc_t** cpt, registers_t* r) {
+    proc_spinlock_lock(&__thread_modifier);
+    thread_t* ct = get_current_cput()->ct;
+    proc_t* cp = ct->parent_process;
+    proc_spinlock_unlock(&__thread_modifier);
+
+    proc_t* process = kmem_cache_alloc(proc_cache);
+    if (process == NULL) {
+        return ENOMEM_INTERNAL;
+    }
+    memset(process, 0, sizeof(proc_t));
+
+    process->__ob_lock = 0;
+    process->__futex_lock = 0;
+    process->process_list.data = process;
+    process->pprocess = cp->pprocess;
+    process->proc_random = rg_create_random_generator(get_unix_time());
+    process->parent = cp;
+    process->priority = cp->priority;
+    process->sched_class = cp->sched_class;
+    process->stack_size = cp->stack_size;
+    process->argc = cp->argc;
+    process->argv = cp->argv;
+    process->environ = cp->environ;
+
+    thread_t* main_thread = NULL;
+    int err = ENOMEM_INTERNAL;
+
+    process->fds = create_array();
+    process->threads = create_array();
+    process->futexes = create_uint64_table();
+    process->input_buffer = create_queue_static(__message_getter);
+    process->pq_input_buffer = create_queue_static(__message_getter);
+    process->blocked_wait_messages = create_list_static(__message_getter);
+    process->temp_processes = create_list_static(__process_get_function);
+    if (process->fds == NULL || process->threads == NULL || process->futexes == NULL ||
+            process->input_buffer == NULL || process->pq_input_buffer == NULL ||
+            process->blocked_wait_messages == NULL || process->temp_processes == NULL)
+        goto cleanup;
+
+    // areas and page structures must be copied from the same state
+    proc_spinlock_lock(&cp->__mmap_lock);
+    if (!clone_mmap_list(cp, process)) {
+        proc_spinlock_unlock(&cp->__mmap_lock);
+        goto cleanup;
+    }
+    process->pml4 = clone_paging_structures(cp->pml4);
+    proc_spinlock_unlock(&cp->__mmap_lock);
+    if (process->pml4 == 0)
+        goto cleanup;
+
+    main_thread = kmem_cache_alloc(thread_cache);
+    if (main_thread == NULL)
+        goto cleanup;
+    memset(main_thread, 0, sizeof(thread_t));
+    main_thread->parent_process = process;
+    main_thread->priority = ct->priority;
+    main_thread->sched_class = ct->sched_class;
+    main_thread->blocked = false;
+    main_thread->stack_bottom_address = ct->stack_bottom_address;
+    main_thread->stack_top_address = ct->stack_top_address;
+    main_thread->local_info = ct->local_info;
+
+    main_thread->continuation = kmem_cache_alloc(continuation_cache);
+    if (main_thread->continuation == NULL)
+        goto cleanup;
+    main_thread->continuation->present = false;
+
+    main_thread->futex_block = create_list_static(__blocked_getter);
+    if (main_thread->futex_block == NULL)
+        goto cleanup;
+
+    // local info page is written by kernel, thus it is copied right away
+    tli_t* li = different_page_mem(process->pml4, main_thread->local_info);
+    if (li == NULL)
+        goto cleanup;
+
+    array_push_data(process->threads, main_thread);
+
+    for (int i=0; i<MESSAGE_BUFFER_CNT; i++) {
+        _message_t* m = &process->output_buffer[i];
+        m->owner = process;
+        m->used = false;
+        m->message = cp->output_buffer[i].message;
+    }
+
+    copy_registers(r, main_thread);
+    main_thread->last_rax = 0;
+
+    proc_spinlock_lock(&__proclist_lock);
+    main_thread->tId = __atomic_add_fetch(&thread_id_num, 1, __ATOMIC_SEQ_CST);
+    process->proc_id = ++process_id_num;
+    list_push_right(processes, process);
+    proc_spinlock_unlock(&__proclist_lock);
+
+    li->t = main_thread->tId;
+    main_thread->blocked_list.data = main_thread;
+
+    enschedule_best(main_thread);
+    *cpt = process;
+    return 0;
+
+cleanup:
+    if (main_thread != NULL) {
+        if (main_thread->futex_block != NULL)
+            free_list(main_thread->futex_block);
+        kmem_cache_free(continuation_cache, main_thread->continuation);
+        kmem_cache_free(thread_cache, main_thread);
+    }
+    if (process->pml4 != 0)
+        free_proc_memory(process);
+    free_mmap_list(process);
+    if (process->temp_processes != NULL)
+        free_list(process->temp_processes);
+    if (process->blocked_wait_messages != NULL)
+        free_list(process->blocked_wait_messages);
+    if (process->pq_input_buffer != NULL)
+        free_queue(process->pq_input_buffer);
+    if (process->input_buffer != NULL)
+        free_queue(process->input_buffer);
+    if (process->futexes != NULL)
+        destroy_table(process->futexes);
+    if (process->threads != NULL)
+        destroy_array(process->threads);
+    if (process->fds != NULL)
+        destroy_array(process->fds);
+    kmem_cache_free(proc_cache, process);
+    // TODO: free process address page
+    return err;
+}
+
 uintptr_t map_virtual_virtual(uintptr_t* _vastart, uintptr_t vaend, bool readonly) {
     uintptr_t vastart = *_vastart;
     uintptr_t vaoffset = vastart % 0x1000;
@@ -755,18 +1373,22 @@ uintptr_t map_virtual_virtual(uintptr_t* _vastart, uintptr_t vaend, bool readonl
 
     proc_t* proc = get_current_process();
 
-    mmap_area_t** _hole = find_va_hole(proc, vaend-vastart, 0x1000);
-    mmap_area_t* hole = *_hole;
+    proc_spinlock_lock(&proc->__mmap_lock);
+    mmap_area_t* hole = find_va_hole(proc, vaend-vastart, 0x1000);
     if (hole == NULL) {
+        proc_spinlock_unlock(&proc->__mmap_lock);
         return 0;
     }
     hole->mtype = kernel_allocated_heap_data;
     uintptr_t temporary = hole->vastart;
     if (!map_range(_vastart, vaend, &temporary, hole->vaend, true, readonly, false, proc->pml4)) {
-        free_mmap_area(hole, _hole, proc);
+        free_mmap_area(hole, proc, NULL);
+        proc_spinlock_unlock(&proc->__mmap_lock);
         return 0;
     }
-    return hole->vastart+vaoffset;
+    uintptr_t address = hole->vastart+vaoffset;
+    proc_spinlock_unlock(&proc->__mmap_lock);
+    return address;
 }
 
 uintptr_t map_physical_virtual(puint_t* _vastart, puint_t vaend, bool readonly) {
@@ -777,19 +1399,56 @@ uintptr_t map_physical_virtual(puint_t* _vastart, puint_t vaend, bool readonly)
 
     proc_t* proc = get_current_process();
 
-    mmap_area_t** _hole = find_va_hole(proc, vaend-vastart, 0x1000);
-    mmap_area_t* hole = *_hole;
+    proc_spinlock_lock(&proc->__mmap_lock);
+    mmap_area_t* hole = find_va_hole(proc, vaend-vastart, 0x1000);
     if (hole == NULL) {
+        proc_spinlock_unlock(&proc->__mmap_lock);
         return 0;
     }
     hole->mtype = kernel_allocated_heap_data;
     uintptr_t temporary = hole->vastart;
     if (!map_range(_vastart, vaend, &temporary, hole->vaend, false, readonly, false, proc->pml4)) {
         *_vastart = vastart;
-        free_mmap_area(hole, _hole, proc);
+        free_mmap_area(hole, proc, NULL);
+        proc_spinlock_unlock(&proc->__mmap_lock);
+        return 0;
+    }
+    uintptr_t address = hole->vastart+vaoffset;
+    proc_spinlock_unlock(&proc->__mmap_lock);
+    return address;
+}
+
+uintptr_t map_contiguous_frames(uint8_t order, puint_t* physaddr) {
+    size_t size = 0x1000UL << order;
+    proc_t* proc = get_current_process();
+
+    puint_t frames = alloc_frames(order);
+    if (frames == 0) {
+        return 0;
+    }
+
+    proc_spinlock_lock(&proc->__mmap_lock);
+    mmap_area_t* hole = find_va_hole(proc, size, 0x1000);
+    if (hole == NULL) {
+        proc_spinlock_unlock(&proc->__mmap_lock);
+        free_frames(frames, order);
         return 0;
     }
-    return hole->vastart+vaoffset;
+    hole->mtype = kernel_allocated_heap_data;
+    uintptr_t temporary = hole->vastart;
+    puint_t vastart = frames;
+    if (!map_range(&vastart, frames+size, &temporary, hole->vaend, false, false, false, proc->pml4)) {
+        // already mapped frames are released with the area
+        free_mmap_area(hole, proc, NULL);
+        proc_spinlock_unlock(&proc->__mmap_lock);
+        for (; vastart < frames+size; vastart += 0x1000)
+            free_frames(vastart, 0);
+        return 0;
+    }
+    uintptr_t address = hole->vastart;
+    proc_spinlock_unlock(&proc->__mmap_lock);
+    *physaddr = frames;
+    return address;
 }
 
 int cp_stage_1(cp_stage1* data, ruint_t* process_num) {
@@ -802,7 +1461,7 @@ int cp_stage_1(cp_stage1* data, ruint_t* process_num) {
 		goto handle_mem_error;
 	}
 
-	proc_t* process = malloc(sizeof(proc_t));
+	proc_t* process = kmem_cache_alloc(proc_cache);
 	if (process == NULL) {
 		goto handle_mem_error;
 	}
@@ -812,6 +1471,7 @@ int cp_stage_1(cp_stage1* data, ruint_t* process_num) {
 	tp->process = process;
 
 	process->__ob_lock = 0;
+	process->__futex_lock = 0;
 	process->process_list.data = process;
 
 	if (data->privilege && cp->pprocess)
@@ -831,6 +1491,7 @@ int cp_stage_1(cp_stage1* data, ruint_t* process_num) {
 	}
 
 	process->mem_maps = NULL;
+	process->mem_map_tree = NULL;
 	process->proc_random = rg_create_random_generator(get_unix_time());
 	process->parent = NULL;
 	if (data->parent)
@@ -842,6 +1503,12 @@ int cp_stage_1(cp_stage1* data, ruint_t* process_num) {
 		goto handle_mem_error;
 	} else
 		process->priority = data->priority;
+	process->sched_class = cp->sched_class;
+	if (data->stack_size > MAX_STACK_SIZE) {
+		error = EINVAL;
+		goto handle_mem_error;
+	}
+	process->stack_size = data->stack_size != 0 ? ALIGN_UP(data->stack_size, 0x1000) : BASE_STACK_SIZE;
 
 	process->futexes = create_uint64_table();
 
@@ -907,7 +1574,7 @@ handle_mem_error:
 			free_list(process->blocked_wait_messages);
 		if (process->temp_processes != NULL)
 			free_list(process->temp_processes);
-		free(process);
+		kmem_cache_free(proc_cache, process);
 	}
 	return error;
 }
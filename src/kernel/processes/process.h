@@ -31,6 +31,7 @@
 #include "../commons.h"
 #include "../interrupts/idt.h"
 #include "../memory/paging.h"
+#include "../memory/slab.h"
 #include "ipc.h"
 
 #include <ds/array.h>
@@ -54,12 +55,25 @@ typedef enum mmap_area_type {
     program_data, stack_data, heap_data, nondealloc_map, kernel_allocated_heap_data
 } ma_type_t;
 
+/**
+ * Memory area of a process.
+ *
+ * Areas are kept both in address ordered list and in red black interval
+ * tree, where every area knows largest gap before any area of its subtree.
+ */
 typedef struct mmap_area {
     uintptr_t               vastart;
     uintptr_t               vaend;
     ma_type_t               mtype;
     uint64_t                count;
     struct mmap_area*       next;
+    struct mmap_area*       prev;
+
+    struct mmap_area*       parent;
+    struct mmap_area*       left;
+    struct mmap_area*       right;
+    bool                    red;
+    size_t                  max_gap;
 } mmap_area_t;
 
 typedef struct thread thread_t;
@@ -80,9 +94,13 @@ typedef struct proc {
     array_t*                fds;
     array_t*                threads;
     uint8_t                 priority;
+    uint8_t                 sched_class; // class of new threads
 
-    mmap_area_t*            mem_maps;
+    mmap_area_t*            mem_maps;     // lowest area
+    mmap_area_t*            mem_map_tree; // root of interval tree
+    ruint_t                 __mmap_lock;  // guards mem_maps and mem_map_tree
     struct chained_element  process_list;
+    size_t                  stack_size; // stack reservation of new threads, 0 for BASE_STACK_SIZE
 
     uint64_t				   __ob_lock;
     _message_t                 output_buffer[MESSAGE_BUFFER_CNT];
@@ -91,6 +109,7 @@ typedef struct proc {
     message_target_container_t groups[256];
 
     hash_table_t*           futexes;
+    ruint_t                 __futex_lock; // guards futexes and futex_block lists of threads
     list_t*                 blocked_wait_messages;
 
     list_t*					temp_processes;
@@ -102,6 +121,22 @@ struct thread {
 
     uint8_t                 priority;
     bool                    blocked;
+    volatile bool           parked;   // blocked thread is off cpu, its waker enschedules it
+    struct thread*          run_next; // next thread posted to run queue inbox
+    size_t                  last_cpu; // insert_id+1 of cpu thread last ran on, 0 if it did not run yet
+    uint64_t                runnable_tsc; // tsc when thread was queued, 0 if it is not queued
+
+    /* fair class information, see fairqueue.h */
+    uint8_t                 sched_class;   // SCHED_CLASS_FAIR or SCHED_CLASS_RT
+    bool                    vruntime_local; // vruntime is absolute on cpu thread is queued on,
+                                            // otherwise relative to min_vruntime of that cpu
+    uint64_t                vruntime;
+    uint64_t                sleep_tsc;     // tsc when thread blocked, 0 if it did not
+    uint64_t                sum_exec;      // tsc ticks thread spent running
+    struct thread*          fair_parent;
+    struct thread*          fair_left;
+    struct thread*          fair_right;
+    bool                    fair_red;
     continuation_t*         continuation;
 
     /* Userspace information */
@@ -112,7 +147,6 @@ struct thread {
     uintptr_t               stack_top_address;
     uintptr_t               stack_bottom_address;
 
-    struct chained_element  schedule_list;
     struct chained_element  blocked_list;
 
     tli_t*                  local_info;
@@ -120,8 +154,33 @@ struct thread {
 };
 
 #define BASE_STACK_SIZE 0x1000000
+/** Lowest address of process memory areas */
+#define MMAP_LOWEST (0x1000UL)
+/** End of lower half of address space, areas end below it */
+#define MMAP_HIGHEST (0x800000000000UL)
+/** Unmapped page below every stack */
+#define STACK_GUARD_SIZE 0x1000
+/** Largest stack reservation process can ask for */
+#define MAX_STACK_SIZE 0x40000000
+
+/** Large page windows checked by idle cpu at once */
+#define PROMOTE_SCAN_BATCH (32)
+/** Pause between two passes of large page promotion over all processes, in ms */
+#define PROMOTE_SCAN_INTERVAL (1000)
+/** Idle cpus swap pages out while there are less free frames than this */
+#define SWAPPER_FREE_TARGET (2048)
+/** Times system call waiting for memory is resumed before it is left for next schedule */
+#define SWAPPER_WAIT_RETRIES (4)
+/** Threads share cpu by virtual runtime weighted by priority */
+#define SCHED_CLASS_FAIR (0)
+/** Threads run by priority, before any fair thread */
+#define SCHED_CLASS_RT   (1)
 
 extern list_t* processes;
+extern kmem_cache_t* proc_cache;
+extern kmem_cache_t* thread_cache;
+extern kmem_cache_t* mmap_area_cache;
+extern kmem_cache_t* continuation_cache;
 
 pid_t get_current_pid();
 proc_t* get_current_process();
@@ -129,12 +188,40 @@ proc_t* get_current_process();
 proc_t* create_init_process_structure(uintptr_t pml);
 void process_init(proc_t* process);
 
-mmap_area_t** mmap_area(proc_t* proc, uintptr_t address);
-mmap_area_t** request_va_hole(proc_t* proc, uintptr_t start_address, size_t req_size);
-mmap_area_t** find_va_hole(proc_t* proc, size_t req_size, size_t align_amount);
+/*
+ * Area functions below expect __mmap_lock of process to be held, unless
+ * process is not yet visible to other cpus.
+ */
 
+/**
+ * Returns area containing address or NULL.
+ */
+mmap_area_t* mmap_area(proc_t* proc, uintptr_t address);
+/**
+ * Creates area at start_address, returns NULL if it would overlap another area.
+ */
+mmap_area_t* request_va_hole(proc_t* proc, uintptr_t start_address, size_t req_size);
+/**
+ * Creates area of req_size at randomized address aligned to align_amount,
+ * returns NULL if there is no hole large enough.
+ */
+mmap_area_t* find_va_hole(proc_t* proc, size_t req_size, size_t align_amount);
+/**
+ * Removes area from process and releases its memory, if batch is not NULL,
+ * memory release is deferred to it. Returns following area.
+ */
+mmap_area_t* free_mmap_area(mmap_area_t* mm, proc_t* proc, tlb_batch_t* batch);
+
+/**
+ * Creates process from elf image, stack_size is reservation of its stacks,
+ * 0 for BASE_STACK_SIZE. Returns EINVAL if it is above MAX_STACK_SIZE.
+ */
 int create_process_base(uint8_t* image_data, int argc, char** argv, char** envp, proc_t** cpt,
-        uint8_t priority, registers_t* r);
+        uint8_t priority, size_t stack_size, registers_t* r);
+/**
+ * Creates copy on write clone of current process, child continues from r.
+ */
+int create_process_clone(proc_t** cpt, registers_t* r);
 
 void* proc_alloc(size_t size);
 void* proc_alloc_direct(proc_t* proc, size_t size);
@@ -143,7 +230,47 @@ void  proc_dealloc_direct(proc_t* proc, uintptr_t mem);
 
 uintptr_t map_virtual_virtual(uintptr_t* vastart, uintptr_t vaend, bool readonly);
 uintptr_t map_physical_virtual(puint_t* vastart, puint_t vaend, bool readonly);
+/**
+ * Allocates 2^order physically contiguous frames and maps them into current process.
+ *
+ * Physical address of the block is stored in physaddr. Frames are released when
+ * mapping is deallocated.
+ */
+uintptr_t map_contiguous_frames(uint8_t order, puint_t* physaddr);
 
 void initialize_processes();
 
+/**
+ * Large page promotion daemon step, called by idle cpus.
+ *
+ * Scans heap and program data of processes for fully populated large page
+ * windows and promotes them. Returns false if there was nothing to do.
+ */
+bool promote_large_pages_idle();
+
+/**
+ * Swaps out up to target pages of process heaps, stacks and program data.
+ *
+ * Clock hand moves over processes and their areas (see swap_out_range), page
+ * must stay unused for one whole pass to be swapped out, so at most two passes
+ * are done. Returns number of released frames, 0 if other cpu is reclaiming.
+ */
+size_t swapper_reclaim(size_t target);
+
+/**
+ * Swapper daemon step, called by idle cpus. Swaps pages out while there are
+ * less than SWAPPER_FREE_TARGET free frames. Returns false if there was nothing to do.
+ */
+bool swapper_idle();
+
+/**
+ * Resumes system call of current thread, which is waiting for memory.
+ *
+ * Call left its continuation present because it ran out of frames. Frames are
+ * reclaimed and call is resumed via continuation, until it finishes. If nothing
+ * can be reclaimed, continuation stays present and call is resumed when thread
+ * is scheduled again.
+ */
+void swapper_wait(registers_t* r);
+
 int cp_stage_1(cp_stage1* data, ruint_t* process_num);
@@ -0,0 +1,113 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * runqueue.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: per cpu run queues with work stealing deques
+ */
+
+#include "runqueue.h"
+
+#define RUNQ_DEQUE_MASK (RUNQ_DEQUE_SIZE-1)
+
+void run_queue_init(run_queue_t* rq) {
+    memset(rq, 0, sizeof(run_queue_t));
+    fair_queue_init(&rq->fair);
+}
+
+bool run_queue_push(run_queue_t* rq, uint8_t priority, thread_t* t) {
+    steal_deque_t* d = &rq->priority[priority];
+    int64_t bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= RUNQ_DEQUE_SIZE)
+        return false;
+
+    __atomic_store_n(&d->threads[bottom & RUNQ_DEQUE_MASK], t, __ATOMIC_RELAXED);
+    // thread must be visible before takers see new bottom
+    __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void run_queue_enqueue(run_queue_t* rq, thread_t* t) {
+    if (t->sched_class == SCHED_CLASS_FAIR)
+        fair_queue_enqueue(&rq->fair, t);
+    else if (!run_queue_push(rq, t->priority, t))
+        run_queue_post(rq, t);
+}
+
+void run_queue_post(run_queue_t* rq, thread_t* t) {
+    __atomic_add_fetch(&rq->posted_weight, RUNQ_WEIGHT(t->priority), __ATOMIC_RELAXED);
+    thread_t* head = __atomic_load_n(&rq->inbox, __ATOMIC_RELAXED);
+    do {
+        t->run_next = head;
+    } while (!__atomic_compare_exchange_n(&rq->inbox, &head, t, true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void run_queue_drain(run_queue_t* rq) {
+    if (__atomic_load_n(&rq->inbox, __ATOMIC_RELAXED) == NULL)
+        return;
+    thread_t* posted = __atomic_exchange_n(&rq->inbox, NULL, __ATOMIC_ACQUIRE);
+
+    // inbox is a stack, reverse it to keep order in which threads were posted
+    thread_t* ordered = NULL;
+    while (posted != NULL) {
+        thread_t* next = posted->run_next;
+        posted->run_next = ordered;
+        ordered = posted;
+        posted = next;
+    }
+
+    while (ordered != NULL) {
+        thread_t* t = ordered;
+        ordered = t->run_next;
+        t->run_next = NULL;
+        __atomic_sub_fetch(&rq->posted_weight, RUNQ_WEIGHT(t->priority), __ATOMIC_RELAXED);
+        run_queue_enqueue(rq, t);
+    }
+}
+
+thread_t* run_queue_take(run_queue_t* rq, uint8_t priority) {
+    steal_deque_t* d = &rq->priority[priority];
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    for (;;) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int64_t bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+        if (top >= bottom)
+            return NULL;
+
+        // slot can only be reused by owner once top moved past it,
+        // then compare and swap below fails
+        thread_t* t = __atomic_load_n(&d->threads[top & RUNQ_DEQUE_MASK], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&d->top, &top, top + 1, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+            return t;
+        // other cpu took it, top now holds current value
+    }
+}
+
+size_t run_queue_size(run_queue_t* rq, uint8_t priority) {
+    steal_deque_t* d = &rq->priority[priority];
+    int64_t bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    return bottom > top ? (size_t)(bottom - top) : 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * runqueue.h
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: per cpu run queues with work stealing deques
+ */
+
+#pragma once
+
+#include "../commons.h"
+#include "process.h"
+#include "fairqueue.h"
+
+/** Number of thread priorities, priority 0 runs first */
+#define RUNQ_PRIORITIES (5)
+/** Capacity of single steal deque, must be power of two */
+#define RUNQ_DEQUE_SIZE (256)
+/** Load of thread of given priority, priority 0 weighs most */
+#define RUNQ_WEIGHT(priority) (RUNQ_PRIORITIES-(priority))
+/** Number of buckets of scheduling latency histogram */
+#define RUNQ_LATENCY_BUCKETS (16)
+/** Load averages are fixed point numbers with this many fraction bits */
+#define LOAD_FIXED_SHIFT (11)
+#define LOAD_FIXED_1     (1UL<<LOAD_FIXED_SHIFT)
+
+/**
+ * Chase-Lev work stealing deque of runnable threads.
+ *
+ * Only owning cpu pushes at bottom, any cpu takes from top with single
+ * compare and swap, so no lock is needed. Owner takes from top as well,
+ * threads of single priority are thus run in round robin order. Deque
+ * does not grow, indices only increase and wrap around threads array.
+ */
+typedef struct steal_deque {
+    volatile int64_t top;
+    volatile int64_t bottom;
+    thread_t* volatile threads[RUNQ_DEQUE_SIZE];
+} steal_deque_t;
+
+/**
+ * Run queue of single cpu.
+ *
+ * Real time threads are kept in deques by priority and run before fair
+ * threads. Deques are pushed only by owning cpu. Other cpus post threads
+ * to inbox, which is lock free stack linked by thread run_next, owner
+ * moves them to deques or fair queue on next schedule.
+ */
+typedef struct run_queue {
+    steal_deque_t      priority[RUNQ_PRIORITIES];
+    fair_queue_t       fair;
+    thread_t* volatile inbox;
+    volatile uint64_t  posted_weight; // weight of threads in inbox
+    volatile bool      idle; // cpu waits for IPI_RUN_SCHEDULER
+    volatile uint8_t   running_weight; // weight of executing thread, 0 if none
+    volatile uint64_t  load_avg; // decayed load, fixed point with LOAD_FIXED_SHIFT
+    volatile bool      tick_stopped; // local timer is stopped, cpu is idle or runs single thread
+    uint64_t           tick_stop_ms; // clock_time_ms when tick was stopped
+    uint64_t           tick_stop_load; // load of cpu while tick is stopped
+    uint64_t           exec_start;  // tsc since running thread was last charged
+    uint64_t           slice_start; // tsc when running thread was switched to
+
+    /* statistics */
+    uint64_t switches;       // threads switched to
+    uint64_t wakeups;        // threads enscheduled to this cpu
+    uint64_t remote_wakeups; // of those, enscheduled by other cpus
+    uint64_t steals;         // threads taken from other cpus
+    uint64_t migrations;     // threads moved here by load balancer
+    uint64_t ticks;          // scheduler ticks of this cpu
+    uint64_t tick_stops;     // times tick was stopped
+    uint64_t ticks_per_second; // ticks in last window of at least one second
+    uint64_t tick_window_start;
+    uint64_t tick_window_ticks;
+    /* runnable to running latency, bucket i counts below 2^i us, last one the rest */
+    uint64_t latency[RUNQ_LATENCY_BUCKETS];
+} run_queue_t;
+
+void run_queue_init(run_queue_t* rq);
+
+/**
+ * Pushes thread to deque of priority. Only owning cpu can push.
+ * Returns false if deque is full.
+ */
+bool run_queue_push(run_queue_t* rq, uint8_t priority, thread_t* t);
+
+/**
+ * Queues thread by its class, real time thread that does not fit its deque
+ * is posted. Only owning cpu can enqueue.
+ */
+void run_queue_enqueue(run_queue_t* rq, thread_t* t);
+
+/**
+ * Posts thread to inbox of run queue, can be called from any cpu.
+ */
+void run_queue_post(run_queue_t* rq, thread_t* t);
+
+/**
+ * Moves posted threads to deques of their priority or fair queue. Only owning
+ * cpu can drain. Thread that does not fit stays in inbox.
+ */
+void run_queue_drain(run_queue_t* rq);
+
+/**
+ * Takes oldest thread of priority or returns NULL. Can be called from any cpu.
+ */
+thread_t* run_queue_take(run_queue_t* rq, uint8_t priority);
+
+/**
+ * Returns number of threads in deque of priority. Value is only a hint when
+ * read by other than owning cpu.
+ */
+size_t run_queue_size(run_queue_t* rq, uint8_t priority);
@@ -29,68 +29,39 @@
 #include "../cpus/cpu_mgmt.h"
 #include "../cpus/ipi.h"
 #include "../syscalls/sys.h"
+#include "../memory/usercopy.h"
 
 #include <stdnoreturn.h>
 #include <ds/hmap.h>
 #include <ds/llist.h>
 #include <ds/array.h>
-#include <ds/btree.h>
 
 extern void wait_until_activated(ruint_t wait_code);
 extern void proc_spinlock_lock(volatile void* memaddr);
 extern void proc_spinlock_unlock(volatile void* memaddr);
+extern uint64_t read_tsc();
 extern void switch_to_usermode(ruint_t rdi, ruint_t rip, ruint_t rsp,
         ruint_t flags, ruint_t rsi, ruint_t rdx);
-extern void* get_active_page();
-extern void set_active_page(void* page);
 
 #define INTERRUPT_FLAG (1<<9)
 
 ruint_t __process_modifier;
 ruint_t __thread_modifier;
-ruint_t __halted_modifier;
 bool    scheduler_enabled = false;
+/** clock_time_ms of next load balancing */
+uint64_t balance_next;
 
 uint64_t do_get_priority_count(cpu_t* cpu) {
     uint64_t count = 0;
-    queue_t* queues[5] = { cpu->priority_0, cpu->priority_1, cpu->priority_2, cpu->priority_3, cpu->priority_4 };
-    for (uint8_t i=0; i<5; i++) {
-        count += queue_size(queues[i]) * (5-i);
+    for (uint8_t i=0; i<RUNQ_PRIORITIES; i++) {
+        count += run_queue_size(&cpu->runq, i) * (RUNQ_PRIORITIES-i);
     }
+    count += __atomic_load_n(&cpu->runq.fair.load, __ATOMIC_RELAXED);
+    // posted threads are not counted by queues yet
+    count += __atomic_load_n(&cpu->runq.posted_weight, __ATOMIC_RELAXED);
     return count;
 }
 
-uint64_t get_priority_count(cpu_t* cpu) {
-    proc_spinlock_lock(&cpu->__cpu_lock);
-    proc_spinlock_lock(&cpu->__cpu_sched_lock);
-
-    // TODO:
-    uint64_t count = do_get_priority_count(cpu);
-
-    proc_spinlock_unlock(&cpu->__cpu_lock);
-    proc_spinlock_unlock(&cpu->__cpu_sched_lock);
-
-    return count;
-}
-
-void attemp_to_run_scheduler(registers_t* r) {
-    rg_t rd = rg_create_random_generator(get_unix_time());
-    uint32_t ticks = 0;
-
-    do {
-        cpu_t* cpu = array_get_random(cpus, &rd);
-        if (do_get_priority_count(cpu) > 0) {
-            if (cpu == get_current_cput()) {
-                if (cpu->__cpu_lock == 1)
-                    continue;
-            }
-            send_ipi_nowait(cpu->apic_id, IPI_RUN_SCHEDULER, 0, 0, 0, r);
-            break;
-        }
-        ++ticks;
-    } while (ticks < array_get_size(cpus));
-}
-
 void copy_registers(registers_t* r, thread_t* t) {
     t->last_rip = r->rip;
     t->last_rsp = r->uesp;
@@ -133,61 +104,268 @@ void registers_copy(thread_t* t, registers_t* r) {
     r->rflags = t->last_rflags;
 }
 
-thread_t* get_and_update_queue(cpu_t* cpu, queue_t* selq, uint8_t ord, queue_t** queues) {
-    thread_t* winner = queue_pop(selq);
-    queue_t* popq = NULL;
-    queue_t* pushq = selq;
-    for (uint8_t i=ord+1; i<5; i++) {
-        queue_t* tq = queues[i];
-        if (queue_has_elements(tq)) {
-            popq = tq;
-            break;
+/**
+ * Takes highest priority real time thread from local run queue, or fair
+ * thread with lowest virtual runtime if there is none.
+ *
+ * One real time thread of next non empty lower priority is moved one level
+ * up, so lower priorities are not starved.
+ */
+static thread_t* take_local_thread(cpu_t* cpu) {
+    run_queue_t* rq = &cpu->runq;
+    for (uint8_t i=0; i<RUNQ_PRIORITIES; i++) {
+        thread_t* winner = run_queue_take(rq, i);
+        if (winner == NULL)
+            continue;
+
+        uint8_t pushq = i;
+        for (uint8_t j=i+1; j<RUNQ_PRIORITIES; j++) {
+            thread_t* ptpick = run_queue_take(rq, j);
+            if (ptpick != NULL) {
+                if (!run_queue_push(rq, pushq, ptpick))
+                    run_queue_post(rq, ptpick);
+                break;
+            }
+            pushq = j;
         }
-        pushq = tq;
-    }
-    if (popq != NULL) {
-        thread_t* ptpick = queue_pop(popq);
-        queue_push(pushq, ptpick);
+        return winner;
     }
-    return winner;
+    return fair_queue_take(&rq->fair, false);
 }
 
-thread_t* get_and_update_threads(cpu_t* cpu, queue_t** queues) {
-    for (uint8_t i=0; i<5; i++) {
-        queue_t* tq = queues[i];
-        if (queue_has_elements(tq)) {
-            return get_and_update_queue(cpu, tq, i, queues);
+/**
+ * Steals highest priority real time thread of other cpu, or fair thread
+ * if there is none. Victims are tried in order starting from next cpu.
+ * Returns NULL if there is nothing to steal.
+ */
+static thread_t* steal_thread(cpu_t* cpu) {
+    size_t count = array_get_size(cpus);
+    for (uint8_t p=0; p<RUNQ_PRIORITIES; p++) {
+        for (size_t i=1; i<count; i++) {
+            cpu_t* victim = array_get_at(cpus, (cpu->insert_id + i) % count);
+            thread_t* t = run_queue_take(&victim->runq, p);
+            if (t != NULL) {
+                ++cpu->runq.steals;
+                return t;
+            }
+        }
+    }
+    for (size_t i=1; i<count; i++) {
+        cpu_t* victim = array_get_at(cpus, (cpu->insert_id + i) % count);
+        thread_t* t = fair_queue_take(&victim->runq.fair, true);
+        if (t != NULL) {
+            fair_queue_adopt(&cpu->runq.fair, t);
+            ++cpu->runq.steals;
+            return t;
         }
     }
     return NULL;
 }
 
-void context_switch(registers_t* r, cpu_t* cpu, thread_t* old_head, thread_t* selection) {
-    if (old_head != NULL && !old_head->blocked) {
-        queue_t* queues[5] = { cpu->priority_0, cpu->priority_1, cpu->priority_2, cpu->priority_3, cpu->priority_4 };
-        queue_push(queues[old_head->priority], old_head);
+/**
+ * Checks whether other cpu has thread that can be stolen.
+ */
+static bool can_steal(cpu_t* cpu) {
+    for (size_t i=0; i<array_get_size(cpus); i++) {
+        cpu_t* victim = array_get_at(cpus, i);
+        if (victim == cpu)
+            continue;
+        for (uint8_t p=0; p<RUNQ_PRIORITIES; p++) {
+            if (run_queue_size(&victim->runq, p) > 0)
+                return true;
+        }
+        if (__atomic_load_n(&victim->runq.fair.nr_running, __ATOMIC_RELAXED) > 0)
+            return true;
     }
+    return false;
+}
 
-    if (old_head != selection) {
-        cpu->ct = selection;
-        if (r != NULL && r->cs != 8) {
-            copy_registers(r, old_head);
+/**
+ * Wakes up one idle cpu, so it can steal new work.
+ */
+static void kick_idle_cpu(cpu_t* self) {
+    for (size_t i=0; i<array_get_size(cpus); i++) {
+        cpu_t* cpu = array_get_at(cpus, i);
+        if (cpu == self || !__atomic_load_n(&cpu->runq.idle, __ATOMIC_SEQ_CST))
+            continue;
+        bool idle = true;
+        if (__atomic_compare_exchange_n(&cpu->runq.idle, &idle, false, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            send_ipi_nowait(cpu->apic_id, IPI_RUN_SCHEDULER, 0, 0, 0, NULL);
+            return;
         }
+    }
+}
 
-    } else if (r != NULL && r->cs == (40|0x0003)) {
-        proc_spinlock_unlock(&__thread_modifier);
-        proc_spinlock_unlock(&cpu->__cpu_lock);
-        proc_spinlock_unlock(&cpu->__cpu_sched_lock);
-        return; // same thread
+/**
+ * Puts thread that was switched out back to local run queue, or parks it
+ * if it is blocked. Registers of the thread must be saved already, other
+ * cpus can steal it right away.
+ */
+static void release_thread(cpu_t* cpu, thread_t* t) {
+    if (__atomic_load_n(&t->blocked, __ATOMIC_SEQ_CST)) {
+        // waker can enschedule it to any cpu once it is parked
+        if (t->sched_class == SCHED_CLASS_FAIR)
+            fair_queue_detach(&cpu->runq.fair, t);
+        __atomic_store_n(&t->parked, true, __ATOMIC_SEQ_CST);
+        // waker that came before thread was parked left enscheduling to us
+        if (__atomic_load_n(&t->blocked, __ATOMIC_SEQ_CST) ||
+                !__atomic_exchange_n(&t->parked, false, __ATOMIC_SEQ_CST))
+            return;
+    }
+    t->runnable_tsc = read_tsc();
+    run_queue_enqueue(&cpu->runq, t);
+}
+
+/**
+ * Returns current load of cpu, queued and running threads weighted by priority.
+ */
+static uint64_t cpu_load(cpu_t* cpu) {
+    return do_get_priority_count(cpu) + cpu->runq.running_weight;
+}
+
+/**
+ * Returns load used for placement, in fixed point.
+ *
+ * Average keeps cpu that was busy recently loaded, current load accounts
+ * for threads placed since last sample. Cpu with stopped tick runs at most
+ * one thread, its current load is exact.
+ */
+static uint64_t placement_load(cpu_t* cpu) {
+    uint64_t cur = cpu_load(cpu) << LOAD_FIXED_SHIFT;
+    if (__atomic_load_n(&cpu->runq.tick_stopped, __ATOMIC_RELAXED))
+        return cur; // average is not sampled without tick
+    uint64_t avg = __atomic_load_n(&cpu->runq.load_avg, __ATOMIC_RELAXED);
+    return avg > cur ? avg : cur;
+}
+
+/**
+ * Updates decayed load average of cpu with load sample.
+ */
+static void update_load_average(cpu_t* cpu, uint64_t load_sample) {
+    uint64_t sample = load_sample << LOAD_FIXED_SHIFT;
+    uint64_t load = __atomic_load_n(&cpu->runq.load_avg, __ATOMIC_RELAXED);
+    load = (load * LOAD_DECAY + sample * (LOAD_FIXED_1 - LOAD_DECAY)) >> LOAD_FIXED_SHIFT;
+    __atomic_store_n(&cpu->runq.load_avg, load, __ATOMIC_RELAXED);
+}
+
+/**
+ * Closes tick rate window of cpu once it spans at least one second.
+ */
+static void roll_tick_window(cpu_t* cpu, uint64_t now) {
+    uint64_t elapsed = now - cpu->runq.tick_window_start;
+    if (elapsed >= 1000) {
+        cpu->runq.ticks_per_second = (cpu->runq.tick_window_ticks * 1000) / elapsed;
+        cpu->runq.tick_window_start = now;
+        cpu->runq.tick_window_ticks = 0;
+    }
+}
+
+/**
+ * Stops scheduler tick of this cpu, it is idle or runs single thread.
+ *
+ * Thread posted by other cpu after this point sees tick_stopped and sends
+ * IPI_RUN_SCHEDULER, one posted before is seen here and tick keeps running.
+ */
+static void tick_stop(cpu_t* cpu) {
+    if (cpu->runq.tick_stopped)
+        return;
+    __atomic_store_n(&cpu->runq.tick_stopped, true, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cpu->runq.inbox, __ATOMIC_SEQ_CST) != NULL) {
+        __atomic_store_n(&cpu->runq.tick_stopped, false, __ATOMIC_SEQ_CST);
+        return;
+    }
+    local_timer_stop();
+    cpu->runq.tick_stop_ms = clock_time_ms();
+    cpu->runq.tick_stop_load = cpu_load(cpu);
+    ++cpu->runq.tick_stops;
+}
+
+/**
+ * Restarts scheduler tick of this cpu, load average is decayed by samples
+ * missed while tick was stopped.
+ */
+static void tick_restart(cpu_t* cpu) {
+    if (!cpu->runq.tick_stopped)
+        return;
+    uint64_t now = clock_time_ms();
+    uint64_t missed = (now - cpu->runq.tick_stop_ms) / LOAD_SAMPLE_MS;
+    for (uint64_t i=0; i<missed && i<LOAD_CATCHUP_SAMPLES; i++)
+        update_load_average(cpu, cpu->runq.tick_stop_load);
+    roll_tick_window(cpu, now);
+
+    local_timer_start();
+    __atomic_store_n(&cpu->runq.tick_stopped, false, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Adds time thread waited in run queue to latency histogram of cpu.
+ */
+static void record_latency(cpu_t* cpu, uint64_t tsc_delta) {
+    uint64_t us = tsc_per_ms != 0 ? (tsc_delta * 1000) / tsc_per_ms : 0;
+    uint8_t bucket = 0;
+    while (bucket < RUNQ_LATENCY_BUCKETS-1 && (1UL << bucket) <= us)
+        ++bucket;
+    ++cpu->runq.latency[bucket];
+}
+
+/**
+ * Charges time since last charge to running thread of cpu.
+ */
+static void update_curr(cpu_t* cpu) {
+    uint64_t now = read_tsc();
+    thread_t* ct = cpu->ct;
+    if (ct != NULL) {
+        uint64_t delta = now - cpu->runq.exec_start;
+        ct->sum_exec += delta;
+        if (ct->sched_class == SCHED_CLASS_FAIR)
+            fair_queue_charge(&cpu->runq.fair, ct, delta);
+    }
+    cpu->runq.exec_start = now;
+}
+
+/**
+ * Returns true if running thread of cpu should give cpu to queued thread.
+ *
+ * Real time thread is preempted only by other real time thread, fair
+ * thread also by fair thread that ran less.
+ */
+static bool should_preempt(cpu_t* cpu) {
+    if (__atomic_load_n(&cpu->runq.inbox, __ATOMIC_RELAXED) != NULL)
+        return true;
+    for (uint8_t p=0; p<RUNQ_PRIORITIES; p++) {
+        if (run_queue_size(&cpu->runq, p) > 0)
+            return true;
     }
+    if (cpu->ct->sched_class != SCHED_CLASS_FAIR)
+        return false;
+    return fair_queue_should_preempt(&cpu->runq.fair, cpu->ct,
+            read_tsc() - cpu->runq.slice_start);
+}
 
-    uintptr_t pml4 = (uintptr_t)get_active_page();
-    if (cpu->ct->parent_process->pml4 != pml4) {
-        set_active_page((void*)cpu->ct->parent_process->pml4);
+void context_switch(registers_t* r, cpu_t* cpu, thread_t* old_head, thread_t* selection) {
+    uint64_t now = read_tsc();
+    cpu->ct = selection;
+    cpu->runq.running_weight = RUNQ_WEIGHT(selection->priority);
+    cpu->runq.exec_start = now;
+    cpu->runq.slice_start = now;
+    selection->last_cpu = cpu->insert_id+1;
+    ++cpu->runq.switches;
+    if (selection->runnable_tsc != 0) {
+        record_latency(cpu, now - selection->runnable_tsc);
+        selection->runnable_tsc = 0;
     }
+    // single runnable thread needs no tick until other thread is queued
+    if (do_get_priority_count(cpu) > 0)
+        tick_restart(cpu);
+    else
+        tick_stop(cpu);
 
-    pml4 = (uintptr_t)get_active_page();
-    __atomic_store_n(&cpu->current_address_space, pml4, __ATOMIC_SEQ_CST);
+    if (old_head == selection && r != NULL && r->cs == (40|0x0003)) {
+        return; // same thread
+    }
+
+    switch_address_space(cpu, cpu->ct->parent_process->pml4);
 
     if (r != NULL) {
         r->cs = 40 | 0x0003; // user space code
@@ -202,10 +380,6 @@ void context_switch(registers_t* r, cpu_t* cpu, thread_t* old_head, thread_t* se
     write_gs((uintptr_t)cpu->ct->local_info);
     __asm__ __volatile__ ("\tswapgs\n");
 
-    proc_spinlock_unlock(&__thread_modifier);
-    proc_spinlock_unlock(&cpu->__cpu_lock);
-    proc_spinlock_unlock(&cpu->__cpu_sched_lock);
-
     if (r == NULL) {
         // TODO: add flags for io
         ruint_t flags = INTERRUPT_FLAG;
@@ -222,119 +396,297 @@ void context_switch(registers_t* r, cpu_t* cpu, thread_t* old_head, thread_t* se
     }
 }
 
-// TODO add switching threads
+/**
+ * Switches to next thread of this cpu.
+ *
+ * Runnable current thread goes to the back of its local queue, blocked one is
+ * parked. If local queues are empty, thread is stolen from other cpu. Cpu with
+ * nothing to run does idle work and waits for IPI_RUN_SCHEDULER, which is
+ * sent when work is enscheduled to it or is available for stealing.
+ *
+ * No lock is taken, run queues are only pushed by owning cpu and other cpus
+ * post to inbox or steal.
+ */
 void schedule(registers_t* r) {
     cpu_t* cpu = get_current_cput();
+    __atomic_store_n(&cpu->runq.idle, false, __ATOMIC_SEQ_CST);
+    run_queue_drain(&cpu->runq);
+    update_curr(cpu);
+
+    thread_t* old_head = cpu->ct;
+    if (old_head != NULL) {
+        if (r != NULL && !old_head->blocked && do_get_priority_count(cpu) == 0)
+            return; // nothing else to run, current thread continues
 
-    proc_spinlock_lock(&cpu->__cpu_lock);
-    proc_spinlock_lock(&cpu->__cpu_sched_lock);
+        if (r != NULL && r->cs != 8) {
+            copy_registers(r, old_head);
+        }
+        cpu->ct = NULL;
+        cpu->runq.running_weight = 0;
+        release_thread(cpu, old_head);
+    }
 
-    while (do_get_priority_count(cpu) == 0) {
+    thread_t* selection;
+    while ((selection = take_local_thread(cpu)) == NULL &&
+            (selection = steal_thread(cpu)) == NULL) {
         r = NULL; // discard remaining stack info, we won't be jumping from this
-        proc_spinlock_unlock(&cpu->__cpu_lock);
-        proc_spinlock_unlock(&cpu->__cpu_sched_lock);
+        if (swapper_idle() || zero_frames_idle() || promote_large_pages_idle()) {
+            // let pending interrupts in between batches, then recheck queues
+            ENABLE_INTERRUPTS();
+            DISABLE_INTERRUPTS();
+            run_queue_drain(&cpu->runq);
+            continue;
+        }
+
+        // enscheduling cpu checks idle flag after it queued the thread,
+        // so either it sees the flag or the thread is seen here
+        __atomic_store_n(&cpu->runq.idle, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&cpu->runq.inbox, __ATOMIC_SEQ_CST) != NULL || can_steal(cpu)) {
+            __atomic_store_n(&cpu->runq.idle, false, __ATOMIC_SEQ_CST);
+            run_queue_drain(&cpu->runq);
+            continue;
+        }
+        tick_stop(cpu);
         ENABLE_INTERRUPTS();
         wait_until_activated(WAIT_SCHEDULER_QUEUE_CHNG);
-        proc_spinlock_lock(&cpu->__cpu_lock);
-        proc_spinlock_lock(&cpu->__cpu_sched_lock);
+        DISABLE_INTERRUPTS();
+        __atomic_store_n(&cpu->runq.idle, false, __ATOMIC_SEQ_CST);
+        run_queue_drain(&cpu->runq);
     }
 
-    proc_spinlock_lock(&__thread_modifier);
-
-    queue_t* queues[5] = { cpu->priority_0, cpu->priority_1, cpu->priority_2, cpu->priority_3, cpu->priority_4 };
-    thread_t* selection = get_and_update_threads(cpu, queues);
-    thread_t* old_head = cpu->ct;
-
     context_switch(r, cpu, old_head, selection);
 }
 
-void do_enschedule(thread_t* t, cpu_t* cpu) {
-    queue_t* queues[5] = { cpu->priority_0, cpu->priority_1, cpu->priority_2, cpu->priority_3, cpu->priority_4 };
-    queue_push(queues[t->priority], t);
+/**
+ * Puts thread to run queue of cpu. Own run queue is pushed directly, idle
+ * cpu is then kicked to steal. Thread for other cpu is posted to its inbox.
+ */
+static void place_thread(thread_t* t, cpu_t* cpu) {
+    cpu_t* self = get_current_cput();
+
+    if (cpu == self) {
+        run_queue_enqueue(&cpu->runq, t);
+        // current thread has competition now
+        if (cpu->ct != NULL)
+            tick_restart(cpu);
+        // work can be stolen now
+        kick_idle_cpu(self);
+        return;
+    }
 
-    if (cpu != get_current_cput()) {
+    run_queue_post(&cpu->runq, t);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    // busy cpu picks posted thread up on its next tick, cpu without tick
+    // must be woken up
+    bool idle = true;
+    if (__atomic_compare_exchange_n(&cpu->runq.idle, &idle, false, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ||
+            __atomic_load_n(&cpu->runq.tick_stopped, __ATOMIC_SEQ_CST)) {
         send_ipi_nowait(cpu->apic_id, IPI_RUN_SCHEDULER, 0, 0, 0, NULL);
     }
 }
 
-void enschedule(thread_t* t, cpu_t* cpu) {
-    proc_spinlock_lock(&cpu->__cpu_lock);
-    proc_spinlock_lock(&cpu->__cpu_sched_lock);
-    proc_spinlock_lock(&__thread_modifier);
+void do_enschedule(thread_t* t, cpu_t* cpu) {
+    t->runnable_tsc = read_tsc();
+    __atomic_add_fetch(&cpu->runq.wakeups, 1, __ATOMIC_RELAXED);
+    if (cpu != get_current_cput())
+        __atomic_add_fetch(&cpu->runq.remote_wakeups, 1, __ATOMIC_RELAXED);
+    place_thread(t, cpu);
+}
 
+void enschedule(thread_t* t, cpu_t* cpu) {
     do_enschedule(t, cpu);
-
-    proc_spinlock_unlock(&__thread_modifier);
-    proc_spinlock_unlock(&cpu->__cpu_sched_lock);
-    proc_spinlock_unlock(&cpu->__cpu_lock);
 }
 
 void enschedule_to_self(thread_t* t) {
     enschedule(t, get_current_cput());
 }
 
-void enschedule_best(thread_t* t) {
+static cpu_t* least_loaded_cpu() {
     cpu_t* mincpu = array_get_at(cpus, 0);
-    uint64_t priority = get_priority_count(mincpu);
+    uint64_t load = placement_load(mincpu);
     for (uint32_t i=1; i<array_get_size(cpus); i++) {
-        cpu_t* test = array_get_at(cpus, 0);
-        uint64_t np = get_priority_count(test);
-        if (priority > np) {
+        cpu_t* test = array_get_at(cpus, i);
+        uint64_t nl = placement_load(test);
+        if (load > nl) {
             mincpu = test;
-            priority = np;
+            load = nl;
         }
     }
+    return mincpu;
+}
 
-    enschedule(t, mincpu);
+/**
+ * Enschedules thread to best cpu.
+ *
+ * Cpu thread last ran on is preferred if it is idle, its caches are still
+ * warm. Otherwise less loaded of that cpu and waking cpu is picked, as
+ * woken thread often works with data of its waker. Least loaded cpu is
+ * used instead if it is lighter by more than load of the thread. Thread
+ * that did not run yet goes to least loaded cpu.
+ */
+void enschedule_best(thread_t* t) {
+    cpu_t* least = least_loaded_cpu();
+    if (t->last_cpu == 0) {
+        enschedule(t, least);
+        return;
+    }
+
+    cpu_t* prev = array_get_at(cpus, t->last_cpu-1);
+    if (__atomic_load_n(&prev->runq.idle, __ATOMIC_RELAXED)) {
+        enschedule(t, prev);
+        return;
+    }
+
+    cpu_t* affine = prev;
+    cpu_t* self = get_current_cput();
+    if (placement_load(self) < placement_load(prev))
+        affine = self;
+
+    uint64_t margin = (uint64_t)RUNQ_WEIGHT(t->priority) << LOAD_FIXED_SHIFT;
+    if (placement_load(least) + margin < placement_load(affine))
+        enschedule(t, least);
+    else
+        enschedule(t, affine);
 }
 
-void enschedule_best_nolock(thread_t* t) {
-    cpu_t* mincpu = array_get_at(cpus, 0);
-    uint64_t priority = get_priority_count(mincpu);
-    for (uint32_t i=1; i<array_get_size(cpus); i++) {
-        cpu_t* test = array_get_at(cpus, 0);
-        uint64_t np = get_priority_count(test);
-        if (priority > np) {
-            mincpu = test;
-            priority = np;
+void balance_load(registers_t* r) {
+    cpu_t* busiest = NULL;
+    cpu_t* idlest = NULL;
+    uint64_t maxload = 0;
+    uint64_t minload = UINT64_MAX;
+    for (uint32_t i=0; i<array_get_size(cpus); i++) {
+        cpu_t* cpu = array_get_at(cpus, i);
+        uint64_t load = placement_load(cpu);
+        if (busiest == NULL || load > maxload) {
+            busiest = cpu;
+            maxload = load;
+        }
+        if (idlest == NULL || load < minload) {
+            idlest = cpu;
+            minload = load;
+        }
+    }
+    if (busiest == idlest)
+        return;
+
+    // moving thread of weight w lowers imbalance by 2w, lightest threads go first
+    uint64_t imbalance = maxload - minload;
+    uint32_t moved = 0;
+    for (int8_t p=RUNQ_PRIORITIES-1; p>=0 && moved < BALANCE_BATCH; p--) {
+        uint64_t cost = (uint64_t)(2*RUNQ_WEIGHT(p)) << LOAD_FIXED_SHIFT;
+        while (moved < BALANCE_BATCH && cost <= imbalance) {
+            thread_t* t = run_queue_take(&busiest->runq, p);
+            if (t == NULL)
+                break;
+            __atomic_add_fetch(&idlest->runq.migrations, 1, __ATOMIC_RELAXED);
+            place_thread(t, idlest);
+            imbalance -= cost;
+            ++moved;
+        }
+    }
+    // fair threads are moved after real time ones
+    while (moved < BALANCE_BATCH) {
+        thread_t* t = fair_queue_take(&busiest->runq.fair, true);
+        if (t == NULL)
+            break;
+        uint64_t cost = (uint64_t)(2*RUNQ_WEIGHT(t->priority)) << LOAD_FIXED_SHIFT;
+        if (cost > imbalance) {
+            fair_queue_enqueue(&busiest->runq.fair, t);
+            break;
         }
+        __atomic_add_fetch(&idlest->runq.migrations, 1, __ATOMIC_RELAXED);
+        place_thread(t, idlest);
+        imbalance -= cost;
+        ++moved;
+    }
+
+    // timer interrupted idle wait of this cpu, switch to moved threads
+    cpu_t* self = get_current_cput();
+    bool idle = true;
+    if (moved > 0 && idlest == self && __atomic_compare_exchange_n(&self->runq.idle,
+            &idle, false, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        send_ipi_nowait(self->apic_id, IPI_RUN_SCHEDULER, 0, 0, 0, r);
     }
+}
 
-    do_enschedule(t, mincpu);
+void scheduler_tick(registers_t* r) {
+    cpu_t* cpu = get_current_cput();
+    uint64_t now = clock_time_ms();
+    ++cpu->runq.ticks;
+    ++cpu->runq.tick_window_ticks;
+    roll_tick_window(cpu, now);
+
+    if (cpu->runq.ticks % (LOAD_SAMPLE_MS/SCHED_TICK_MS) == 0)
+        update_load_average(cpu, cpu_load(cpu));
+
+    // any cpu with running tick balances, once per interval
+    uint64_t next = __atomic_load_n(&balance_next, __ATOMIC_RELAXED);
+    if (now >= next && __atomic_compare_exchange_n(&balance_next, &next,
+            now + BALANCE_INTERVAL_MS, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        balance_load(r);
+
+    // idle cpu is woken up by enscheduling, kernel code is not preempted
+    if (cpu->ct == NULL || (r->cs & 0x0003) != 0x0003)
+        return;
+    update_curr(cpu);
+    if (should_preempt(cpu))
+        schedule(r);
+    else if (do_get_priority_count(cpu) == 0)
+        tick_stop(cpu);
+}
+
+uint64_t get_ticks_per_second(cpu_t* cpu) {
+    uint64_t elapsed = clock_time_ms() - cpu->runq.tick_window_start;
+    // window is not closed while tick is stopped
+    if (cpu->runq.tick_stopped && elapsed >= 1000)
+        return (cpu->runq.tick_window_ticks * 1000) / elapsed;
+    return cpu->runq.ticks_per_second;
 }
 
 void initialize_scheduler() {
     __process_modifier = 0;
     __thread_modifier = 0;
-    __halted_modifier = 0;
 }
 
+/**
+ * Blocks current thread on futex word ftx, if it still holds value.
+ *
+ * Futex lists are guarded by per process __futex_lock, so the thread is
+ * either found by futex_wake or value was changed before it checked. Word is
+ * read under the lock without resolving faults, if its page went away, it is
+ * faulted in with the lock released and read again. Returns EINVAL if ftx is
+ * not user memory.
+ */
 int futex_wait(registers_t* registers, uint32_t* ftx, uint32_t value) {
-    if (*ftx != value) {
-        return EWOULDBLOCK;
-    }
-
     cpu_t* cpu = get_current_cput();
+    proc_t* proc = cpu->ct->parent_process;
 
-    proc_spinlock_lock(&cpu->__cpu_lock);
-    proc_spinlock_lock(&cpu->__cpu_sched_lock);
-    proc_spinlock_lock(&__thread_modifier);
-    proc_spinlock_lock(&__halted_modifier);
+    uint32_t current;
+    for (;;) {
+        proc_spinlock_lock(&proc->__futex_lock);
+        if (copy_from_user_nofault(&current, ftx, sizeof(uint32_t)))
+            break;
+        proc_spinlock_unlock(&proc->__futex_lock);
+        if (!copy_from_user(&current, ftx, sizeof(uint32_t)))
+            return EINVAL;
+    }
+    if (current != value) {
+        proc_spinlock_unlock(&proc->__futex_lock);
+        return EWOULDBLOCK;
+    }
     // TODO: add timeout
 
-    list_t* btl = (list_t*)table_get(cpu->ct->parent_process->futexes, (void*) ftx);
+    list_t* btl = (list_t*)table_get(proc->futexes, (void*) ftx);
     if (btl == NULL) {
         btl = cpu->ct->futex_block;
-        table_set(cpu->ct->parent_process->futexes, (void*) ftx, (void*)btl);
+        table_set(proc->futexes, (void*) ftx, (void*)btl);
     }
 
     list_push_right(btl, cpu->ct);
-    cpu->ct->blocked = true;
+    __atomic_store_n(&cpu->ct->blocked, true, __ATOMIC_SEQ_CST);
 
-    proc_spinlock_unlock(&__halted_modifier);
-    proc_spinlock_unlock(&__thread_modifier);
-    proc_spinlock_unlock(&cpu->__cpu_sched_lock);
-    proc_spinlock_unlock(&cpu->__cpu_lock);
+    proc_spinlock_unlock(&proc->__futex_lock);
 
     schedule(registers);
     return 0;
@@ -342,18 +694,13 @@ int futex_wait(registers_t* registers, uint32_t* ftx, uint32_t value) {
 
 int futex_wake(registers_t* registers, uint32_t* ftx, int num) {
     cpu_t* cpu = get_current_cput();
+    proc_t* proc = cpu->ct->parent_process;
 
-    proc_spinlock_lock(&cpu->__cpu_lock);
-    proc_spinlock_lock(&cpu->__cpu_sched_lock);
-    proc_spinlock_lock(&__thread_modifier);
-    proc_spinlock_lock(&__halted_modifier);
+    proc_spinlock_lock(&proc->__futex_lock);
 
-    list_t* btl = (list_t*)table_get(cpu->ct->parent_process->futexes, (void*) ftx);
+    list_t* btl = (list_t*)table_get(proc->futexes, (void*) ftx);
     if (btl == NULL) {
-        proc_spinlock_unlock(&__halted_modifier);
-        proc_spinlock_unlock(&__thread_modifier);
-        proc_spinlock_unlock(&cpu->__cpu_sched_lock);
-        proc_spinlock_unlock(&cpu->__cpu_lock);
+        proc_spinlock_unlock(&proc->__futex_lock);
         return EINVAL;
     }
 
@@ -364,13 +711,12 @@ int futex_wake(registers_t* registers, uint32_t* ftx, int num) {
         t = list_next(&li);
         list_remove_it(&li);
 
-        t->blocked = false;
-        enschedule_best_nolock(t);
+        __atomic_store_n(&t->blocked, false, __ATOMIC_SEQ_CST);
+        // thread that is not parked yet is put back to queue by its cpu
+        if (__atomic_exchange_n(&t->parked, false, __ATOMIC_SEQ_CST))
+            enschedule_best(t);
     }
 
-    proc_spinlock_unlock(&__halted_modifier);
-    proc_spinlock_unlock(&__thread_modifier);
-    proc_spinlock_unlock(&cpu->__cpu_sched_lock);
-    proc_spinlock_unlock(&cpu->__cpu_lock);
+    proc_spinlock_unlock(&proc->__futex_lock);
     return 0;
 }
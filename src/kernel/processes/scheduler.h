@@ -35,7 +35,35 @@
 #include <ds/random.h>
 #include <ds/array.h>
 
-void attemp_to_run_scheduler(registers_t* r);
+/** Period of per cpu scheduler tick */
+#define SCHED_TICK_MS       (2)
+/** Load averages are sampled every LOAD_SAMPLE_MS milliseconds */
+#define LOAD_SAMPLE_MS      (10)
+/** Decay of load average per sample, e^(-1/16) in fixed point */
+#define LOAD_DECAY          (1923)
+/** Run queues are balanced every BALANCE_INTERVAL_MS milliseconds */
+#define BALANCE_INTERVAL_MS (100)
+/** Maximum number of threads moved by single balancing pass */
+#define BALANCE_BATCH       (4)
+/** Maximum number of load samples applied for time tick was stopped */
+#define LOAD_CATCHUP_SAMPLES (128)
+
+/**
+ * Scheduler tick of current cpu, called from its local timer.
+ *
+ * Samples load, balances run queues and preempts running thread if other
+ * threads are queued. Tick of cpu running single thread is stopped until
+ * other thread is queued. r are registers of interrupted code.
+ */
+void scheduler_tick(registers_t* r);
+/**
+ * Moves queued threads from most to least loaded cpu.
+ */
+void balance_load(registers_t* r);
+/**
+ * Returns number of scheduler ticks cpu received per second recently.
+ */
+uint64_t get_ticks_per_second(cpu_t* cpu);
 void schedule(registers_t* r);
 void enschedule(thread_t* t, cpu_t* cpu);
 void enschedule_best(thread_t* t);
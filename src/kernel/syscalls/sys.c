@@ -31,6 +31,7 @@
 #include "../cpus/cpu_mgmt.h"
 #include "../interrupts/idt.h"
 #include "../processes/daemons.h"
+#include "../memory/swap.h"
 
 extern ruint_t __thread_modifier;
 extern void proc_spinlock_lock(volatile void* memaddr);
@@ -132,6 +133,10 @@ void sys_handler(registers_t* registers) {
     proc_spinlock_unlock(&cpu->__cpu_lock);
 
     do_sys_handler(registers, sc, cnt);
+    if (cnt->present) {
+        // call is waiting for memory, resume it once swapper made room
+        swapper_wait(registers);
+    }
 }
 
 syscall_t make_syscall_0(syscall_0 sfnc, bool e, bool unsafe) {
@@ -212,4 +217,10 @@ void initialize_system_calls() {
     register_syscall(true, DEV_SYS_PCIe_BUS_COUNT, make_syscall_0(dev_dm_get_pcie_c, false, false));
     register_syscall(true, DEV_SYS_PCIe_INFO, make_syscall_1(dev_dm_get_pcie_info, false, false));
     register_syscall(true, DEV_SYS_MAP_PHYSICAL_SELF, make_syscall_2(dev_selfmap_physical, false, false));
+    register_syscall(true, DEV_SYS_ALLOC_FRAMES, make_syscall_2(dev_alloc_frames, false, false));
+    register_syscall(true, DEV_SYS_CLONE_PROCESS, make_syscall_0(dev_clone_process, false, false));
+    register_syscall(true, DEV_SYS_MEMORY_STATS, make_syscall_1(dev_memory_stats, false, false));
+    register_syscall(true, DEV_SYS_SET_SCHED_CLASS, make_syscall_1(dev_set_sched_class, false, false));
+    register_syscall(true, DEV_SYS_LOG, make_syscall_1(dev_log, false, false));
+    register_syscall(true, DEV_SYS_SCHED_STATS, make_syscall_2(dev_sched_stats, false, false));
 }
@@ -9,92 +9,38 @@
 #include "../processes/ipc.h"
 #include "../processes/daemons.h"
 #include "../processes/scheduler.h"
-
-#define MAX_CHECKED_ELEMENTS 0x512
+#include "../memory/usercopy.h"
 
 static volatile bool initramfs_exists = true;
 extern void proc_spinlock_lock(volatile void* memaddr);
 extern void proc_spinlock_unlock(volatile void* memaddr);
 extern uintptr_t get_active_page();
 
-bool repair_memory(memstate_t state, uint64_t* b, size_t elements, continuation_t* c) {
-	// TODO: dispatch crap here
-	switch (state) {
-	case ms_okay: return true; // sentinel
-	case ms_notpresent:
-	case ms_einvalid: {
-		// TODO: add abort
-	} break;
-	case ms_cow: {
-		// TODO: add cow
-	} break;
-	case ms_allocondem: {
-		for (size_t ix=0; ix<elements; ix++) {
-			alloc_info_t ainfo;
-
-			ainfo.from = b[ix];
-			ainfo.amount = 0x1000;
-			ainfo.finished = false;
-			ainfo.exec = false;
-			ainfo.aod = false;
-
-			allocate_mem(&ainfo, false, false, get_active_page());
-			if (!ainfo.finished) {
-				// TODO: add swapper dispatch call here
-				c->present = true;
-				return false;
-			}
-		}
-		return true;
-	} break;
-	case ms_swapped: {
-		// TODO: add allocondem
-	} break;
-	}
-	return false;
-}
-
-bool validate_address(void* address, size_t size, continuation_t* c) {
-	size_t found = 0;
-	uint64_t localbuf[MAX_CHECKED_ELEMENTS];
-	memstate_t state = check_mem_state((uintptr_t)address, size, localbuf, MAX_CHECKED_ELEMENTS, &found);
-
-	if (state != ms_okay) {
-		return repair_memory(state, localbuf, found, c);
+/**
+ * Copies string from user into newly allocated kernel string.
+ *
+ * Returns NULL if string is not user memory, is longer than USER_STRING_MAX
+ * or there is no memory. Returned string must be freed.
+ */
+static char* copy_string_from_user(const char* string) {
+	char* ks = malloc(USER_STRING_MAX);
+	if (ks == NULL)
+		return NULL;
+	int64_t len = strncpy_from_user(ks, string, USER_STRING_MAX);
+	if (len < 0 || len == USER_STRING_MAX) {
+		free(ks);
+		return NULL;
 	}
-
-	return true;
+	return ks;
 }
 
-bool validate_string(char* string, continuation_t* c) {
-	size_t found = 0;
-	uint64_t localbuf[MAX_CHECKED_ELEMENTS];
-
-	uintptr_t addr = (uintptr_t)string;
-	uintptr_t nextb = ALIGN_UP(addr, 0x1000);
-
-	while (true) {
-		memstate_t state = check_mem_state(addr, nextb-addr, localbuf, MAX_CHECKED_ELEMENTS, &found);
-		if (state != ms_okay) {
-			return repair_memory(state, localbuf, found, c);
-		}
-		// mstate is fine, check the characters
-		char* s = (char*)addr;
-		for (size_t i=0; i<nextb-addr; i++) {
-			if (s[i] == '\0')
-				return true;
-		}
-		addr += 0x1000;
-		nextb += 0x1000;
-	}
-
-	return true;
+static void free_string_array(size_t count, char** array) {
+	for (size_t i=0; i<count; i++)
+		free(array[i]);
+	free(array);
 }
 
-bool validate_message(message_t* message, continuation_t* c) {
-	bool test = validate_address((void*)message, sizeof(message_t), c);
-	if (test)
-		return test;
+bool validate_message(message_t* message) {
 	uint64_t cm = 0;
 	uint8_t* mbytes = (uint8_t*)message;
 	for (unsigned int i=0; i<sizeof(message_t); i++) {
@@ -107,26 +53,23 @@ ruint_t allocate_memory_cont(registers_t* r, continuation_t* c, ruint_t from, ru
 		ruint_t addr);
 
 ruint_t allocate_memory(registers_t* r, continuation_t* c, ruint_t size) {
-    cpu_t* cpu = get_current_cput();
-
-    proc_spinlock_lock(&cpu->__cpu_lock);
-    proc_spinlock_lock(&__thread_modifier);
+    proc_t* proc = get_current_cput()->ct->parent_process;
 
-    thread_t* ct = cpu->ct;
+    proc_spinlock_lock(&proc->__mmap_lock);
 
-    mmap_area_t** _mmap_area = find_va_hole(ct->parent_process, size, 0x1000);
-    mmap_area_t* mmap_area = *_mmap_area;
+    // large requests are aligned so they can be backed by large pages
+    mmap_area_t* mmap_area = find_va_hole(proc, size,
+    		size >= LARGE_PAGE_SIZE ? LARGE_PAGE_SIZE : 0x1000);
     if (mmap_area == 0) {
-        proc_spinlock_unlock(&__thread_modifier);
-        proc_spinlock_unlock(&cpu->__cpu_lock);
+        proc_spinlock_unlock(&proc->__mmap_lock);
         c->present = true;
         return 0;
     }
     mmap_area->mtype = heap_data;
-    proc_spinlock_unlock(&__thread_modifier);
-    proc_spinlock_unlock(&cpu->__cpu_lock);
+    uintptr_t vastart = mmap_area->vastart;
+    proc_spinlock_unlock(&proc->__mmap_lock);
 
-    return allocate_memory_cont(r, c, mmap_area->vastart, size, mmap_area->vastart);
+    return allocate_memory_cont(r, c, vastart, size, vastart);
 }
 
 ruint_t allocate_memory_cont(registers_t* r, continuation_t* c, ruint_t from, ruint_t size,
@@ -151,43 +94,26 @@ ruint_t allocate_memory_cont(registers_t* r, continuation_t* c, ruint_t from, ru
 		c->_1 = ainfo.amount;
 		c->_2 = addr;
 		c->present = true;
-		// TODO: add message to swapper
 	}
 	return addr;
 }
 
 ruint_t deallocate_memory(registers_t* r, continuation_t* c, ruint_t from, ruint_t aamount) {
-	cpu_t* cpu = get_current_cput();
-
-	proc_spinlock_lock(&cpu->__cpu_lock);
-	proc_spinlock_lock(&__thread_modifier);
+	proc_t* proc = get_current_cput()->ct->parent_process;
 
-	thread_t* ct = cpu->ct;
-	mmap_area_t** prev = &ct->parent_process->mem_maps;
-	mmap_area_t* mmap_area = ct->parent_process->mem_maps;
-	while (mmap_area != NULL) {
-		if (mmap_area->vastart == from) {
-			if (mmap_area->vaend != from+aamount) {
-				// TODO: add sigsegv
-				return 1;
-			}
-			break;
-		}
-		prev = &mmap_area->next;
-		mmap_area = *prev;
-	}
+	proc_spinlock_lock(&proc->__mmap_lock);
 
-	if (mmap_area == NULL || mmap_area->mtype != heap_data) {
+	mmap_area_t* area = mmap_area(proc, from);
+	if (area == NULL || area->vastart != from || area->vaend != from+aamount
+			|| area->mtype != heap_data) {
 		// TODO: add sigsegv
+		proc_spinlock_unlock(&proc->__mmap_lock);
 		return 1;
 	}
 
-	deallocate(mmap_area->vastart, aamount, get_active_page());
-	*prev = mmap_area->next;
-	free(mmap_area);
+	free_mmap_area(area, proc, NULL);
 
-	proc_spinlock_unlock(&__thread_modifier);
-	proc_spinlock_unlock(&cpu->__cpu_lock);
+	proc_spinlock_unlock(&proc->__mmap_lock);
 	return 0;
 }
 
@@ -199,7 +125,6 @@ ruint_t dev_selfmap_physical(registers_t* r, continuation_t* c, ruint_t _physadd
 
 	uintptr_t ptr = map_physical_virtual(&physaddr, physaddr+size, false);
 	if (ptr == 0) {
-		// TODO: add swapper
 		c->_0 = physaddr;
 		c->_1 = size-(physaddr-_physaddr);
 		c->present = true;
@@ -208,6 +133,40 @@ ruint_t dev_selfmap_physical(registers_t* r, continuation_t* c, ruint_t _physadd
 	return (ruint_t)ptr;
 }
 
+ruint_t dev_alloc_frames(registers_t* r, continuation_t* c, ruint_t _order, ruint_t _physaddr) {
+	if (!get_current_process()->pprocess)
+		return 0;
+	if (_order > BUDDY_MAX_ORDER)
+		return 0;
+	puint_t* physaddr = (puint_t*)_physaddr;
+	if (_physaddr >= USER_SPACE_END || USER_SPACE_END-_physaddr < sizeof(puint_t))
+		return 0;
+
+	puint_t frames;
+	uintptr_t ptr = map_contiguous_frames((uint8_t)_order, &frames);
+	if (ptr == 0) {
+		// call is retried once swapper made room, see swapper_wait
+		c->present = true;
+		return 0;
+	}
+	if (!copy_to_user(physaddr, &frames, sizeof(puint_t))) {
+		proc_dealloc(ptr);
+		return 0;
+	}
+	return (ruint_t)ptr;
+}
+
+ruint_t dev_clone_process(registers_t* r, continuation_t* c) {
+	if (!get_current_process()->pprocess)
+		return (ruint_t)-EINVAL;
+
+	proc_t* process;
+	int rv = create_process_clone(&process, r);
+	if (rv != 0)
+		return (ruint_t)-rv;
+	return (ruint_t)process->proc_id;
+}
+
 ruint_t get_pid(registers_t* r, continuation_t* c) {
 	return get_current_pid();
 }
@@ -245,17 +204,23 @@ ruint_t dev_fb_get_width(registers_t* r, continuation_t* c) {
 
 // services
 ruint_t get_service_status(registers_t* r, continuation_t* c, ruint_t sname) {
-	const char* name = (const char*) sname;
-	if (!validate_string((void*)name, c))
+	char* name = copy_string_from_user((const char*) sname);
+	if (name == NULL)
 		return -1;
-	return daemon_registered(name);
+	bool registered = daemon_registered(name);
+	free(name);
+	return registered;
 }
 
 ruint_t register_service(registers_t* r, continuation_t* c, ruint_t sname) {
-	const char* name = (const char*) sname;
-	if (!validate_string((void*)name, c))
+	char* name = copy_string_from_user((const char*) sname);
+	if (name == NULL)
 		return -1;
-	return register_daemon_service(get_current_pid(), name, false, c);
+	// service table keeps the name on success
+	pid_t rv = register_daemon_service(get_current_pid(), name, false, c);
+	if (rv == DAEMON_NOT_REGISTERED || rv == ENOMEM_INTERNAL)
+		free(name);
+	return rv;
 }
 
 // initramfs
@@ -264,108 +229,150 @@ ruint_t get_initramfs_entry(registers_t* r, continuation_t* c, ruint_t p, ruint_
 		return E_IFS_INITRAMFS_GONE;
 	}
 
-	const char* path = (const char*)(uintptr_t)p;
-	initramfs_entry_t* entry = (initramfs_entry_t*)(uintptr_t)strpnt;
-
 	STATIC_ASSERT(sizeof(ifs_directory_t) == sizeof(ifs_file_t));
 
-	if (!validate_string((void*)p, c))
+	if (strpnt >= USER_SPACE_END || USER_SPACE_END-strpnt < sizeof(ifs_directory_t))
 		return E_EINVAL;
 
-	if (!validate_address((void*)strpnt, sizeof(ifs_directory_t), c))
+	char* path = copy_string_from_user((const char*)(uintptr_t)p);
+	if (path == NULL)
 		return E_EINVAL;
 
 	path_element_t* pe = get_path(path);
+	free(path);
 
 	if (pe == NULL) {
 		return E_EINVAL;
 	}
 
+	union {
+		initramfs_entry_t entry;
+		ifs_directory_t   dir;
+		ifs_file_t        file;
+	} ke;
+	memset(&ke, 0, sizeof(ke));
+
 	if (pe->type == PE_DIR) {
-		entry->type = et_dir;
-		strncpy(entry->name, pe->name, 255);
-		entry->num_ent_or_size = array_get_size(pe->element.dir->path_el_array);
+		ke.entry.type = et_dir;
+		strncpy(ke.entry.name, pe->name, 255);
+		ke.entry.num_ent_or_size = array_get_size(pe->element.dir->path_el_array);
+
+		// entries and names share single allocation, so failed call, which
+		// might be restarted via continuation, releases everything at once
+		size_t size = ke.entry.num_ent_or_size * 8;
+		for (uint32_t i=0; i<ke.entry.num_ent_or_size; i++) {
+			path_element_t* child_pe = (path_element_t*)array_get_at(pe->element.dir->path_el_array, i);
+			size += strlen(child_pe->name)+1;
+		}
 
-		ifs_directory_t* de = ((ifs_directory_t*)entry);
-		de->entries = proc_alloc(entry->num_ent_or_size * 8);
-		if (de->entries == NULL)
+		ke.dir.entries = proc_alloc(size);
+		if (ke.dir.entries == NULL) {
 			c->present = true;
 			return ENOMEM_INTERNAL;
+		}
+		char* name = (char*)&ke.dir.entries[ke.entry.num_ent_or_size];
 		size_t len;
-		for (uint32_t i=0; i<entry->num_ent_or_size; i++) {
+		for (uint32_t i=0; i<ke.entry.num_ent_or_size; i++) {
 			path_element_t* child_pe = (path_element_t*)array_get_at(pe->element.dir->path_el_array, i);
 
-			de->entries[i] = proc_alloc((len = strlen(child_pe->name))+1);
-			if (de->entries[i] == NULL) {
-				proc_dealloc((uintptr_t)de->entries);
-				c->present = true;
-				return ENOMEM_INTERNAL;
+			len = strlen(child_pe->name);
+			if (!copy_to_user(name, child_pe->name, len+1) ||
+					!copy_to_user(&ke.dir.entries[i], &name, sizeof(char*))) {
+				proc_dealloc((uintptr_t)ke.dir.entries);
+				return E_EINVAL;
 			}
-			memcpy(de->entries[i], child_pe->name, len+1);
+			name += len+1;
 		}
 	} else {
-		entry->type = et_file;
-		strncpy(entry->name, pe->name, 255);
-		entry->num_ent_or_size = pe->element.file->size;
+		ke.entry.type = et_file;
+		strncpy(ke.entry.name, pe->name, 255);
+		ke.entry.num_ent_or_size = pe->element.file->size;
 		puint_t fe = (puint_t)get_data(pe->element.file)
 							-ADDRESS_OFFSET(RESERVED_KBLOCK_RAM_MAPPINGS);
-		((ifs_file_t*)entry)->file_contents = (char*)
+		ke.file.file_contents = (char*)
 				map_physical_virtual(&fe,
-					(puint_t)((uintptr_t)get_data(pe->element.file))+entry->num_ent_or_size
+					(puint_t)((uintptr_t)get_data(pe->element.file))+ke.entry.num_ent_or_size
 					-ADDRESS_OFFSET(RESERVED_KBLOCK_RAM_MAPPINGS), true);
-		if (((ifs_file_t*)entry)->file_contents == NULL) {
+		if (ke.file.file_contents == NULL) {
 			c->present = true;
 			return ENOMEM_INTERNAL;
 		}
 	}
 
+	if (!copy_to_user((void*)strpnt, &ke, sizeof(ifs_directory_t))) {
+		if (ke.entry.type == et_dir)
+			proc_dealloc((uintptr_t)ke.dir.entries);
+		return E_EINVAL;
+	}
+
 	return E_IFS_ACTION_SUCCESS;
 }
 
 ruint_t create_process_ivfs(registers_t* r, continuation_t* c, ruint_t _path, ruint_t _argc,
 							ruint_t _argv, ruint_t _envp) {
 	size_t ix = 0;
-	char* path = (char*)_path;
-	if (!validate_string(path, c))
-		return EINVAL;
-
+	int rv = EINVAL;
 	int argc = _argc;
+	if (argc < 0 || (size_t)argc >= USER_STRING_MAX)
+		return EINVAL;
 
-	char** argv = (char**)_argv;
-	if (!validate_address((void*)argv, (argc+1)*8, c)) {
+	char* path = copy_string_from_user((const char*)_path);
+	if (path == NULL)
 		return EINVAL;
+
+	char** argv = malloc(8*(argc+1));
+	size_t envc = 0;
+	char** envp = malloc(8*USER_STRING_MAX);
+	if (argv == NULL || envp == NULL) {
+		free(argv);
+		free(envp);
+		free(path);
+		c->present = true;
+		return ENOMEM_INTERNAL;
 	}
-	for (ix=0; ix<(size_t)argc; ++ix) {
-		if (!validate_string(argv[ix], c))
-			return EINVAL;
+
+	size_t argn = 0;
+	if (!copy_from_user(argv, (void*)_argv, 8*(argc+1)))
+		goto fail;
+	for (; argn<(size_t)argc; ++argn) {
+		if ((argv[argn] = copy_string_from_user(argv[argn])) == NULL)
+			goto fail;
 	}
+	argv[argc] = NULL;
 
-	char** envp = (char**)_envp;
-	ix = 0;
-	while (true) {
-		if (!validate_address((void*)(envp+ix), 8, c)) {
-			return EINVAL;
-		}
-		if (envp[ix] == NULL)
+	for (ix=0; ix<USER_STRING_MAX; ++ix) {
+		char* env;
+		if (!copy_from_user(&env, (void*)(_envp+ix*8), sizeof(char*)))
+			goto fail;
+		if (env == NULL)
 			break;
-		if (!validate_string(envp[ix], c))
-			return EINVAL;
+		if ((envp[envc] = copy_string_from_user(env)) == NULL)
+			goto fail;
+		++envc;
 	}
+	if (ix == USER_STRING_MAX)
+		goto fail;
+	envp[envc] = NULL;
 
 	path_element_t* pe = get_path(path);
 	if (pe == NULL || pe->type == PE_DIR) {
-		return ENOENT;
+		rv = ENOENT;
+		goto fail;
 	}
 
 	proc_t* cp = get_current_process();
 
 	proc_t* process;
-	int rv = create_process_base(get_data(pe->element.file), argc, argv, envp,
-			&process, 0, r);
+	rv = create_process_base(get_data(pe->element.file), argc, argv, envp,
+			&process, 0, 0, r);
 	if (rv == 0) {
 		process->parent = cp;
 	}
 
+fail:
+	free_string_array(argn, argv);
+	free_string_array(envc, envp);
+	free(path);
 	return rv;
 }
 
@@ -384,15 +391,23 @@ int self_message(uint64_t command, char* data) {
 
 // IPC
 ruint_t sys_send_message(registers_t* r, continuation_t* c, ruint_t _message) {
-	message_t* message = (message_t*)_message;
-	if (!validate_message(message, c))
+	message_t* message = malloc(sizeof(message_t));
+	if (message == NULL) {
+		c->present = true;
+		return ENOMEM_INTERNAL;
+	}
+	if (!copy_from_user(message, (void*)_message, sizeof(message_t)) ||
+			!validate_message(message)) {
+		free(message);
 		return 0;
+	}
 
 	int retval = 0;
 
 	if (message->header.flags.no_target) {
 		retval = self_message(message->header.gps_id, message->data);
 	}
+	free(message);
 
 	if (retval == ENOMEM_INTERNAL) {
 		// TODO: call swapper
@@ -405,9 +420,6 @@ ruint_t sys_send_message(registers_t* r, continuation_t* c, ruint_t _message) {
 
 ruint_t get_empty_message(registers_t* r, continuation_t* c, ruint_t _mp) {
 	message_t** mp = (message_t**)_mp;
-	if (!validate_address((void*)mp, 8, c)) {
-		return EINVAL;
-	}
 	proc_t* cp = get_current_process();
 
 	proc_spinlock_lock(&cp->__ob_lock);
@@ -416,9 +428,16 @@ ruint_t get_empty_message(registers_t* r, continuation_t* c, ruint_t _mp) {
 		_message_t* message = &cp->output_buffer[i];
 		if (!message->used) {
 			message->used = true;
-			memset(message->message, 0, sizeof(message_t));
-			*mp = message->message;
 			proc_spinlock_unlock(&cp->__ob_lock);
+
+			// slot is ours now, user memory is touched without lock
+			if (!clear_user(message->message, sizeof(message_t)) ||
+					!copy_to_user(mp, &message->message, sizeof(message_t*))) {
+				proc_spinlock_lock(&cp->__ob_lock);
+				message->used = false;
+				proc_spinlock_unlock(&cp->__ob_lock);
+				return EINVAL;
+			}
 			return 0;
 		}
 	}
@@ -436,16 +455,19 @@ ruint_t sys_recv_message(registers_t* r, continuation_t* c, ruint_t _message) {
 ruint_t __futex_wait(registers_t* r, continuation_t* c, ruint_t _ftx_addr, ruint_t _state) {
 	uint32_t* ftx_addr = (uint32_t*)_ftx_addr;
 	uint32_t state = (uint32_t)_state;
-	if (!validate_address((void*)(ftx_addr), 8, c)) {
+	if ((_ftx_addr & 3) != 0) {
 		return EINVAL;
 	}
+	// futex word is only read through user copy, see futex_wait
 	return (ruint_t)futex_wait(r, ftx_addr, state);
 }
 
 ruint_t __futex_wake(registers_t* r, continuation_t* c, ruint_t _ftx_addr, ruint_t _num) {
 	uint32_t* ftx_addr = (uint32_t*)_ftx_addr;
 	int num = (int)_num;
-	if (!validate_address((void*)(ftx_addr), 8, c)) {
+	uint32_t value;
+	// word is only used as key, but it must be readable user memory
+	if ((_ftx_addr & 3) != 0 || !copy_from_user(&value, ftx_addr, sizeof(uint32_t))) {
 		return EINVAL;
 	}
 	return (ruint_t)futex_wake(r, ftx_addr, num);
@@ -471,10 +493,123 @@ ruint_t dev_dm_get_pcie_info(registers_t* r, continuation_t* c, ruint_t _pcistru
 		return EINVAL;
 	}
 
-	if (!validate_address(pcistruct, sizeof(pci_bus_t)*pcicount, c)) {
+	pci_bus_t* info = malloc(sizeof(pci_bus_t)*pcicount);
+	if (info == NULL) {
+		c->present = true;
+		return ENOMEM_INTERNAL;
+	}
+
+	get_pcie_info(info);
+	bool copied = copy_to_user(pcistruct, info, sizeof(pci_bus_t)*pcicount);
+	free(info);
+	return copied ? 0 : EINVAL;
+}
+
+// Memory statistics
+ruint_t dev_memory_stats(registers_t* r, continuation_t* c, ruint_t _stats) {
+	memory_stats_t ks;
+	memory_stats_t* stats = &ks;
+
+	stats->zero_pool_hits = __atomic_load_n(&zero_pool_hits, __ATOMIC_RELAXED);
+	stats->zero_pool_misses = __atomic_load_n(&zero_pool_misses, __ATOMIC_RELAXED);
+	stats->large_pages_scanned = __atomic_load_n(&large_page_stats.scanned, __ATOMIC_RELAXED);
+	stats->large_pages_promoted = __atomic_load_n(&large_page_stats.promoted, __ATOMIC_RELAXED);
+	stats->large_pages_failed = __atomic_load_n(&large_page_stats.failed, __ATOMIC_RELAXED);
+	stats->large_pages_on_demand = __atomic_load_n(&large_page_stats.on_demand, __ATOMIC_RELAXED);
+	stats->large_pages_split = __atomic_load_n(&large_page_stats.split, __ATOMIC_RELAXED);
+	stats->frame_pool_build_time = frame_pool_build_time;
+	stats->free_frames = get_free_frame_count();
+	stats->swap_slots = __atomic_load_n(&swap_stats.slots, __ATOMIC_RELAXED);
+	stats->swap_slots_used = __atomic_load_n(&swap_stats.slots_used, __ATOMIC_RELAXED);
+	stats->swap_pages_out = __atomic_load_n(&swap_stats.pages_out, __ATOMIC_RELAXED);
+	stats->swap_clean_out = __atomic_load_n(&swap_stats.clean_out, __ATOMIC_RELAXED);
+	stats->swap_pages_in = __atomic_load_n(&swap_stats.pages_in, __ATOMIC_RELAXED);
+	stats->swap_scanned = __atomic_load_n(&swap_stats.scanned, __ATOMIC_RELAXED);
+	stats->swap_referenced = __atomic_load_n(&swap_stats.referenced, __ATOMIC_RELAXED);
+
+	lock_stats_t frame, spaces, kernel;
+	get_paging_lock_stats(&frame, &spaces, &kernel);
+	memcpy(&stats->frame_lock, &frame, sizeof(memory_lock_stats_t));
+	memcpy(&stats->address_space_locks, &spaces, sizeof(memory_lock_stats_t));
+	memcpy(&stats->kernel_space_lock, &kernel, sizeof(memory_lock_stats_t));
+
+	if (!copy_to_user((void*)_stats, stats, sizeof(memory_stats_t))) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+// Scheduling class
+// Only calling thread changes class, other threads of process keep theirs,
+// since they might be queued on other cpus. New processes and threads
+// inherit class of process.
+ruint_t dev_set_sched_class(registers_t* r, continuation_t* c, ruint_t _sched_class) {
+	if (!get_current_process()->pprocess)
+		return EINVAL;
+	if (_sched_class != SCHED_CLASS_FAIR && _sched_class != SCHED_CLASS_RT)
 		return EINVAL;
+
+	thread_t* ct = get_current_cput()->ct;
+	ct->parent_process->sched_class = (uint8_t)_sched_class;
+	if (ct->sched_class != _sched_class) {
+		// thread joining fair class starts at min_vruntime of its cpu
+		ct->vruntime = 0;
+		ct->vruntime_local = false;
+		ct->sched_class = (uint8_t)_sched_class;
 	}
+	return 0;
+}
+
+// Scheduler statistics
+// Statistics of first count cpus are copied to stats, returns number of cpus
+// or 0 if stats are not user memory. Counters are written by their cpus
+// without locking, so snapshot is not exact.
+ruint_t dev_sched_stats(registers_t* r, continuation_t* c, ruint_t _stats, ruint_t _count) {
+	size_t cpu_count = array_get_size(cpus);
+	size_t count = _count < cpu_count ? (size_t)_count : cpu_count;
+	if (count == 0)
+		return cpu_count;
+
+	sched_stats_t* stats = malloc(sizeof(sched_stats_t)*count);
+	if (stats == NULL) {
+		c->present = true;
+		return 0;
+	}
+	for (size_t i=0; i<count; i++) {
+		run_queue_t* rq = &((cpu_t*)array_get_at(cpus, i))->runq;
+		stats[i].switches = rq->switches;
+		stats[i].wakeups = rq->wakeups;
+		stats[i].remote_wakeups = rq->remote_wakeups;
+		stats[i].steals = rq->steals;
+		stats[i].migrations = __atomic_load_n(&rq->migrations, __ATOMIC_RELAXED);
+		stats[i].ticks = rq->ticks;
+		stats[i].tick_stops = rq->tick_stops;
+		stats[i].ticks_per_second = rq->ticks_per_second;
+		stats[i].load_avg = __atomic_load_n(&rq->load_avg, __ATOMIC_RELAXED);
+		for (size_t b=0; b<SCHED_LATENCY_BUCKETS; b++)
+			stats[i].latency[b] = b < RUNQ_LATENCY_BUCKETS ? rq->latency[b] : 0;
+	}
+
+	bool copied = copy_to_user((void*)_stats, stats, sizeof(sched_stats_t)*count);
+	free(stats);
+	return copied ? cpu_count : 0;
+}
+
+// Logging
+// Messages of processes go to kernel log, prefixed by pid. Log itself is not
+// locked, so processes on different cpus are serialized here.
+static volatile ruint_t __log_lock;
+
+ruint_t dev_log(registers_t* r, continuation_t* c, ruint_t _message) {
+	if (!get_current_process()->pprocess)
+		return EINVAL;
+	char* message = copy_string_from_user((const char*)_message);
+	if (message == NULL)
+		return EINVAL;
 
-	get_pcie_info(pcistruct);
+	proc_spinlock_lock(&__log_lock);
+	vlog_msg("[%ld] %s", (long)get_current_process()->proc_id, message);
+	proc_spinlock_unlock(&__log_lock);
+	free(message);
 	return 0;
 }
@@ -25,6 +25,7 @@
  *  Contents: minimal kernel logger functionality
  */
 #include "logger.h"
+#include "../memory/slab.h"
 
 #include <ds/llist.h>
 
@@ -33,6 +34,7 @@ typedef enum {
 } log_level_t;
 
 list_t* boot_log;
+kmem_cache_t* log_entry_cache;
 
 typedef struct log_entry {
     log_level_t ll;
@@ -50,6 +52,7 @@ static struct chained_element* __log_entry_getter(void* data) {
 
 void initialize_logger() {
     boot_log = create_list_static(&__log_entry_getter);
+    log_entry_cache = kmem_cache_create("log_entry", sizeof(log_entry_t), 8, NULL, 0);
 }
 
 static inline void print_to_com(char* ch) {
@@ -67,7 +70,7 @@ static inline void print_to_com(char* ch) {
 void log(log_level_t log_level, const char* message) {
 
     // write message that we are in the kernel
-    log_entry_t* le = malloc(sizeof(log_entry_t));
+    log_entry_t* le = kmem_cache_alloc(log_entry_cache);
     if (le == NULL)
         return;
     le->ll = log_level;
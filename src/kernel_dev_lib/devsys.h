@@ -42,3 +42,9 @@
 #define DEV_SYS_PCIe_BUS_COUNT                  (7 + 2048)
 #define DEV_SYS_PCIe_INFO                       (8 + 2048)
 #define DEV_SYS_MAP_PHYSICAL_SELF               (9 + 2048)
+#define DEV_SYS_ALLOC_FRAMES                    (10 + 2048)
+#define DEV_SYS_CLONE_PROCESS                   (11 + 2048)
+#define DEV_SYS_MEMORY_STATS                    (12 + 2048)
+#define DEV_SYS_SET_SCHED_CLASS                 (13 + 2048)
+#define DEV_SYS_LOG                             (14 + 2048)
+#define DEV_SYS_SCHED_STATS                     (15 + 2048)
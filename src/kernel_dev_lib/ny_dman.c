@@ -38,3 +38,23 @@ int get_pci_info(pci_bus_t* addr) {
 void* self_map_physical(puint_t physaddr, size_t size) {
     return dev_sys_2arg(DEV_SYS_MAP_PHYSICAL_SELF, physaddr, size);
 }
+
+void* alloc_contiguous_frames(unsigned int order, puint_t* physaddr) {
+    return (void*)dev_sys_2arg(DEV_SYS_ALLOC_FRAMES, order, (ruint_t)physaddr);
+}
+
+int get_memory_stats(memory_stats_t* stats) {
+    return dev_sys_1arg(DEV_SYS_MEMORY_STATS, (ruint_t)stats);
+}
+
+int set_sched_class(int sched_class) {
+    return dev_sys_1arg(DEV_SYS_SET_SCHED_CLASS, sched_class);
+}
+
+int kernel_log(const char* message) {
+    return dev_sys_1arg(DEV_SYS_LOG, (ruint_t)message);
+}
+
+size_t get_sched_stats(sched_stats_t* stats, size_t count) {
+    return dev_sys_2arg(DEV_SYS_SCHED_STATS, (ruint_t)stats, count);
+}
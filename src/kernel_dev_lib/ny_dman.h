@@ -39,6 +39,64 @@ typedef struct pci_bus {
     uint32_t _reserved;
 } pci_bus_t;
 
+/** Threads share cpu by virtual runtime weighted by priority */
+#define SCHED_CLASS_FAIR (0)
+/** Threads run by priority, before any fair thread */
+#define SCHED_CLASS_RT   (1)
+
+typedef struct memory_lock_stats {
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t wait_time; // TSC ticks
+    uint64_t hold_time; // TSC ticks
+    uint64_t max_hold;  // TSC ticks
+} memory_lock_stats_t;
+
+typedef struct memory_stats {
+    uint64_t zero_pool_hits;
+    uint64_t zero_pool_misses;
+    uint64_t large_pages_scanned;
+    uint64_t large_pages_promoted;
+    uint64_t large_pages_failed;
+    uint64_t large_pages_on_demand;
+    uint64_t large_pages_split;
+    memory_lock_stats_t frame_lock;
+    memory_lock_stats_t address_space_locks;
+    memory_lock_stats_t kernel_space_lock;
+    uint64_t frame_pool_build_time; // TSC ticks spent building frame pool at boot
+    uint64_t free_frames;
+    uint64_t swap_slots;
+    uint64_t swap_slots_used;
+    uint64_t swap_pages_out;
+    uint64_t swap_clean_out;  // swapped out without write, swap copy was still valid
+    uint64_t swap_pages_in;
+    uint64_t swap_scanned;
+    uint64_t swap_referenced; // pages given second chance
+} memory_stats_t;
+
+/** Buckets of scheduling latency histogram, bucket i counts below 2^i us */
+#define SCHED_LATENCY_BUCKETS (16)
+/** Load averages are fixed point numbers with this many fraction bits */
+#define SCHED_LOAD_SHIFT (11)
+
+typedef struct sched_stats {
+    uint64_t switches;       // threads switched to
+    uint64_t wakeups;        // threads enscheduled to this cpu
+    uint64_t remote_wakeups; // of those, enscheduled by other cpus
+    uint64_t steals;         // threads taken from other cpus
+    uint64_t migrations;     // threads moved here by load balancer
+    uint64_t ticks;
+    uint64_t tick_stops;
+    uint64_t ticks_per_second;
+    uint64_t load_avg;       // fixed point with SCHED_LOAD_SHIFT
+    uint64_t latency[SCHED_LATENCY_BUCKETS]; // runnable to running
+} sched_stats_t;
+
 int64_t get_pci_bus_count();
 int     get_pci_info(pci_bus_t* addr);
 void*   self_map_physical(puint_t physaddr, size_t size);
+void*   alloc_contiguous_frames(unsigned int order, puint_t* physaddr);
+int     get_memory_stats(memory_stats_t* stats);
+int     set_sched_class(int sched_class);
+int     kernel_log(const char* message);
+size_t  get_sched_stats(sched_stats_t* stats, size_t count);
@@ -65,3 +65,7 @@ int execve_ifs(const char* ifs_path, char** argv, char** envp, int priority) {
             (ruint_t)ifs_path, (ruint_t)argc, (ruint_t)argv, (ruint_t)envp);
 }
 
+int clone_process() {
+    return (int)dev_sys_0arg(DEV_SYS_CLONE_PROCESS);
+}
+
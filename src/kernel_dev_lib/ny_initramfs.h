@@ -60,3 +60,10 @@ typedef struct ifs_file {
 int get_directory(const char* path, ifs_directory_t* dir);
 int get_file(const char* path, ifs_file_t* file);
 int execve_ifs(const char* ifs_path, char** argv, char** envp, int priority);
+/**
+ * Creates copy on write clone of this process.
+ *
+ * Returns pid of the clone in this process, 0 in the clone and negative
+ * error number on failure.
+ */
+int clone_process();
@@ -0,0 +1,94 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to use, copy, 
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+ * and to permit persons to whom the Software is furnished to do so, subject to the 
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies 
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS 
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * bench.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: 
+ */
+
+#include "bench.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+void bench_log(const char* format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    kernel_log(message);
+}
+
+void* bench_alloc(size_t size) {
+    return (void*)sys_1arg(SYS_ALLOCATE, (ruint_t)size);
+}
+
+bool bench_free(void* address, size_t size) {
+    return sys_2arg(SYS_DEALLOCATE, (ruint_t)address, (ruint_t)size) == 0;
+}
+
+void touch_pages(void* address, size_t size, bool write) {
+    volatile uint8_t* p = (volatile uint8_t*)address;
+    uint8_t sum = 0;
+    for (size_t i=0; i<size; i+=4*KiB) {
+        if (write)
+            p[i] = (uint8_t)i;
+        else
+            sum += p[i];
+    }
+    (void)sum;
+}
+
+int start_workers(int count) {
+    for (int i=1; i<count; i++) {
+        int pid = clone_process();
+        if (pid == 0)
+            return i;
+        if (pid < 0) {
+            bench_log("bench: clone failed with %d, %d workers run", -pid, i);
+            break;
+        }
+    }
+    return 0;
+}
+
+void park(void) {
+    static uint32_t parked = 0;
+    while (1)
+        sys_2arg(SYS_FUTEX_WAIT, (ruint_t)&parked, 0);
+}
+
+void wait_until(uint64_t tsc) {
+    while (rdtsc() < tsc)
+        ;
+}
+
+void log_lock_delta(const char* name, memory_lock_stats_t* before,
+        memory_lock_stats_t* after) {
+    bench_log("%s: acquired %lu, contended %lu, wait %lu, hold %lu, max hold %lu",
+            name, after->acquired - before->acquired,
+            after->contended - before->contended,
+            after->wait_time - before->wait_time,
+            after->hold_time - before->hold_time,
+            after->max_hold);
+}
@@ -0,0 +1,106 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to use, copy, 
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+ * and to permit persons to whom the Software is furnished to do so, subject to the 
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies 
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS 
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * bench.h
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: common helpers of benchmark service
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <ny/nyarlathotep.h>
+#include <cthulhu/process.h>
+
+/** How long workers of a check run, in TSC ticks, about a second at 2 GHz */
+#define BENCH_RUN_TSC   (2000000000UL)
+/** Time workers get after deadline to log their results */
+#define BENCH_GRACE_TSC (1000000000UL)
+
+#define KiB (1024UL)
+#define MiB (1024UL*KiB)
+#define GiB (1024UL*MiB)
+
+/** Initramfs path of service image */
+extern const char* bench_path;
+
+typedef struct bench_check {
+    const char* name;
+    void (*run)(void);
+} bench_check_t;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * Formats message and writes it to kernel log.
+ */
+void bench_log(const char* format, ...) __attribute__ ((format (printf, 1, 2)));
+
+/**
+ * Allocates on demand heap memory, size must be multiple of page size.
+ */
+void* bench_alloc(size_t size);
+bool  bench_free(void* address, size_t size);
+
+/**
+ * Touches every page of memory, by write or by read.
+ */
+void  touch_pages(void* address, size_t size, bool write);
+
+/**
+ * Clones process count-1 times, returns index of worker, original process
+ * is worker 0. Clones do not share memory, so workers can only agree on
+ * values set before the call, such as deadline.
+ */
+int   start_workers(int count);
+
+/**
+ * Blocks calling worker forever, clones have no way to exit.
+ */
+void  park(void) __attribute__ ((noreturn));
+
+void  wait_until(uint64_t tsc);
+
+void  log_lock_delta(const char* name, memory_lock_stats_t* before,
+        memory_lock_stats_t* after);
+
+void  check_frame_alloc(void);
+void  check_dealloc(void);
+void  check_munmap(void);
+void  check_fault_latency(void);
+void  check_zero_read(void);
+void  check_large_pages(void);
+void  check_promote(void);
+void  check_map_stress(void);
+void  check_bulk_unmap(void);
+void  check_fault_storm(void);
+void  check_boot_pool(void);
+void  check_context_switch(void);
+void  check_spread(void);
+void  check_fairness(void);
+void  check_spawn(void);
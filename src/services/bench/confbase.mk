@@ -0,0 +1,5 @@
+BASE_CPPFLAGS  :=
+BASE_CFLAGS    :=-std=c11 -Wall -Wextra 
+BASE_LDFLAGS   :=
+BASE_NASMFLAGS :=-f elf64
+
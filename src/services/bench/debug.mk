@@ -0,0 +1,4 @@
+MODE_CPPFLAGS  :=
+MODE_CFLAGS    :=-g -O0
+MODE_LDFLAGS   :=
+MODE_NASMFLAGS :=-F dwarf -g
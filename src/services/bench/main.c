@@ -0,0 +1,94 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to use, copy, 
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+ * and to permit persons to whom the Software is furnished to do so, subject to the 
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies 
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS 
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * main.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: benchmark service, runs checks listed in conf/bench/checks or all of them
+ *      when file is missing. Started by init when sys/bench is in its load order, see
+ *      disk/update_image.sh. Results are written to kernel log.
+ */
+
+#include "bench.h"
+
+#include <string.h>
+
+const char* bench_path = "sys/bench";
+
+static bench_check_t checks[] = {
+        { "frame_alloc", check_frame_alloc },
+        { "dealloc", check_dealloc },
+        { "munmap", check_munmap },
+        { "fault_latency", check_fault_latency },
+        { "zero_read", check_zero_read },
+        { "spawn", check_spawn },
+        { "large_pages", check_large_pages },
+        { "promote", check_promote },
+        { "map_stress", check_map_stress },
+        { "bulk_unmap", check_bulk_unmap },
+        { "fault_storm", check_fault_storm },
+        { "boot_pool", check_boot_pool },
+        { "context_switch", check_context_switch },
+        { "spread", check_spread },
+        { "fairness", check_fairness },
+};
+
+#define CHECK_COUNT (sizeof(checks)/sizeof(bench_check_t))
+
+static bool run_check(const char* name) {
+    for (size_t i=0; i<CHECK_COUNT; i++) {
+        if (strcmp(checks[i].name, name) == 0) {
+            bench_log("bench: %s", name);
+            checks[i].run();
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char** argv) {
+    // spawn check starts image with park argument
+    if (argc > 1 && strcmp(argv[1], "park") == 0)
+        park();
+    if (argc > 0)
+        bench_path = argv[0];
+
+    ifs_file_t f;
+    if (get_file("conf/bench/checks", &f) != E_IFS_ACTION_SUCCESS) {
+        for (size_t i=0; i<CHECK_COUNT; i++)
+            run_check(checks[i].name);
+    } else {
+        char* contents = malloc(f.entry.num_ent_or_size+1);
+        memcpy(contents, f.file_contents, f.entry.num_ent_or_size);
+        contents[f.entry.num_ent_or_size] = 0;
+
+        char* name = strtok(contents, "\n");
+        while (name != NULL) {
+            if (strlen(name) != 0 && !run_check(name))
+                bench_log("bench: unknown check %s", name);
+            name = strtok(NULL, "\n");
+        }
+        free(contents);
+    }
+
+    bench_log("bench: done");
+    park();
+}
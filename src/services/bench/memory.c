@@ -0,0 +1,472 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to use, copy, 
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+ * and to permit persons to whom the Software is furnished to do so, subject to the 
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies 
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS 
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * memory.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: memory management checks
+ */
+
+#include "bench.h"
+
+/** Workers of concurrent frame allocation, run with at least as many cpus */
+#define FRAME_ALLOC_WORKERS (8)
+/** Pages allocated, touched and freed by single round */
+#define FRAME_ALLOC_BLOCK   (1*MiB)
+#define FRAME_ALLOC_ROUNDS  (64)
+
+/**
+ * Allocation stress of frame pool. Blocks are below large page size, so
+ * every page takes frame from the pool on fault and returns it on free.
+ *
+ * Single process pass shows frame lock acquisitions per page, which stay
+ * well below one with per cpu frame caches. Concurrent pass runs
+ * FRAME_ALLOC_WORKERS processes, each logs its pages and cycles per page,
+ * throughput is their sum.
+ */
+void check_frame_alloc(void) {
+    memory_stats_t before, after;
+    size_t pages = 0;
+
+    get_memory_stats(&before);
+    uint64_t start = rdtsc();
+    for (int i=0; i<FRAME_ALLOC_ROUNDS; i++) {
+        void* block = bench_alloc(FRAME_ALLOC_BLOCK);
+        if (block == NULL)
+            break;
+        touch_pages(block, FRAME_ALLOC_BLOCK, true);
+        bench_free(block, FRAME_ALLOC_BLOCK);
+        pages += FRAME_ALLOC_BLOCK / (4*KiB);
+    }
+    uint64_t elapsed = rdtsc() - start;
+    get_memory_stats(&after);
+    if (pages == 0) {
+        bench_log("frame_alloc: no memory, skipped");
+        return;
+    }
+    bench_log("frame_alloc: single process, %lu pages, %lu cycles per page, "
+            "%lu frame lock acquisitions per 100 pages", pages, elapsed / pages,
+            (after.frame_lock.acquired - before.frame_lock.acquired) * 100 / pages);
+
+    uint64_t deadline = rdtsc() + BENCH_RUN_TSC;
+    get_memory_stats(&before);
+    int worker = start_workers(FRAME_ALLOC_WORKERS);
+
+    pages = 0;
+    start = rdtsc();
+    while (rdtsc() < deadline) {
+        void* block = bench_alloc(FRAME_ALLOC_BLOCK);
+        if (block == NULL)
+            break;
+        touch_pages(block, FRAME_ALLOC_BLOCK, true);
+        bench_free(block, FRAME_ALLOC_BLOCK);
+        pages += FRAME_ALLOC_BLOCK / (4*KiB);
+    }
+    elapsed = rdtsc() - start;
+    bench_log("frame_alloc: worker %d, %lu pages, %lu cycles per page", worker,
+            pages, pages ? elapsed / pages : 0);
+    if (worker != 0)
+        park();
+
+    wait_until(deadline + BENCH_GRACE_TSC);
+    get_memory_stats(&after);
+    log_lock_delta("frame_alloc: frame lock", &before.frame_lock, &after.frame_lock);
+}
+
+#define DEALLOC_SIZE   (64*MiB)
+#define DEALLOC_ROUNDS (8)
+
+/**
+ * Cycles of deallocation of fully touched 64 MiB region, which looks up frame
+ * info of every frame. Region is large page aligned, so large page counters
+ * are logged as well, to tell whether 4 KiB or 2 MiB frames were freed.
+ */
+void check_dealloc(void) {
+    memory_stats_t before, after;
+    uint64_t total = 0, best = UINT64_MAX;
+    int rounds = 0;
+
+    get_memory_stats(&before);
+    for (; rounds<DEALLOC_ROUNDS; rounds++) {
+        void* region = bench_alloc(DEALLOC_SIZE);
+        if (region == NULL)
+            break;
+        touch_pages(region, DEALLOC_SIZE, true);
+
+        uint64_t start = rdtsc();
+        bench_free(region, DEALLOC_SIZE);
+        uint64_t elapsed = rdtsc() - start;
+        total += elapsed;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    get_memory_stats(&after);
+    if (rounds == 0) {
+        bench_log("dealloc: no memory for 64 MiB region, skipped");
+        return;
+    }
+    bench_log("dealloc: %d rounds, %lu cycles average, %lu cycles best, %lu cycles per page",
+            rounds, total / rounds, best, total / rounds / (DEALLOC_SIZE / (4*KiB)));
+    bench_log("dealloc: large pages on demand %lu, split %lu",
+            after.large_pages_on_demand - before.large_pages_on_demand,
+            after.large_pages_split - before.large_pages_split);
+}
+
+/** Busy workers beside measuring process, set to vCPU count minus one */
+#define MUNMAP_BUSY_WORKERS (7)
+#define MUNMAP_SIZE         (64*KiB)
+
+/**
+ * Latency of unmap while other cpus run other address spaces. Shootdown
+ * only has to interrupt cpus that have address space of process loaded,
+ * which is none of the busy ones. Run at -smp 2, 8 and 16 with
+ * MUNMAP_BUSY_WORKERS matching, best case is unaffected by busy workers
+ * taking cpu from measuring process.
+ */
+void check_munmap(void) {
+    uint64_t deadline = rdtsc() + BENCH_RUN_TSC;
+    int worker = start_workers(MUNMAP_BUSY_WORKERS + 1);
+    if (worker != 0) {
+        while (rdtsc() < deadline)
+            ;
+        park();
+    }
+
+    uint64_t total = 0, best = UINT64_MAX, worst = 0, rounds = 0;
+    while (rdtsc() < deadline) {
+        void* region = bench_alloc(MUNMAP_SIZE);
+        if (region == NULL)
+            break;
+        touch_pages(region, MUNMAP_SIZE, true);
+
+        uint64_t start = rdtsc();
+        bench_free(region, MUNMAP_SIZE);
+        uint64_t elapsed = rdtsc() - start;
+        total += elapsed;
+        ++rounds;
+        if (elapsed < best)
+            best = elapsed;
+        if (elapsed > worst)
+            worst = elapsed;
+    }
+    if (rounds == 0) {
+        bench_log("munmap: no memory, skipped");
+        return;
+    }
+    bench_log("munmap: %d busy workers, %lu rounds, %lu cycles average, %lu best, %lu worst",
+            MUNMAP_BUSY_WORKERS, rounds, total / rounds, best, worst);
+}
+
+#define FAULT_BLOCK  (1*MiB)
+#define FAULT_ROUNDS (32)
+
+/**
+ * Latency of first write to on demand page, each write is timed alone.
+ * Frames come from zeroed frame pool when it has them, pool hits and misses
+ * tell how many faults had to zero frame inline.
+ */
+void check_fault_latency(void) {
+    memory_stats_t before, after;
+    uint64_t total = 0, worst = 0, faults = 0;
+
+    get_memory_stats(&before);
+    for (int i=0; i<FAULT_ROUNDS; i++) {
+        volatile uint8_t* block = bench_alloc(FAULT_BLOCK);
+        if (block == NULL)
+            break;
+        for (size_t offset=0; offset<FAULT_BLOCK; offset+=4*KiB) {
+            uint64_t start = rdtsc();
+            block[offset] = 1;
+            uint64_t elapsed = rdtsc() - start;
+            total += elapsed;
+            if (elapsed > worst)
+                worst = elapsed;
+            ++faults;
+        }
+        bench_free((void*)block, FAULT_BLOCK);
+    }
+    get_memory_stats(&after);
+    if (faults == 0) {
+        bench_log("fault_latency: no memory, skipped");
+        return;
+    }
+    bench_log("fault_latency: %lu faults, %lu cycles average, %lu worst", faults,
+            total / faults, worst);
+    bench_log("fault_latency: zero pool hits %lu, misses %lu",
+            after.zero_pool_hits - before.zero_pool_hits,
+            after.zero_pool_misses - before.zero_pool_misses);
+}
+
+#define ZERO_READ_SIZE  (1*GiB)
+/** Free frame count drifts by per cpu frame caches, allow 4 MiB */
+#define ZERO_READ_SLACK (1024)
+
+/**
+ * Reads every page of 1 GiB on demand region, read faults map shared zero
+ * frame, so free frame count must stay flat. Page tables are made when
+ * region is allocated and are reported separately.
+ */
+void check_zero_read(void) {
+    memory_stats_t start, allocated, read;
+
+    get_memory_stats(&start);
+    void* region = bench_alloc(ZERO_READ_SIZE);
+    if (region == NULL) {
+        bench_log("zero_read: no address space for 1 GiB region, skipped");
+        return;
+    }
+    get_memory_stats(&allocated);
+    touch_pages(region, ZERO_READ_SIZE, false);
+    get_memory_stats(&read);
+    bench_free(region, ZERO_READ_SIZE);
+
+    int64_t committed = (int64_t)allocated.free_frames - (int64_t)read.free_frames;
+    bench_log("zero_read: %ld frames for page tables, %ld frames committed by reading "
+            "%lu pages, %s", (int64_t)start.free_frames - (int64_t)allocated.free_frames,
+            committed, ZERO_READ_SIZE / (4*KiB), committed <= ZERO_READ_SLACK ? "ok" : "FAILED");
+}
+
+#define WALK_SIZE    (64*MiB)
+#define WALK_PIECE   (1*MiB)
+#define WALK_PASSES  (16)
+/** Stride touches new page and new cache line every access */
+#define WALK_STRIDE  (4*KiB + 64)
+
+static uint64_t walk(void* region, size_t size) {
+    volatile uint8_t* p = (volatile uint8_t*)region;
+    uint8_t sum = 0;
+    uint64_t start = rdtsc();
+    for (int pass=0; pass<WALK_PASSES; pass++)
+        for (size_t offset=(size_t)pass*64; offset<size; offset+=WALK_STRIDE)
+            sum += p[offset];
+    (void)sum;
+    return rdtsc() - start;
+}
+
+/**
+ * TLB heavy strided walk over 64 MiB region backed by 2 MiB pages, against
+ * the same amount of memory in 1 MiB regions, which are too small for
+ * large pages.
+ */
+void check_large_pages(void) {
+    memory_stats_t before, after;
+    void* pieces[WALK_SIZE / WALK_PIECE];
+    size_t accesses = WALK_PASSES * (WALK_SIZE / WALK_STRIDE);
+
+    get_memory_stats(&before);
+    void* region = bench_alloc(WALK_SIZE);
+    if (region == NULL) {
+        bench_log("large_pages: no memory, skipped");
+        return;
+    }
+    touch_pages(region, WALK_SIZE, true);
+    uint64_t large = walk(region, WALK_SIZE);
+    bench_free(region, WALK_SIZE);
+    get_memory_stats(&after);
+
+    uint64_t small = 0;
+    size_t count = 0;
+    for (; count<WALK_SIZE/WALK_PIECE; count++) {
+        if ((pieces[count] = bench_alloc(WALK_PIECE)) == NULL)
+            break;
+        touch_pages(pieces[count], WALK_PIECE, true);
+    }
+    for (size_t i=0; i<count; i++)
+        small += walk(pieces[i], WALK_PIECE);
+    for (size_t i=0; i<count; i++)
+        bench_free(pieces[i], WALK_PIECE);
+
+    bench_log("large_pages: 2 MiB pages %lu cycles per access, 4 KiB pages %lu cycles per access",
+            large / accesses, count == WALK_SIZE/WALK_PIECE ? small / accesses : 0);
+    bench_log("large_pages: on demand %lu, split %lu",
+            after.large_pages_on_demand - before.large_pages_on_demand,
+            after.large_pages_split - before.large_pages_split);
+}
+
+/** Promotion daemon scans once a second, give it several passes */
+#define PROMOTE_WAIT_TSC (10*BENCH_RUN_TSC)
+
+/**
+ * Walk over region faulted in 4 KiB at a time, before and after promotion
+ * daemon collapsed it into 2 MiB pages. Region is read first, so it maps
+ * zero frame, then written, so every page gets its own 4 KiB frame instead
+ * of large page on demand.
+ */
+void check_promote(void) {
+    memory_stats_t before, after;
+    size_t accesses = WALK_PASSES * (WALK_SIZE / WALK_STRIDE);
+    uint64_t windows = WALK_SIZE / (2*MiB);
+
+    void* region = bench_alloc(WALK_SIZE);
+    if (region == NULL) {
+        bench_log("promote: no memory, skipped");
+        return;
+    }
+    get_memory_stats(&before);
+    touch_pages(region, WALK_SIZE, false);
+    touch_pages(region, WALK_SIZE, true);
+    uint64_t small = walk(region, WALK_SIZE);
+
+    uint64_t deadline = rdtsc() + PROMOTE_WAIT_TSC;
+    do {
+        get_memory_stats(&after);
+    } while (after.large_pages_promoted - before.large_pages_promoted < windows &&
+            rdtsc() < deadline);
+
+    uint64_t large = walk(region, WALK_SIZE);
+    bench_free(region, WALK_SIZE);
+
+    bench_log("promote: before %lu cycles per access, after %lu cycles per access",
+            small / accesses, large / accesses);
+    bench_log("promote: %lu windows, scanned %lu, promoted %lu, failed %lu", windows,
+            after.large_pages_scanned - before.large_pages_scanned,
+            after.large_pages_promoted - before.large_pages_promoted,
+            after.large_pages_failed - before.large_pages_failed);
+}
+
+/**
+ * Mappings of mmap stress. Placement is randomized, so every mapping takes
+ * its own page table and usually page directory, 100k need guest with at
+ * least 2 GiB of memory.
+ */
+#define MAP_STRESS_COUNT (100000)
+#define MAP_STRESS_BATCH (10000)
+
+/**
+ * Cycles per allocation and per deallocation of single page mappings as
+ * memory area tree grows, cost of batch should stay almost flat.
+ */
+void check_map_stress(void) {
+    void** mappings = malloc(sizeof(void*) * MAP_STRESS_COUNT);
+    if (mappings == NULL) {
+        bench_log("map_stress: no memory, skipped");
+        return;
+    }
+
+    // MAP_STRESS_COUNT is multiple of MAP_STRESS_BATCH
+    size_t count = 0;
+    bool full = false;
+    while (count < MAP_STRESS_COUNT && !full) {
+        size_t batch = count;
+        uint64_t start = rdtsc();
+        for (; count<batch+MAP_STRESS_BATCH; count++) {
+            if ((mappings[count] = bench_alloc(4*KiB)) == NULL) {
+                full = true;
+                break;
+            }
+        }
+        uint64_t elapsed = rdtsc() - start;
+        if (count > batch)
+            bench_log("map_stress: %lu mappings, %lu cycles per allocation", count,
+                    elapsed / (count - batch));
+    }
+
+    uint64_t start = rdtsc();
+    for (size_t i=0; i<count; i++)
+        bench_free(mappings[i], 4*KiB);
+    uint64_t elapsed = rdtsc() - start;
+    if (count != 0)
+        bench_log("map_stress: %lu cycles per deallocation", elapsed / count);
+    free(mappings);
+}
+
+#define UNMAP_SIZE  (64*MiB)
+/** Free frame count drifts by per cpu frame caches, allow 1 MiB */
+#define UNMAP_SLACK (256)
+
+/**
+ * Cycles of unmap of region faulted in 4 KiB pages, which covers whole page
+ * tables and frees them in bulk. Free frame count must return to value it
+ * had before region was allocated, page tables included.
+ */
+void check_bulk_unmap(void) {
+    memory_stats_t before, after;
+
+    get_memory_stats(&before);
+    void* region = bench_alloc(UNMAP_SIZE);
+    if (region == NULL) {
+        bench_log("bulk_unmap: no memory, skipped");
+        return;
+    }
+    // read first, so writes do not map large pages on demand
+    touch_pages(region, UNMAP_SIZE, false);
+    touch_pages(region, UNMAP_SIZE, true);
+
+    uint64_t start = rdtsc();
+    bench_free(region, UNMAP_SIZE);
+    uint64_t elapsed = rdtsc() - start;
+    get_memory_stats(&after);
+
+    int64_t leaked = (int64_t)before.free_frames - (int64_t)after.free_frames;
+    bench_log("bulk_unmap: %lu cycles, %lu cycles per page, %ld frames not returned, %s",
+            elapsed, elapsed / (UNMAP_SIZE / (4*KiB)), leaked,
+            leaked <= UNMAP_SLACK ? "ok" : "FAILED");
+}
+
+/** Workers of fault storm, run with -smp 8 */
+#define FAULT_STORM_WORKERS (8)
+
+/**
+ * Fault storm of unrelated processes. Every page takes read fault, which
+ * maps zero frame, and write fault, which copies it, both under address
+ * space lock of its process. Lock deltas show whether workers still wait
+ * for each other.
+ */
+void check_fault_storm(void) {
+    memory_stats_t before, after;
+
+    uint64_t deadline = rdtsc() + BENCH_RUN_TSC;
+    get_memory_stats(&before);
+    int worker = start_workers(FAULT_STORM_WORKERS);
+
+    uint64_t faults = 0;
+    while (rdtsc() < deadline) {
+        void* block = bench_alloc(FAULT_BLOCK);
+        if (block == NULL)
+            break;
+        touch_pages(block, FAULT_BLOCK, false);
+        touch_pages(block, FAULT_BLOCK, true);
+        bench_free(block, FAULT_BLOCK);
+        faults += 2 * (FAULT_BLOCK / (4*KiB));
+    }
+    bench_log("fault_storm: worker %d, %lu faults", worker, faults);
+    if (worker != 0)
+        park();
+
+    wait_until(deadline + BENCH_GRACE_TSC);
+    get_memory_stats(&after);
+    log_lock_delta("fault_storm: address space locks", &before.address_space_locks,
+            &after.address_space_locks);
+    log_lock_delta("fault_storm: frame lock", &before.frame_lock, &after.frame_lock);
+    log_lock_delta("fault_storm: kernel space lock", &before.kernel_space_lock,
+            &after.kernel_space_lock);
+}
+
+/**
+ * Time spent building frame pool at boot. Run guest with -m 65536 to see
+ * construction cost at 64 GiB.
+ */
+void check_boot_pool(void) {
+    memory_stats_t stats;
+    get_memory_stats(&stats);
+    bench_log("boot_pool: frame pool built in %lu cycles, %lu frames free",
+            stats.frame_pool_build_time, stats.free_frames);
+}
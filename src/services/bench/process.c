@@ -0,0 +1,69 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to use, copy, 
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+ * and to permit persons to whom the Software is furnished to do so, subject to the 
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies 
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS 
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * process.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: process creation checks
+ */
+
+#include "bench.h"
+
+#include <string.h>
+
+#define SPAWN_COUNT (16)
+
+/**
+ * Spawn latency of process clone against loading image from initramfs.
+ * Both spawned processes park right away, cycles are those of parent
+ * until call returns with new process enscheduled.
+ */
+void check_spawn(void) {
+    uint64_t clone_total = 0, exec_total = 0;
+    int clones = 0, execs = 0;
+
+    for (; clones<SPAWN_COUNT; clones++) {
+        uint64_t start = rdtsc();
+        int pid = clone_process();
+        uint64_t elapsed = rdtsc() - start;
+        if (pid == 0)
+            park();
+        if (pid < 0)
+            break;
+        clone_total += elapsed;
+    }
+
+    char* args[] = { (char*)bench_path, "park", NULL };
+    char* envp[] = { NULL };
+    for (; execs<SPAWN_COUNT; execs++) {
+        uint64_t start = rdtsc();
+        int rv = execve_ifs(bench_path, args, envp, 0);
+        uint64_t elapsed = rdtsc() - start;
+        if (rv != 0)
+            break;
+        exec_total += elapsed;
+    }
+
+    bench_log("spawn: clone %d processes, %lu cycles average", clones,
+            clones ? clone_total / clones : 0);
+    bench_log("spawn: execve_ifs %d processes, %lu cycles average", execs,
+            execs ? exec_total / execs : 0);
+}
@@ -0,0 +1,4 @@
+MODE_CPPFLAGS  := 
+MODE_CFLAGS    :=-O2
+MODE_ARFLAGS   :=
+MODE_NASMFLAGS :=
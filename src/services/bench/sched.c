@@ -0,0 +1,209 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to use, copy, 
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+ * and to permit persons to whom the Software is furnished to do so, subject to the 
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies 
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS 
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * sched.c
+ *  Created on: Oct 17, 2026
+ *      Author: agent
+ *  Contents: scheduler checks
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+
+/** CPU bound workers per cpu of context switch check */
+#define SWITCH_WORKERS_PER_CPU (2)
+
+static size_t cpu_count(void) {
+    return get_sched_stats(NULL, 0);
+}
+
+static sched_stats_t* sched_snapshot(size_t cpus) {
+    sched_stats_t* stats = malloc(sizeof(sched_stats_t) * cpus);
+    if (stats != NULL && get_sched_stats(stats, cpus) == 0) {
+        free(stats);
+        return NULL;
+    }
+    return stats;
+}
+
+static uint64_t spin_until(uint64_t deadline) {
+    uint64_t iterations = 0;
+    while (rdtsc() < deadline)
+        ++iterations;
+    return iterations;
+}
+
+/**
+ * Logs latency histogram summed over all cpus.
+ */
+static void log_latency(const char* name, sched_stats_t* before, sched_stats_t* after,
+        size_t cpus) {
+    char line[256];
+    int length = snprintf(line, sizeof(line), "%s: latency histogram", name);
+    for (size_t b=0; b<SCHED_LATENCY_BUCKETS; b++) {
+        uint64_t count = 0;
+        for (size_t i=0; i<cpus; i++)
+            count += after[i].latency[b] - before[i].latency[b];
+        if (length > 0 && (size_t)length < sizeof(line))
+            length += snprintf(line + length, sizeof(line) - length, " %lu", count);
+    }
+    bench_log("%s", line);
+}
+
+/**
+ * Context switch throughput with SWITCH_WORKERS_PER_CPU CPU bound workers
+ * per cpu, so every tick has thread to switch to. Run at -smp 2 up to 16.
+ */
+void check_context_switch(void) {
+    size_t cpus = cpu_count();
+    sched_stats_t* before = sched_snapshot(cpus);
+    if (before == NULL) {
+        bench_log("context_switch: no memory, skipped");
+        return;
+    }
+
+    uint64_t deadline = rdtsc() + BENCH_RUN_TSC;
+    int worker = start_workers(cpus * SWITCH_WORKERS_PER_CPU);
+    uint64_t iterations = spin_until(deadline);
+    sched_stats_t* after = worker == 0 ? sched_snapshot(cpus) : NULL;
+    bench_log("context_switch: worker %d, %lu iterations", worker, iterations);
+    if (worker != 0)
+        park();
+
+    wait_until(deadline + BENCH_GRACE_TSC);
+    if (after == NULL) {
+        free(before);
+        return;
+    }
+    uint64_t switches = 0;
+    for (size_t i=0; i<cpus; i++) {
+        bench_log("context_switch: cpu %lu, switches %lu, steals %lu, wakeups %lu, "
+                "remote %lu, ticks %lu", i, after[i].switches - before[i].switches,
+                after[i].steals - before[i].steals, after[i].wakeups - before[i].wakeups,
+                after[i].remote_wakeups - before[i].remote_wakeups,
+                after[i].ticks - before[i].ticks);
+        switches += after[i].switches - before[i].switches;
+    }
+    bench_log("context_switch: %lu cpus, %lu switches in %lu cycles", cpus, switches,
+            BENCH_RUN_TSC);
+    log_latency("context_switch", before, after, cpus);
+    free(before);
+    free(after);
+}
+
+#define SPREAD_WORKERS (64)
+/** Load averages decay slowly, run longer than other checks */
+#define SPREAD_RUN_TSC (4*BENCH_RUN_TSC)
+
+/**
+ * Placement of SPREAD_WORKERS CPU bound workers. Load averages are sampled
+ * late in the run, when they settled, and must be within half of each
+ * other. Migrations show how much balancer had to move after placement.
+ */
+void check_spread(void) {
+    size_t cpus = cpu_count();
+    sched_stats_t* before = sched_snapshot(cpus);
+    if (before == NULL) {
+        bench_log("spread: no memory, skipped");
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    uint64_t deadline = start + SPREAD_RUN_TSC;
+    int worker = start_workers(SPREAD_WORKERS);
+    if (worker != 0) {
+        uint64_t iterations = spin_until(deadline);
+        bench_log("spread: worker %d, %lu iterations", worker, iterations);
+        park();
+    }
+
+    spin_until(start + SPREAD_RUN_TSC / 4 * 3);
+    sched_stats_t* after = sched_snapshot(cpus);
+    spin_until(deadline);
+    wait_until(deadline + BENCH_GRACE_TSC);
+    if (after == NULL) {
+        free(before);
+        return;
+    }
+
+    uint64_t min = UINT64_MAX, max = 0;
+    for (size_t i=0; i<cpus; i++) {
+        uint64_t load = after[i].load_avg;
+        bench_log("spread: cpu %lu, load %lu.%02lu, migrations %lu, switches %lu", i,
+                load >> SCHED_LOAD_SHIFT, ((load & ((1UL << SCHED_LOAD_SHIFT) - 1)) * 100)
+                >> SCHED_LOAD_SHIFT, after[i].migrations - before[i].migrations,
+                after[i].switches - before[i].switches);
+        if (load < min)
+            min = load;
+        if (load > max)
+            max = load;
+    }
+    bench_log("spread: %d workers on %lu cpus, %s", SPREAD_WORKERS, cpus,
+            max <= min + min / 2 ? "ok" : "UNEVEN");
+    free(before);
+    free(after);
+}
+
+#define FAIR_WORKERS_PER_CPU (2)
+/** Gap between two TSC reads longer than this means worker was switched out */
+#define FAIR_GAP_TSC         (20000)
+
+/**
+ * Fairness and latency of fair class with FAIR_WORKERS_PER_CPU CPU bound
+ * workers per cpu. Each worker logs its iterations, which should be close
+ * to each other, and how often and for how long at most it waited to run
+ * again. Latency histogram shows the same from scheduler side.
+ */
+void check_fairness(void) {
+    size_t cpus = cpu_count();
+    sched_stats_t* before = sched_snapshot(cpus);
+    if (before == NULL) {
+        bench_log("fairness: no memory, skipped");
+        return;
+    }
+
+    uint64_t deadline = rdtsc() + BENCH_RUN_TSC;
+    int worker = start_workers(cpus * FAIR_WORKERS_PER_CPU);
+    uint64_t iterations = 0, waits = 0, worst = 0;
+    uint64_t last = rdtsc();
+    while (last < deadline) {
+        uint64_t now = rdtsc();
+        if (now - last > FAIR_GAP_TSC) {
+            ++waits;
+            if (now - last > worst)
+                worst = now - last;
+        }
+        last = now;
+        ++iterations;
+    }
+    sched_stats_t* after = worker == 0 ? sched_snapshot(cpus) : NULL;
+    bench_log("fairness: worker %d, %lu iterations, %lu waits, %lu cycles longest wait",
+            worker, iterations, waits, worst);
+    if (worker != 0)
+        park();
+
+    wait_until(deadline + BENCH_GRACE_TSC);
+    if (after != NULL)
+        log_latency("fairness", before, after, cpus);
+    free(before);
+    free(after);
+}